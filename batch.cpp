@@ -0,0 +1,118 @@
+#include "batch.h"
+#include "planner.h"
+#include "thread_pool.h"
+
+#include <chrono>
+
+/**
+ *
+ * @param pool Optional pool
+ * @param count Number of tasks
+ * @param task Called with each index in [0, count)
+ * @brief Runs the tasks on the pool, or in order without one
+ */
+static void run_tasks(ThreadPool *pool, size_t count, const std::function<void(size_t)> &task)
+{
+	if (pool)
+	{
+		pool->run(count, task);
+		return;
+	}
+	for (size_t i = 0; i < count; ++i)
+		task(i);
+}
+
+/**
+ *
+ * @param corpus A corpus with sentence ids
+ * @param queries Parsed queries
+ * @param options Matches to skip and produce for every query, or to only count.
+ *				  The pool, if any, runs the batch.
+ * @param stats Optional output, what was shared and the time taken
+ * @brief Runs every distinct query once, with the clauses they share matched
+ *		  once, see batch.h
+ * @return One result per query, in order
+ */
+std::vector<BatchResult> run_batch(const Corpus &corpus, const std::vector<Query> &queries, const ResultOptions &options, BatchStats *stats)
+{
+	using Clock = std::chrono::steady_clock;
+	const Clock::time_point start = Clock::now();
+
+	// Identical queries, by the keys of their clauses, run once
+	std::unordered_map<std::string, size_t> query_keys;
+	std::vector<size_t> distinct;		// Query index of each distinct query
+	std::vector<size_t> result_of;		// Distinct query of each query
+	for (size_t q = 0; q < queries.size(); ++q)
+	{
+		const auto [found, inserted] = query_keys.try_emplace(query_key(queries[q]), distinct.size());
+		if (inserted)
+			distinct.push_back(q);
+		result_of.push_back(found->second);
+	}
+
+	// Clauses of several literals used more than once are matched once
+	std::unordered_map<std::string, std::pair<const Clause*, size_t>> uses;
+	for (size_t q : distinct)
+	{
+		for (const Clause& clause : queries[q])
+		{
+			if (clause.size() < 2)
+				continue;
+			auto& use = uses[clause_key(clause)];
+			use.first = &clause;
+			use.second++;
+		}
+	}
+	std::vector<std::pair<std::string, const Clause*>> shared;
+	size_t clause_uses = 0;
+	for (const auto& [key, use] : uses)
+	{
+		if (use.second < 2)
+			continue;
+		shared.emplace_back(key, use.first);
+		clause_uses += use.second;
+	}
+
+	std::vector<ClauseResult> shared_results(shared.size());
+	run_tasks(options.pool, shared.size(), [&](size_t i) {
+		shared_results[i] = clause_result(corpus, *shared[i].second);
+	});
+	ClauseResults clauses;
+	for (size_t i = 0; i < shared.size(); ++i)
+		clauses.emplace(shared[i].first, std::move(shared_results[i]));
+	const Clock::time_point clauses_done = Clock::now();
+
+	// Each query runs on one thread, the batch is what is spread over the pool
+	ResultOptions query_options = options;
+	query_options.pool = nullptr;
+	std::vector<BatchResult> distinct_results(distinct.size());
+	run_tasks(options.pool, distinct.size(), [&](size_t i) {
+		const Query& query = queries[distinct[i]];
+		BatchResult& result = distinct_results[i];
+		result.count = 0;
+		if (query.empty())
+			return;
+
+		const QueryPlan plan = plan_query(corpus, query, &clauses);
+		result.count = stream_plan(corpus, plan, static_cast<int>(query.size()), [&](const Match &match) {
+			result.matches.push_back(match);
+			return true;
+		}, query_options);
+	});
+
+	std::vector<BatchResult> results;
+	results.reserve(queries.size());
+	for (size_t q = 0; q < queries.size(); ++q)
+		results.push_back(distinct_results[result_of[q]]);
+
+	if (stats)
+	{
+		stats->queries = queries.size();
+		stats->distinct_queries = distinct.size();
+		stats->shared_clauses = shared.size();
+		stats->clause_uses = clause_uses;
+		stats->clause_seconds = std::chrono::duration<double>(clauses_done - start).count();
+		stats->query_seconds = std::chrono::duration<double>(Clock::now() - clauses_done).count();
+	}
+	return results;
+}
@@ -0,0 +1,44 @@
+#include <vector>
+#include "corpus.h"
+
+#ifndef BATCH_H
+#define BATCH_H
+/*********************************************************
+ * @brief
+ *			Batch execution of many queries with shared clauses.
+ * @details
+ *			Queries in a batch often repeat clauses, like many queries
+ *			containing [pos="SUBST" lemma="be"], or repeat whole queries.
+ *			A batch runs every distinct query once, by clause_key() per
+ *			clause, and first matches every clause of more than one
+ *			literal that occurs more than once, at shift 0. The plans of
+ *			the queries then use that one result, shifted to each clause's
+ *			offset, in place of the clause's literals. Single literals are
+ *			not shared, their lookups are already views.
+ *
+ *			With a pool the shared clauses, and then the queries, run in
+ *			parallel, one task each.
+ */
+//*********************************************************
+
+// ----------------- STRUCTS -----------------
+struct BatchResult
+{
+	size_t count;					// Matches produced, or counted
+	std::vector<Match> matches;		// Empty if only counting
+};
+
+struct BatchStats
+{
+	size_t queries;
+	size_t distinct_queries;
+	size_t shared_clauses;		// Clauses matched once for several uses
+	size_t clause_uses;			// Uses of the shared clauses
+	double clause_seconds;
+	double query_seconds;
+};
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+std::vector<BatchResult> run_batch(const Corpus &corpus, const std::vector<Query> &queries, const ResultOptions &options = {}, BatchStats *stats = nullptr);
+
+#endif //BATCH_H
@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "corpus.h"
+#include "image.h"
+#include "planner.h"
+#include "scan.h"
+#include "segment.h"
+#include "server.h"
+
+/*********************************************************
+ * @brief
+ *			Benchmark of query latency over a workload file.
+ * @details
+ *			Every query of the workload runs a few times to warm up,
+ *			then a fixed number of timed times. A run is split into the
+ *			stages of a query:
+ *				- parse, parse_sequence() against the dictionaries
+ *				- lookup, plan_query(), finding the operands' postings
+ *				  and ordering the steps
+ *				- intersect, plan_result(), running the steps
+ *				- materialize, producing or counting the matches of the
+ *				  result
+ *			A sequence with repetitions has no plan, its whole match is
+ *			timed as materialize. Each query reports p50 and p99 of the
+ *			run times, the mean of each stage and the corpus tokens per
+ *			second. With --scale the workload runs again on corpora of
+ *			other sizes, sentence prefixes below 1 and copies laid end to
+ *			end above. --json writes one JSON object per line for
+ *			regression tracking.
+ */
+//*********************************************************
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * @brief One line of the workload, count <query> or match <query>, a bare
+ *		  query is a match
+ */
+struct WorkloadQuery
+{
+	std::string text;
+	bool count_only;
+};
+
+/**
+ * @brief Times of one run, in milliseconds, a stage that did not run is nullopt
+ */
+struct RunTimes
+{
+	double parse;
+	std::optional<double> lookup;
+	std::optional<double> intersect;
+	double materialize;
+
+	double total() const { return parse + lookup.value_or(0) + intersect.value_or(0) + materialize; }
+};
+
+static double milliseconds_since(Clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+/**
+ * @param filename The workload, one query per line, # starts a comment
+ * @attention Throws an exception if the file can not be opened or has no queries
+ * @return The queries in file order
+ */
+static std::vector<WorkloadQuery> read_workload(const std::string &filename)
+{
+	std::ifstream file(filename);
+	if (!file)
+		throw std::invalid_argument("Could not open file " + filename);
+
+	std::vector<WorkloadQuery> workload;
+	std::string line;
+	while (std::getline(file, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
+		if (line.compare(0, 6, "count ") == 0)
+			workload.push_back({line.substr(6), true});
+		else if (line.compare(0, 6, "match ") == 0)
+			workload.push_back({line.substr(6), false});
+		else
+			workload.push_back({line, false});
+	}
+	if (workload.empty())
+		throw std::invalid_argument("Error: no queries in " + filename);
+	return workload;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param query A query of the workload
+ * @param matches Output, number of matches
+ * @brief Runs the query once, stage by stage, see the top of the file
+ * @attention Throws an exception if the query does not parse
+ * @return The time of each stage
+ */
+static RunTimes run_once(const Corpus &corpus, const WorkloadQuery &query, size_t &matches)
+{
+	RunTimes times{};
+	Clock::time_point start = Clock::now();
+	const Sequence sequence = parse_sequence(query.text, corpus);
+	times.parse = milliseconds_since(start);
+
+	std::vector<Match> produced;
+	auto keep = [&](const Match &match) {
+		produced.push_back(match);
+		return true;
+	};
+	ResultOptions options;
+	options.count_only = query.count_only;
+
+	if (!is_fixed_length(sequence))
+	{
+		start = Clock::now();
+		matches = stream_matches(corpus, sequence, keep, options);
+		times.materialize = milliseconds_since(start);
+		return times;
+	}
+
+	const Query fixed = fixed_query(sequence);
+	start = Clock::now();
+	const QueryPlan plan = plan_query(corpus, fixed);
+	times.lookup = milliseconds_since(start);
+
+	start = Clock::now();
+	const ClauseResult result = plan_result(plan);
+	times.intersect = milliseconds_since(start);
+
+	start = Clock::now();
+	matches = stream_plan(corpus, result_plan(result, static_cast<int>(corpus.token_count())), static_cast<int>(fixed.size()), keep, options);
+	times.materialize = milliseconds_since(start);
+	return times;
+}
+
+/**
+ * @param sorted Sorted samples, at least one
+ * @param fraction Between 0 and 1
+ * @return The nearest rank percentile
+ */
+static double percentile(const std::vector<double> &sorted, double fraction)
+{
+	const size_t rank = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+	return sorted[std::clamp<size_t>(rank, 1, sorted.size()) - 1];
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param fraction Share of the tokens to keep, below 1
+ * @brief Takes the sentences that start before the fraction of the tokens
+ * @return A corpus of those sentences, with all the dictionaries, indexed
+ */
+static Corpus corpus_prefix(const Corpus &corpus, double fraction)
+{
+	const int target = static_cast<int>(corpus.token_count() * fraction);
+	const auto cut = std::lower_bound(corpus.sentences.begin(), corpus.sentences.end(), target);
+	const size_t end = cut == corpus.sentences.end() ? corpus.token_count() : static_cast<size_t>(*cut);
+
+	std::vector<Token> tokens;
+	tokens.reserve(end);
+	for (size_t p = 0; p < end; ++p)
+		tokens.push_back(corpus.token(p));
+
+	Corpus prefix;
+	prefix.dictionaries = corpus.dictionaries;
+	build_columns(prefix, tokens);
+	prefix.sentences = std::vector<int>(corpus.sentences.begin(), cut);
+	build_sentence_ids(prefix);
+	build_indices(prefix);
+	return prefix;
+}
+
+/**
+ *
+ * @param corpus The loaded corpus
+ * @param factor Size of the result relative to the corpus
+ * @param options How the result is indexed
+ * @brief Lays whole copies of the corpus end to end, followed by a prefix
+ *		  for the fraction, see merge_segments()
+ * @return The scaled corpus
+ */
+static Corpus scaled_corpus(const std::shared_ptr<const Corpus> &corpus, double factor, const SegmentOptions &options)
+{
+	std::vector<std::shared_ptr<const Corpus>> parts(static_cast<size_t>(factor), corpus);
+	const double fraction = factor - static_cast<double>(parts.size());
+	if (fraction > 0)
+		parts.push_back(std::make_shared<const Corpus>(corpus_prefix(*corpus, fraction)));
+	return merge_segments(parts, options);
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param scale Its size relative to the loaded corpus
+ * @param workload The queries
+ * @param warmup Untimed runs of each query
+ * @param runs Timed runs of each query
+ * @param json Optional, receives one line per query
+ * @brief Runs the workload and prints a line per query, a query that does
+ *		  not parse prints its error
+ */
+static void run_workload(const Corpus &corpus, double scale, const std::vector<WorkloadQuery> &workload, int warmup, int runs, std::ostream *json)
+{
+	std::cout << "\nCorpus of " << corpus.token_count() << " tokens (scale " << scale << ")" << std::endl;
+	std::cout << std::left << std::setw(48) << "query" << std::right << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms"
+			  << std::setw(14) << "tokens/s" << std::setw(10) << "matches" << "   parse / lookup / intersect / materialize ms" << std::endl;
+
+	for (const WorkloadQuery& query : workload)
+	{
+		const std::string label = (query.count_only ? "count " : "") + query.text;
+		try
+		{
+			size_t matches = 0;
+			for (int i = 0; i < warmup; ++i)
+				run_once(corpus, query, matches);
+
+			std::vector<RunTimes> times;
+			for (int i = 0; i < runs; ++i)
+				times.push_back(run_once(corpus, query, matches));
+
+			std::vector<double> totals;
+			RunTimes mean{};
+			for (const RunTimes& run : times)
+			{
+				totals.push_back(run.total());
+				mean.parse += run.parse / runs;
+				if (run.lookup)
+					mean.lookup = mean.lookup.value_or(0) + *run.lookup / runs;
+				if (run.intersect)
+					mean.intersect = mean.intersect.value_or(0) + *run.intersect / runs;
+				mean.materialize += run.materialize / runs;
+			}
+			std::sort(totals.begin(), totals.end());
+			const double mean_ms = mean.total();
+			const double tokens_per_second = mean_ms > 0 ? corpus.token_count() / (mean_ms / 1000) : 0;
+			auto stage = [](const std::optional<double> &ms) { return ms ? std::to_string(*ms) : std::string("-"); };
+
+			std::cout << std::left << std::setw(48) << label.substr(0, 47) << std::right << std::setw(10) << std::setprecision(4) << percentile(totals, 0.5)
+					  << std::setw(10) << percentile(totals, 0.99) << std::setw(14) << std::setprecision(3) << tokens_per_second
+					  << std::setw(10) << matches << "   " << mean.parse << " / " << stage(mean.lookup) << " / " << stage(mean.intersect)
+					  << " / " << mean.materialize << std::endl;
+
+			if (json)
+			{
+				auto field = [](const std::optional<double> &ms) { return ms ? std::to_string(*ms) : std::string("null"); };
+				*json << "{\"type\":\"query\",\"scale\":" << scale << ",\"tokens\":" << corpus.token_count()
+					  << ",\"query\":\"" << json_escape(query.text) << "\",\"mode\":\"" << (query.count_only ? "count" : "match") << "\""
+					  << ",\"warmup\":" << warmup << ",\"runs\":" << runs << ",\"matches\":" << matches
+					  << ",\"p50_ms\":" << percentile(totals, 0.5) << ",\"p99_ms\":" << percentile(totals, 0.99)
+					  << ",\"mean_ms\":" << mean_ms << ",\"min_ms\":" << totals.front() << ",\"max_ms\":" << totals.back()
+					  << ",\"tokens_per_second\":" << tokens_per_second
+					  << ",\"stages_ms\":{\"parse\":" << mean.parse << ",\"lookup\":" << field(mean.lookup)
+					  << ",\"intersect\":" << field(mean.intersect) << ",\"materialize\":" << mean.materialize << "}}" << std::endl;
+			}
+		}
+		catch (const std::logic_error& e)
+		{
+			std::cout << std::left << std::setw(48) << label.substr(0, 47) << "  error: " << e.what() << std::endl;
+			if (json)
+				*json << "{\"type\":\"error\",\"scale\":" << scale << ",\"query\":\"" << json_escape(query.text) << "\",\"message\":\"" << json_escape(e.what()) << "\"}" << std::endl;
+		}
+	}
+}
+
+/**
+ * Usage: bench <corpus file> --workload <file> [--warmup <n>] [--runs <n>] [--scale <factor>,...] [--json <file>] [--threads <n>] [--compress-index] [--bitmap-density <fraction>] [--scan <mode>]
+ *	- The corpus file is either a CSV corpus or an image, its load and index times are reported
+ *	- --workload is the query file, one query per line, count <query> only counts
+ *	- --warmup and --runs set the untimed and timed runs of each query, default 3 and 20
+ *	- --scale runs the workload on corpora of the given sizes relative to the corpus, default 1
+ *	- --json writes the results to a file, one JSON object per line
+ *	- --threads, --compress-index, --bitmap-density and --scan are those of B
+ */
+int main(int argc, char* argv[])
+{
+	std::string corpus_filename;
+	std::string workload_filename;
+	std::string json_filename;
+	int warmup = 3;
+	int runs = 20;
+	std::vector<double> scales;
+	SegmentOptions options;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (arg == "--workload" && i + 1 < argc) {
+			workload_filename = argv[++i];
+		} else if (arg == "--warmup" && i + 1 < argc) {
+			warmup = std::stoi(argv[++i]);
+		} else if (arg == "--runs" && i + 1 < argc) {
+			runs = std::stoi(argv[++i]);
+		} else if (arg == "--scale" && i + 1 < argc) {
+			std::istringstream factors(argv[++i]);
+			std::string factor;
+			while (std::getline(factors, factor, ','))
+				scales.push_back(std::stod(factor));
+		} else if (arg == "--json" && i + 1 < argc) {
+			json_filename = argv[++i];
+		} else if (arg == "--threads" && i + 1 < argc) {
+			options.threads = std::stoul(argv[++i]);
+		} else if (arg == "--bitmap-density" && i + 1 < argc) {
+			options.bitmap_density = std::stod(argv[++i]);
+		} else if (arg == "--compress-index") {
+			options.compress = true;
+		} else if (arg == "--scan" && i + 1 < argc) {
+			try {
+				set_scan_mode(parse_scan_mode(argv[++i]));
+			} catch (const std::invalid_argument &e) {
+				std::cerr << e.what() << ", expected auto, always or never" << std::endl;
+				return 1;
+			}
+		} else if (!arg.empty() && arg[0] != '-') {
+			corpus_filename = arg;
+		} else {
+			corpus_filename.clear();
+			break;
+		}
+	}
+	if (corpus_filename.empty() || workload_filename.empty() || runs <= 0 || warmup < 0
+		|| std::any_of(scales.begin(), scales.end(), [](double scale) { return !(scale > 0); })) {
+		std::cerr << "Usage: " << argv[0] << " <corpus file> --workload <file> [--warmup <n>] [--runs <n>] [--scale <factor>,...] [--json <file>] [--threads <n>] [--compress-index] [--bitmap-density <fraction>] [--scan <mode>]" << std::endl;
+		return 1;
+	}
+	if (scales.empty())
+		scales.push_back(1);
+
+	try {
+		const std::vector<WorkloadQuery> workload = read_workload(workload_filename);
+		std::ofstream json_file;
+		if (!json_filename.empty()) {
+			json_file.open(json_filename);
+			if (!json_file)
+				throw std::invalid_argument("Could not write file " + json_filename);
+		}
+		std::ostream* json = json_filename.empty() ? nullptr : &json_file;
+
+		IngestStats stats{};
+		Clock::time_point start = Clock::now();
+		Corpus loaded = is_corpus_image(corpus_filename) ? load_corpus_image(corpus_filename) : load_corpus(corpus_filename, &stats, options.threads);
+		const double load_ms = milliseconds_since(start);
+		start = Clock::now();
+		finish_segment(loaded, options);
+		const double finish_ms = milliseconds_since(start);
+		std::cout << "Loaded " << loaded.token_count() << " tokens in " << load_ms << " ms (parse " << stats.parse_seconds * 1000
+				  << " ms, index " << stats.index_seconds * 1000 << " ms), optional indexes in " << finish_ms << " ms" << std::endl;
+		if (json)
+			*json << "{\"type\":\"load\",\"file\":\"" << json_escape(corpus_filename) << "\",\"tokens\":" << loaded.token_count()
+				  << ",\"sentences\":" << loaded.sentences.size() << ",\"load_ms\":" << load_ms << ",\"parse_ms\":" << stats.parse_seconds * 1000
+				  << ",\"index_ms\":" << stats.index_seconds * 1000 << ",\"optional_index_ms\":" << finish_ms << "}" << std::endl;
+
+		const auto corpus = std::make_shared<const Corpus>(std::move(loaded));
+		for (double scale : scales) {
+			if (scale == 1) {
+				run_workload(*corpus, scale, workload, warmup, runs, json);
+				continue;
+			}
+			start = Clock::now();
+			const Corpus scaled = scaled_corpus(corpus, scale, options);
+			const double build_ms = milliseconds_since(start);
+			if (json)
+				*json << "{\"type\":\"scale\",\"scale\":" << scale << ",\"tokens\":" << scaled.token_count() << ",\"build_ms\":" << build_ms << "}" << std::endl;
+			if (scaled.token_count() == 0) {
+				std::cout << "\nScale " << scale << " leaves no sentence, skipped" << std::endl;
+				continue;
+			}
+			run_workload(scaled, scale, workload, warmup, runs, json);
+		}
+	} catch (const std::invalid_argument& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,421 @@
+#include "bitmap.h"
+#include "profile.h"
+#include "scratch.h"
+
+#include <algorithm>
+#include <bit>
+
+//-----------------------------  BUILDING  ----------------------------------------------------------
+
+static size_t words_for(int universe)
+{
+	return (static_cast<size_t>(universe) + 63) / 64;
+}
+
+/**
+ *
+ * @param column The column of the attribute to build bitmaps for
+ * @param value_count Number of distinct string indexes, every value must be below it
+ * @param min_density Values on at least this fraction of the tokens get a bitmap,
+ *					  0 or less builds none
+ * @brief Counts the values, then sets the bits of the frequent ones in a second pass
+ * @return The bitmap index
+ */
+BitmapIndex build_bitmap_index(const Column &column, size_t value_count, double min_density)
+{
+	BitmapIndex index;
+	index.universe = static_cast<int>(column.size());
+	index.words_per_bitmap = words_for(index.universe);
+	if (min_density <= 0 || column.size() == 0)
+		return index;
+
+	std::vector<uint32_t> value_counts(value_count, 0);
+	column.visit([&](auto values) {
+		for (const auto value : values)
+			value_counts[value]++;
+	});
+
+	const double threshold = min_density * column.size();
+	std::vector<int> slots(value_count, -1);
+	std::vector<uint32_t> counts;
+	for (size_t value = 0; value < value_count; ++value)
+	{
+		if (value_counts[value] > 0 && value_counts[value] >= threshold)
+		{
+			slots[value] = static_cast<int>(counts.size());
+			counts.push_back(value_counts[value]);
+		}
+	}
+
+	std::vector<uint64_t> words(counts.size() * index.words_per_bitmap, 0);
+	column.visit([&](auto values) {
+		for (size_t i = 0; i < values.size(); ++i)
+		{
+			const int slot = slots[values[i]];
+			if (slot >= 0)
+				words[slot * index.words_per_bitmap + i / 64] |= uint64_t{1} << (i % 64);
+		}
+	});
+
+	index.slots = std::move(slots);
+	index.words = std::move(words);
+	index.counts = std::move(counts);
+	return index;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param min_density Values on at least this fraction of the tokens get a bitmap,
+ *					  0 or less removes the bitmaps
+ * @brief Builds the bitmaps of all four attributes, replacing any existing ones.
+ *		  Literals on a value with a bitmap are matched as a BitmapSet from then on.
+ */
+void build_bitmap_indices(Corpus &corpus, double min_density)
+{
+	auto build = [&](Attribute attribute) {
+		return build_bitmap_index(corpus.column(attribute), corpus.dictionary(attribute).size(), min_density);
+	};
+	corpus.word_bitmaps = build(Attribute::word);
+	corpus.c5_bitmaps = build(Attribute::c5);
+	corpus.lemma_bitmaps = build(Attribute::lemma);
+	corpus.pos_bitmaps = build(Attribute::pos);
+}
+
+/**
+ *
+ * @param value A string index, must have a bitmap
+ * @param shift Shift of the literal's clause
+ * @return The value's bitmap, viewed in place
+ */
+BitmapSet BitmapIndex::lookup(uint32_t value, int shift) const
+{
+	const size_t slot = slots[value];
+	return {words.slice(slot * words_per_bitmap, words_per_bitmap), shift, universe, counts[slot]};
+}
+
+//-----------------------------  HELPERS  ----------------------------------------------------------
+
+/**
+ * @brief A range [begin, end) of match starts
+ */
+struct StartRange
+{
+	int begin;
+	int end;
+
+	bool empty() const { return begin >= end; }
+};
+
+/**
+ * @return The match starts A can hold, those of its bits within the corpus
+ */
+static StartRange start_range(const BitmapSet& A)
+{
+	const int64_t begin = std::max<int64_t>(0, -static_cast<int64_t>(A.shift));
+	const int64_t end = std::min<int64_t>(A.universe, static_cast<int64_t>(A.words.size()) * 64 - A.shift);
+	return {static_cast<int>(begin), static_cast<int>(std::max(begin, end))};
+}
+
+static StartRange overlap(StartRange a, StartRange b)
+{
+	const int begin = std::max(a.begin, b.begin);
+	return {begin, std::max(begin, std::min(a.end, b.end))};
+}
+
+static StartRange hull(StartRange a, StartRange b)
+{
+	if (a.empty())
+		return b;
+	if (b.empty())
+		return a;
+	return {std::min(a.begin, b.begin), std::max(a.end, b.end)};
+}
+
+/**
+ * @return The match starts of a dense set within the corpus
+ */
+static StartRange dense_range(const DenseSet& A, int universe)
+{
+	const int begin = std::max(A.first, 0);
+	return {begin, std::max(begin, std::min(A.last + 1, universe))};
+}
+
+/**
+ * @param A A bitmap set, its shift may be negative
+ * @param begin Match start of the result's bit 0
+ * @param w Word index of the result
+ * @brief Bits of match starts begin+64w..begin+64w+63 of A, built from the two
+ *		  words the shift makes them straddle. Bits outside A are 0.
+ */
+static uint64_t aligned_word(const BitmapSet& A, int begin, size_t w)
+{
+	const int64_t p = static_cast<int64_t>(begin) + static_cast<int64_t>(w) * 64 + A.shift;
+	const int64_t i = p >= 0 ? p / 64 : -((-p + 63) / 64);
+	const int offset = static_cast<int>(p - i * 64);
+	auto word_at = [&](int64_t j) { return j >= 0 && static_cast<size_t>(j) < A.words.size() ? A.words[j] : uint64_t{0}; };
+
+	const uint64_t low = word_at(i);
+	if (offset == 0)
+		return low;
+	return (low >> offset) | (word_at(i + 1) << (64 - offset));
+}
+
+/**
+ * @return The bits of word w, of a result starting at match start begin, whose
+ *		   match start is within [first, last]
+ */
+static uint64_t range_mask(int first, int last, int begin, size_t w)
+{
+	const int64_t lo = static_cast<int64_t>(begin) + static_cast<int64_t>(w) * 64;
+	const int64_t from = std::max<int64_t>(first, lo) - lo;
+	const int64_t to = std::min<int64_t>(last, lo + 63) - lo;
+	if (from > to)
+		return 0;
+
+	const int64_t width = to - from + 1;
+	return (width == 64 ? ~uint64_t{0} : (uint64_t{1} << width) - 1) << from;
+}
+
+/**
+ * @param universe Number of corpus positions
+ * @param range Match starts of the result
+ * @param word_of Word w of the result
+ * @brief Builds a bitmap whose bit 0 is match start range.begin, one word at a
+ *		  time, and counts its bits
+ */
+template<typename F>
+static BitmapSet combine(int universe, StartRange range, F&& word_of)
+{
+	PROFILE_KERNEL(Kernel::BITMAP_WORDS);
+	const size_t word_count = words_for(range.end - range.begin);
+	std::shared_ptr<std::vector<uint64_t>> buffer = scratch_words(word_count);
+	std::vector<uint64_t>& words = *buffer;
+	size_t count = 0;
+	for (size_t w = 0; w < word_count; ++w)
+	{
+		words[w] = word_of(w);
+		count += std::popcount(words[w]);
+	}
+	// Starts past the range can come from a complemented operand, clear them
+	if (word_count > 0)
+	{
+		const uint64_t mask = range_mask(range.begin, range.end - 1, range.begin, word_count - 1);
+		count -= std::popcount(words.back() & ~mask);
+		words.back() &= mask;
+	}
+	return {share_words(std::move(buffer)), -range.begin, universe, count};
+}
+
+/**
+ * @return True if match start is in A
+ */
+static bool contains_start(const BitmapSet& A, int start)
+{
+	const int64_t p = static_cast<int64_t>(start) + A.shift;
+	if (p < 0 || static_cast<size_t>(p) >= A.words.size() * 64)
+		return false;
+	return (A.words[p / 64] >> (p % 64)) & 1;
+}
+
+/**
+ * @param A A bitmap set
+ * @param B A sorted set of positions
+ * @param B_shift Shift of B
+ * @param set True to set the bits of B's match starts, false to clear them
+ * @return A copy of A, widened to B's match starts when setting, with the bits
+ *		   of B changed
+ */
+template<typename T>
+static BitmapSet update_bits(const BitmapSet& A, const T& B, int B_shift, bool set)
+{
+	PROFILE_KERNEL(Kernel::BITMAP_UPDATE);
+	StartRange range = start_range(A);
+	if (set && !B.empty())
+	{
+		const int first = std::max(B.front() - B_shift, 0);
+		const int last = std::min(B.back() - B_shift, A.universe - 1);
+		if (first <= last)
+			range = hull(range, {first, last + 1});
+	}
+
+	std::shared_ptr<std::vector<uint64_t>> buffer = scratch_words(words_for(range.end - range.begin));
+	std::vector<uint64_t>& words = *buffer;
+	for (size_t w = 0; w < words.size(); ++w)
+		words[w] = aligned_word(A, range.begin, w);
+
+	for (int elem : B)
+	{
+		const int start = elem - B_shift;
+		if (start < range.begin || start >= range.end)
+			continue;
+
+		const int bit_index = start - range.begin;
+		const uint64_t bit = uint64_t{1} << (bit_index % 64);
+		words[bit_index / 64] = set ? words[bit_index / 64] | bit : words[bit_index / 64] & ~bit;
+	}
+
+	size_t count = 0;
+	for (uint64_t word : words)
+		count += std::popcount(word);
+	return {share_words(std::move(buffer)), -range.begin, A.universe, count};
+}
+
+/**
+ *
+ * @param A A bitmap set
+ * @param begin First match start to keep
+ * @param end Match start past the last one to keep
+ * @brief Views the words holding the match starts in [begin, end), for running
+ *		  a plan on one window of the corpus. Bits just outside the window can
+ *		  remain, the caller only enumerates starts within it.
+ * @return The restricted set, its shift may be negative
+ */
+BitmapSet restrict_set(const BitmapSet &A, int begin, int end)
+{
+	const int64_t first_bit = static_cast<int64_t>(begin) + A.shift;
+	const int64_t end_bit = static_cast<int64_t>(end) + A.shift;
+	const int64_t word_count = static_cast<int64_t>(A.words.size());
+	const int64_t first = std::clamp<int64_t>(first_bit >= 0 ? first_bit / 64 : 0, 0, word_count);
+	const int64_t last = std::clamp<int64_t>(end_bit > 0 ? (end_bit + 63) / 64 : 0, first, word_count);
+
+	BitmapSet part{A.words.slice(first, last - first), A.shift - static_cast<int>(first * 64), A.universe, 0};
+	for (uint64_t word : part.words)
+		part.count += std::popcount(word);
+	return part;
+}
+
+//-----------------------------  KERNELS  ----------------------------------------------------------
+
+BitmapSet intersection(const BitmapSet &A, const BitmapSet &B)
+{
+	const StartRange range = overlap(start_range(A), start_range(B));
+	return combine(A.universe, range, [&](size_t w) { return aligned_word(A, range.begin, w) & aligned_word(B, range.begin, w); });
+}
+
+BitmapSet difference(const BitmapSet &A, const BitmapSet &B)
+{
+	const StartRange range = start_range(A);
+	return combine(A.universe, range, [&](size_t w) { return aligned_word(A, range.begin, w) & ~aligned_word(B, range.begin, w); });
+}
+
+BitmapSet unite(const BitmapSet &A, const BitmapSet &B)
+{
+	const StartRange range = hull(start_range(A), start_range(B));
+	return combine(A.universe, range, [&](size_t w) { return aligned_word(A, range.begin, w) | aligned_word(B, range.begin, w); });
+}
+
+/**
+ * @param A A bitmap set
+ * @param B A sorted set
+ * @param B_shift Shift of B
+ * @brief Probes the bit of each element of B, costs O(|B|) whatever the size of A
+ * @return The intersection, as match starts
+ */
+template<typename T>
+static ExplicitSet probe_intersect(const BitmapSet& A, const T& B, int B_shift)
+{
+	PROFILE_KERNEL(Kernel::BITMAP_PROBE);
+	ExplicitSet C = scratch_set(B.size());
+	for (int elem : B)
+	{
+		if (contains_start(A, elem - B_shift))
+			C.elems.push_back(elem - B_shift);
+	}
+	return C;
+}
+
+/**
+ * @param A A sorted set
+ * @param A_shift Shift of A
+ * @param B A bitmap set
+ * @return A diff B, as match starts
+ */
+template<typename T>
+static ExplicitSet probe_diff(const T& A, int A_shift, const BitmapSet& B)
+{
+	PROFILE_KERNEL(Kernel::BITMAP_PROBE);
+	ExplicitSet C = scratch_set(A.size());
+	for (int elem : A)
+	{
+		if (!contains_start(B, elem - A_shift))
+			C.elems.push_back(elem - A_shift);
+	}
+	return C;
+}
+
+ExplicitSet intersection(const BitmapSet &A, const IndexSet &B)
+{
+	return probe_intersect(A, B.elems, B.shift);
+}
+
+ExplicitSet intersection(const BitmapSet &A, const ExplicitSet &B)
+{
+	return probe_intersect(A, B.elems, 0);
+}
+
+ExplicitSet difference(const IndexSet &A, const BitmapSet &B)
+{
+	return probe_diff(A.elems, A.shift, B);
+}
+
+ExplicitSet difference(const ExplicitSet &A, const BitmapSet &B)
+{
+	return probe_diff(A.elems, 0, B);
+}
+
+BitmapSet difference(const BitmapSet &A, const IndexSet &B)
+{
+	return update_bits(A, B.elems, B.shift, false);
+}
+
+BitmapSet difference(const BitmapSet &A, const ExplicitSet &B)
+{
+	return update_bits(A, B.elems, 0, false);
+}
+
+BitmapSet unite(const BitmapSet &A, const IndexSet &B)
+{
+	return update_bits(A, B.elems, B.shift, true);
+}
+
+BitmapSet unite(const BitmapSet &A, const ExplicitSet &B)
+{
+	return update_bits(A, B.elems, 0, true);
+}
+
+/**
+ *
+ * @param A A bitmap set
+ * @param B A dense set
+ * @brief A dense set covering every match start of A, like the one of an empty
+ *		  clause, leaves A as it is without copying it
+ * @return The match starts of A within B
+ */
+BitmapSet intersection(const BitmapSet &A, const DenseSet &B)
+{
+	const StartRange own = start_range(A);
+	if (B.first <= own.begin && B.last >= own.end - 1)
+		return A;
+
+	const StartRange range = overlap(own, dense_range(B, A.universe));
+	return combine(A.universe, range, [&](size_t w) { return aligned_word(A, range.begin, w); });
+}
+
+BitmapSet difference(const BitmapSet &A, const DenseSet &B)
+{
+	const StartRange range = start_range(A);
+	return combine(A.universe, range, [&](size_t w) { return aligned_word(A, range.begin, w) & ~range_mask(B.first, B.last, range.begin, w); });
+}
+
+BitmapSet difference(const DenseSet &A, const BitmapSet &B)
+{
+	const StartRange range = dense_range(A, B.universe);
+	return combine(B.universe, range, [&](size_t w) { return ~aligned_word(B, range.begin, w); });
+}
+
+BitmapSet unite(const BitmapSet &A, const DenseSet &B)
+{
+	const StartRange range = hull(start_range(A), dense_range(B, A.universe));
+	return combine(A.universe, range, [&](size_t w) { return aligned_word(A, range.begin, w) | range_mask(B.first, B.last, range.begin, w); });
+}
@@ -0,0 +1,57 @@
+#include <vector>
+#include "corpus.h"
+
+#ifndef BITMAP_H
+#define BITMAP_H
+/*********************************************************
+ * @brief
+ *			Bitmap sets for frequent attribute values.
+ * @details
+ *			A value that covers a large part of the corpus, like a
+ *			common pos tag, has a postings list of millions of ints.
+ *			Its bitmap is corpus.size()/8 bytes, smaller once the value
+ *			covers more than 1/32 of the corpus, and two bitmaps are
+ *			intersected 64 positions at a time.
+ *
+ *			Bitmaps are precomputed by build_bitmap_indices() for values
+ *			at or above a density threshold. Operations between two
+ *			bitmaps are word parallel AND / ANDNOT / OR, with the words
+ *			of a shifted set realigned on the fly. Against a sparse set
+ *			the bitmap is probed once per element instead. A bitmap result
+ *			only spans the match starts its operands can hold, its bit 0
+ *			is the first of them (a shift of minus that start), and it
+ *			drops negative starts, which can never be a match.
+ */
+//*********************************************************
+
+// ----------------- CONSTANTS -----------------
+constexpr double DEFAULT_BITMAP_DENSITY = 1.0 / 32;
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+
+// Building
+BitmapIndex build_bitmap_index(const Column &column, size_t value_count, double min_density);
+void build_bitmap_indices(Corpus &corpus, double min_density = DEFAULT_BITMAP_DENSITY);
+
+BitmapSet restrict_set(const BitmapSet &A, int begin, int end);
+
+// Kernels
+BitmapSet intersection(const BitmapSet &A, const BitmapSet &B);
+BitmapSet difference(const BitmapSet &A, const BitmapSet &B);
+BitmapSet unite(const BitmapSet &A, const BitmapSet &B);
+
+ExplicitSet intersection(const BitmapSet &A, const IndexSet &B);
+ExplicitSet intersection(const BitmapSet &A, const ExplicitSet &B);
+ExplicitSet difference(const IndexSet &A, const BitmapSet &B);
+ExplicitSet difference(const ExplicitSet &A, const BitmapSet &B);
+BitmapSet difference(const BitmapSet &A, const IndexSet &B);
+BitmapSet difference(const BitmapSet &A, const ExplicitSet &B);
+BitmapSet unite(const BitmapSet &A, const IndexSet &B);
+BitmapSet unite(const BitmapSet &A, const ExplicitSet &B);
+
+BitmapSet intersection(const BitmapSet &A, const DenseSet &B);
+BitmapSet difference(const BitmapSet &A, const DenseSet &B);
+BitmapSet difference(const DenseSet &A, const BitmapSet &B);
+BitmapSet unite(const BitmapSet &A, const DenseSet &B);
+
+#endif //BITMAP_H
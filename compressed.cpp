@@ -0,0 +1,423 @@
+#include "compressed.h"
+#include "profile.h"
+#include "scratch.h"
+#include "simd_sets.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+
+//-----------------------------  BUILDING  ----------------------------------------------------------
+
+// Blocks are read with unaligned 8 byte loads, the last one may run past the packed bits
+constexpr size_t BLOCK_READ_PADDING = 8;
+
+/**
+ * @param positions Sorted positions of one block
+ * @param count Number of positions, at most POSTING_BLOCK_SIZE
+ * @param blocks Output, the block header is appended
+ * @param data Output, the packed gaps are appended
+ */
+static void append_block(const int* positions, size_t count, std::vector<PostingBlock>& blocks, std::vector<uint8_t>& data)
+{
+	uint32_t max_gap = 0;
+	for (size_t i = 1; i < count; ++i)
+		max_gap = std::max(max_gap, static_cast<uint32_t>(positions[i] - positions[i - 1] - 1));
+
+	PostingBlock block{};
+	block.first = positions[0];
+	block.last = positions[count - 1];
+	block.offset = data.size();
+	block.bits = static_cast<uint8_t>(std::bit_width(max_gap));
+	block.count = static_cast<uint8_t>(count);
+	blocks.push_back(block);
+
+	// Pack the gaps least significant bit first
+	uint64_t pending = 0;
+	int pending_bits = 0;
+	for (size_t i = 1; i < count; ++i)
+	{
+		pending |= static_cast<uint64_t>(positions[i] - positions[i - 1] - 1) << pending_bits;
+		pending_bits += block.bits;
+		for (; pending_bits >= 8; pending_bits -= 8)
+		{
+			data.push_back(static_cast<uint8_t>(pending));
+			pending >>= 8;
+		}
+	}
+	if (pending_bits > 0)
+		data.push_back(static_cast<uint8_t>(pending));
+}
+
+/**
+ *
+ * @param index An attribute index, positions ordered by value
+ * @param offsets The index's offsets table
+ * @brief Cuts each value's range of the index into blocks and packs them
+ * @return The compressed index
+ */
+CompressedIndex compress_index(const SharedArray<int> &index, const SharedArray<int> &offsets)
+{
+	std::vector<PostingBlock> blocks;
+	std::vector<uint8_t> data;
+	std::vector<uint32_t> value_blocks(offsets.size(), 0);
+
+	for (size_t value = 0; value + 1 < offsets.size(); ++value)
+	{
+		value_blocks[value] = static_cast<uint32_t>(blocks.size());
+		for (int begin = offsets[value]; begin < offsets[value + 1]; begin += POSTING_BLOCK_SIZE)
+		{
+			const size_t count = std::min<size_t>(POSTING_BLOCK_SIZE, offsets[value + 1] - begin);
+			append_block(index.data() + begin, count, blocks, data);
+		}
+	}
+	if (!value_blocks.empty())
+		value_blocks.back() = static_cast<uint32_t>(blocks.size());
+	data.resize(data.size() + BLOCK_READ_PADDING, 0);
+
+	CompressedIndex compressed;
+	compressed.blocks = std::move(blocks);
+	compressed.data = std::move(data);
+	compressed.value_blocks = std::move(value_blocks);
+	return compressed;
+}
+
+/**
+ *
+ * @param corpus A corpus with built indexes
+ * @brief Replaces the four indexes and their offsets tables with compressed
+ *		  indexes, which are used for all literal lookups from then on.
+ *		  Does nothing for indexes that are already compressed.
+ */
+void compress_indices(Corpus &corpus)
+{
+	struct Job { SharedArray<int> Corpus::* index; SharedArray<int> Corpus::* offsets; CompressedIndex Corpus::* compressed; };
+	const Job jobs[] = {
+		{&Corpus::word_index, &Corpus::word_offsets, &Corpus::word_compressed},
+		{&Corpus::c5_index, &Corpus::c5_offsets, &Corpus::c5_compressed},
+		{&Corpus::lemma_index, &Corpus::lemma_offsets, &Corpus::lemma_compressed},
+		{&Corpus::pos_index, &Corpus::pos_offsets, &Corpus::pos_compressed},
+	};
+	for (const Job& job : jobs)
+	{
+		if ((corpus.*job.offsets).empty())
+			continue;
+
+		corpus.*job.compressed = compress_index(corpus.*job.index, corpus.*job.offsets);
+		corpus.*job.index = {};
+		corpus.*job.offsets = {};
+	}
+}
+
+/**
+ *
+ * @param value A string index
+ * @param shift Shift of the literal's clause
+ * @return The blocks of value, as a CompressedSet
+ */
+CompressedSet CompressedIndex::lookup(uint32_t value, int shift) const
+{
+	// Values outside the table do not occur in the corpus
+	if (static_cast<size_t>(value) + 1 >= value_blocks.size())
+		return {std::span<const PostingBlock>(), data.data(), shift};
+
+	const uint32_t first = value_blocks[value];
+	return {blocks.span().subspan(first, value_blocks[value + 1] - first), data.data(), shift};
+}
+
+/**
+ * @return Memory used by the compressed index, in bytes
+ */
+size_t CompressedIndex::bytes() const
+{
+	return blocks.size() * sizeof(PostingBlock) + data.size() + value_blocks.size() * sizeof(uint32_t);
+}
+
+//-----------------------------  DECODING  ----------------------------------------------------------
+
+/**
+ *
+ * @param A A compressed set
+ * @param block Block of A to decode
+ * @param out Room for POSTING_BLOCK_SIZE elements
+ * @brief Unpacks the gaps of a block and sums them up
+ * @return Number of positions written to out, unshifted
+ */
+size_t decode_block(const CompressedSet &A, size_t block, int *out)
+{
+	const PostingBlock& header = A.blocks[block];
+	const uint8_t* packed = A.data + header.offset;
+
+	out[0] = header.first;
+	if (header.bits == 0) // A run of consecutive positions
+	{
+		for (size_t i = 1; i < header.count; ++i)
+			out[i] = out[i - 1] + 1;
+		return header.count;
+	}
+
+	const uint64_t mask = (uint64_t{1} << header.bits) - 1;
+	size_t bit = 0;
+	for (size_t i = 1; i < header.count; ++i, bit += header.bits)
+	{
+		uint64_t word;
+		std::memcpy(&word, packed + bit / 8, sizeof(word));
+		out[i] = out[i - 1] + 1 + static_cast<int>((word >> (bit % 8)) & mask);
+	}
+	return header.count;
+}
+
+/**
+ *
+ * @param A A compressed set
+ * @return Every match start of A
+ */
+ExplicitSet decompress(const CompressedSet &A)
+{
+	PROFILE_KERNEL(Kernel::DECODE);
+	ExplicitSet C = scratch_set(A.size());
+	C.elems.resize(A.size());
+	size_t count = 0;
+	for (size_t b = 0; b < A.blocks.size(); ++b)
+		count += decode_block(A, b, C.elems.data() + count);
+	for (int& elem : C.elems)
+		elem -= A.shift;
+	return C;
+}
+
+/**
+ *
+ * @param A A compressed set
+ * @param begin First match start to keep
+ * @param end Match start past the last one to keep
+ * @brief Views the blocks holding the match starts in [begin, end), found from
+ *		  the block headers, for running a plan on one window of the corpus.
+ *		  The first and last block can hold starts outside the window, the
+ *		  caller only enumerates starts within it.
+ * @return The restricted set
+ */
+CompressedSet restrict_set(const CompressedSet &A, int begin, int end)
+{
+	const int64_t first_position = static_cast<int64_t>(begin) + A.shift;
+	const int64_t end_position = static_cast<int64_t>(end) + A.shift;
+	auto first = std::partition_point(A.blocks.begin(), A.blocks.end(), [&](const PostingBlock& block) { return block.last < first_position; });
+	auto last = std::partition_point(first, A.blocks.end(), [&](const PostingBlock& block) { return block.first < end_position; });
+	return {std::span<const PostingBlock>(first, last), A.data, A.shift};
+}
+
+//-----------------------------  KERNELS  ----------------------------------------------------------
+
+/**
+ * @param blocks Block headers of a compressed set
+ * @param b Block to start from, every block before it ends before target
+ * @param target An unshifted position
+ * @brief Gallops over the headers, like gallop() over positions, without
+ *		  decoding anything.
+ * @return The first block whose last position is >= target, or blocks.size()
+ */
+static size_t skip_blocks(std::span<const PostingBlock> blocks, size_t b, int target)
+{
+	size_t step = 1;
+	size_t hi = b;
+	while (hi < blocks.size() && blocks[hi].last < target)
+	{
+		b = hi + 1;
+		hi += step;
+		step *= 2;
+	}
+	hi = std::min(hi, blocks.size());
+	return std::partition_point(blocks.begin() + b, blocks.begin() + hi,
+		[&](const PostingBlock& block) { return block.last < target; }) - blocks.begin();
+}
+
+/**
+ * @param A A compressed set
+ * @param B A sorted set
+ * @param B_shift Shift of B
+ * @brief For each element of B, skips to the block of A that could hold it.
+ *		  The B elements inside that block are intersected with it in one go,
+ *		  so each block is decoded at most once and blocks without B elements
+ *		  are never decoded.
+ * @return The intersection, as match starts
+ */
+template<typename T>
+static ExplicitSet intersect_blocks(const CompressedSet& A, const T& B, int B_shift)
+{
+	PROFILE_KERNEL(Kernel::BLOCK_SKIP);
+	ExplicitSet C = scratch_set(std::min(A.size(), B.size()) + SIMD_OUTPUT_PADDING);
+	C.elems.resize(std::min(A.size(), B.size()) + SIMD_OUTPUT_PADDING);
+	std::array<int, POSTING_BLOCK_SIZE> values;
+	size_t count = 0;
+	size_t b = 0;
+	size_t q = 0;
+
+	while (q < B.size())
+	{
+		b = skip_blocks(A.blocks, b, B[q] - B_shift + A.shift);
+		if (b == A.blocks.size())
+			break;
+
+		// B elements between the first and last position of the block
+		const PostingBlock& block = A.blocks[b];
+		const size_t q_begin = gallop(B, q, block.first - A.shift + B_shift);
+		const size_t q_end = gallop(B, q_begin, block.last - A.shift + B_shift + 1);
+		if (q_begin < q_end)
+		{
+			const size_t k = decode_block(A, b, values.data());
+			count += simd_intersect(values.data(), k, A.shift, B.data() + q_begin, q_end - q_begin, B_shift, C.elems.data() + count);
+		}
+		q = q_end;
+		++b;
+	}
+	C.elems.resize(count);
+	return C;
+}
+
+/**
+ * @param A A sorted set
+ * @param A_shift Shift of A
+ * @param B A compressed set
+ * @brief Elements of A outside every block of B are copied, the ones inside a
+ *		  block are diffed against the decoded block.
+ * @return A diff B, as match starts
+ */
+template<typename T>
+static ExplicitSet diff_blocks(const T& A, int A_shift, const CompressedSet& B)
+{
+	PROFILE_KERNEL(Kernel::BLOCK_SKIP);
+	ExplicitSet C = scratch_set(A.size() + SIMD_OUTPUT_PADDING);
+	C.elems.resize(A.size() + SIMD_OUTPUT_PADDING);
+	std::array<int, POSTING_BLOCK_SIZE> values;
+	size_t count = 0;
+	size_t b = 0;
+	size_t p = 0;
+
+	while (p < A.size())
+	{
+		b = skip_blocks(B.blocks, b, A[p] - A_shift + B.shift);
+		if (b == B.blocks.size())
+			break;
+
+		const PostingBlock& block = B.blocks[b];
+		const size_t p_begin = gallop(A, p, block.first - B.shift + A_shift);
+		const size_t p_end = gallop(A, p_begin, block.last - B.shift + A_shift + 1);
+		for (; p < p_begin; ++p)
+			C.elems[count++] = A[p] - A_shift;
+		if (p_begin < p_end)
+		{
+			const size_t k = decode_block(B, b, values.data());
+			count += simd_difference(A.data() + p_begin, p_end - p_begin, A_shift, values.data(), k, B.shift, C.elems.data() + count);
+		}
+		p = p_end;
+		++b;
+	}
+	for (; p < A.size(); ++p)
+		C.elems[count++] = A[p] - A_shift;
+	C.elems.resize(count);
+	return C;
+}
+
+ExplicitSet intersection(const CompressedSet &A, const IndexSet &B)
+{
+	return intersect_blocks(A, B.elems, B.shift);
+}
+
+ExplicitSet intersection(const CompressedSet &A, const ExplicitSet &B)
+{
+	return intersect_blocks(A, B.elems, 0);
+}
+
+ExplicitSet difference(const IndexSet &A, const CompressedSet &B)
+{
+	return diff_blocks(A.elems, A.shift, B);
+}
+
+ExplicitSet difference(const ExplicitSet &A, const CompressedSet &B)
+{
+	return diff_blocks(A.elems, 0, B);
+}
+
+/**
+ *
+ * @param A A compressed set
+ * @param B A compressed set
+ * @brief Walks the blocks of both sets together. A block that does not overlap
+ *		  the current block of the other set is skipped by galloping over the
+ *		  headers, overlapping blocks are decoded once and intersected.
+ * @return The intersection, as match starts
+ */
+ExplicitSet intersection(const CompressedSet &A, const CompressedSet &B)
+{
+	PROFILE_KERNEL(Kernel::BLOCK_SKIP);
+	ExplicitSet C = scratch_set(std::min(A.size(), B.size()) + SIMD_OUTPUT_PADDING);
+	C.elems.resize(std::min(A.size(), B.size()) + SIMD_OUTPUT_PADDING);
+	std::array<int, POSTING_BLOCK_SIZE> a_values, b_values;
+	size_t a_decoded = A.blocks.size(), b_decoded = B.blocks.size();
+	size_t a_count = 0, b_count = 0;
+	size_t count = 0;
+	size_t a = 0;
+	size_t b = 0;
+
+	while (a < A.blocks.size() && b < B.blocks.size())
+	{
+		// Block ranges as match starts
+		const int a_first = A.blocks[a].first - A.shift, a_last = A.blocks[a].last - A.shift;
+		const int b_first = B.blocks[b].first - B.shift, b_last = B.blocks[b].last - B.shift;
+		if (a_last < b_first)
+		{
+			a = skip_blocks(A.blocks, a, b_first + A.shift);
+			continue;
+		}
+		if (b_last < a_first)
+		{
+			b = skip_blocks(B.blocks, b, a_first + B.shift);
+			continue;
+		}
+
+		// A block can overlap several blocks of the other set, keep the last decoded ones
+		if (a_decoded != a)
+		{
+			a_count = decode_block(A, a, a_values.data());
+			a_decoded = a;
+		}
+		if (b_decoded != b)
+		{
+			b_count = decode_block(B, b, b_values.data());
+			b_decoded = b;
+		}
+		count += simd_intersect(a_values.data(), a_count, A.shift, b_values.data(), b_count, B.shift, C.elems.data() + count);
+
+		if (a_last <= b_last)
+			++a;
+		if (b_last <= a_last)
+			++b;
+	}
+	C.elems.resize(count);
+	return C;
+}
+
+/**
+ *
+ * @param A A compressed set
+ * @param B A dense set
+ * @return The match starts of A within B, only the blocks overlapping B are decoded
+ */
+ExplicitSet intersection(const CompressedSet &A, const DenseSet &B)
+{
+	PROFILE_KERNEL(Kernel::BLOCK_SKIP);
+	ExplicitSet C = scratch_set(std::min<size_t>(A.size(), std::max(B.last - B.first + 1, 0)));
+	std::array<int, POSTING_BLOCK_SIZE> values;
+	for (size_t b = skip_blocks(A.blocks, 0, B.first + A.shift);
+		 b < A.blocks.size() && A.blocks[b].first - A.shift <= B.last; ++b)
+	{
+		const size_t k = decode_block(A, b, values.data());
+		for (size_t i = 0; i < k; ++i)
+		{
+			const int start = values[i] - A.shift;
+			if (start >= B.first && start <= B.last)
+				C.elems.push_back(start);
+		}
+	}
+	return C;
+}
@@ -0,0 +1,43 @@
+#include <vector>
+#include "corpus.h"
+
+#ifndef COMPRESSED_H
+#define COMPRESSED_H
+/*********************************************************
+ * @brief
+ *			Block compressed postings lists.
+ * @details
+ *			The positions of each value are cut into blocks of
+ *			POSTING_BLOCK_SIZE. A block stores its first position in the
+ *			header and the gaps to the following positions bit packed,
+ *			with the smallest bit width that fits the largest gap of the
+ *			block. Frequent values have small gaps and pack to a few bits
+ *			per position, instead of the four bytes of a plain index.
+ *
+ *			The block headers are the skip pointers: the kernels below
+ *			gallop over first/last and only decode a block when the other
+ *			set has elements inside its range. Results are ExplicitSets of
+ *			match starts, like the other kernels in corpus.cpp.
+ */
+//*********************************************************
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+
+// Building
+CompressedIndex compress_index(const SharedArray<int> &index, const SharedArray<int> &offsets);
+void compress_indices(Corpus &corpus);
+
+// Decoding
+size_t decode_block(const CompressedSet &A, size_t block, int *out);
+ExplicitSet decompress(const CompressedSet &A);
+CompressedSet restrict_set(const CompressedSet &A, int begin, int end);
+
+// Kernels
+ExplicitSet intersection(const CompressedSet &A, const CompressedSet &B);
+ExplicitSet intersection(const CompressedSet &A, const IndexSet &B);
+ExplicitSet intersection(const CompressedSet &A, const ExplicitSet &B);
+ExplicitSet intersection(const CompressedSet &A, const DenseSet &B);
+ExplicitSet difference(const IndexSet &A, const CompressedSet &B);
+ExplicitSet difference(const ExplicitSet &A, const CompressedSet &B);
+
+#endif //COMPRESSED_H
@@ -1,4 +1,19 @@
 #include "corpus.h"
+#include "bitmap.h"
+#include "compressed.h"
+#include "pattern.h"
+#include "planner.h"
+#include "profile.h"
+#include "result_cache.h"
+#include "scratch.h"
+#include "simd_sets.h"
+#include "thread_pool.h"
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <optional>
+#include <thread>
 
 //-----------------------------  PARSING FUNCTIONS BELOW  ----------------------------------------------------------
 
@@ -8,46 +23,141 @@
  * @brief Parses a string into a Query object
  *
  * @attention Throws a exception if the query is empty,
- *			  the query is not in the correct format or if
+ *			  the query is not in the correct format, if
  *			  the query contains tokens that are not in the corpus
+ *			  or if a clause is repeated, see parse_sequence()
  *
  * @return A query object that can be used to search the corpus.
  */
 Query parse_query(const std::string& text, const Corpus& corpus)
 {
-	Query query;
-	std::vector<std::string> clauses = split_clauses(text);
-	for (const std::string& clause : clauses)
+	const Sequence sequence = parse_sequence(text, corpus);
+	if (!is_fixed_length(sequence))
+		throw std::invalid_argument("Error: Repeated clauses can only be matched and counted");
+	return fixed_query(sequence);
+}
+
+/**
+ * @param text A query in string format, a clause can be followed by {min,max} or {n}
+ * @param corpus A corpus
+ * @brief Parses a string into a Sequence, a query whose clauses can repeat
+ *
+ * @attention Throws a exception if the query is empty, the query is not in the
+ *			  correct format, if a repetition is out of bounds or if the query
+ *			  contains tokens that are not in the corpus
+ *
+ * @return The clauses and their repetitions
+ */
+Sequence parse_sequence(const std::string& text, const Corpus& corpus)
+{
+	PROFILE_STAGE(Stage::PARSE);
+	Sequence sequence;
+	std::vector<std::pair<int, int>> repetitions;
+	std::vector<std::string> clauses = split_clauses(text, &repetitions);
+	for (size_t i = 0; i < clauses.size(); ++i)
 	{
-		std::vector<Literal> literals = parse_clause(clause, corpus);
-		Clause current_clause;
-		for (const Literal& lit : literals)
-		{
-			current_clause.push_back(lit);
-		}
-		query.push_back(current_clause);
+		sequence.push_back({parse_clause(clauses[i], corpus), repetitions[i].first, repetitions[i].second});
 	}
-	if(query.empty())
+	if(sequence.empty())
 		throw std::invalid_argument("Error: Empty Query");
 
+	return sequence;
+}
+
+/**
+ * @return True if every clause of the sequence matches exactly one token
+ */
+bool is_fixed_length(const Sequence &sequence)
+{
+	return std::all_of(sequence.begin(), sequence.end(), [](const RepeatedClause &clause) {
+		return clause.min == 1 && clause.max == 1;
+	});
+}
+
+/**
+ * @return The clauses of the sequence, without their repetitions
+ */
+Query fixed_query(const Sequence &sequence)
+{
+	Query query;
+	for (const RepeatedClause &clause : sequence)
+		query.push_back(clause.clause);
 	return query;
 }
 
+/**
+ * @param text The text between the braces of a repetition, n or min,max
+ * @attention Throws an exception if the bounds are not numbers, min > max,
+ *			  max is 0 or max is above MAX_REPETITION
+ * @return min and max
+ */
+static std::pair<int, int> parse_repetition(const std::string& text)
+{
+	const size_t comma = text.find(',');
+	auto bound = [&](const std::string& number) {
+		const bool digits = std::all_of(number.begin(), number.end(), [](char ch) { return std::isdigit(static_cast<unsigned char>(ch)); });
+		if (number.empty() || number.size() > 3 || !digits)
+			throw std::invalid_argument("Invalid repetition {" + text + "}");
+		return std::stoi(number);
+	};
+	const int min = bound(text.substr(0, comma));
+	const int max = comma == std::string::npos ? min : bound(text.substr(comma + 1));
+	if (min > max || max == 0 || max > MAX_REPETITION)
+		throw std::invalid_argument("Invalid repetition {" + text + "}, it needs min <= max and 0 < max <= " + std::to_string(MAX_REPETITION));
+	return {min, max};
+}
+
 /**
  * @param text
+ * @param repetitions Optional output, the {min,max} of each clause, {1,1} if it
+ *					  has none. Without it a repetition is an error.
  * @brief Splits a string of multiple clauses into a vector of strings,
  *		  where each string is a clause.
  * @return A vector of strings each representing a clause
  */
-std::vector<std::string> split_clauses(const std::string& text)
+std::vector<std::string> split_clauses(const std::string& text, std::vector<std::pair<int, int>>* repetitions)
 {
 	std::vector<std::string> clauses;
 	std::string sub_clause;
+	std::string bounds;
 	bool in_clause = false;
+	bool in_value = false;	// Brackets inside quotes belong to the value, e.g. a regex
+	bool in_bounds = false;	// Between the braces of a repetition
+	bool repeated = false;	// The last clause already has a repetition
 
 	for (char ch : text)
 	{
-		if (ch == '[')
+		if (in_clause && ch == '"')
+		{
+			in_value = !in_value;
+			sub_clause += ch;
+		}
+		else if (in_value)
+		{
+			sub_clause += ch;
+		}
+		else if (in_bounds)
+		{
+			if (ch != '}')
+			{
+				bounds += ch;
+				continue;
+			}
+			in_bounds = false;
+			repeated = true;
+			if (!repetitions)
+				throw std::invalid_argument("Repetition {" + bounds + "} is not supported here");
+			repetitions->back() = parse_repetition(bounds);
+		}
+		else if (ch == '{' && !in_clause)
+		{
+			// A repetition of the clause just closed
+			if (clauses.empty() || repeated)
+				throw std::invalid_argument("A repetition {min,max} must follow a clause");
+			in_bounds = true;
+			bounds.clear();
+		}
+		else if (ch == '[')
 		{
 			// Start of a new clause, reset the clause string
 			if (in_clause)
@@ -64,7 +174,10 @@ std::vector<std::string> split_clauses(const std::string& text)
 			if (in_clause)
 			{
 				clauses.push_back(sub_clause);
+				if (repetitions)
+					repetitions->push_back({1, 1});
 				in_clause = false;
+				repeated = false;
 			}
 			else
 			{
@@ -82,16 +195,62 @@ std::vector<std::string> split_clauses(const std::string& text)
 	{
 		throw std::invalid_argument("Missing closing bracket for a clause");
 	}
+	if (in_bounds)
+	{
+		throw std::invalid_argument("Missing closing brace for a repetition");
+	}
 
 	return clauses;
 }
 
+/**
+ *
+ * @param alternatives Literals written with | between them
+ * @param corpus The corpus
+ * @brief Joins the alternatives into one literal. Equalities and patterns of one
+ *		  attribute become one pattern of all their values, as cheap to match
+ *		  as a single pattern. Other alternatives are kept as they are, and the
+ *		  literal passes if any of them does.
+ * @return The disjunction
+ */
+static Literal disjunction(const std::vector<Literal>& alternatives, const Corpus& corpus)
+{
+	const Attribute attribute = alternatives.front().attribute;
+	const bool one_attribute = std::all_of(alternatives.begin(), alternatives.end(), [&](const Literal& literal) {
+		return literal.attribute == attribute && literal.is_equality;
+	});
+	if (!one_attribute)
+		return Literal{attribute, 0, true, nullptr, std::make_shared<const std::vector<Literal>>(alternatives)};
+
+	const Dictionary& dictionary = corpus.dictionary(attribute);
+	std::string text;
+	std::vector<uint32_t> values;
+	for (const Literal& literal : alternatives)
+	{
+		text += (text.empty() ? "" : "|") + (literal.values ? literal.values->text : "=\"" + dictionary.index2string[literal.value] + "\"");
+		if (literal.values)
+			values.insert(values.end(), literal.values->values.begin(), literal.values->values.end());
+		else
+			values.push_back(literal.value);
+	}
+	Literal joined{attribute, 0, true, make_value_set(std::move(text), std::move(values), dictionary.size()), nullptr};
+	if (joined.values->values.size() == 1)
+	{
+		joined.value = joined.values->values.front();
+		joined.values.reset();
+	}
+	return joined;
+}
+
 /**
  *
  * @param text A string of literals
  * @param corpus The corpus
  * @brief Takes a string of literals( A clause), splits them one by one,
- *		  Ensures correct format, and then returns a vector containing all literals
+ *		  Ensures correct format, and then returns a vector containing all literals.
+ *		  A literal is attr="value" or attr!="value", attr~"regex" or attr!~"regex"
+ *		  for a pattern, and a %c after the value ignores case, see pattern.h.
+ *		  Literals joined by | are one literal that passes if any of them does.
  *
  * @attention Throws an exception if the literal is not in the correct format or
  *			  if the literal dosnt exist in the corpus
@@ -99,7 +258,6 @@ std::vector<std::string> split_clauses(const std::string& text)
  */
 std::vector<Literal> parse_clause(const std::string& text, const Corpus& corpus) {
     std::vector<Literal> literals;
-    std::istringstream stream(text);
     std::string literal;
 
 	auto trim_and_validate_lit = [](const std::string& value) -> std::string {
@@ -111,112 +269,80 @@ std::vector<Literal> parse_clause(const std::string& text, const Corpus& corpus)
 
     // Helper lambda to process and set the literal values
     auto process_literal = [&](Literal& literal_obj, size_t pos, const std::string& op) {
-        literal_obj.is_equality = (op == "=");
-        literal_obj.attribute = literal.substr(0, pos);
+        literal_obj.is_equality = (op == "=" || op == "~");
+        literal_obj.attribute = parse_attribute(std::string_view(literal).substr(0, pos));
         std::string value = literal.substr(pos + op.size());
+        const bool ignore_case = value.size() > 2 && value.ends_with("%c");
+        if (ignore_case)
+        	value.resize(value.size() - 2);
         value = trim_and_validate_lit(value);
 
-    	auto index = corpus.string2index.find(value);
-    	if (index != corpus.string2index.end())
-    		literal_obj.value = index->second;
-    	else
-    		throw std::logic_error("Error: "+value+" does not exist in corpus");
-    };
+    	const Dictionary& dictionary = corpus.dictionary(literal_obj.attribute);
+    	const bool is_regex = op.back() == '~';
+    	if (!is_regex && !ignore_case)
+    	{
+    		auto index = dictionary.string2index.find(value);
+    		if (index != dictionary.string2index.end())
+    			literal_obj.value = index->second;
+    		else
+    			throw std::logic_error("Error: "+value+" does not exist in corpus as "+attribute_name(literal_obj.attribute));
+    		return;
+    	}
 
-    while (getline(stream, literal, ' ')) { // Split by space to get each literal
-        Literal lit;
-        size_t pos = literal.find("!=");
+    	// A pattern of one value is an ordinary literal, see pattern.h
+    	literal_obj.value = 0;
+    	literal_obj.values = expand_pattern(dictionary, value, is_regex, ignore_case);
+    	if (literal_obj.values->values.size() == 1)
+    	{
+    		literal_obj.value = literal_obj.values->values.front();
+    		literal_obj.values.reset();
+    	}
+    };
 
-        if (pos != std::string::npos) {
-            process_literal(lit, pos, "!=");
-        } else if ((pos = literal.find('=')) != std::string::npos) {
-            process_literal(lit, pos, "=");
+    // Literals end at spaces and at |, outside quotes, a | is a token of its own
+    std::vector<std::string> tokens;
+    bool in_value = false;
+    for (char ch : text) {
+        if (ch == '"')
+            in_value = !in_value;
+        if (!in_value && (ch == ' ' || ch == '|')) {
+            if (!literal.empty())
+                tokens.push_back(std::move(literal));
+            literal.clear();
+            if (ch == '|')
+                tokens.push_back("|");
         } else {
-            throw std::invalid_argument("Cannot parse literal");
+            literal += ch;
         }
+    }
+    if (!literal.empty())
+        tokens.push_back(literal);
+
+    std::vector<std::vector<Literal>> groups; // Literals joined by |
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i] == "|") {
+            if (groups.empty() || i + 1 == tokens.size() || tokens[i + 1] == "|")
+                throw std::invalid_argument("Cannot parse literal, | needs a literal on both sides");
+            continue;
+        }
+        literal = tokens[i];
+        Literal lit;
+        const size_t pos = literal.find_first_of("!=~");
+        if (pos == std::string::npos || (literal[pos] == '!' && pos + 1 < literal.size() && literal[pos + 1] != '=' && literal[pos + 1] != '~'))
+            throw std::invalid_argument("Cannot parse literal");
 
-        // Validate the attribute
-    	if (lit.attribute != "word" && lit.attribute != "c5" && lit.attribute != "lemma" && lit.attribute != "pos")
-    	{
-    		throw std::invalid_argument("attribute not recognized");
-    	}
-
-        literals.push_back(lit);
+        process_literal(lit, pos, literal[pos] == '!' ? literal.substr(pos, 2) : literal.substr(pos, 1));
+        if (i > 0 && tokens[i - 1] == "|")
+            groups.back().push_back(lit);
+        else
+            groups.push_back({lit});
     }
 
+    for (const std::vector<Literal>& group : groups)
+        literals.push_back(group.size() == 1 ? group.front() : disjunction(group, corpus));
     return literals;
 }
 
-//-----------------------------  CORPUS FUNCTIONS BELOW  ----------------------------------------------------------
-/**
- *
- * @param filename Name of input file¨
- * @brief Takes a file containing a corpus of sentences and parses it into a Corpus object
- * @return Corpus object
- */
-Corpus load_corpus(const std::string& filename)
-{
-	std::ifstream corpus_file(filename);
-	if (!corpus_file) // Exit if file didnt open
-		throw std::invalid_argument("Could not open file " + filename);
-
-	Corpus corpus;
-	std::string row;
-	size_t token_index = 0;
-	bool in_sentence = false;
-
-	getline(corpus_file, row); // Skip header
-	while (getline(corpus_file, row)) // Parse file row by row
-	{
-		if (row.empty() || row[0] == '#')
-		{
-			// If row is empty, sentence complete, set flag to later save sentence index
-			if (row.empty())
-			{
-				in_sentence = false;
-			}
-			// If row is comment, skip
-			continue;
-		}
-
-		std::istringstream row_content(row);
-		std::string word, c5, lemma, pos;
-
-		std::istringstream token_stream(row);
-		// If full token is found, add to Corpus
-		if (row_content >> word >> c5 >> lemma >> pos)
-		{
-			Token row_token{};
-			row_token.word = insert_and_get_index(corpus, word);
-			row_token.c5 = insert_and_get_index(corpus, c5);
-			row_token.lemma = insert_and_get_index(corpus, lemma);
-			row_token.pos = insert_and_get_index(corpus, pos);
-
-			if (!in_sentence)
-			{
-				in_sentence = true;
-				corpus.sentences.push_back(static_cast<int>(token_index));
-			}
-
-			corpus.tokens.push_back(row_token);
-			token_index++;
-		}
-		// Files should include 4 string per row, if not stringstream probably failed, or file is incomplete ->EXIT
-		else
-		{
-			throw std::invalid_argument(std::string("Error: could not parse line " + row + " of file " + filename));
-		}
-	}
-	// Last sentence of file
-	if (!row.empty())
-	{
-		corpus.sentences.push_back(static_cast<int>(token_index));
-	}
-
-	build_indices(corpus);
-	return corpus;
-}
-
 //--------------------------------- OLD MATCHING FUNCTIONS BELOW  ------------------------------------------------------
 /**
  * @brief Helper function for "match(const Corpus &corpus, const Query &query)"
@@ -241,18 +367,21 @@ std::vector<Match> match(const Corpus& corpus, const std::string& query_string)
 std::vector<Match> match(const Corpus& corpus, const Query& query)
 {
 	std::vector<Match> matches;
+	std::vector<ClauseEvaluator> clauses;
+	for (const Clause& clause : query)
+		clauses.push_back(compile_clause(corpus, clause));
 
 	for (size_t sentence_index = 0; sentence_index < corpus.sentences.size(); ++sentence_index)
 	{
 		size_t start = corpus.sentences[sentence_index];
-		size_t end = (sentence_index + 1 < corpus.sentences.size()) ? corpus.sentences[sentence_index + 1] : corpus.tokens.size();
+		size_t end = (sentence_index + 1 < corpus.sentences.size()) ? corpus.sentences[sentence_index + 1] : corpus.token_count();
 
 		for (size_t i = start; i < end; ++i)
 		{
 			bool all_clauses_match = true;
 			for (size_t j = 0; j < query.size(); ++j)
 			{
-				if (i + j >= end || !compare_token_clause(corpus.tokens[i + j], query[j], corpus))
+				if (i + j >= end || !clauses[j](i + j))
 				{
 					all_clauses_match = false;
 					break;
@@ -283,24 +412,30 @@ std::vector<Match> match_single(const Corpus &corpus, const std::string &attr, c
 {
 	std::vector<Match> matches;
 
-	auto value_element = corpus.string2index.find(value);
-	if (value_element == corpus.string2index.end()) {
+	const Attribute attribute = parse_attribute(attr);
+	const Dictionary& dictionary = corpus.dictionary(attribute);
+	auto value_element = dictionary.string2index.find(value);
+	if (value_element == dictionary.string2index.end()) {
 		// If word doesnt exist, return no matches
 		return matches;
 	}
 
-	// Create a indexSet
-	uint32_t value_index = value_element->second;
-	IndexSet matching_tokens = index_lookup(corpus, attr, value_index);
-
-	// Binary search the corpus sentences vector for the span in the IndexSet,
-	// Then create a Match object and add to the vector to be returned
-	for (const int index : matching_tokens.elems) {
-		auto sentence = std::upper_bound(corpus.sentences.begin(),
-			corpus.sentences.end(), index);
-		int sentence_index = std::distance(corpus.sentences.begin(), sentence) - 1;
+	// Create a Match object for each position and add to the vector to be returned
+	auto add_match = [&](const int index) {
+		matches.push_back({corpus.sentence_ids[index], index, 1});
+	};
 
-		matches.push_back({sentence_index, index, 1});
+	uint32_t value_index = value_element->second;
+	const PostingsDirectory directory = postings_directory(corpus, attribute);
+	if (directory.is_compressed())
+	{
+		for (const int index : decompress(directory.compressed->lookup(value_index)).elems)
+			add_match(index);
+	}
+	else
+	{
+		for (const int index : directory.lookup(value_index).elems)
+			add_match(index);
 	}
 	return matches;
 }
@@ -339,16 +474,87 @@ bool compare_token_clause(const Token& token, const Clause& clause, const Corpus
  */
 bool compare_literal_token(const Token& token, const Literal& literal, const Corpus& corpus)
 {
-	const std::string& attr = literal.attribute;
-	const uint32_t& val = literal.value;
-	bool is_equal = literal.is_equality;
+	if (literal.alternatives)
+	{
+		return std::any_of(literal.alternatives->begin(), literal.alternatives->end(), [&](const Literal& alternative) {
+			return compare_literal_token(token, alternative, corpus);
+		});
+	}
+	const uint32_t value = token.*attribute_member(literal.attribute);
+	return (literal.values ? literal.values->contains(value) : value == literal.value) == literal.is_equality;
+}
+
+/**
+ * @brief Compares one value of a column, instantiated for every column width
+ *		  and operator so the load and the comparison are fixed at compile time
+ */
+template<typename T, bool is_equality>
+static bool compare_column(const ClauseEvaluator::LiteralTest& literal, size_t position)
+{
+	return (static_cast<const T*>(literal.column)[position] == literal.value) == is_equality;
+}
+
+/**
+ * @brief Looks one value of a column up in a pattern's values, see compare_column()
+ */
+template<typename T, bool is_equality>
+static bool contains_column(const ClauseEvaluator::LiteralTest& literal, size_t position)
+{
+	return literal.values->contains(static_cast<const T*>(literal.column)[position]) == is_equality;
+}
+
+/**
+ * @brief Passes if any alternative of a disjunction does, see compare_column()
+ */
+static bool any_column(const ClauseEvaluator::LiteralTest& literal, size_t position)
+{
+	for (const ClauseEvaluator::LiteralTest& alternative : *literal.alternatives)
+	{
+		if (alternative.test(alternative, position))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * @return The literal bound to its attribute's column and comparison, see compile_clause()
+ */
+static ClauseEvaluator::LiteralTest compile_literal(const Corpus &corpus, const Literal &literal)
+{
+	if (literal.alternatives)
+	{
+		auto alternatives = std::make_shared<std::vector<ClauseEvaluator::LiteralTest>>();
+		for (const Literal& alternative : *literal.alternatives)
+			alternatives->push_back(compile_literal(corpus, alternative));
+		return {any_column, nullptr, 0, nullptr, std::move(alternatives)};
+	}
 
-	if (attr == "word") return is_equal ? token.word == val : token.word != val;
-	if (attr == "c5") return is_equal ? token.c5 == val : token.c5 != val;
-	if (attr == "lemma") return is_equal ? token.lemma == val : token.lemma != val;
-	if (attr == "pos") return is_equal ? token.pos == val : token.pos != val;
+	const Column& column = corpus.column(literal.attribute);
+	const ClauseEvaluator::Test test = column.visit([&](auto values) -> ClauseEvaluator::Test {
+		using T = typename decltype(values)::value_type;
+		if (literal.values)
+			return literal.is_equality ? contains_column<T, true> : contains_column<T, false>;
+		return literal.is_equality ? compare_column<T, true> : compare_column<T, false>;
+	});
+	return {test, column.data(), literal.value, literal.values.get(), nullptr};
+}
 
-	throw std::invalid_argument("Attribute not recognized");
+/**
+ *
+ * @param corpus A corpus
+ * @param clause A clause
+ * @brief Binds every literal to its attribute's column and the comparison of
+ *		  the column's width and the operator, chosen once instead of for every
+ *		  token scanned
+ * @return The clause evaluator, true for every token if the clause is empty
+ */
+ClauseEvaluator compile_clause(const Corpus &corpus, const Clause &clause)
+{
+	ClauseEvaluator evaluator;
+	evaluator.tests.reserve(clause.size());
+	for (const Literal& literal : clause)
+		evaluator.tests.push_back(compile_literal(corpus, literal));
+	return evaluator;
 }
 
 // -----------------------------  Intersections  ----------------------------------------------------------
@@ -358,22 +564,24 @@ bool compare_literal_token(const Token& token, const Literal& literal, const Cor
  * @param A First input set.
  * @param B Second input set
  *			- Sets can be of type IndexSet or ExplicitSet.
- * @brief  Uses binary search to find the intersection of two sets.
- *		  - Is suitable for use if A is smaller than B.
+ * @brief  Gallops through B for each element in A, continuing from the last
+ *		  position found. Runs in O(|A| log(|B|/|A|)).
+ *		  - Is suitable for use if A is much smaller than B.
  * @return A Explicitset containing the intersection of A and B.
  */
 template<typename T1, typename T2>
-ExplicitSet binary_intersect_two_sets(const T1& A, const T2& B, int A_shift = 0, int B_shift = 0)
+ExplicitSet galloping_intersect_two_sets(const T1& A, const T2& B, int A_shift = 0, int B_shift = 0)
 {
-	ExplicitSet C;
-	// Binary search B for each element in A
+	PROFILE_KERNEL(Kernel::GALLOP);
+	ExplicitSet C = scratch_set(A.size());
+	size_t q = 0;
 	for (const int x : A)
 	{
-		// Check if A exists in B
-		if (std::binary_search(B.begin(), B.end(), x - A_shift + B_shift))
-		{
-			C.elems.push_back(x);
-		}
+		q = gallop(B, q, x - A_shift + B_shift);
+		if (q == B.size())
+			break;
+		if (B[q] == x - A_shift + B_shift)
+			C.elems.push_back(x - A_shift);
 	}
 	return C;
 }
@@ -383,47 +591,71 @@ ExplicitSet binary_intersect_two_sets(const T1& A, const T2& B, int A_shift = 0,
  * @param A First input set.
  * @param B Second input set
  *			- Sets can be of type IndexSet or ExplicitSet.
- * @brief  Uses binary search to find the difference of two sets.
- *		  - Is suitable for use if A is smaller than B.
+ * @brief  Gallops through B for each element in A, keeping those not found.
+ *		  - Is suitable for use if A is much smaller than B.
  * @return A Explicitset containing (A difference B)
  */
 template<typename T1, typename T2>
-ExplicitSet binary_diff_two_sets(const T1& A, const T2& B, int A_shift = 0, int B_shift = 0) {
-	ExplicitSet C;
-	std::cout<<"bin diff"<<std::endl;
-	// Binary search B for each element in A
+ExplicitSet galloping_diff_two_sets(const T1& A, const T2& B, int A_shift = 0, int B_shift = 0) {
+	PROFILE_KERNEL(Kernel::GALLOP);
+	ExplicitSet C = scratch_set(A.size());
+	size_t q = 0;
 	for (const int x : A) {
-		// Check if x exists in B (after applying the shifts)
-		if (!std::binary_search(B.begin(), B.end(), x - A_shift + B_shift)) {
-			C.elems.push_back(x);
+		q = gallop(B, q, x - A_shift + B_shift);
+		if (q == B.size() || B[q] != x - A_shift + B_shift) {
+			C.elems.push_back(x - A_shift);
 		}
 	}
+	return C;
+}
 
+/**
+ * Computes the difference of two sets.
+ * @param A First input set.
+ * @param B Second input set
+ *			- Sets can be of type IndexSet or ExplicitSet.
+ * @brief  Gallops through A for each element in B and copies the runs of A
+ *		  between them, so only |B| searches are made.
+ *		  - Is suitable for use if B is much smaller than A.
+ * @return A Explicitset containing (A difference B)
+ */
+template<typename T1, typename T2>
+ExplicitSet galloping_diff_runs(const T1& A, const T2& B, int A_shift = 0, int B_shift = 0) {
+	PROFILE_KERNEL(Kernel::GALLOP_RUNS);
+	ExplicitSet C = scratch_set(A.size());
+	size_t p = 0;
+	auto copy_run = [&](size_t end) {
+		for (; p < end; ++p)
+			C.elems.push_back(A[p] - A_shift);
+	};
+	for (const int y : B) {
+		const size_t found = gallop(A, p, y - B_shift + A_shift);
+		copy_run(found);
+		if (p == A.size())
+			break;
+		if (A[p] == y - B_shift + A_shift)
+			++p; // Skip the common element
+	}
+	copy_run(A.size());
 	return C;
 }
+
 /**
  * Computes the intersection of two sets.
  * @param A First input set.
  * @param B Second input set
  *			- Sets can be of type IndexSet or ExplicitSet.
+ * @brief  Block-compare merge, vectorized with the widest instruction set
+ *		  available (see simd_sets.h).
+ *		  - Is suitable for sets of similar size.
  * @return A vector containing the intersection of A and B.
  */
 template<typename T1, typename T2>
 ExplicitSet intersect_two_sets(const T1& A, const T2& B, int A_shift = 0, int B_shift = 0) {
-	ExplicitSet C;
-	size_t p = 0, q = 0;
-
-	while (p < A.size() && q < B.size()) {
-		if (A[p] - A_shift < B[q] - B_shift) {
-			++p;
-		} else if (B[q] - B_shift < A[p] - A_shift) {
-			++q;
-		} else {
-			C.elems.push_back(A[p] - A_shift); // Found an intersection
-			++p;
-			++q;
-		}
-	}
+	PROFILE_KERNEL(Kernel::MERGE);
+	ExplicitSet C = scratch_set(std::min(A.size(), B.size()) + SIMD_OUTPUT_PADDING);
+	C.elems.resize(std::min(A.size(), B.size()) + SIMD_OUTPUT_PADDING);
+	C.elems.resize(simd_intersect(A.data(), A.size(), A_shift, B.data(), B.size(), B_shift, C.elems.data()));
 	return C;
 }
 
@@ -432,33 +664,19 @@ ExplicitSet intersect_two_sets(const T1& A, const T2& B, int A_shift = 0, int B_
  * @param A First input set.
  * @param B Second input set
  *			- Sets can be of type IndexSet or ExplicitSet.
+ * @brief  Block-compare merge, vectorized with the widest instruction set
+ *		  available (see simd_sets.h).
  * @return A vector containing all elements in A that are not in B.
  */
 template<typename T1, typename T2>
 ExplicitSet diff_two_sets(const T1& A, const T2& B, int A_shift = 0, int B_shift = 0) {
-	ExplicitSet C;
-	size_t p = 0, q = 0;
-
-	while (q < A.size() && p < B.size()) {
-		if (A[q] - A_shift < B[p] - B_shift) {
-			C.elems.push_back(A[q] - A_shift); // A[q] is not in B
-			++q;
-		} else if (B[p] - B_shift < A[q] - A_shift) {
-			++p; // Skip B[p] as it's not in A
-		} else {
-			++q; // Found a common element, skip it
-			++p;
-		}
-	}
-
-	// Add remaining elements from A
-	while (q < A.size()) {
-		C.elems.push_back(A[q] - A_shift);
-		++q;
-	}
-
+	PROFILE_KERNEL(Kernel::MERGE);
+	ExplicitSet C = scratch_set(A.size() + SIMD_OUTPUT_PADDING);
+	C.elems.resize(A.size() + SIMD_OUTPUT_PADDING);
+	C.elems.resize(simd_difference(A.data(), A.size(), A_shift, B.data(), B.size(), B_shift, C.elems.data()));
 	return C;
 }
+
 /**
  * Computes the Difference between two sets
  * @param A A dense set
@@ -468,12 +686,13 @@ ExplicitSet diff_two_sets(const T1& A, const T2& B, int A_shift = 0, int B_shift
 template<typename T2>
 ExplicitSet diff_dense_x(const DenseSet& A, const T2& B, int B_shift = 0)
 {
-	ExplicitSet C;
+	PROFILE_KERNEL(Kernel::DENSE_RANGE);
+	ExplicitSet C = scratch_set(std::max(A.last - A.first + 1, 0));
 
 	int p = A.first;
 
 	int q = 0;
-	while(p <= A.last && q < B.size()){
+	while(p <= A.last && static_cast<size_t>(q) < B.size()){
 		if(p < B[q] - B_shift){
 			C.elems.push_back(p);
 			p++;
@@ -504,7 +723,8 @@ ExplicitSet diff_dense_x(const DenseSet& A, const T2& B, int B_shift = 0)
 template<typename T1>
 ExplicitSet diff_x_denseset(const T1& A, const DenseSet B, int A_shift = 0)
 {
-	ExplicitSet C;
+	PROFILE_KERNEL(Kernel::DENSE_RANGE);
+	ExplicitSet C = scratch_set(A.size());
 
 	for (const int elem : A) {
 		auto elem_shifted = elem - A_shift;
@@ -516,39 +736,104 @@ ExplicitSet diff_x_denseset(const T1& A, const DenseSet B, int A_shift = 0)
 	return C;
 }
 
+/**
+ * Computes the intersection of two sorted sets, choosing the kernel by size ratio.
+ * @param A First input set.
+ * @param B Second input set
+ *			- Sets can be of type IndexSet or ExplicitSet.
+ * @brief  Gallops with the smaller set through the larger when they differ by
+ *		  more than GALLOP_RATIO, otherwise merges.
+ * @return A Explicitset containing the intersection of A and B.
+ */
+template<typename T1, typename T2>
+ExplicitSet adaptive_intersect(const T1& A, const T2& B, int A_shift = 0, int B_shift = 0)
+{
+	if(A.size()*GALLOP_RATIO <= B.size())
+		return galloping_intersect_two_sets(A, B, A_shift, B_shift);
+	else if(B.size()*GALLOP_RATIO <= A.size())
+		return galloping_intersect_two_sets(B, A, B_shift, A_shift);
+	else
+		return intersect_two_sets(A, B, A_shift, B_shift);
+}
+
+/**
+ * Computes the difference of two sorted sets, choosing the kernel by size ratio.
+ * @param A First input set.
+ * @param B Second input set
+ *			- Sets can be of type IndexSet or ExplicitSet.
+ * @brief  Gallops A through B if A is much smaller, B through A if B is much
+ *		  smaller, otherwise merges.
+ * @return A Explicitset containing (A difference B)
+ */
+template<typename T1, typename T2>
+ExplicitSet adaptive_diff(const T1& A, const T2& B, int A_shift = 0, int B_shift = 0)
+{
+	if(A.size()*GALLOP_RATIO <= B.size())
+		return galloping_diff_two_sets(A, B, A_shift, B_shift);
+	else if(B.size()*GALLOP_RATIO <= A.size())
+		return galloping_diff_runs(A, B, A_shift, B_shift);
+	else
+		return diff_two_sets(A, B, A_shift, B_shift);
+}
+
+/**
+ * Computes the union of two sets.
+ * @param A First input set.
+ * @param B Second input set
+ *			- Sets can be of type IndexSet or ExplicitSet.
+ * @return A ExplicitSet containing every element in A or B, once.
+ */
+template<typename T1, typename T2>
+ExplicitSet union_two_sets(const T1& A, const T2& B, int A_shift = 0, int B_shift = 0)
+{
+	PROFILE_KERNEL(Kernel::UNION_MERGE);
+	ExplicitSet C = scratch_set(A.size() + B.size());
+	size_t p = 0, q = 0;
+
+	while (p < A.size() && q < B.size()) {
+		const int x = A[p] - A_shift;
+		const int y = B[q] - B_shift;
+		C.elems.push_back(std::min(x, y));
+		p += (x <= y);
+		q += (y <= x);
+	}
+	for (; p < A.size(); ++p)
+		C.elems.push_back(A[p] - A_shift);
+	for (; q < B.size(); ++q)
+		C.elems.push_back(B[q] - B_shift);
+	return C;
+}
+
+/**
+ * @param A A dense set
+ * @return A ExplicitSet with every element of A
+ */
+ExplicitSet materialize(const DenseSet& A)
+{
+	ExplicitSet C = scratch_set(std::max(A.last - A.first + 1, 0));
+	if (A.last >= A.first)
+	{
+		C.elems.resize(A.last - A.first + 1);
+		std::iota(C.elems.begin(), C.elems.end(), A.first);
+	}
+	return C;
+}
+
 // ----- SAME SET TYPE OPERATIONS ----------------------------------------------------
 ExplicitSet intersection(const ExplicitSet &A, const ExplicitSet &B){
-	if(A.elems.size()*10<=B.elems.size())
-		return binary_intersect_two_sets(A.elems, B.elems);
-	else if(A.elems.size()>B.elems.size()*10)
-		return binary_intersect_two_sets(B.elems, A.elems);
-	else
-		return intersect_two_sets(A.elems, B.elems);
+	return adaptive_intersect(A.elems, B.elems);
 }
 
-// times 10 because of ....
 ExplicitSet difference(const ExplicitSet &A, const ExplicitSet &B){
-	if(A.elems.size()>=B.elems.size()*10)
-		return binary_diff_two_sets(A.elems, B.elems);
-	else
-		return diff_two_sets(A.elems, B.elems);
+	return adaptive_diff(A.elems, B.elems);
 }
 
 ExplicitSet intersection(const IndexSet& A, const IndexSet& B) {
-
-	if(A.elems.size()*10<=B.elems.size())
-		return binary_intersect_two_sets(A.elems, B.elems, A.shift, B.shift);
-	else if(A.elems.size()>B.elems.size()*10)
-		return binary_intersect_two_sets(B.elems, A.elems, B.shift, A.shift);
-	else
-		return intersect_two_sets(A.elems, B.elems, A.shift, B.shift);
+	return adaptive_intersect(A.elems, B.elems, A.shift, B.shift);
 }
 
 ExplicitSet difference(const IndexSet &A, const IndexSet &B){
-	if(A.elems.size()>=B.elems.size()*10)
-		return binary_diff_two_sets(A.elems, B.elems, A.shift, B.shift);
-	else
-		return diff_two_sets(A.elems, B.elems, A.shift, B.shift);
+	return adaptive_diff(A.elems, B.elems, A.shift, B.shift);
 }
 
 DenseSet intersection(const DenseSet& A, const DenseSet& B) {
@@ -571,42 +856,28 @@ DenseSet difference(const DenseSet &A, const DenseSet &B){
 
 // ----- Index and explicit ----------------------------------------------------
 ExplicitSet intersection(const IndexSet& A, const ExplicitSet& B) {
-	if(A.elems.size()*10<=B.elems.size())
-		return binary_intersect_two_sets(A.elems, B.elems, A.shift);
-
-	else if(A.elems.size()>B.elems.size()*10)
-		return binary_intersect_two_sets(B.elems, A.elems, 0, A.shift);
-	else
-		return intersect_two_sets(A.elems, B.elems, A.shift);
+	return adaptive_intersect(A.elems, B.elems, A.shift);
 }
 ExplicitSet intersection(const ExplicitSet& A, const IndexSet& B) {
 	return intersection(B, A);
 }
 
 ExplicitSet difference(const IndexSet &A, const ExplicitSet &B){
-	if(A.elems.size()>=B.elems.size()*10)
-		return binary_diff_two_sets(A.elems, B.elems, A.shift);
-	else
-		return diff_two_sets(A.elems, B.elems, A.shift);
+	return adaptive_diff(A.elems, B.elems, A.shift);
 }
 ExplicitSet difference(const ExplicitSet &A, const IndexSet &B)
 {
-	if(A.elems.size()>=B.elems.size()*10)
-		return binary_diff_two_sets(A.elems, B.elems, 0,B.shift);
-	else
-		return diff_two_sets(A.elems, B.elems, 0, B.shift);
+	return adaptive_diff(A.elems, B.elems, 0, B.shift);
 }
 
 // ----- Dense and explicit ----------------------------------------------------
 ExplicitSet intersection(const DenseSet& A, const ExplicitSet& B) {
-	std::vector<int> c;
-	for (const int i : B.elems){
-		if(i > A.last){
-			return ExplicitSet{c};
-		}
-		c.push_back(i);
-	}
-	return ExplicitSet{c};
+	PROFILE_KERNEL(Kernel::DENSE_RANGE);
+	auto first = std::lower_bound(B.elems.begin(), B.elems.end(), A.first);
+	auto last = std::upper_bound(first, B.elems.end(), A.last);
+	ExplicitSet C = scratch_set(last - first);
+	C.elems.assign(first, last);
+	return C;
 }
 
 ExplicitSet intersection(const ExplicitSet& A, const DenseSet& B) {
@@ -625,17 +896,15 @@ ExplicitSet difference(const ExplicitSet &A, const DenseSet &B)
 }
 
 // ----- Index and dense ------------------------------------------------
-ExplicitSet intersection(const IndexSet& A, const DenseSet& B) {
-	std::vector<int> c;
-	for(const int i: A.elems){
-		if(i - A.shift <= B.last && i - A.shift >= B.first){
-			c.push_back(i-A.shift);
-		}
-	}
-	return ExplicitSet{c};
+// A sub-span of the index, nothing is copied
+IndexSet intersection(const IndexSet& A, const DenseSet& B) {
+	PROFILE_KERNEL(Kernel::DENSE_RANGE);
+	auto first = std::lower_bound(A.elems.begin(), A.elems.end(), B.first + A.shift);
+	auto last = std::upper_bound(first, A.elems.end(), B.last + A.shift);
+	return {A.elems.subspan(first - A.elems.begin(), last - first), A.shift};
 }
 
-ExplicitSet intersection(const DenseSet& A, const IndexSet& B) {
+IndexSet intersection(const DenseSet& A, const IndexSet& B) {
 	return intersection(B, A);
 }
 
@@ -649,43 +918,229 @@ ExplicitSet difference(const IndexSet &A, const DenseSet &B)
 }
 
 
-//------------------------------------------------------------------------
-/**
- *
- * @param A A MatchSet
- * @param B A MatchSet
- *
- * @brief Computes the intersection of two MatchSets
- * @return A new MatchSet containing the intersection.
- */
-MatchSet intersection(const MatchSet &A, const MatchSet &B)
-{
-	MatchSet matchset;
-	if(A.complement && B.complement) // return the compliment of (A intersect B)
+// ----- Unions ------------------------------------------------
+ExplicitSet unite(const IndexSet& A, const IndexSet& B) {
+	return union_two_sets(A.elems, B.elems, A.shift, B.shift);
+}
+ExplicitSet unite(const IndexSet& A, const ExplicitSet& B) {
+	return union_two_sets(A.elems, B.elems, A.shift);
+}
+ExplicitSet unite(const ExplicitSet& A, const IndexSet& B) {
+	return unite(B, A);
+}
+ExplicitSet unite(const ExplicitSet& A, const ExplicitSet& B) {
+	return union_two_sets(A.elems, B.elems);
+}
+
+// Dense sets reach a union through the empty clauses of a repetition, see
+// sequence_starts(), mostly as ranges that overlap or another set inside the
+// range. Those stay dense, only disjoint ranges and sets reaching past the
+// range are materialized.
+decltype(MatchSet::set) unite(const DenseSet& A, const DenseSet& B) {
+	if (A.first > A.last)
+		return B;
+	if (B.first > B.last)
+		return A;
+	if (B.first <= A.last + 1 && A.first <= B.last + 1)
 	{
-		matchset.complement = true;
-		matchset.set = std::visit([](auto &&a, auto &&b) -> std::variant<DenseSet, IndexSet, ExplicitSet>
-								{ return intersection(a, b); }, A.set, B.set);
+		PROFILE_KERNEL(Kernel::DENSE_RANGE);
+		return DenseSet{std::min(A.first, B.first), std::max(A.last, B.last)};
 	}
-	else if(A.complement) // Return (B diff A)
+	return unite(materialize(A), materialize(B));
+}
+decltype(MatchSet::set) unite(const DenseSet& A, const IndexSet& B) {
+	if (B.elems.empty() || (A.first <= B.elems.front() - B.shift && B.elems.back() - B.shift <= A.last))
 	{
-		matchset.complement = false;
-		matchset.set = std::visit([](auto &&a, auto &&b) -> std::variant<DenseSet, IndexSet, ExplicitSet>
-								{ return difference(a, b); }, B.set, A.set);
+		PROFILE_KERNEL(Kernel::DENSE_RANGE);
+		return A;
 	}
-	else if(B.complement) // return ( B diff A)
+	return unite(materialize(A), B);
+}
+decltype(MatchSet::set) unite(const IndexSet& A, const DenseSet& B) {
+	return unite(B, A);
+}
+decltype(MatchSet::set) unite(const DenseSet& A, const ExplicitSet& B) {
+	if (B.elems.empty() || (A.first <= B.elems.front() && B.elems.back() <= A.last))
 	{
-		matchset.complement = false;
-		matchset.set = std::visit([](auto &&a, auto &&b) -> std::variant<DenseSet, IndexSet, ExplicitSet>
-								{ return difference(a, b); }, A.set, B.set);
+		PROFILE_KERNEL(Kernel::DENSE_RANGE);
+		return A;
+	}
+	return unite(materialize(A), B);
+}
+decltype(MatchSet::set) unite(const ExplicitSet& A, const DenseSet& B) {
+	return unite(B, A);
+}
+
+// ----- Compressed ------------------------------------------------
+// The block skipping kernels are in compressed.cpp. A difference from or a union
+// with a compressed set reads all of it anyway, so it is decoded first.
+ExplicitSet intersection(const IndexSet& A, const CompressedSet& B) {
+	return intersection(B, A);
+}
+ExplicitSet intersection(const ExplicitSet& A, const CompressedSet& B) {
+	return intersection(B, A);
+}
+ExplicitSet intersection(const DenseSet& A, const CompressedSet& B) {
+	return intersection(B, A);
+}
+
+ExplicitSet difference(const CompressedSet &A, const CompressedSet &B) {
+	return difference(decompress(A), B);
+}
+ExplicitSet difference(const CompressedSet &A, const IndexSet &B) {
+	return difference(decompress(A), B);
+}
+ExplicitSet difference(const CompressedSet &A, const ExplicitSet &B) {
+	return difference(decompress(A), B);
+}
+ExplicitSet difference(const CompressedSet &A, const DenseSet &B) {
+	return difference(decompress(A), B);
+}
+ExplicitSet difference(const DenseSet &A, const CompressedSet &B) {
+	return difference(A, decompress(B));
+}
+
+ExplicitSet unite(const CompressedSet& A, const CompressedSet& B) {
+	return unite(decompress(A), decompress(B));
+}
+ExplicitSet unite(const CompressedSet& A, const IndexSet& B) {
+	return unite(decompress(A), B);
+}
+ExplicitSet unite(const IndexSet& A, const CompressedSet& B) {
+	return unite(B, A);
+}
+ExplicitSet unite(const CompressedSet& A, const ExplicitSet& B) {
+	return unite(decompress(A), B);
+}
+ExplicitSet unite(const ExplicitSet& A, const CompressedSet& B) {
+	return unite(B, A);
+}
+decltype(MatchSet::set) unite(const CompressedSet& A, const DenseSet& B) {
+	return unite(decompress(A), B);
+}
+decltype(MatchSet::set) unite(const DenseSet& A, const CompressedSet& B) {
+	return unite(B, A);
+}
+
+// ----- Bitmap ------------------------------------------------
+// The word parallel and probing kernels are in bitmap.cpp
+ExplicitSet intersection(const IndexSet& A, const BitmapSet& B) {
+	return intersection(B, A);
+}
+ExplicitSet intersection(const ExplicitSet& A, const BitmapSet& B) {
+	return intersection(B, A);
+}
+BitmapSet intersection(const DenseSet& A, const BitmapSet& B) {
+	return intersection(B, A);
+}
+ExplicitSet intersection(const CompressedSet& A, const BitmapSet& B) {
+	return intersection(B, decompress(A));
+}
+ExplicitSet intersection(const BitmapSet& A, const CompressedSet& B) {
+	return intersection(B, A);
+}
+
+ExplicitSet difference(const CompressedSet &A, const BitmapSet &B) {
+	return difference(decompress(A), B);
+}
+BitmapSet difference(const BitmapSet &A, const CompressedSet &B) {
+	return difference(A, decompress(B));
+}
+
+BitmapSet unite(const IndexSet& A, const BitmapSet& B) {
+	return unite(B, A);
+}
+BitmapSet unite(const ExplicitSet& A, const BitmapSet& B) {
+	return unite(B, A);
+}
+BitmapSet unite(const DenseSet& A, const BitmapSet& B) {
+	return unite(B, A);
+}
+BitmapSet unite(const BitmapSet& A, const CompressedSet& B) {
+	return unite(A, decompress(B));
+}
+BitmapSet unite(const CompressedSet& A, const BitmapSet& B) {
+	return unite(B, A);
+}
+
+//------------------------------------------------------------------------
+/**
+ *
+ * @param A A MatchSet
+ * @param B A MatchSet
+ *
+ * @brief Computes the intersection of two MatchSets
+ * @return A new MatchSet containing the intersection.
+ */
+MatchSet intersection(const MatchSet &A, const MatchSet &B)
+{
+	if(A.complement && B.complement) // return the compliment of (A union B)
+	{
+		return PROFILE_STEP(SetOperation::OR, &A, &B, MatchSet{std::visit([](auto &&a, auto &&b) -> decltype(MatchSet::set)
+								{ return unite(a, b); }, A.set, B.set), true});
+	}
+	else if(A.complement) // Return (B diff A)
+	{
+		return PROFILE_STEP(SetOperation::AND_NOT, &B, &A, MatchSet{std::visit([](auto &&a, auto &&b) -> decltype(MatchSet::set)
+								{ return difference(a, b); }, B.set, A.set), false});
+	}
+	else if(B.complement) // return ( B diff A)
+	{
+		return PROFILE_STEP(SetOperation::AND_NOT, &A, &B, MatchSet{std::visit([](auto &&a, auto &&b) -> decltype(MatchSet::set)
+								{ return difference(a, b); }, A.set, B.set), false});
 	}
 	else // Return (A intersect B)
 	{
-		matchset.complement = false;
-		matchset.set = std::visit([](auto &&a, auto &&b) -> std::variant<DenseSet, IndexSet, ExplicitSet>{
-		return intersection(a, b); }, A.set, B.set);
+		return PROFILE_STEP(SetOperation::AND, &A, &B, MatchSet{std::visit([](auto &&a, auto &&b) -> decltype(MatchSet::set){
+		return intersection(a, b); }, A.set, B.set), false});
+	}
+}
+
+/**
+ *
+ * @param A A MatchSet
+ * @param B A MatchSet
+ *
+ * @brief Computes the union of two MatchSets, a complement through its
+ *		  excluded positions: not A or B is not (A diff B)
+ * @return A new MatchSet containing the union.
+ */
+MatchSet unite(const MatchSet &A, const MatchSet &B)
+{
+	auto apply = [](const MatchSet &a, const MatchSet &b, auto &&operation) -> decltype(MatchSet::set) {
+		return std::visit([&](auto &&x, auto &&y) -> decltype(MatchSet::set) { return operation(x, y); }, a.set, b.set);
+	};
+	if (A.complement && B.complement) // Return the complement of (A intersect B)
+		return PROFILE_STEP(SetOperation::AND, &A, &B, MatchSet{apply(A, B, [](auto &&a, auto &&b) -> decltype(MatchSet::set) { return intersection(a, b); }), true});
+	if (A.complement) // Return the complement of (A diff B)
+		return PROFILE_STEP(SetOperation::AND_NOT, &A, &B, MatchSet{apply(A, B, [](auto &&a, auto &&b) -> decltype(MatchSet::set) { return difference(a, b); }), true});
+	if (B.complement) // Return the complement of (B diff A)
+		return PROFILE_STEP(SetOperation::AND_NOT, &B, &A, MatchSet{apply(B, A, [](auto &&a, auto &&b) -> decltype(MatchSet::set) { return difference(a, b); }), true});
+	return PROFILE_STEP(SetOperation::OR, &A, &B, MatchSet{apply(A, B, [](auto &&a, auto &&b) -> decltype(MatchSet::set) { return unite(a, b); }), false});
+}
+
+/**
+ *
+ * @param sets MatchSets to unite
+ * @brief Unites the sets pairwise, in rounds that halve their number, so every
+ *		  element is merged about log(k) times instead of k times
+ * @return The union, an empty set if there are no sets
+ */
+MatchSet unite_all(std::vector<MatchSet> sets)
+{
+	if (sets.empty())
+		return MatchSet{ExplicitSet(), false};
+
+	while (sets.size() > 1)
+	{
+		std::vector<MatchSet> next;
+		for (size_t i = 0; i + 1 < sets.size(); i += 2)
+			next.push_back(unite(sets[i], sets[i + 1]));
+		if (sets.size() % 2)
+			next.push_back(std::move(sets.back()));
+		sets = std::move(next);
 	}
-	return matchset;
+	return std::move(sets.front());
 }
 
 
@@ -693,198 +1148,423 @@ MatchSet intersection(const MatchSet &A, const MatchSet &B)
 
 
 /**
- * @brief Retrieves the index of the string from the corpus mappings.
+ * @brief Retrieves the index of the string from the dictionary of an attribute.
  *		  If the string is new, its added to the mapping.
  *
- * @param corpus the corpus object
+ * @param dictionary the dictionary of an attribute
  * @param str the string to look up or add
  * @return the index corresponding to the string
  */
-uint32_t insert_and_get_index(Corpus& corpus, const std::string& str)
+uint32_t insert_and_get_index(Dictionary& dictionary, std::string_view str)
 {
-	auto index = corpus.string2index.find(str);
-	if (index != corpus.string2index.end()) // If string exists, return index.
+	auto index = dictionary.string2index.find(str);
+	if (index != dictionary.string2index.end()) // If string exists, return index.
 	{
 		return index->second;
 	}
 	else // If string isnt indexed, add it and return new index.
 	{
-		auto new_index = corpus.index2string.size();
-		corpus.index2string.push_back(str);
-		corpus.string2index[str] = new_index;
+		auto new_index = static_cast<uint32_t>(dictionary.index2string.size());
+		dictionary.index2string.emplace_back(str);
+		dictionary.string2index.emplace(dictionary.index2string.back(), new_index);
 		return new_index;
 	}
 }
 
 /**
  *
- * @param tokens
- * @param attribute
- * @return
+ * @param tokens Parsed tokens
+ * @param attribute The attribute to store
+ * @param value_count Size of the attribute's dictionary, every value is below it
+ * @brief Copies one attribute of the tokens into a column of the smallest
+ *		  width that holds value_count values
+ * @return The column
  */
-Index build_index(const std::vector<Token> &tokens, uint32_t Token::* attribute)
+Column make_column(std::span<const Token> tokens, uint32_t Token::* attribute, size_t value_count)
 {
-	Index index(tokens.size());
-	for(int i = 0; i < tokens.size(); i++)
-		index[i] = i;
+	auto narrow = [&]<typename T>(T) {
+		std::vector<T> values(tokens.size());
+		for (size_t i = 0; i < tokens.size(); ++i)
+			values[i] = static_cast<T>(tokens[i].*attribute);
+		return Column{SharedArray<T>(std::move(values))};
+	};
+	if (value_count <= size_t{1} << 8)
+		return narrow(uint8_t{});
+	if (value_count <= size_t{1} << 16)
+		return narrow(uint16_t{});
+	return narrow(uint32_t{});
+}
 
-	std::stable_sort(index.begin(), index.end(), [&](int a, int b) {
-		return tokens[a].*attribute < tokens[b].*attribute;
-	});
+/**
+ *
+ * @param corpus A corpus with its dictionaries
+ * @param tokens Parsed tokens, values from the dictionaries
+ * @brief Stores the tokens as one column per attribute, replacing any columns
+ */
+void build_columns(Corpus &corpus, std::span<const Token> tokens)
+{
+	for (Attribute attribute : {Attribute::word, Attribute::c5, Attribute::lemma, Attribute::pos})
+	{
+		corpus.columns[static_cast<size_t>(attribute)] =
+			make_column(tokens, attribute_member(attribute), corpus.dictionary(attribute).size());
+	}
+}
 
-	return index;
+/**
+ *
+ * @param corpus A corpus with tokens and sentences
+ * @brief Builds the sentence id of every token, so a match is resolved to its
+ *		  sentence with one load instead of a binary search over sentences
+ */
+void build_sentence_ids(Corpus &corpus)
+{
+	const int token_count = static_cast<int>(corpus.token_count());
+	std::vector<int> ids(token_count, -1);
+	for (size_t s = 0; s < corpus.sentences.size(); ++s)
+	{
+		const int begin = std::clamp(corpus.sentences[s], 0, token_count);
+		const int end = s + 1 < corpus.sentences.size() ? std::clamp(corpus.sentences[s + 1], begin, token_count) : token_count;
+		std::fill(ids.begin() + begin, ids.begin() + end, static_cast<int>(s));
+	}
+	corpus.sentence_ids = std::move(ids);
 }
 
 /**
  *
- * @param corpus
+ * @param column The column of an attribute
+ * @param value_count Number of distinct string indexes, every value must be below it
+ * @param offsets Optional output, offsets[v]..offsets[v+1] is the range of value v in the index
+ * @brief Builds an index with a counting sort over the string indexes. Positions
+ *		  are visited in order, so each value's range is sorted, like a stable sort
+ *		  by value would give, but in linear time.
+ * @return The token positions ordered by value
  */
-void build_indices(Corpus &corpus)
+Index build_index(const Column &column, size_t value_count, Index* offsets)
 {
-	corpus.word_index = build_index(corpus.tokens, &Token::word);
-	corpus.c5_index = build_index(corpus.tokens, &Token::c5);
-	corpus.lemma_index = build_index(corpus.tokens, &Token::lemma);
-	corpus.pos_index = build_index(corpus.tokens, &Token::pos);
+	return column.visit([&](auto values) {
+		Index starts(value_count + 1, 0);
+		for (const auto value : values)
+			starts[value + 1]++;
+		std::partial_sum(starts.begin(), starts.end(), starts.begin());
+
+		Index index(values.size());
+		Index next = starts;
+		for (int i = 0; i < static_cast<int>(values.size()); i++)
+			index[next[values[i]]++] = i;
+
+		if (offsets)
+			*offsets = std::move(starts);
+		return index;
+	});
 }
 
 /**
  *
  * @param corpus
- * @param attribute
- * @param value
- * @return
+ * @param threads Number of threads, the four indexes are built concurrently if above 1
  */
-IndexSet index_lookup(const Corpus &corpus, const std::string &attribute, uint32_t value)
+void build_indices(Corpus &corpus, unsigned threads)
 {
-	// Get correct index
-	const Index* index = nullptr;
-	uint32_t Token::*attribute_point;
+	struct Job { SharedArray<int> Corpus::* index; SharedArray<int> Corpus::* offsets; Attribute attribute; };
+	const Job jobs[] = {
+		{&Corpus::word_index, &Corpus::word_offsets, Attribute::word},
+		{&Corpus::c5_index, &Corpus::c5_offsets, Attribute::c5},
+		{&Corpus::lemma_index, &Corpus::lemma_offsets, Attribute::lemma},
+		{&Corpus::pos_index, &Corpus::pos_offsets, Attribute::pos},
+	};
+	auto run = [&](const Job& job) {
+		Index offsets;
+		corpus.*job.index = build_index(corpus.column(job.attribute), corpus.dictionary(job.attribute).size(), &offsets);
+		corpus.*job.offsets = std::move(offsets);
+	};
 
-	// Set pointers for attribute type, and index
-	if (attribute == "word")
-	{
-		index = &corpus.word_index;
-		attribute_point = &Token::word;
-	}
-	else if (attribute == "c5")
+	if (threads <= 1)
 	{
-		index = &corpus.c5_index;
-		attribute_point = &Token::c5;
+		for (const Job& job : jobs)
+			run(job);
+		return;
 	}
-	else if (attribute == "lemma")
-	{
-		index = &corpus.lemma_index;
-		attribute_point = &Token::lemma;
-	}
-	else if (attribute == "pos")
+
+	// Each job writes a different member, hand them out to at most threads workers
+	std::atomic<size_t> next_job = 0;
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < std::min<size_t>(threads, std::size(jobs)); ++t)
 	{
-		index = &corpus.pos_index;
-		attribute_point = &Token::pos;
+		workers.emplace_back([&] {
+			for (size_t j = next_job++; j < std::size(jobs); j = next_job++)
+				run(jobs[j]);
+		});
 	}
-	else
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param attribute An attribute
+ * @brief Resolves the postings directory (index and offsets table) of an attribute
+ *
+ * @return The postings directory
+ */
+PostingsDirectory postings_directory(const Corpus &corpus, Attribute attribute)
+{
+	switch (attribute)
 	{
-		throw std::invalid_argument("Unknown attribute: " + attribute);
+		case Attribute::word:
+			return {&corpus.word_index, &corpus.word_offsets, &corpus.word_compressed, &corpus.word_bitmaps};
+		case Attribute::c5:
+			return {&corpus.c5_index, &corpus.c5_offsets, &corpus.c5_compressed, &corpus.c5_bitmaps};
+		case Attribute::lemma:
+			return {&corpus.lemma_index, &corpus.lemma_offsets, &corpus.lemma_compressed, &corpus.lemma_bitmaps};
+		case Attribute::pos:
+			return {&corpus.pos_index, &corpus.pos_offsets, &corpus.pos_compressed, &corpus.pos_bitmaps};
 	}
+	throw std::invalid_argument("Unknown attribute");
+}
 
-	auto first = std::lower_bound(index->begin(), index->end(),
-		value , [&](int a, int b) {
+/**
+ *
+ * @param corpus A corpus
+ * @param attribute An attribute
+ * @param value A string index
+ * @attention Throws an exception if the index was replaced by compress_indices
+ * @return The positions where attribute has the value, unshifted
+ */
+IndexSet index_lookup(const Corpus &corpus, Attribute attribute, uint32_t value)
+{
+	const PostingsDirectory directory = postings_directory(corpus, attribute);
+	if (directory.is_compressed())
+		throw std::logic_error(std::string("The ") + attribute_name(attribute) + " index is compressed, it has no plain postings to view");
+	const IndexSet set = directory.lookup(value);
+	PROFILE_LOOKUP(set.elems.size());
+	return set;
+}
 
-		return corpus.tokens[a].*attribute_point < value;
-	});
-	auto last = std::upper_bound(first, index->end(),
-		value, [&](int a, int b) {
+/**
+ *
+ * @param name A attribute of a literal in string format
+ * @attention Throws an exception if the attribute is unknown
+ * @return The attribute
+ */
+Attribute parse_attribute(std::string_view name)
+{
+	if (name == "word") return Attribute::word;
+	if (name == "c5") return Attribute::c5;
+	if (name == "lemma") return Attribute::lemma;
+	if (name == "pos") return Attribute::pos;
 
-		return value < corpus.tokens[b].*attribute_point;
+	throw std::invalid_argument("Unknown attribute: " + std::string(name));
+}
+
+/**
+ * @return The attribute as written in a query
+ */
+const char* attribute_name(Attribute attribute)
+{
+	static constexpr const char* NAMES[ATTRIBUTE_COUNT] = {"word", "c5", "lemma", "pos"};
+	return NAMES[static_cast<size_t>(attribute)];
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param first Attribute of the first token of each pair
+ * @param second Attribute of the following token
+ * @brief Builds a binary index with two counting sorts, first by the second
+ *		  value and then, stably, by the first value.
+ * @return The binary index
+ */
+BinaryIndex build_binary_index(const Corpus &corpus, Attribute first, Attribute second)
+{
+	const Column& first_column = corpus.column(first);
+	const Column& second_column = corpus.column(second);
+	const int pairs = corpus.token_count() == 0 ? 0 : static_cast<int>(corpus.token_count()) - 1;
+
+	auto counting_sort = [&](const Index& in, Index& out, size_t value_count, auto value_of) {
+		Index starts(value_count + 1, 0);
+		for (int p : in)
+			starts[value_of(p) + 1]++;
+		std::partial_sum(starts.begin(), starts.end(), starts.begin());
+
+		Index next = starts;
+		for (int p : in)
+			out[next[value_of(p)]++] = p;
+		return starts;
+	};
+
+	Index all(pairs), by_second(pairs), positions(pairs);
+	std::iota(all.begin(), all.end(), 0);
+	std::vector<uint32_t> second_values(pairs);
+	Index offsets = first_column.visit([&](auto first_values) {
+		return second_column.visit([&](auto second_values_of) {
+			counting_sort(all, by_second, corpus.dictionary(second).size(), [&](int p) { return second_values_of[p + 1]; });
+			Index starts = counting_sort(by_second, positions, corpus.dictionary(first).size(), [&](int p) { return first_values[p]; });
+			for (int k = 0; k < pairs; ++k)
+				second_values[k] = second_values_of[positions[k] + 1];
+			return starts;
+		});
 	});
-	IndexSet new_set = {std::span<const int>(&*first, std::distance(first, last)), 0};
-	// Return braced initializer
-	return new_set;
+
+	BinaryIndex index;
+	index.first_attribute = first;
+	index.second_attribute = second;
+	index.positions = std::move(positions);
+	index.second_values = std::move(second_values);
+	index.offsets = std::move(offsets);
+	return index;
 }
-// -----------------------------  NEW MATCHING FUNCTIONS  ----------------------------------------------------------
 
 /**
  *
- * @param set A matchset
- * @return THe size of the set
+ * @param corpus A corpus with built indexes
+ * @param pairs Attribute pairs, e.g. {"pos", "lemma"} for [pos=..] [lemma=..]
+ * @brief Builds binary indexes for the given pairs, replacing any existing ones
+ * @attention Throws an exception if an attribute is unknown
  */
-int find_set_size(const MatchSet &set)
+void build_binary_indices(Corpus &corpus, const std::vector<std::pair<std::string, std::string>> &pairs)
 {
-	if (std::holds_alternative<DenseSet>(set.set))
-	{
-		DenseSet denseSet = std::get<DenseSet>(set.set);
-		return denseSet.last - denseSet.first + 1;
-	}
-	else if (std::holds_alternative<IndexSet>(set.set))
+	corpus.binary_indexes.clear();
+	for (const auto& [first, second] : pairs)
 	{
-		IndexSet indexSet = std::get<IndexSet>(set.set);
-		return static_cast<int>(indexSet.elems.size());
+		corpus.binary_indexes.push_back(build_binary_index(corpus, parse_attribute(first), parse_attribute(second)));
 	}
-	else if (std::holds_alternative<ExplicitSet>(set.set))
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param first Attribute of the first clause
+ * @param second Attribute of the following clause
+ * @return The binary index over the pair, or nullptr if it was not built
+ */
+const BinaryIndex* find_binary_index(const Corpus &corpus, Attribute first, Attribute second)
+{
+	for (const BinaryIndex& index : corpus.binary_indexes)
 	{
-		ExplicitSet explicitSet = std::get<ExplicitSet>(set.set);
-		return static_cast<int>(explicitSet.elems.size());
+		if (index.first_attribute == first && index.second_attribute == second)
+			return &index;
 	}
-	throw std::invalid_argument("Error: Unknown set type");
+	return nullptr;
 }
 
 /**
  *
- * @param sets A vector of MatchSets to intersect
- * @brief Intersects a vector of MatchSets,
- *	     - All densesets are intersected together
- *	     - ALl other sets are sorted from smallest to largest,
- *	       And intersected in order Small->Large
- *	     - Then the Two resulting sets are intersected
- * @return
+ * @param first Value of the first token
+ * @param second Value of the following token
+ * @param shift Shift of the first token's clause
+ * @return The positions i where the pair occurs, as an IndexSet
  */
-MatchSet intersect_with_plan(std::vector<MatchSet> &sets)
+IndexSet BinaryIndex::lookup(uint32_t first, uint32_t second, int shift) const
 {
-	std::vector<MatchSet> otherSets;
-	MatchSet dense_set;
-	bool dense_found = false;
-	for (const auto &set : sets)
-	{
-		if (std::holds_alternative<DenseSet>(set.set))
-		{
-			if (!dense_found)
-			{
-				dense_set = set;
-			}
-			else
-			{
-				dense_set = intersection(dense_set, set); // Collapse DenseSets
-			}
-			dense_found = true;
-		}
+	if (static_cast<size_t>(first) + 1 >= offsets.size())
+		return {std::span<const int>(), shift};
+
+	auto begin = second_values.begin() + offsets[first];
+	auto end = second_values.begin() + offsets[first + 1];
+	auto [lo, hi] = std::equal_range(begin, end, second);
+	PROFILE_LOOKUP(hi - lo);
+	return {std::span<const int>(positions.data() + (lo - second_values.begin()), hi - lo), shift};
+}
+
+// -----------------------------  NEW MATCHING FUNCTIONS  ----------------------------------------------------------
+
+/**
+ *
+ * @param set A matchset
+ * @return THe size of the set, the excluded positions if it is a complement
+ */
+int find_set_size(const MatchSet &set)
+{
+	return std::visit([](const auto &s) -> int {
+		using T = std::decay_t<decltype(s)>;
+		if constexpr (std::is_same_v<T, DenseSet>)
+			return s.last - s.first + 1;
+		else if constexpr (std::is_same_v<T, IndexSet> || std::is_same_v<T, ExplicitSet>)
+			return static_cast<int>(s.elems.size());
 		else
-		{
-			otherSets.push_back(set);
-		}
-	}
-	std::sort(otherSets.begin(),otherSets.end(), [](const MatchSet &a, const MatchSet &b) {
-		return find_set_size(a) < find_set_size(b);
-	});
+			return static_cast<int>(s.size());
+	}, set.set);
+}
 
+/**
+ *
+ * @param sets A vector of MatchSets to intersect
+ * @param corpus_size Number of tokens, 0 if unknown
+ * @brief Intersects a vector of MatchSets in the order chosen by plan_sets(),
+ *		  see planner.h. Sets are planned as they are, without alternative
+ *		  representations.
+ * @return The intersection
+ */
+MatchSet intersect_with_plan(std::vector<MatchSet> &sets, int corpus_size)
+{
+	std::vector<PlanOperand> operands;
+	for (size_t i = 0; i < sets.size(); ++i)
+		operands.push_back({std::string(), sets[i], std::nullopt, {}, std::nullopt});
+	return execute_plan(plan_sets(std::move(operands), corpus_size));
+}
 
-	MatchSet returnSet;
-	if(!otherSets.empty())
-	{
-		returnSet = otherSets[0];
-		for (size_t i = 1; i < otherSets.size(); ++i)
+/**
+ *
+ * @param set A MatchSet
+ * @param begin First match start to keep
+ * @param end Match start past the last one to keep
+ * @brief Narrows a set to the match starts in [begin, end), viewing the sorted
+ *		  sets in place. Compressed and bitmap sets keep whole blocks and words,
+ *		  so a few starts outside the window can remain. A complement keeps its
+ *		  meaning within the window.
+ * @return The restricted set
+ */
+MatchSet restrict_set(const MatchSet &set, int begin, int end)
+{
+	return {std::visit([&](const auto &s) -> decltype(MatchSet::set) {
+		using T = std::decay_t<decltype(s)>;
+		if constexpr (std::is_same_v<T, DenseSet>)
+			return DenseSet{std::max(s.first, begin), std::min(s.last, end - 1)};
+		else if constexpr (std::is_same_v<T, IndexSet>)
 		{
-			returnSet = intersection(returnSet, otherSets[i]);
+			auto first = std::lower_bound(s.elems.begin(), s.elems.end(), begin + s.shift);
+			auto last = std::lower_bound(first, s.elems.end(), end + s.shift);
+			return IndexSet{std::span<const int>(first, last), s.shift};
 		}
-		if(dense_found)
+		else if constexpr (std::is_same_v<T, ExplicitSet>)
 		{
-			returnSet = intersection(returnSet, dense_set);
+			auto first = std::lower_bound(s.elems.begin(), s.elems.end(), begin);
+			auto last = std::lower_bound(first, s.elems.end(), end);
+			ExplicitSet part = scratch_set(last - first);
+			part.elems.assign(first, last);
+			return part;
 		}
-	}
-	else
-	{
-		return dense_set;
-	}
+		else
+			return restrict_set(s, begin, end);
+	}, set.set), set.complement};
+}
 
-	return returnSet;
+/**
+ *
+ * @param set A MatchSet of a clause, not an ExplicitSet
+ * @param shift Added shift, the clause's offset in a query
+ * @brief Moves the match starts of a set shift positions back, as if its
+ *		  clause was at that offset, without touching the elements. Sets that
+ *		  view their elements carry a shift, an ExplicitSet has none.
+ * @attention Throws an exception for an ExplicitSet
+ * @return The shifted set
+ */
+MatchSet shift_set(const MatchSet &set, int shift)
+{
+	return {std::visit([&](const auto &s) -> decltype(MatchSet::set) {
+		using T = std::decay_t<decltype(s)>;
+		if constexpr (std::is_same_v<T, DenseSet>)
+			return DenseSet{s.first - shift, s.last - shift};
+		else if constexpr (std::is_same_v<T, ExplicitSet>)
+			throw std::logic_error("An ExplicitSet can not be shifted, view it as an IndexSet");
+		else
+		{
+			T shifted = s;
+			shifted.shift += shift;
+			return shifted;
+		}
+	}, set.set), set.complement};
 }
 
 /**
@@ -896,9 +1576,35 @@ MatchSet intersect_with_plan(std::vector<MatchSet> &sets)
  */
 MatchSet match_set(const Corpus &corpus, const Literal &literal, int shift)
 {
+	if (literal.alternatives)
+	{
+		std::vector<MatchSet> sets;
+		for (const Literal& alternative : *literal.alternatives)
+			sets.push_back(match_set(corpus, alternative, shift));
+		return unite_all(std::move(sets));
+	}
+	if (literal.values)
+	{
+		MatchSet set = union_postings(corpus, literal.attribute, literal.values->values, shift);
+		set.complement = !literal.is_equality;
+		return set;
+	}
+	const PostingsDirectory directory = postings_directory(corpus, literal.attribute);
+	if (directory.bitmaps->contains(literal.value))
+	{
+		const BitmapSet bitmap = directory.bitmaps->lookup(literal.value, shift);
+		PROFILE_LOOKUP(bitmap.size());
+		return MatchSet{bitmap, !literal.is_equality};
+	}
+	if (directory.is_compressed())
+	{
+		const CompressedSet compressed = directory.compressed->lookup(literal.value, shift);
+		PROFILE_LOOKUP(compressed.size());
+		return MatchSet{compressed, !literal.is_equality};
+	}
 
-	IndexSet index_set = index_lookup(corpus, literal.attribute, literal.value);
-	index_set.shift = shift;
+	IndexSet index_set = directory.lookup(literal.value, shift);
+	PROFILE_LOOKUP(index_set.elems.size());
 	if (!literal.is_equality)
 	{
 		return MatchSet{index_set, true};
@@ -920,96 +1626,688 @@ MatchSet match_set(const Corpus &corpus, const Clause &clause, int shift)
 {
 	if(clause.empty())
 	{
-		DenseSet entire_corp = {0, static_cast<int>(corpus.tokens.size()-1)};
+		DenseSet entire_corp = {0, static_cast<int>(corpus.token_count()-1)};
 		return MatchSet(entire_corp, false);
 	}
 
-	std::vector<MatchSet> sets;
-
+	std::vector<PlanOperand> operands;
 	for (const auto &literal : clause) // Create all sets to later intersect
 	{
-		sets.push_back(match_set(corpus, literal, shift));
+		operands.push_back(literal_operand(corpus, literal, shift));
 	}
-	return intersect_with_plan(sets);
-
+	return execute_plan(plan_sets(std::move(operands), static_cast<int>(corpus.token_count())));
 }
 
 /**
  *
  * @param corpus A corpus
  * @param query A query
- * @return A MatchSet containing the matches
+ * @brief Plans the query with plan_query() and runs the plan, see planner.h
+ * @return A MatchSet containing the match starts. If it is a complement, the
+ *		   matches are every corpus position not in the set.
  */
 MatchSet match_set(const Corpus &corpus, const Query &query)
 {
 	if(query.empty())
 		return {};
 
-	std::vector<MatchSet> sets;
-	int shift = 0;
+	// A complement is returned as it is, it is only enumerated by for_each_position
+	return execute_plan(plan_query(corpus, query));
+}
+
+/**
+ *
+ * @param set A MatchSet of match starts
+ * @param begin First position to enumerate
+ * @param end Position past the last one to enumerate
+ * @param f Called with each position in increasing order, returns false to stop
+ * @brief Enumerates the positions of a set within [begin, end). A complement
+ *		  is streamed by walking the range and skipping the positions in the
+ *		  set, so it is never stored.
+ * @return False if f stopped the enumeration
+ */
+template<typename F>
+bool for_each_position(const MatchSet &set, int begin, int end, F &&f)
+{
+	// g returns false to end the walk, the elements of every set are sorted
+	auto for_each_element = [](const auto &s, auto &&g) {
+		using T = std::decay_t<decltype(s)>;
+		if constexpr (std::is_same_v<T, DenseSet>)
+		{
+			for (int i = s.first; i <= s.last; ++i)
+				if (!g(i)) return;
+		}
+		else if constexpr (std::is_same_v<T, IndexSet>)
+		{
+			for (int elem : s.elems)
+				if (!g(elem - s.shift)) return;
+		}
+		else if constexpr (std::is_same_v<T, CompressedSet>)
+		{
+			int values[POSTING_BLOCK_SIZE];
+			for (size_t b = 0; b < s.blocks.size(); ++b)
+			{
+				const size_t k = decode_block(s, b, values);
+				for (size_t i = 0; i < k; ++i)
+					if (!g(values[i] - s.shift)) return;
+			}
+		}
+		else if constexpr (std::is_same_v<T, BitmapSet>)
+		{
+			for (size_t w = 0; w < s.words.size(); ++w)
+			{
+				for (uint64_t bits = s.words[w]; bits; bits &= bits - 1)
+					if (!g(static_cast<int>(w * 64) + std::countr_zero(bits) - s.shift)) return;
+			}
+		}
+		else
+		{
+			for (int elem : s.elems)
+				if (!g(elem)) return;
+		}
+	};
+
+	bool stopped = false;
+	if (!set.complement)
+	{
+		std::visit([&](const auto &s) {
+			for_each_element(s, [&](int i) {
+				if (i >= end)
+					return false;
+				if (i >= begin && !f(i))
+				{
+					stopped = true;
+					return false;
+				}
+				return true;
+			});
+		}, set.set);
+		return !stopped;
+	}
 
-	for (const auto &clause : query)
+	int next = begin;
+	std::visit([&](const auto &s) {
+		for_each_element(s, [&](int excluded) {
+			for (; next < std::min(excluded, end); ++next)
+			{
+				if (!f(next))
+				{
+					stopped = true;
+					return false;
+				}
+			}
+			if (next == excluded)
+				++next;
+			return next < end;
+		});
+	}, set.set);
+	if (stopped)
+		return false;
+	for (; next < end; ++next)
 	{
-		sets.push_back(match_set(corpus, clause, shift++));
+		if (!f(next))
+			return false;
 	}
+	return true;
+}
 
-	MatchSet set = intersect_with_plan(sets);
+/**
+ *
+ * @param corpus A corpus with sentence ids
+ * @param set A MatchSet of match starts
+ * @param len Number of tokens in a match
+ * @param begin First match start to enumerate
+ * @param end Match start past the last one to enumerate
+ * @param f Called with the start and sentence of each match, in increasing
+ *		  order, returns false to stop
+ * @brief Enumerates the matches of a set that end inside the corpus and do not
+ *		  cross a sentence boundary, like the old match did. Starts are collected
+ *		  in batches and filtered with simd_same_sentence().
+ * @return False if f stopped the enumeration
+ */
+template<typename F>
+bool for_each_match(const Corpus &corpus, const MatchSet &set, int len, int begin, int end, F &&f)
+{
+	PROFILE_STAGE(Stage::RESOLVE);
+	const int corpus_size = static_cast<int>(corpus.token_count());
+	const int* sentence_ids = corpus.sentence_ids.data();
+	if (len <= 1)
+		return for_each_position(set, begin, end, [&](int i) { return f(i, sentence_ids[i]); });
+
+	constexpr size_t BATCH_SIZE = 1024;
+	std::array<int, BATCH_SIZE + SIMD_OUTPUT_PADDING> batch;
+	size_t filled = 0;
+	auto flush = [&] {
+		const size_t kept = simd_same_sentence(batch.data(), filled, len - 1, sentence_ids, corpus_size, batch.data());
+		filled = 0;
+		for (size_t k = 0; k < kept; ++k)
+		{
+			if (!f(batch[k], sentence_ids[batch[k]]))
+				return false;
+		}
+		return true;
+	};
+	const bool walked = for_each_position(set, begin, end, [&](int i) {
+		batch[filled++] = i;
+		return filled < BATCH_SIZE || flush();
+	});
+	return walked && flush();
+}
 
-	// Handle complements
-	if(set.complement)
+/**
+ *
+ * @param corpus A corpus
+ * @param pool The pool the shards run on
+ * @brief Splits the corpus into a few shards per thread, cut at the sentence
+ *		  starts nearest to equal sizes, so no match is split between two. A
+ *		  small corpus gets fewer shards, down to one.
+ * @return The shards as ranges [begin, end) of match starts, in order
+ */
+static std::vector<std::pair<int, int>> sentence_shards(const Corpus &corpus, const ThreadPool &pool)
+{
+	constexpr int MIN_SHARD = 1 << 16;
+	constexpr size_t SHARDS_PER_THREAD = 4;
+	const int corpus_size = static_cast<int>(corpus.token_count());
+	const size_t shard_count = std::clamp<size_t>(corpus_size / MIN_SHARD, 1, pool.size() * SHARDS_PER_THREAD);
+
+	std::vector<std::pair<int, int>> shards;
+	int begin = 0;
+	for (size_t s = 1; s <= shard_count && begin < corpus_size; ++s)
 	{
-		DenseSet entire_corp = {0, static_cast<int>(corpus.tokens.size()-1)};
-		MatchSet entire_corp_match = {entire_corp, false};
-		set = intersection(entire_corp_match, set);
+		int end = corpus_size;
+		if (s < shard_count)
+		{
+			const int target = static_cast<int>(static_cast<int64_t>(corpus_size) * s / shard_count);
+			auto next = std::lower_bound(corpus.sentences.begin(), corpus.sentences.end(), target);
+			end = next == corpus.sentences.end() ? corpus_size : std::clamp(*next, begin, corpus_size);
+		}
+		if (end > begin)
+			shards.push_back({begin, end});
+		begin = end;
 	}
-	return set;
+	return shards;
 }
 
 /**
  *
  * @param corpus A corpus
- * @param query A query
- * @return A vector of Match objects
+ * @param plan The plan of a query
+ * @param len Number of tokens in a match
+ * @param pool The pool to run the shards on
+ * @param f Called with each match, in order
+ * @param count_only Count the matches without calling f
+ * @brief Runs the plan on every shard of the corpus in parallel, each with the
+ *		  operands restricted to the shard, then hands the matches over in order
+ * @return Number of matches
  */
-std::vector<Match> match2(const Corpus &corpus, const Query &query)
+template<typename F>
+static size_t sharded_matches(const Corpus &corpus, const QueryPlan &plan, int len, ThreadPool &pool, F &&f, bool count_only)
 {
-	MatchSet matchSet = match_set(corpus, query);
-	std::vector<Match> matches;
+	const std::vector<std::pair<int, int>> shards = sentence_shards(corpus, pool);
+	std::vector<std::vector<std::pair<int, int>>> found(shards.size());
+	std::vector<size_t> counts(shards.size(), 0);
+	QueryProfile* profile = active_profile();
+	std::vector<QueryProfile> profiles(profile ? shards.size() : 0);
+	pool.run(shards.size(), [&](size_t k) {
+		const ProfileScope scope(profile ? &profiles[k] : nullptr);
+		const auto [begin, end] = shards[k];
+		for_each_match(corpus, execute_plan(plan, begin, end), len, begin, end, [&](int start, int sentence) {
+			if (count_only)
+				++counts[k];
+			else
+				found[k].push_back({start, sentence});
+			return true;
+		});
+	});
+	for (const QueryProfile& shard : profiles)
+		profile->merge(shard);
 
-	if(std::holds_alternative<DenseSet>(matchSet.set))
+	size_t total = 0;
+	for (size_t k = 0; k < shards.size(); ++k)
 	{
-		DenseSet denseSet = std::get<DenseSet>(matchSet.set);
-		for(int i = denseSet.first; i <= denseSet.last; i++)
+		if (count_only)
+		{
+			total += counts[k];
+			continue;
+		}
+		for (const auto& [start, sentence] : found[k])
 		{
-			auto sentence = std::upper_bound(corpus.sentences.begin(),
-				corpus.sentences.end(), i);
-			int sentence_index = std::distance(corpus.sentences.begin(), sentence) - 1;
-			matches.push_back({sentence_index, i, 1});
+			++total;
+			if (!f(start, sentence))
+				return total;
 		}
 	}
-	else if(std::holds_alternative<IndexSet>(matchSet.set))
+	return total;
+}
+
+/**
+ *
+ * @param plan The plan of a query
+ * @param wanted Number of matches needed
+ * @return Positions in the first window, enough to hold the wanted matches
+ *		   twice over by the plan's estimate
+ */
+static int first_window(const QueryPlan &plan, size_t wanted)
+{
+	constexpr int MIN_WINDOW = 1 << 16;
+	const double matches = estimated_matches(plan);
+	if (matches <= 0)
+		return plan.corpus_size;
+
+	const double positions = 2.0 * static_cast<double>(wanted) * plan.corpus_size / matches;
+	return static_cast<int>(std::clamp(positions, static_cast<double>(MIN_WINDOW), static_cast<double>(plan.corpus_size)));
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param query A query
+ * @param f Called with each match in order, returns false to stop
+ * @param options Matches to skip and produce, or to only count
+ * @brief Produces the matches of a query without storing them. Without a limit
+ *		  the plan runs once over the corpus. With a limit it runs on windows of
+ *		  match starts, from the start of the corpus and doubling in size, with
+ *		  every operand restricted to the window, so the set operations stop
+ *		  with the window that fills the limit. With a pool and no limit the
+ *		  plan runs on sentence aligned shards in parallel instead. With a
+ *		  cache, clauses come from it, and a result without a limit goes in.
+ * @attention Throws an exception if the corpus has no sentence ids
+ * @return Number of matches produced, or counted
+ */
+size_t stream_matches(const Corpus &corpus, const Query &query, const std::function<bool(const Match &)> &f, const ResultOptions &options)
+{
+	if (query.empty() || options.limit == 0)
+		return 0;
+	if (!options.cache)
+		return stream_plan(corpus, plan_query(corpus, query), static_cast<int>(query.size()), f, options);
+
+	// Without a limit the whole result is computed anyway, keep it
+	QueryPlan plan = plan_cached(corpus, query, *options.cache);
+	if (options.limit == NO_LIMIT)
 	{
-		IndexSet indexSet = std::get<IndexSet>(matchSet.set);
-		for(int i : indexSet.elems)
+		const ClauseResult result = plan_result(plan);
+		options.cache->insert(query_key(query), result);
+		plan = result_plan(result, static_cast<int>(corpus.token_count()));
+	}
+	return stream_plan(corpus, plan, static_cast<int>(query.size()), f, options);
+}
+
+/**
+ *
+ * @param corpus A corpus with sentence ids
+ * @param plan The plan of a query, from plan_query()
+ * @param len Number of clauses of the query
+ * @param f Called with each match in order, returns false to stop
+ * @param options Matches to skip and produce, or to only count
+ * @brief Produces the matches of a planned query, see stream_matches
+ * @attention Throws an exception if the corpus has no sentence ids
+ * @return Number of matches produced, or counted
+ */
+size_t stream_plan(const Corpus &corpus, const QueryPlan &plan, int len, const std::function<bool(const Match &)> &f, const ResultOptions &options)
+{
+	if (corpus.sentence_ids.size() != corpus.token_count())
+		throw std::logic_error("The corpus has no sentence ids, see build_sentence_ids");
+	if (options.limit == 0)
+		return 0;
+
+	const int corpus_size = static_cast<int>(corpus.token_count());
+	size_t skipped = 0;
+	size_t produced = 0;
+	auto take = [&](int start, int sentence) {
+		if (skipped < options.offset)
 		{
-			auto sentence = std::upper_bound(corpus.sentences.begin(),
-				corpus.sentences.end(), i);
-			int sentence_index = std::distance(corpus.sentences.begin(), sentence) - 1;
-			matches.push_back({sentence_index, i, 1});
+			++skipped;
+			return true;
 		}
+		++produced;
+		if (!options.count_only && !f({sentence, start, len}))
+			return false;
+		return produced < options.limit;
+	};
+
+	if (options.limit == NO_LIMIT && options.pool && options.pool->size() > 1)
+	{
+		const size_t total = sharded_matches(corpus, plan, len, *options.pool, take, options.count_only);
+		return options.count_only ? total - std::min(total, options.offset) : produced;
 	}
-	else if(std::holds_alternative<ExplicitSet>(matchSet.set))
+	if (options.limit == NO_LIMIT)
 	{
-		ExplicitSet explicitSet = std::get<ExplicitSet>(matchSet.set);
-		for(int i : explicitSet.elems)
+		for_each_match(corpus, execute_plan(plan), len, 0, corpus_size, take);
+		return produced;
+	}
+
+	const size_t wanted = options.offset + std::min(options.limit, NO_LIMIT - options.offset);
+	int64_t window = first_window(plan, wanted);
+	for (int begin = 0; begin < corpus_size; window *= 2)
+	{
+		const int end = static_cast<int>(std::min<int64_t>(begin + window, corpus_size));
+		if (!for_each_match(corpus, execute_plan(plan, begin, end), len, begin, end, take))
+			break;
+		begin = end;
+	}
+	return produced;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param len Number of tokens in a match
+ * @return Number of match starts whose match stays in one sentence
+ */
+static size_t sentence_starts(const Corpus &corpus, int len)
+{
+	const int token_count = static_cast<int>(corpus.token_count());
+	size_t starts = 0;
+	int begin = 0; // Tokens before the first sentence share a sentence id too
+	for (size_t s = 0; s <= corpus.sentences.size(); ++s)
+	{
+		const int end = s < corpus.sentences.size() ? std::clamp(corpus.sentences[s], begin, token_count) : token_count;
+		if (end - begin >= len)
+			starts += end - begin - len + 1;
+		begin = end;
+	}
+	return starts;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param query A query
+ * @param pool Optional, walks the sets of longer queries on shards in parallel
+ * @param cache Optional, clauses and query results are taken from and kept in it
+ * @brief Counts the matches without producing them. A single clause query is
+ *		  counted from the size of its set. Longer queries walk the set to drop
+ *		  matches crossing a sentence, but a complement is counted by walking
+ *		  only the excluded starts and subtracting them from every start that
+ *		  stays in its sentence.
+ * @attention Throws an exception if the corpus has no sentence ids
+ * @return Number of matches, the size match2 would return
+ */
+size_t count(const Corpus &corpus, const Query &query, ThreadPool *pool, ResultCache *cache)
+{
+	if (corpus.sentence_ids.size() != corpus.token_count())
+		throw std::logic_error("The corpus has no sentence ids, see build_sentence_ids");
+	if (query.empty())
+		return 0;
+
+	const int corpus_size = static_cast<int>(corpus.token_count());
+	const int len = static_cast<int>(query.size());
+	const QueryPlan plan = cache ? plan_cached(corpus, query, *cache) : plan_query(corpus, query);
+	if (len > 1 && pool && pool->size() > 1)
+	{
+		const std::vector<std::pair<int, int>> shards = sentence_shards(corpus, *pool);
+		std::vector<size_t> found(shards.size(), 0);
+		std::atomic<bool> complement = false;
+		QueryProfile* profile = active_profile();
+		std::vector<QueryProfile> profiles(profile ? shards.size() : 0);
+		pool->run(shards.size(), [&](size_t k) {
+			const ProfileScope scope(profile ? &profiles[k] : nullptr);
+			const auto [begin, end] = shards[k];
+			const MatchSet set = execute_plan(plan, begin, end);
+			complement = set.complement; // The same for every shard
+			for_each_match(corpus, MatchSet{set.set, false}, len, begin, end, [&](int, int) {
+				++found[k];
+				return true;
+			});
+		});
+		for (const QueryProfile& shard : profiles)
+			profile->merge(shard);
+		const size_t total = std::accumulate(found.begin(), found.end(), size_t{0});
+		return complement ? sentence_starts(corpus, len) - total : total;
+	}
+
+	const ClauseResult result = plan_result(plan);
+	if (cache)
+		cache->insert(query_key(query), result);
+	const MatchSet& set = result.set;
+	if (len == 1) // Every start is a match, and a single clause set holds no starts outside the corpus
+	{
+		const size_t size = find_set_size(set);
+		return set.complement ? corpus_size - size : size;
+	}
+
+	size_t found = 0;
+	for_each_match(corpus, MatchSet{set.set, false}, len, 0, corpus_size, [&](int, int) {
+		++found;
+		return true;
+	});
+	return set.complement ? sentence_starts(corpus, len) - found : found;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param query A query
+ * @param attribute Attribute to count, word, c5, lemma or pos
+ * @param clause Clause of the query whose token is counted
+ * @brief Counts the value of the attribute at the given clause of every match,
+ *		  in one pass over the final set into a counter per string index
+ * @attention Throws an exception if the attribute is unknown or the clause is
+ *			  past the end of the query
+ * @return The values that occur, most frequent first
+ */
+std::vector<ValueCount> group_by(const Corpus &corpus, const Query &query, const std::string &attribute, size_t clause)
+{
+	if (clause >= query.size())
+		throw std::invalid_argument("Clause " + std::to_string(clause) + " is not in the query");
+	if (corpus.sentence_ids.size() != corpus.token_count())
+		throw std::logic_error("The corpus has no sentence ids, see build_sentence_ids");
+
+	const Attribute counted = parse_attribute(attribute);
+	const MatchSet set = match_set(corpus, query);
+	std::vector<uint32_t> counts(corpus.dictionary(counted).size(), 0);
+	corpus.column(counted).visit([&](auto values) {
+		const auto* tokens = values.data() + clause;
+		for_each_match(corpus, set, static_cast<int>(query.size()), 0, static_cast<int>(corpus.token_count()), [&](int start, int) {
+			++counts[tokens[start]];
+			return true;
+		});
+	});
+
+	std::vector<ValueCount> histogram;
+	for (size_t value = 0; value < counts.size(); ++value)
+	{
+		if (counts[value] > 0)
+			histogram.push_back({static_cast<uint32_t>(value), counts[value]});
+	}
+	std::sort(histogram.begin(), histogram.end(), [](const ValueCount& a, const ValueCount& b) {
+		return a.count != b.count ? a.count > b.count : a.value < b.value;
+	});
+	return histogram;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param query A query
+ * @param options Matches to skip and return, see stream_matches
+ * @attention Throws an exception if the corpus has no sentence ids
+ * @return A vector of Match objects, none of them crossing a sentence boundary.
+ *		   Empty if only counting.
+ */
+std::vector<Match> match2(const Corpus &corpus, const Query &query, const ResultOptions &options)
+{
+	std::vector<Match> matches;
+	stream_matches(corpus, query, [&](const Match &match) {
+		matches.push_back(match);
+		return true;
+	}, options);
+	return matches;
+}
+
+// -----------------------------  REPETITION  ----------------------------------------------------------
+
+/**
+ *
+ * @param corpus A corpus
+ * @param sequence A sequence
+ * @brief Finds the match starts of a sequence with set operations, from its
+ *		  last clause to its first. rest holds the positions the rest of the
+ *		  sequence can start at, at first every position up to the corpus end.
+ *		  A clause repeated min to max times starts at p if its tokens match at
+ *		  p..p+r-1 and the rest starts at p+r, for some r from min to max, so
+ *		  its starts are the clause's set shifted by 0..r-1 and intersected, run,
+ *		  intersected with rest shifted by r and united over r. Sentences are
+ *		  not considered, the starts are candidates for longest_match().
+ * @return The candidate starts, with the storage they view
+ */
+static ClauseResult sequence_starts(const Corpus &corpus, const Sequence &sequence)
+{
+	PROFILE_STAGE(Stage::EXECUTE);
+	const int corpus_size = static_cast<int>(corpus.token_count());
+	const DenseSet everywhere{0, corpus_size};
+	std::vector<ClauseResult> pinned;	// Storage of the sets computed so far
+	ClauseResult rest = make_shiftable(MatchSet{everywhere, false});
+	for (size_t k = sequence.size(); k-- > 0;)
+	{
+		const RepeatedClause& element = sequence[k];
+		const DenseSet* dense = std::get_if<DenseSet>(&rest.set.set);
+		if (element.min == 0 && dense && dense->first <= 0 && dense->last >= corpus_size)
+			continue; // An optional clause before the end matches everywhere
+
+		pinned.push_back(clause_result(corpus, element.clause));
+		const MatchSet tokens = pinned.back().set;
+		MatchSet run{everywhere, false}; // Starts whose next r tokens match the clause, never a complement
+		std::vector<MatchSet> ends;
+		for (int r = 0; r <= element.max; ++r)
 		{
-			auto sentence = std::upper_bound(corpus.sentences.begin(),
-				corpus.sentences.end(), i);
-			int sentence_index = std::distance(corpus.sentences.begin(), sentence) - 1;
-			Match newMatch = {sentence_index, i, 1};
-			newMatch.len = query.size();
-			matches.push_back(newMatch);
+			if (r > 0)
+				run = intersection(run, shift_set(tokens, r - 1));
+			if (r >= element.min)
+				ends.push_back(intersection(run, shift_set(rest.set, r)));
+			if (find_set_size(run) <= 0)
+				break;
 		}
+		pinned.push_back(std::move(rest));
+		rest = make_shiftable(unite_all(std::move(ends)));
 	}
+	for (const ClauseResult& result : pinned)
+		rest.storage.insert(rest.storage.end(), result.storage.begin(), result.storage.end());
+	return rest;
+}
+
+/**
+ *
+ * @param sequence A sequence
+ * @param clauses The clauses of the sequence, compiled
+ * @param start A match start
+ * @param stop End of the start's sentence, no match reaches past it
+ * @param reach Scratch buffer
+ * @param next Scratch buffer
+ * @brief Follows the sequence from the start token by token, keeping the
+ *		  positions every way of repeating the clauses so far can reach
+ * @return Length of the longest match from the start, 0 if there is none
+ */
+static int longest_match(const Sequence &sequence, const std::vector<ClauseEvaluator> &clauses, int start, int stop,
+						 std::vector<int> &reach, std::vector<int> &next)
+{
+	reach.assign(1, start);
+	for (size_t k = 0; k < sequence.size() && !reach.empty(); ++k)
+	{
+		next.clear();
+		for (const int position : reach)
+		{
+			for (int r = 0; ; ++r)
+			{
+				if (r >= sequence[k].min)
+					next.push_back(position + r);
+				if (r == sequence[k].max || position + r >= stop || !clauses[k](position + r))
+					break;
+			}
+		}
+		std::sort(next.begin(), next.end());
+		next.erase(std::unique(next.begin(), next.end()), next.end());
+		reach.swap(next);
+	}
+	return reach.empty() ? 0 : reach.back() - start;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param sequence A sequence
+ * @param f Called with each match in order, returns false to stop
+ * @param options Matches to skip and produce, or to only count
+ * @brief Produces the matches of a sequence, one per start: the longest that
+ *		  stays in the start's sentence. A sequence without repetitions is a
+ *		  query, see stream_matches(). Otherwise the candidate starts are found
+ *		  over the whole corpus with sequence_starts(), then followed token by
+ *		  token with longest_match(). The cache and the pool are not used for
+ *		  repetitions.
+ * @attention Throws an exception if the corpus has no sentence ids
+ * @return Number of matches produced, or counted
+ */
+size_t stream_matches(const Corpus &corpus, const Sequence &sequence, const std::function<bool(const Match &)> &f, const ResultOptions &options)
+{
+	if (is_fixed_length(sequence))
+		return stream_matches(corpus, fixed_query(sequence), f, options);
+	if (corpus.sentence_ids.size() != corpus.token_count())
+		throw std::logic_error("The corpus has no sentence ids, see build_sentence_ids");
+	if (options.limit == 0)
+		return 0;
+
+	std::vector<ClauseEvaluator> clauses;
+	for (const RepeatedClause& element : sequence)
+		clauses.push_back(compile_clause(corpus, element.clause));
+
+	const int corpus_size = static_cast<int>(corpus.token_count());
+	const ClauseResult starts = sequence_starts(corpus, sequence);
+	std::vector<int> reach, next;
+	size_t skipped = 0;
+	size_t produced = 0;
+	PROFILE_STAGE(Stage::RESOLVE);
+	for_each_position(starts.set, 0, corpus_size, [&](int start) {
+		const int sentence = corpus.sentence_ids[start];
+		const size_t following = static_cast<size_t>(sentence + 1);
+		const int stop = following < corpus.sentences.size() ? std::clamp(corpus.sentences[following], start, corpus_size) : corpus_size;
+		const int len = longest_match(sequence, clauses, start, stop, reach, next);
+		if (len == 0)
+			return true;
+		if (skipped < options.offset)
+		{
+			++skipped;
+			return true;
+		}
+		++produced;
+		if (!options.count_only && !f({sentence, start, len}))
+			return false;
+		return produced < options.limit;
+	});
+	return produced;
+}
+
+/**
+ * @param corpus A corpus
+ * @param sequence A sequence
+ * @param options Matches to skip and produce
+ * @return The matches, see stream_matches()
+ */
+std::vector<Match> match2(const Corpus &corpus, const Sequence &sequence, const ResultOptions &options)
+{
+	if (is_fixed_length(sequence))
+		return match2(corpus, fixed_query(sequence), options);
+
+	std::vector<Match> matches;
+	stream_matches(corpus, sequence, [&](const Match &match) {
+		matches.push_back(match);
+		return true;
+	}, options);
 	return matches;
 }
+
+/**
+ * @param corpus A corpus
+ * @param sequence A sequence
+ * @param pool Optional, used if the sequence has no repetitions
+ * @param cache Optional, used if the sequence has no repetitions
+ * @return Number of matches, the size match2 would return
+ */
+size_t count(const Corpus &corpus, const Sequence &sequence, ThreadPool *pool, ResultCache *cache)
+{
+	if (is_fixed_length(sequence))
+		return count(corpus, fixed_query(sequence), pool, cache);
+
+	ResultOptions options;
+	options.count_only = true;
+	return stream_matches(corpus, sequence, [](const Match &) { return true; }, options);
+}
@@ -11,10 +11,15 @@
 #include <variant>
 #include <ranges>
 #include <algorithm>
+#include <array>
 #include <cctype>
 #include <utility>
 #include <fstream>
 #include <numeric>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <functional>
 
 #ifndef CORPUS_H
 #define CORPUS_H
@@ -48,6 +53,10 @@
 //*********************************************************
 
 struct Literal;
+struct IndexSet;
+class ThreadPool;
+class ResultCache;
+struct QueryPlan;
 // ----------------- ALIASES -----------------
 using Clause = std::vector<Literal>;
 using Query = std::vector<Clause>;
@@ -55,6 +64,52 @@ using Query = std::vector<Clause>;
 using Index = std::vector<int>;
 
 // ----------------- STRUCTS -----------------
+/**
+ * @brief An immutable array that either owns its elements or views memory
+ *		  owned by someone else (e.g. a memory mapped corpus image).
+ *		  Copies share the same storage, so spans into it stay valid.
+ */
+template <typename T>
+struct SharedArray
+{
+	SharedArray() = default;
+
+	SharedArray(std::vector<T> elems)
+	{
+		auto owner = std::make_shared<const std::vector<T>>(std::move(elems));
+		view = std::span<const T>(*owner);
+		storage = std::move(owner);
+	}
+
+	SharedArray(std::span<const T> elems, std::shared_ptr<const void> owner)
+		: view(elems), storage(std::move(owner)) {}
+
+	size_t size() const { return view.size(); }
+	bool empty() const { return view.empty(); }
+	const T* data() const { return view.data(); }
+	const T& operator[](size_t i) const { return view[i]; }
+	auto begin() const { return view.begin(); }
+	auto end() const { return view.end(); }
+	std::span<const T> span() const { return view; }
+
+	// A view of count elements from offset, sharing the storage
+	SharedArray slice(size_t offset, size_t count) const
+	{
+		SharedArray part;
+		part.view = view.subspan(offset, count);
+		part.storage = storage;
+		return part;
+	}
+
+private:
+	std::span<const T> view;
+	std::shared_ptr<const void> storage;
+};
+
+/**
+ * @brief The attributes of one token as a row. The corpus stores them as
+ *		  columns, see Column, Corpus::token() assembles a row.
+ */
 struct Token
 {
 	uint32_t word;
@@ -63,23 +118,293 @@ struct Token
 	uint32_t pos;
 };
 
+/**
+ * @brief Hash for string keys that also accepts std::string_view, so that
+ *		  lookups do not need to allocate a std::string.
+ */
+struct StringHash
+{
+	using is_transparent = void;
+	size_t operator()(std::string_view str) const { return std::hash<std::string_view>{}(str); }
+};
+
+using StringMap = std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>>;
+
+/**
+ * @brief The strings of one attribute. A value of the attribute is the
+ *		  position of its string in index2string.
+ */
+struct Dictionary
+{
+	std::vector<std::string> index2string;
+	StringMap string2index;
+	// Values in string order and in case-folded order, for patterns, see pattern.h
+	std::vector<uint32_t> sorted;
+	std::vector<uint32_t> folded;
+
+	size_t size() const { return index2string.size(); }
+};
+
+/**
+ * @brief The values of one attribute for every token, stored with the
+ *		  smallest width that holds every value of its dictionary, see
+ *		  make_column(). pos and c5 have a few dozen values and take a
+ *		  byte per token.
+ */
+struct Column
+{
+	std::variant<SharedArray<uint8_t>, SharedArray<uint16_t>, SharedArray<uint32_t>> values;
+
+	size_t size() const { return std::visit([](const auto& v) { return v.size(); }, values); }
+	size_t width() const { return std::visit([](const auto& v) { return sizeof(v[0]); }, values); }
+	const void* data() const { return std::visit([](const auto& v) -> const void* { return v.data(); }, values); }
+	uint32_t operator[](size_t i) const { return std::visit([i](const auto& v) -> uint32_t { return v[i]; }, values); }
+
+	// Calls f with the values as a std::span of their stored type
+	template<typename F>
+	decltype(auto) visit(F&& f) const
+	{
+		return std::visit([&](const auto& v) -> decltype(auto) { return f(v.span()); }, values);
+	}
+};
+
+/**
+ * @brief The attributes of a token, resolved from their names when a query is
+ *		  parsed, so matching never compares attribute strings.
+ */
+enum class Attribute : uint8_t
+{
+	word,
+	c5,
+	lemma,
+	pos
+};
+
+constexpr size_t ATTRIBUTE_COUNT = 4;
+
+/**
+ * @return The Token member holding the attribute
+ */
+constexpr uint32_t Token::* attribute_member(Attribute attribute)
+{
+	switch (attribute)
+	{
+		case Attribute::word: return &Token::word;
+		case Attribute::c5: return &Token::c5;
+		case Attribute::lemma: return &Token::lemma;
+		case Attribute::pos: return &Token::pos;
+	}
+	return &Token::word;
+}
+
+/**
+ * @brief The values a pattern matches, expanded once at parse time, see
+ *		  expand_pattern(). bits has a bit per value of the dictionary.
+ */
+struct ValueSet
+{
+	std::string text;				// The pattern as written, e.g. ~"hous.*" or ="house"%c
+	std::vector<uint32_t> values;	// Sorted
+	std::vector<uint64_t> bits;
+
+	bool contains(uint32_t value) const { return value / 64 < bits.size() && (bits[value / 64] >> (value % 64)) & 1; }
+};
+
 struct Literal
 {
-	std::string attribute;
+	Attribute attribute;
 	uint32_t value;
 	bool is_equality;
+	std::shared_ptr<const ValueSet> values;	// Set for a pattern, matched instead of value
+	std::shared_ptr<const std::vector<Literal>> alternatives;	// Set for a disjunction, matched if any of them is
+};
+
+constexpr int MAX_REPETITION = 32;
+
+/**
+ * @brief A clause matching between min and max consecutive tokens, written
+ *		  [...]{min,max} or [...]{n}, see parse_sequence()
+ */
+struct RepeatedClause
+{
+	Clause clause;
+	int min = 1;
+	int max = 1;
+};
+
+using Sequence = std::vector<RepeatedClause>;
+
+/**
+ * @brief A clause compiled for scanning tokens, see compile_clause(). Every
+ *		  literal is bound to its attribute's column and to a comparison
+ *		  instantiated for the column's width and the operator, so testing a
+ *		  token is a load and an integer compare per literal.
+ */
+struct ClauseEvaluator
+{
+	struct LiteralTest;
+	using Test = bool (*)(const LiteralTest& literal, size_t position);
+
+	struct LiteralTest
+	{
+		Test test;
+		const void* column;
+		uint32_t value;
+		const ValueSet* values;	// The literal's pattern, if it has one
+		std::shared_ptr<const std::vector<LiteralTest>> alternatives;	// The literal's disjunction, if it is one
+	};
+
+	std::vector<LiteralTest> tests;
+
+	bool operator()(size_t position) const
+	{
+		for (const LiteralTest& literal : tests)
+		{
+			if (!literal.test(literal, position))
+				return false;
+		}
+		return true;
+	}
+};
+
+/**
+ * @brief Binary index over two attributes of adjacent tokens. Every position i
+ *		  with a successor is stored once, ordered by the pair
+ *		  (tokens[i].first, tokens[i+1].second) and then by position, so the
+ *		  positions of one pair form a sorted range.
+ */
+struct BinaryIndex
+{
+	Attribute first_attribute;
+	Attribute second_attribute;
+	SharedArray<int> positions;
+	SharedArray<uint32_t> second_values;	// tokens[positions[k]+1].second
+	SharedArray<int> offsets;				// first value -> range in positions
+
+	IndexSet lookup(uint32_t first, uint32_t second, int shift = 0) const;
+};
+
+constexpr size_t POSTING_BLOCK_SIZE = 128;
+
+/**
+ * @brief Header of one block of a compressed postings list. The block holds
+ *		  count positions: first, then count-1 gaps (position - previous - 1)
+ *		  packed with bits bits each, starting at data[offset]. first and last
+ *		  double as skip pointers, a block can be passed without decoding it.
+ */
+struct PostingBlock
+{
+	int first;
+	int last;
+	uint64_t offset;
+	uint8_t bits;
+	uint8_t count;
+};
+
+/**
+ * @brief Sorted positions of one value, viewed in a CompressedIndex. Every
+ *		  block but the last holds POSTING_BLOCK_SIZE positions.
+ */
+struct CompressedSet
+{
+	std::span<const PostingBlock> blocks;
+	const uint8_t* data;
+	int shift;
+
+	size_t size() const { return blocks.empty() ? 0 : (blocks.size() - 1) * POSTING_BLOCK_SIZE + blocks.back().count; }
+};
+
+/**
+ * @brief Block compressed version of an attribute index, see compressed.h.
+ *		  value_blocks[value]..value_blocks[value+1] are the blocks of value.
+ */
+struct CompressedIndex
+{
+	SharedArray<PostingBlock> blocks;
+	SharedArray<uint8_t> data;				// Padded so a block can always be read 8 bytes at a time
+	SharedArray<uint32_t> value_blocks;
+
+	CompressedSet lookup(uint32_t value, int shift = 0) const;
+	size_t bytes() const;
+};
+
+/**
+ * @brief A set of match starts as a bitmap over the corpus, see bitmap.h.
+ *		  The bit of match start s is s + shift. In a lookup bit p is position
+ *		  p, results and window views begin elsewhere and can have negative
+ *		  shifts.
+ */
+struct BitmapSet
+{
+	SharedArray<uint64_t> words;
+	int shift;
+	int universe;	// Number of corpus positions, bits from universe up are never set
+	size_t count;	// Number of set bits
+
+	size_t size() const { return count; }
+};
+
+/**
+ * @brief Precomputed bitmaps of the frequent values of one attribute.
+ *		  slots[value] is the value's bitmap in words, or -1 if it has none.
+ */
+struct BitmapIndex
+{
+	SharedArray<int> slots;
+	SharedArray<uint64_t> words;
+	SharedArray<uint32_t> counts;	// Set bits per slot
+	size_t words_per_bitmap = 0;
+	int universe = 0;
+
+	bool contains(uint32_t value) const { return value < slots.size() && slots[value] >= 0; }
+	BitmapSet lookup(uint32_t value, int shift = 0) const;
 };
 
 struct Corpus
 {
-	std::vector<Token> tokens;
-	std::vector<int> sentences;
-	std::vector<std::string> index2string;
-	std::map<std::string, uint32_t> string2index;
-	Index word_index;
-	Index c5_index;
-	Index lemma_index;
-	Index pos_index;
+	std::array<Column, ATTRIBUTE_COUNT> columns;			// Indexed by Attribute
+	std::array<Dictionary, ATTRIBUTE_COUNT> dictionaries;	// Indexed by Attribute, values of the columns
+	SharedArray<int> sentences;
+	SharedArray<int> sentence_ids;	// Sentence of each token, see build_sentence_ids
+	SharedArray<int> word_index;
+	SharedArray<int> c5_index;
+	SharedArray<int> lemma_index;
+	SharedArray<int> pos_index;
+	// offsets[value]..offsets[value+1] is the range of value in the matching index
+	SharedArray<int> word_offsets;
+	SharedArray<int> c5_offsets;
+	SharedArray<int> lemma_offsets;
+	SharedArray<int> pos_offsets;
+	// Optional, replace the four indexes and offsets tables, see compress_indices
+	CompressedIndex word_compressed;
+	CompressedIndex c5_compressed;
+	CompressedIndex lemma_compressed;
+	CompressedIndex pos_compressed;
+	// Optional, bitmaps of frequent values, see build_bitmap_indices
+	BitmapIndex word_bitmaps;
+	BitmapIndex c5_bitmaps;
+	BitmapIndex lemma_bitmaps;
+	BitmapIndex pos_bitmaps;
+	std::vector<BinaryIndex> binary_indexes; // Optional, see build_binary_indices
+
+	size_t token_count() const { return columns[0].size(); }
+	const Column& column(Attribute attribute) const { return columns[static_cast<size_t>(attribute)]; }
+	const Dictionary& dictionary(Attribute attribute) const { return dictionaries[static_cast<size_t>(attribute)]; }
+	Token token(size_t position) const
+	{
+		return {columns[0][position], columns[1][position], columns[2][position], columns[3][position]};
+	}
+};
+
+struct IngestStats
+{
+	size_t bytes;
+	size_t tokens;
+	size_t sentences;
+	double parse_seconds;
+	double index_seconds;
+
+	double tokens_per_second() const { return parse_seconds > 0 ? tokens / parse_seconds : 0.0; }
 };
 
 struct Match
@@ -89,43 +414,117 @@ struct Match
 	int len;
 };
 
+/**
+ * @brief One bar of a histogram, see group_by
+ */
+struct ValueCount
+{
+	uint32_t value;	// String index
+	size_t count;
+};
+
+constexpr size_t NO_LIMIT = static_cast<size_t>(-1);
+
+/**
+ * @brief Which matches of a query to produce, see stream_matches
+ */
+struct ResultOptions
+{
+	size_t offset = 0;			// Matches skipped before the first one produced
+	size_t limit = NO_LIMIT;	// Most matches produced
+	bool count_only = false;	// Count the matches without producing them
+	ThreadPool* pool = nullptr;	// Optional, runs a query without a limit on shards in parallel
+	ResultCache* cache = nullptr;	// Optional, reuses clause and query results, see result_cache.h
+};
+
 struct IndexSet
 {
 	std::span<const int> elems;
 	int shift;
 };
 
+/**
+ * @brief Postings directory of one attribute. offsets[value]..offsets[value+1]
+ *		  is the range of value in the attribute's index, so a lookup is two loads.
+ */
+struct PostingsDirectory
+{
+	const SharedArray<int>* index;
+	const SharedArray<int>* offsets;
+	const CompressedIndex* compressed;
+	const BitmapIndex* bitmaps;
+
+	// True if the plain index was replaced by its compressed version
+	bool is_compressed() const { return offsets->empty() && !compressed->value_blocks.empty(); }
+
+	IndexSet lookup(uint32_t value, int shift = 0) const
+	{
+		// Values outside the table do not occur in the corpus
+		if (static_cast<size_t>(value) + 1 >= offsets->size())
+			return {std::span<const int>(), shift};
+
+		const int first = (*offsets)[value];
+		return {std::span<const int>(index->data() + first, (*offsets)[value + 1] - first), shift};
+	}
+};
+
 struct DenseSet // Empty clause
 {
 	int first;
 	int last;
 };
 
+/**
+ * @brief Computed match starts. The elements live in a scratch buffer of the
+ *		  thread, that the set returns when it is destroyed or overwritten, see
+ *		  scratch.h.
+ */
 struct ExplicitSet
 {
 	std::vector<int> elems;
+
+	ExplicitSet() = default;
+	ExplicitSet(std::vector<int> elems) : elems(std::move(elems)) {}
+	ExplicitSet(const ExplicitSet &other);
+	ExplicitSet(ExplicitSet &&other) noexcept = default;
+	ExplicitSet& operator=(const ExplicitSet &other);
+	ExplicitSet& operator=(ExplicitSet &&other) noexcept;
+	~ExplicitSet();
 };
 
 struct MatchSet // variant of sets
 {
-	std::variant<DenseSet, IndexSet, ExplicitSet> set;
+	std::variant<DenseSet, IndexSet, ExplicitSet, CompressedSet, BitmapSet> set;
 	bool complement;
 };
 
 // ----------------- FUNCTION DECLARATIONS -----------------
 
 // Corpus functions
-Corpus load_corpus(const std::string& filename);
+Corpus load_corpus(const std::string& filename, IngestStats* stats = nullptr, unsigned threads = 1);
+Corpus load_segment(const std::string& filename, const Corpus& previous, IngestStats* stats = nullptr, unsigned threads = 1);
 
 // Indexing
-uint32_t insert_and_get_index(Corpus& corpus, const std::string& str);
-Index build_index(const std::vector<Token> &tokens, uint32_t Token::* attribute);
-void build_indices(Corpus &corpus);
-IndexSet index_lookup(const Corpus &corpus, const std::string &attribute, uint32_t value);
+uint32_t insert_and_get_index(Dictionary& dictionary, std::string_view str);
+Column make_column(std::span<const Token> tokens, uint32_t Token::* attribute, size_t value_count);
+void build_columns(Corpus &corpus, std::span<const Token> tokens);
+void build_sentence_ids(Corpus &corpus);
+Index build_index(const Column &column, size_t value_count, Index* offsets = nullptr);
+void build_indices(Corpus &corpus, unsigned threads = 1);
+Attribute parse_attribute(std::string_view name);
+const char* attribute_name(Attribute attribute);
+BinaryIndex build_binary_index(const Corpus &corpus, Attribute first, Attribute second);
+void build_binary_indices(Corpus &corpus, const std::vector<std::pair<std::string, std::string>> &pairs);
+const BinaryIndex* find_binary_index(const Corpus &corpus, Attribute first, Attribute second);
+PostingsDirectory postings_directory(const Corpus &corpus, Attribute attribute);
+IndexSet index_lookup(const Corpus &corpus, Attribute attribute, uint32_t value);
 
 // Parsing functions
 Query parse_query(const std::string& text, const Corpus& corpus);
-std::vector<std::string> split_clauses(const std::string& text);
+Sequence parse_sequence(const std::string& text, const Corpus& corpus);
+bool is_fixed_length(const Sequence &sequence);
+Query fixed_query(const Sequence &sequence);
+std::vector<std::string> split_clauses(const std::string& text, std::vector<std::pair<int, int>>* repetitions = nullptr);
 std::vector<Literal> parse_clause(const std::string& text, const Corpus& corpus);
 
 // Matching
@@ -133,14 +532,29 @@ std::vector<Match> match(const Corpus& corpus, const Query& query);
 std::vector<Match> match(const Corpus& corpus, const std::string& query_string);
 bool compare_token_clause(const Token& token, const Clause& clause, const Corpus& corpus);
 bool compare_literal_token(const Token& token, const Literal& literal, const Corpus& corpus);
+ClauseEvaluator compile_clause(const Corpus &corpus, const Clause &clause);
 
 // NEW matching
 std::vector<Match> match_single(const Corpus &corpus, const std::string &attr, const std::string &value);
 MatchSet intersection(const MatchSet &A, const MatchSet &B);
-MatchSet intersect_with_plan(std::vector<MatchSet> &sets);
+MatchSet unite(const MatchSet &A, const MatchSet &B);
+MatchSet unite_all(std::vector<MatchSet> sets);
+int find_set_size(const MatchSet &set);
+MatchSet intersect_with_plan(std::vector<MatchSet> &sets, int corpus_size = 0);
+
+MatchSet restrict_set(const MatchSet &set, int begin, int end);
+MatchSet shift_set(const MatchSet &set, int shift);
 
+MatchSet match_set(const Corpus &corpus, const Clause &clause, int shift);
 MatchSet match_set(const Corpus &corpus, const Query &query);
-std::vector<Match> match2(const Corpus &corpus, const Query &query);
+size_t stream_matches(const Corpus &corpus, const Query &query, const std::function<bool(const Match &)> &f, const ResultOptions &options = {});
+size_t stream_plan(const Corpus &corpus, const QueryPlan &plan, int len, const std::function<bool(const Match &)> &f, const ResultOptions &options = {});
+std::vector<Match> match2(const Corpus &corpus, const Query &query, const ResultOptions &options = {});
+size_t count(const Corpus &corpus, const Query &query, ThreadPool *pool = nullptr, ResultCache *cache = nullptr);
+size_t stream_matches(const Corpus &corpus, const Sequence &sequence, const std::function<bool(const Match &)> &f, const ResultOptions &options = {});
+std::vector<Match> match2(const Corpus &corpus, const Sequence &sequence, const ResultOptions &options = {});
+size_t count(const Corpus &corpus, const Sequence &sequence, ThreadPool *pool = nullptr, ResultCache *cache = nullptr);
+std::vector<ValueCount> group_by(const Corpus &corpus, const Query &query, const std::string &attribute, size_t clause);
 
 
 
@@ -0,0 +1,302 @@
+#include "image.h"
+#include "mapped_file.h"
+#include "pattern.h"
+
+#include <algorithm>
+#include <cstring>
+
+//-----------------------------  HELPERS  ----------------------------------------------------------
+
+static uint64_t align_up(uint64_t offset)
+{
+	return (offset + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+}
+
+template<typename T>
+static std::span<const T> section_span(const ImageHeader& header, const char* base, ImageSection section)
+{
+	const ImageSectionEntry& entry = header.sections[section];
+	return {reinterpret_cast<const T*>(base + entry.offset), entry.size / sizeof(T)};
+}
+
+// The section of an attribute, first is the section of the word attribute
+static ImageSection attribute_section(ImageSection first, size_t attribute)
+{
+	return static_cast<ImageSection>(first + attribute);
+}
+
+//-----------------------------  WRITING  ----------------------------------------------------------
+
+/**
+ * @param corpus A corpus
+ * @param filename Name of output file
+ * @brief Writes the corpus, including its indexes, as a binary image that
+ *		  can later be opened with load_corpus_image().
+ *
+ * @attention Throws an exception if the file could not be written, or if the
+ *			  indexes were compressed, images only hold plain indexes
+ */
+void save_corpus_image(const Corpus &corpus, const std::string &filename)
+{
+	if (postings_directory(corpus, Attribute::word).is_compressed())
+		throw std::invalid_argument("Compressed indexes can not be saved, compile the image before compressing");
+
+	// Flatten each string table into one blob plus an offset array
+	std::array<std::vector<uint64_t>, ATTRIBUTE_COUNT> string_offsets;
+	std::array<std::string, ATTRIBUTE_COUNT> string_data;
+	for (size_t a = 0; a < ATTRIBUTE_COUNT; ++a)
+	{
+		string_offsets[a].reserve(corpus.dictionaries[a].size() + 1);
+		for (const std::string& str : corpus.dictionaries[a].index2string)
+		{
+			string_offsets[a].push_back(string_data[a].size());
+			string_data[a] += str;
+		}
+		string_offsets[a].push_back(string_data[a].size());
+	}
+
+	struct Source { const void* data; uint64_t size; };
+	auto column = [&](size_t a) { return Source{corpus.columns[a].data(), corpus.columns[a].size() * corpus.columns[a].width()}; };
+	auto offsets = [&](size_t a) { return Source{string_offsets[a].data(), string_offsets[a].size() * sizeof(uint64_t)}; };
+	auto data = [&](size_t a) { return Source{string_data[a].data(), string_data[a].size()}; };
+	const Source sources[SECTION_COUNT] = {
+		column(0), column(1), column(2), column(3),
+		{corpus.sentences.data(), corpus.sentences.size() * sizeof(int)},
+		offsets(0), offsets(1), offsets(2), offsets(3),
+		data(0), data(1), data(2), data(3),
+		{corpus.word_index.data(), corpus.word_index.size() * sizeof(int)},
+		{corpus.c5_index.data(), corpus.c5_index.size() * sizeof(int)},
+		{corpus.lemma_index.data(), corpus.lemma_index.size() * sizeof(int)},
+		{corpus.pos_index.data(), corpus.pos_index.size() * sizeof(int)},
+		{corpus.word_offsets.data(), corpus.word_offsets.size() * sizeof(int)},
+		{corpus.c5_offsets.data(), corpus.c5_offsets.size() * sizeof(int)},
+		{corpus.lemma_offsets.data(), corpus.lemma_offsets.size() * sizeof(int)},
+		{corpus.pos_offsets.data(), corpus.pos_offsets.size() * sizeof(int)},
+		{corpus.sentence_ids.data(), corpus.sentence_ids.size() * sizeof(int)},
+	};
+
+	ImageHeader header{};
+	std::memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	header.version = IMAGE_VERSION;
+	header.byte_order = IMAGE_BYTE_ORDER;
+	for (size_t a = 0; a < ATTRIBUTE_COUNT; ++a)
+		header.column_widths[a] = static_cast<uint8_t>(corpus.columns[a].width());
+	header.section_count = SECTION_COUNT;
+
+	uint64_t offset = align_up(sizeof(ImageHeader));
+	for (size_t i = 0; i < SECTION_COUNT; ++i)
+	{
+		header.sections[i] = {offset, sources[i].size};
+		offset = align_up(offset + sources[i].size);
+	}
+	header.file_size = offset;
+
+	std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+	if (!out)
+		throw std::invalid_argument("Could not open file " + filename);
+
+	const char padding[IMAGE_ALIGNMENT] = {};
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	uint64_t written = sizeof(header);
+	for (size_t i = 0; i < SECTION_COUNT; ++i)
+	{
+		out.write(padding, static_cast<std::streamsize>(header.sections[i].offset - written));
+		out.write(static_cast<const char*>(sources[i].data), static_cast<std::streamsize>(sources[i].size));
+		written = header.sections[i].offset + sources[i].size;
+	}
+	out.write(padding, static_cast<std::streamsize>(header.file_size - written));
+
+	if (!out)
+		throw std::invalid_argument("Could not write file " + filename);
+}
+
+//-----------------------------  LOADING  ----------------------------------------------------------
+
+/**
+ * @param filename Name of a file
+ * @brief Checks whether a file starts with the corpus image magic
+ * @return True if the file looks like a corpus image
+ */
+bool is_corpus_image(const std::string &filename)
+{
+	std::ifstream in(filename, std::ios::binary);
+	char magic[sizeof(IMAGE_MAGIC)] = {};
+	in.read(magic, sizeof(magic));
+	return in && std::memcmp(magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0;
+}
+
+/**
+ * @param header A header read from an image
+ * @param file_size Actual size of the file
+ * @brief Validates the header so that every section lies inside the file and
+ *		  the token arrays and columns agree on their sizes.
+ *
+ * @attention Throws an exception describing the first problem found
+ */
+static void validate_header(const ImageHeader& header, uint64_t file_size, const std::string& filename)
+{
+	if (std::memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0)
+		throw std::invalid_argument("Error: " + filename + " is not a corpus image");
+	if (header.version != IMAGE_VERSION)
+		throw std::invalid_argument("Error: unsupported corpus image version " + std::to_string(header.version));
+	if (header.byte_order != IMAGE_BYTE_ORDER)
+		throw std::invalid_argument("Error: corpus image was written on an incompatible machine");
+	if (header.section_count != SECTION_COUNT || header.file_size != file_size)
+		throw std::invalid_argument("Error: corpus image " + filename + " is truncated or corrupt");
+
+	for (const ImageSectionEntry& entry : header.sections)
+	{
+		if (entry.offset % IMAGE_ALIGNMENT != 0 || entry.offset > file_size || entry.size > file_size - entry.offset)
+			throw std::invalid_argument("Error: corpus image " + filename + " has a section outside the file");
+	}
+
+	const uint64_t token_count = header.sections[SECTION_SENTENCE_IDS].size / sizeof(int);
+	for (ImageSection section : {SECTION_WORD_INDEX, SECTION_C5_INDEX, SECTION_LEMMA_INDEX, SECTION_POS_INDEX, SECTION_SENTENCE_IDS})
+	{
+		if (header.sections[section].size != token_count * sizeof(int))
+			throw std::invalid_argument("Error: corpus image " + filename + " has a token array of the wrong size");
+	}
+
+	for (size_t a = 0; a < ATTRIBUTE_COUNT; ++a)
+	{
+		const uint8_t width = header.column_widths[a];
+		if ((width != 1 && width != 2 && width != 4) || header.sections[attribute_section(SECTION_WORD_COLUMN, a)].size != token_count * width)
+			throw std::invalid_argument("Error: corpus image " + filename + " has a column of the wrong size");
+
+		const uint64_t string_offsets_size = header.sections[attribute_section(SECTION_WORD_STRING_OFFSETS, a)].size;
+		if (string_offsets_size < sizeof(uint64_t))
+			throw std::invalid_argument("Error: corpus image " + filename + " has no string table");
+		if (header.sections[attribute_section(SECTION_WORD_OFFSETS, a)].size != string_offsets_size / sizeof(uint64_t) * sizeof(int))
+			throw std::invalid_argument("Error: corpus image " + filename + " has an offsets table of the wrong size");
+	}
+}
+
+/**
+ * @param offsets An offsets table from an image
+ * @param token_count Number of tokens in the image
+ * @brief Checks that the table is non-decreasing and covers exactly the index,
+ *		  so lookups can not read outside it.
+ * @return True if the table is valid
+ */
+static bool valid_offsets(std::span<const int> offsets, uint64_t token_count)
+{
+	return offsets.front() == 0 && static_cast<uint64_t>(offsets.back()) == token_count &&
+		std::is_sorted(offsets.begin(), offsets.end());
+}
+
+/**
+ * @param values Values from an image
+ * @param first Smallest valid value
+ * @param bound Bound of the valid values
+ * @return True if every value is in [first, bound)
+ */
+template<typename T>
+static bool values_in_range(std::span<const T> values, int64_t first, uint64_t bound)
+{
+	if (values.empty())
+		return true;
+	const auto [low, high] = std::minmax_element(values.begin(), values.end());
+	return static_cast<int64_t>(*low) >= first && static_cast<int64_t>(*high) >= 0 && static_cast<uint64_t>(*high) < bound;
+}
+
+/**
+ * @param corpus A corpus viewing an image, with its dictionaries
+ * @param filename Name of the image
+ * @brief Checks every value that is used as an index, so a corrupt image can
+ *		  not make a query read outside the corpus: the column values against
+ *		  the dictionaries, the index entries and sentence starts against the
+ *		  tokens, and the sentence ids against the sentences.
+ *
+ * @attention Throws an exception describing the first problem found
+ */
+static void validate_values(const Corpus& corpus, const std::string& filename)
+{
+	for (size_t a = 0; a < ATTRIBUTE_COUNT; ++a)
+	{
+		const size_t size = corpus.dictionaries[a].size();
+		if (!corpus.columns[a].visit([&](auto values) { return values_in_range(values, 0, size); }))
+			throw std::invalid_argument("Error: corpus image " + filename + " has a column value outside its dictionary");
+	}
+	for (const SharedArray<int>* index : {&corpus.word_index, &corpus.c5_index, &corpus.lemma_index, &corpus.pos_index})
+	{
+		if (!values_in_range(index->span(), 0, corpus.token_count()))
+			throw std::invalid_argument("Error: corpus image " + filename + " has an index entry outside the corpus");
+	}
+	const std::span<const int> sentences = corpus.sentences.span();
+	// A file without a trailing newline ends with a sentence start at the token count, see build_corpus()
+	if (!values_in_range(sentences, 0, corpus.token_count() + 1) || !std::is_sorted(sentences.begin(), sentences.end()))
+		throw std::invalid_argument("Error: corpus image " + filename + " has a corrupt sentence table");
+	if (!values_in_range(corpus.sentence_ids.span(), 0, sentences.size()))
+		throw std::invalid_argument("Error: corpus image " + filename + " has a sentence id outside the corpus");
+}
+
+/**
+ * @param filename Name of a file written by save_corpus_image()
+ * @param verify Also range check every value, see validate_values(). That reads
+ *				 the whole file, so it is left to images that are not trusted;
+ *				 otherwise only the header, offsets and string tables are checked
+ *				 and the token arrays are not touched until a query needs them.
+ * @brief Memory maps a corpus image. Columns, sentences and indexes are viewed
+ *		  directly in the mapping, only the string tables are copied into the
+ *		  dictionaries.
+ *
+ * @attention Throws an exception if the file could not be opened or is not a valid image
+ * @return Corpus object
+ */
+Corpus load_corpus_image(const std::string &filename, bool verify)
+{
+	std::shared_ptr<const MappedFile> mapping = map_file(filename);
+	if (mapping->size < sizeof(ImageHeader))
+		throw std::invalid_argument("Error: " + filename + " is not a corpus image");
+
+	const char* base = mapping->data;
+	const ImageHeader& header = *reinterpret_cast<const ImageHeader*>(base);
+	validate_header(header, mapping->size, filename);
+
+	Corpus corpus;
+	for (size_t a = 0; a < ATTRIBUTE_COUNT; ++a)
+	{
+		const ImageSection section = attribute_section(SECTION_WORD_COLUMN, a);
+		auto view = [&]<typename T>(T) { return Column{SharedArray<T>(section_span<T>(header, base, section), mapping)}; };
+		const uint8_t width = header.column_widths[a];
+		corpus.columns[a] = width == 1 ? view(uint8_t{}) : width == 2 ? view(uint16_t{}) : view(uint32_t{});
+	}
+	corpus.sentences = {section_span<int>(header, base, SECTION_SENTENCES), mapping};
+	corpus.sentence_ids = {section_span<int>(header, base, SECTION_SENTENCE_IDS), mapping};
+	corpus.word_index = {section_span<int>(header, base, SECTION_WORD_INDEX), mapping};
+	corpus.c5_index = {section_span<int>(header, base, SECTION_C5_INDEX), mapping};
+	corpus.lemma_index = {section_span<int>(header, base, SECTION_LEMMA_INDEX), mapping};
+	corpus.pos_index = {section_span<int>(header, base, SECTION_POS_INDEX), mapping};
+	corpus.word_offsets = {section_span<int>(header, base, SECTION_WORD_OFFSETS), mapping};
+	corpus.c5_offsets = {section_span<int>(header, base, SECTION_C5_OFFSETS), mapping};
+	corpus.lemma_offsets = {section_span<int>(header, base, SECTION_LEMMA_OFFSETS), mapping};
+	corpus.pos_offsets = {section_span<int>(header, base, SECTION_POS_OFFSETS), mapping};
+
+	for (const SharedArray<int>* offsets : {&corpus.word_offsets, &corpus.c5_offsets, &corpus.lemma_offsets, &corpus.pos_offsets})
+	{
+		if (!valid_offsets(offsets->span(), corpus.token_count()))
+			throw std::invalid_argument("Error: corpus image " + filename + " has a corrupt offsets table");
+	}
+
+	// The dictionaries are small compared to the token arrays, rebuild them in memory
+	for (size_t a = 0; a < ATTRIBUTE_COUNT; ++a)
+	{
+		std::span<const uint64_t> string_offsets = section_span<uint64_t>(header, base, attribute_section(SECTION_WORD_STRING_OFFSETS, a));
+		std::span<const char> string_data = section_span<char>(header, base, attribute_section(SECTION_WORD_STRING_DATA, a));
+		Dictionary& dictionary = corpus.dictionaries[a];
+		dictionary.index2string.reserve(string_offsets.size() - 1);
+		for (size_t i = 0; i + 1 < string_offsets.size(); ++i)
+		{
+			if (string_offsets[i] > string_offsets[i + 1] || string_offsets[i + 1] > string_data.size())
+				throw std::invalid_argument("Error: corpus image " + filename + " has a corrupt string table");
+
+			dictionary.index2string.emplace_back(string_data.data() + string_offsets[i], string_offsets[i + 1] - string_offsets[i]);
+			dictionary.string2index.emplace(dictionary.index2string.back(), static_cast<uint32_t>(i));
+		}
+	}
+	if (verify)
+		validate_values(corpus, filename);
+	sort_dictionaries(corpus);
+
+	return corpus;
+}
@@ -0,0 +1,81 @@
+#include <string>
+#include "corpus.h"
+
+#ifndef IMAGE_H
+#define IMAGE_H
+/*********************************************************
+ * @brief
+ *			Binary corpus images.
+ * @details
+ *			A corpus image is a compiled, flat on-disk copy of a Corpus:
+ *			the four attribute columns, sentences and the sentence of each
+ *			token, the four string tables, the four indexes and their
+ *			offsets tables are stored as aligned sections after a small
+ *			header, which records the width of each column. Loading an image memory maps the file, so the
+ *			large arrays are viewed in place instead of being parsed and
+ *			sorted again. Several processes loading the same image share
+ *			the page cache.
+ *
+ *			Images are written in native byte order and are only meant
+ *			to be read on the same kind of machine that wrote them.
+ */
+//*********************************************************
+
+// ----------------- CONSTANTS -----------------
+constexpr char IMAGE_MAGIC[8] = {'C', 'O', 'R', 'P', 'I', 'M', 'G', '\0'};
+constexpr uint32_t IMAGE_VERSION = 4;
+constexpr uint32_t IMAGE_BYTE_ORDER = 0x01020304;
+constexpr size_t IMAGE_ALIGNMENT = 64;
+
+// ----------------- STRUCTS -----------------
+// Sections that exist once per attribute are in Attribute order
+enum ImageSection : uint32_t
+{
+	SECTION_WORD_COLUMN,	// One value per token, of the width in ImageHeader::column_widths
+	SECTION_C5_COLUMN,
+	SECTION_LEMMA_COLUMN,
+	SECTION_POS_COLUMN,
+	SECTION_SENTENCES,
+	SECTION_WORD_STRING_OFFSETS,	// Dictionary size+1 offsets into SECTION_WORD_STRING_DATA
+	SECTION_C5_STRING_OFFSETS,
+	SECTION_LEMMA_STRING_OFFSETS,
+	SECTION_POS_STRING_OFFSETS,
+	SECTION_WORD_STRING_DATA,
+	SECTION_C5_STRING_DATA,
+	SECTION_LEMMA_STRING_DATA,
+	SECTION_POS_STRING_DATA,
+	SECTION_WORD_INDEX,
+	SECTION_C5_INDEX,
+	SECTION_LEMMA_INDEX,
+	SECTION_POS_INDEX,
+	SECTION_WORD_OFFSETS,	// Dictionary size+1 offsets into SECTION_WORD_INDEX
+	SECTION_C5_OFFSETS,
+	SECTION_LEMMA_OFFSETS,
+	SECTION_POS_OFFSETS,
+	SECTION_SENTENCE_IDS,	// Sentence of each token
+	SECTION_COUNT
+};
+
+struct ImageSectionEntry
+{
+	uint64_t offset;	// From start of file, aligned to IMAGE_ALIGNMENT
+	uint64_t size;		// In bytes
+};
+
+struct ImageHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint8_t column_widths[ATTRIBUTE_COUNT];	// Bytes per value of each column
+	uint32_t section_count;
+	uint64_t file_size;
+	ImageSectionEntry sections[SECTION_COUNT];
+};
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+void save_corpus_image(const Corpus &corpus, const std::string &filename);
+Corpus load_corpus_image(const std::string &filename, bool verify = false);
+bool is_corpus_image(const std::string &filename);
+
+#endif //IMAGE_H
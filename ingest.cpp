@@ -0,0 +1,333 @@
+#include "corpus.h"
+#include "mapped_file.h"
+#include "pattern.h"
+
+#include <array>
+#include <chrono>
+#include <exception>
+#include <thread>
+
+//-----------------------------  CORPUS FUNCTIONS BELOW  ----------------------------------------------------------
+
+/**
+ * @brief Same characters as std::isspace in the "C" locale, which is what
+ *		  operator>> used to split rows on.
+ */
+static bool is_field_separator(char ch)
+{
+	return ch == ' ' || ch == '\t' || ch == '\n' || ch == '\v' || ch == '\f' || ch == '\r';
+}
+
+/**
+ * @param row A row of the corpus file, without the newline
+ * @param fields Output, the first four whitespace separated fields of the row
+ * @brief Splits a row into word, c5, lemma and pos. Anything after the fourth
+ *		  field is ignored.
+ * @return True if all four fields were found
+ */
+static bool split_row(std::string_view row, std::string_view (&fields)[4])
+{
+	size_t p = 0;
+	for (std::string_view& field : fields)
+	{
+		while (p < row.size() && is_field_separator(row[p]))
+			++p;
+		if (p == row.size())
+			return false;
+
+		size_t start = p;
+		while (p < row.size() && !is_field_separator(row[p]))
+			++p;
+		field = row.substr(start, p - start);
+	}
+	return true;
+}
+
+/**
+ * @param data The rows to parse, starting at the beginning of a row that is not
+ *			   inside a sentence
+ * @param filename Name of input file, used in error messages
+ * @param tokens Output, tokens are appended
+ * @param sentences Output, sentence starts are appended, relative to the first
+ *					token appended by this call
+ * @param intern Called with the attribute and the string of each field,
+ *				 returns its string index in the attribute's dictionary
+ * @brief Parses rows of a corpus file. Empty rows end sentences, rows starting
+ *		  with # are comments.
+ *
+ * @attention Throws an exception if a row does not contain four fields
+ */
+template<typename Intern>
+static void parse_rows(std::string_view data, const std::string& filename,
+	std::vector<Token>& tokens, std::vector<int>& sentences, Intern&& intern)
+{
+	const size_t first_token = tokens.size();
+	bool in_sentence = false;
+	size_t cursor = 0;
+
+	while (cursor < data.size()) // Parse row by row
+	{
+		size_t row_end = data.find('\n', cursor);
+		if (row_end == std::string_view::npos)
+			row_end = data.size();
+		const std::string_view row = data.substr(cursor, row_end - cursor);
+		cursor = row_end + 1;
+
+		if (row.empty() || row[0] == '#')
+		{
+			// If row is empty, sentence complete, set flag to later save sentence index
+			if (row.empty())
+			{
+				in_sentence = false;
+			}
+			// If row is comment, skip
+			continue;
+		}
+
+		std::string_view fields[4];
+		// Files should include 4 string per row, if not the file is incomplete ->EXIT
+		if (!split_row(row, fields))
+		{
+			throw std::invalid_argument("Error: could not parse line " + std::string(row) + " of file " + filename);
+		}
+
+		Token row_token{};
+		row_token.word = intern(Attribute::word, fields[0]);
+		row_token.c5 = intern(Attribute::c5, fields[1]);
+		row_token.lemma = intern(Attribute::lemma, fields[2]);
+		row_token.pos = intern(Attribute::pos, fields[3]);
+
+		if (!in_sentence)
+		{
+			in_sentence = true;
+			sentences.push_back(static_cast<int>(tokens.size() - first_token));
+		}
+		tokens.push_back(row_token);
+	}
+}
+
+/**
+ * @param data The rows of a corpus file, without the header
+ * @param parts Wanted number of chunks
+ * @brief Splits the rows into chunks that start right after an empty row, so
+ *		  each chunk can be parsed on its own without crossing a sentence.
+ * @return The chunks, in file order. Fewer than parts if the file has few sentences.
+ */
+static std::vector<std::string_view> split_at_sentences(std::string_view data, unsigned parts)
+{
+	std::vector<std::string_view> chunks;
+	size_t begin = 0;
+	for (unsigned i = 1; i < parts && begin < data.size(); ++i)
+	{
+		size_t target = std::max(begin, data.size() / parts * i);
+		size_t blank_row = data.find("\n\n", target);
+		if (blank_row == std::string_view::npos)
+			break;
+
+		size_t end = blank_row + 2;
+		chunks.push_back(data.substr(begin, end - begin));
+		begin = end;
+	}
+	chunks.push_back(data.substr(begin));
+	return chunks;
+}
+
+/**
+ * @brief Result of parsing one chunk. Tokens use chunk-local string indexes
+ *		  into strings, one table per attribute, which are views into the
+ *		  mapped file.
+ */
+struct ParsedChunk
+{
+	std::vector<Token> tokens;
+	std::vector<int> sentences;
+	std::array<std::vector<std::string_view>, ATTRIBUTE_COUNT> strings;
+	std::exception_ptr error;
+};
+
+/**
+ * @param chunks Chunks from split_at_sentences()
+ * @param filename Name of input file, used in error messages
+ * @param corpus Output, receives the merged dictionaries
+ * @brief Parses the chunks on one thread each, then merges the chunk dictionaries
+ *		  into the corpus dictionaries in chunk order. Strings are first seen in the same order
+ *		  as when parsing serially, so the string indexes are the same too.
+ *
+ * @attention Rethrows the first error in file order
+ */
+static void parse_chunks_parallel(const std::vector<std::string_view>& chunks, const std::string& filename,
+	std::vector<Token>& tokens, std::vector<int>& sentences, Corpus& corpus)
+{
+	std::vector<ParsedChunk> parsed(chunks.size());
+	std::vector<std::thread> workers;
+	for (size_t c = 0; c < chunks.size(); ++c)
+	{
+		workers.emplace_back([&, c] {
+			ParsedChunk& chunk = parsed[c];
+			std::array<std::unordered_map<std::string_view, uint32_t>, ATTRIBUTE_COUNT> local_index;
+			try
+			{
+				chunk.tokens.reserve(std::count(chunks[c].begin(), chunks[c].end(), '\n'));
+				parse_rows(chunks[c], filename, chunk.tokens, chunk.sentences, [&](Attribute attribute, std::string_view str) {
+					const size_t a = static_cast<size_t>(attribute);
+					auto [it, inserted] = local_index[a].try_emplace(str, static_cast<uint32_t>(chunk.strings[a].size()));
+					if (inserted)
+						chunk.strings[a].push_back(str);
+					return it->second;
+				});
+			}
+			catch (...)
+			{
+				chunk.error = std::current_exception();
+			}
+		});
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+
+	// Merge dictionaries, serially since global indexes depend on the order
+	std::vector<std::array<std::vector<uint32_t>, ATTRIBUTE_COUNT>> local2global(parsed.size());
+	std::vector<size_t> token_offsets(parsed.size() + 1, 0);
+	for (size_t c = 0; c < parsed.size(); ++c)
+	{
+		if (parsed[c].error)
+			std::rethrow_exception(parsed[c].error);
+
+		for (size_t a = 0; a < ATTRIBUTE_COUNT; ++a)
+		{
+			local2global[c][a].reserve(parsed[c].strings[a].size());
+			for (std::string_view str : parsed[c].strings[a])
+				local2global[c][a].push_back(insert_and_get_index(corpus.dictionaries[a], str));
+		}
+
+		for (int sentence : parsed[c].sentences)
+			sentences.push_back(static_cast<int>(token_offsets[c]) + sentence);
+		token_offsets[c + 1] = token_offsets[c] + parsed[c].tokens.size();
+	}
+
+	// Translate to global indexes, each thread writes its own range
+	tokens.resize(token_offsets.back());
+	workers.clear();
+	for (size_t c = 0; c < parsed.size(); ++c)
+	{
+		workers.emplace_back([&, c] {
+			const auto& [word, c5, lemma, pos] = local2global[c];
+			Token* out = tokens.data() + token_offsets[c];
+			for (const Token& token : parsed[c].tokens)
+				*out++ = {word[token.word], c5[token.c5], lemma[token.lemma], pos[token.pos]};
+			parsed[c].tokens = {};
+		});
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+/**
+ *
+ * @param filename Name of input file
+ * @param corpus The corpus to build, with the dictionaries to intern into
+ * @param stats Optional output, sizes and timings of the load
+ * @param threads Number of threads to parse and index with, 0 means one per core
+ * @brief Parses the file into the corpus and indexes it, see load_corpus()
+ * @attention Throws an exception if the file could not be opened or a row does not
+ *			  contain four fields
+ * @return Corpus object
+ */
+static Corpus build_corpus(const std::string& filename, Corpus corpus, IngestStats* stats, unsigned threads)
+{
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+
+	auto parse_start = std::chrono::steady_clock::now();
+	std::shared_ptr<const MappedFile> file = map_file(filename, true);
+	const std::string_view data = file->view();
+
+	std::vector<Token> tokens;
+	std::vector<int> sentences;
+
+	size_t header_end = data.find('\n'); // Skip header
+	header_end = (header_end == std::string_view::npos) ? data.size() : header_end + 1;
+	const std::string_view rows = data.substr(header_end);
+
+	std::vector<std::string_view> chunks = split_at_sentences(rows, threads);
+	if (chunks.size() > 1)
+	{
+		parse_chunks_parallel(chunks, filename, tokens, sentences, corpus);
+	}
+	else
+	{
+		// One row per line, so the newline count bounds the number of tokens
+		tokens.reserve(std::count(rows.begin(), rows.end(), '\n'));
+		parse_rows(rows, filename, tokens, sentences, [&](Attribute attribute, std::string_view str) {
+			return insert_and_get_index(corpus.dictionaries[static_cast<size_t>(attribute)], str);
+		});
+	}
+	// A file without a trailing newline has always ended with an extra sentence start
+	if (!data.empty() && data.back() != '\n')
+	{
+		sentences.push_back(static_cast<int>(tokens.size()));
+	}
+
+	build_columns(corpus, tokens);
+	tokens = {};
+	corpus.sentences = std::move(sentences);
+
+	auto index_start = std::chrono::steady_clock::now();
+	build_sentence_ids(corpus);
+	build_indices(corpus, threads);
+	sort_dictionaries(corpus);
+	auto index_end = std::chrono::steady_clock::now();
+
+	if (stats)
+	{
+		stats->bytes = data.size();
+		stats->tokens = corpus.token_count();
+		stats->sentences = corpus.sentences.size();
+		stats->parse_seconds = std::chrono::duration<double>(index_start - parse_start).count();
+		stats->index_seconds = std::chrono::duration<double>(index_end - index_start).count();
+	}
+	return corpus;
+}
+
+/**
+ *
+ * @param filename Name of input file
+ * @param stats Optional output, sizes and timings of the load
+ * @param threads Number of threads to parse and index with, 0 means one per core
+ * @brief Takes a file containing a corpus of sentences and parses it into a Corpus object.
+ *		  The file is memory mapped and split into rows and fields without copying;
+ *		  strings are only allocated the first time they are interned.
+ *		  With several threads the file is split at sentence boundaries and the
+ *		  chunks are parsed concurrently. The result does not depend on the thread count.
+ *		  Every attribute has its own dictionary, and once parsed the tokens are
+ *		  stored as one column per attribute, see build_columns().
+ *
+ * @attention Throws an exception if the file could not be opened or a row does not
+ *			  contain four fields
+ * @return Corpus object
+ */
+Corpus load_corpus(const std::string& filename, IngestStats* stats, unsigned threads)
+{
+	return build_corpus(filename, Corpus{}, stats, threads);
+}
+
+/**
+ *
+ * @param filename Name of input file, in the format of load_corpus()
+ * @param previous The corpus the file continues
+ * @param stats Optional output, sizes and timings of the load
+ * @param threads Number of threads to parse and index with, 0 means one per core
+ * @brief Loads a file like load_corpus(), but interns its strings into a copy of
+ *		  the dictionaries of previous. A string keeps its index, so queries
+ *		  parsed against the new corpus also hold for previous, see segment.h.
+ *		  Positions and sentences start from 0 again.
+ * @attention Throws an exception if the file could not be opened or a row does not
+ *			  contain four fields
+ * @return Corpus object with the tokens of the file only
+ */
+Corpus load_segment(const std::string& filename, const Corpus& previous, IngestStats* stats, unsigned threads)
+{
+	Corpus corpus;
+	corpus.dictionaries = previous.dictionaries;
+	return build_corpus(filename, std::move(corpus), stats, threads);
+}
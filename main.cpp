@@ -2,106 +2,186 @@
 // Created by Noel Hedlund on 2024-10-11.
 //
 #include <string>
-#include <chrono>
 #include "corpus.h"
+#include "image.h"
+#include "batch.h"
+#include "bitmap.h"
+#include "compressed.h"
+#include "planner.h"
+#include "profile.h"
+#include "result_cache.h"
+#include "scan.h"
+#include "scratch.h"
+#include "segment.h"
+#include "server.h"
+#include "shard.h"
+#include "thread_pool.h"
 
 // Display functions
 std::string get_input();
-void handle_input(const Corpus& corpus, const std::string& query_string);
-void display_matches(const Corpus& corpus, const std::vector<Match>& matches);
+void handle_input(SegmentedCorpus& segments, const std::string& query_string, ThreadPool& pool, ResultCache* cache);
+void display_matches(const SegmentSnapshot& snapshot, const std::vector<Match>& matches, size_t total);
 
 const std::string COLOR_RED = "\033[1;31m";
 const std::string COLOR_GREEN = "\033[1;32m";
 const std::string COLOR_RESET = "\033[0m";
 const std::string BOLD_UNDERLINE = "\033[1;4m";
+const size_t DISPLAYED_MATCHES = 10;
 
 
 //---------------------------------  DISPLAY FUNCTIONS BELOW  ------------------------------------------------------
-void benchmark(const Corpus &corpus, const Query &query, const std::string &query_string, int runs = 1) {
-	if (runs <= 0) {
-		throw std::invalid_argument("Number of runs must be positive.");
-	}
-
-	double time = 0.0;
+std::string get_input() {
+	std::string query_string;
+	std::cout << "\nEnter a query (or leave empty to exit): ";
+	std::getline(std::cin, query_string);
+	return query_string;
+}
 
-	for (int i = 0; i < runs; ++i) {
-		auto start = std::chrono::high_resolution_clock::now();
+void handle_input(SegmentedCorpus& segments, const std::string& query_string, ThreadPool& pool, ResultCache* cache) {
+	// Every input reads one snapshot, appends and merges publish the next
+	const std::shared_ptr<const SegmentSnapshot> snapshot = segments.snapshot();
+	const Corpus& lexicon = snapshot->lexicon();
 
-		std::vector<Match> results = match2(corpus, query);
+	if (query_string == "scratch") {
+		const ScratchStats stats = scratch_stats();
+		std::cout << stats.acquired << " scratch buffers used, " << stats.allocations << " of them allocated" << std::endl;
+		return;
+	}
 
-		auto end = std::chrono::high_resolution_clock::now();
-		std::chrono::duration<double, std::milli> elapsed = end - start;
+	if (query_string == "stats") {
+		if (!profiling_compiled())
+			std::cout << "No counters, the program was built without QUERY_PROFILING" << std::endl;
+		else
+			std::cout << format_counters(profile_counters());
+		return;
+	}
 
-		time += elapsed.count();
+	if (query_string == "cache") {
+		if (!cache) {
+			std::cout << "No cache, see --cache-mb" << std::endl;
+			return;
+		}
+		const CacheStats stats = cache->stats();
+		std::cout << stats.hits << " hits, " << stats.misses << " misses, " << stats.evictions << " evictions, "
+				  << stats.entries << " entries using " << stats.bytes << " of " << stats.budget << " bytes" << std::endl;
+		return;
 	}
 
-	double average_time = time / runs;
-	std::cout << query_string << " Time taken (average over " << runs << " runs): "
-			  << average_time << " ms" << std::endl;
-}
+	if (query_string == "segments") {
+		const SegmentStats stats = segments.stats();
+		for (size_t s = 0; s < snapshot->segments.size(); ++s)
+			std::cout << "  segment " << s << ": " << snapshot->segments[s]->token_count() << " tokens, "
+					  << snapshot->segments[s]->sentences.size() << " sentences" << std::endl;
+		std::cout << stats.appends << " appends, " << stats.merges << " merges rewriting " << stats.merged_tokens << " tokens" << std::endl;
+		return;
+	}
 
-void run_benchmark() {
-	const std::string corpus_filename = "bnc-05M.csv";
+	const std::string append_prefix = "append ";
+	if (query_string.compare(0, append_prefix.size(), append_prefix) == 0) {
+		try {
+			IngestStats stats{};
+			const size_t tokens = segments.append_file(query_string.substr(append_prefix.size()), &stats);
+			// Cached results do not say which segments they came from
+			if (cache)
+				cache->clear();
+			std::cout << "Appended " << tokens << " tokens in " << stats.parse_seconds + stats.index_seconds << " s" << std::endl;
+		} catch (const std::exception& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+		}
+		return;
+	}
 
-	// Load the corpus with error handling
-	Corpus corpus;
-	try {
-		corpus = load_corpus(corpus_filename);
-	} catch (const std::exception &e) {
-		std::cerr << "Error loading corpus: " << e.what() << std::endl;
+	const std::string explain_prefix = "explain ";
+	if (query_string.compare(0, explain_prefix.size(), explain_prefix) == 0) {
+		try {
+			const Query query = parse_query(query_string.substr(explain_prefix.size()), lexicon);
+			for (size_t s = 0; s < snapshot->segments.size(); ++s) {
+				if (snapshot->segments.size() > 1)
+					std::cout << "Segment " << s << ":" << std::endl;
+				std::cout << explain(plan_query(*snapshot->segments[s], segment_query(*snapshot, s, query), nullptr, true));
+			}
+		} catch (const std::logic_error& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+		}
 		return;
 	}
 
-	// Parse queries
-	const Query q1 = parse_query("[lemma=\"house\" pos!=\"VERB\"]", corpus);
-	const Query q2 = parse_query("[word=\"the\"] [] []", corpus);
-	const Query q3 = parse_query("[lemma=\"poop\"] [lemma=\"scoop\"] [lemma=\"and\"]", corpus);
+	const std::string count_prefix = "count ";
+	if (query_string.compare(0, count_prefix.size(), count_prefix) == 0) {
+		try {
+			std::cout << count(*snapshot, parse_sequence(query_string.substr(count_prefix.size()), lexicon), &pool, cache) << " matches" << std::endl;
+		} catch (const std::logic_error& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+		}
+		return;
+	}
 
-	// Run benchmarks with a specified number of runs for more accurate results
-	const int runs = 25;
-	benchmark(corpus, q1, "[lemma=\"house\" pos!=\"VERB\"]", runs);
-	benchmark(corpus, q2, "[word=\"the\"] [] []", runs);
-	benchmark(corpus, q3, "[lemma=\"poop\"] [lemma=\"scoop\"] [lemma=\"and\"]", runs);
-}
+	// group <attribute> <clause> <query>, the clause counted from 0
+	const std::string group_prefix = "group ";
+	if (query_string.compare(0, group_prefix.size(), group_prefix) == 0) {
+		try {
+			std::istringstream in(query_string.substr(group_prefix.size()));
+			std::string attribute;
+			size_t clause = 0;
+			if (!(in >> attribute >> clause))
+				throw std::invalid_argument("Usage: group <attribute> <clause> <query>");
+			std::string rest;
+			std::getline(in, rest);
 
-std::string get_input() {
-	std::string query_string;
-	std::cout << "\nEnter a query (or leave empty to exit): ";
-	std::getline(std::cin, query_string);
-	return query_string;
-}
+			const std::vector<ValueCount> histogram = group_by(*snapshot, parse_query(rest, lexicon), attribute, clause);
+			const Dictionary& dictionary = lexicon.dictionary(parse_attribute(attribute));
+			const size_t shown = std::min(histogram.size(), static_cast<size_t>(20));
+			for (size_t i = 0; i < shown; ++i)
+				std::cout << "  " << dictionary.index2string[histogram[i].value] << "\t" << histogram[i].count << std::endl;
+			if (histogram.size() > shown)
+				std::cout << "  ... " << histogram.size() - shown << " more values" << std::endl;
+		} catch (const std::logic_error& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+		}
+		return;
+	}
 
-void handle_input(const Corpus& corpus, const std::string& query_string) {
 	try {
 		std::vector<Match> matches;
+		size_t total = 0;
 		try
 		{
-			matches = match2(corpus, parse_query(query_string,corpus));
+			// One run counts every match and keeps the displayed ones
+			total = stream_matches(*snapshot, parse_sequence(query_string, lexicon), [&](const Match &match) {
+				if (matches.size() < DISPLAYED_MATCHES)
+					matches.push_back(match);
+				return true;
+			}, {0, NO_LIMIT, false, &pool, cache});
 		}catch(const std::logic_error& e){
 			std::cout << COLOR_RED << "No matches found." << COLOR_RESET << std::endl;
 		}
 
 		if (!matches.empty())
-			display_matches(corpus, matches);
+			display_matches(*snapshot, matches, total);
 
 	} catch (const std::invalid_argument& e) {
 		std::cerr << "Error: " << e.what() << std::endl;
 	}
 }
 
-void display_matches(const Corpus& corpus, const std::vector<Match>& matches) {
-	size_t displayed_matches = std::min(matches.size(), static_cast<size_t>(10));
-	std::cout << "Found " << matches.size() << " matches. Showing first " << displayed_matches << std::endl;
+void display_matches(const SegmentSnapshot& snapshot, const std::vector<Match>& matches, size_t total) {
+	size_t displayed_matches = std::min(matches.size(), DISPLAYED_MATCHES);
+	std::cout << "Found " << total << " matches. Showing first " << displayed_matches << std::endl;
 
-	for (int i = 0; i < displayed_matches; ++i) {
-		const Match& match = matches[i];
+	for (size_t i = 0; i < displayed_matches; ++i) {
+		// Matches have global positions, the tokens are read from their segment
+		const size_t s = snapshot.segment_of(matches[i].sentence);
+		const Corpus& corpus = *snapshot.segments[s];
+		const Match match{matches[i].sentence - snapshot.sentence_bases[s], matches[i].pos - snapshot.token_bases[s], matches[i].len};
+		const Column& words = corpus.column(Attribute::word);
+		const Dictionary& dictionary = corpus.dictionary(Attribute::word);
 		int sentence_start = corpus.sentences[match.sentence];
-		int sentence_end = (match.sentence + 1 < corpus.sentences.size()) ? corpus.sentences[match.sentence + 1] : corpus.tokens.size();
+		int sentence_end = (static_cast<size_t>(match.sentence) + 1 < corpus.sentences.size()) ? corpus.sentences[match.sentence + 1] : corpus.token_count();
 
-		std::cout << BOLD_UNDERLINE << "Match " << (i + 1) << COLOR_RESET <<" in sentence " << match.sentence + 1 << ": ";
+		std::cout << BOLD_UNDERLINE << "Match " << (i + 1) << COLOR_RESET <<" in sentence " << matches[i].sentence + 1 << ": ";
 
 		for (int j = sentence_start; j < sentence_end; ++j) {
-			std::string word = corpus.index2string[corpus.tokens[j].word];
+			const std::string& word = dictionary.index2string[words[j]];
 
 			if (j >= match.pos && j < match.pos + match.len) {
 				std::cout << COLOR_GREEN << word << COLOR_RESET << " ";
@@ -114,20 +194,342 @@ void display_matches(const Corpus& corpus, const std::vector<Match>& matches) {
 }
 
 
-int main()
+/**
+ * @param corpus A corpus
+ * @param filename File with one query per line
+ * @param pool Pool the batch runs on
+ * @brief Counts the matches of every query in the file as one batch and prints
+ *		  each count next to its query, queries that do not parse print their error
+ */
+void run_batch_file(const Corpus& corpus, const std::string& filename, ThreadPool& pool)
 {
-	const std::string corpus_filename = "bnc-05M.csv";
+	std::ifstream file(filename);
+	if (!file)
+		throw std::invalid_argument("Could not open file " + filename);
+
+	std::vector<std::string> lines;
+	std::vector<Query> queries;
+	std::vector<std::string> errors;
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.empty())
+			continue;
+		lines.push_back(line);
+		try {
+			queries.push_back(parse_query(line, corpus));
+			errors.emplace_back();
+		} catch (const std::logic_error& e) {
+			queries.emplace_back();
+			errors.push_back(e.what());
+		}
+	}
+
+	BatchStats stats{};
+	const std::vector<BatchResult> results = run_batch(corpus, queries, {0, NO_LIMIT, true, &pool}, &stats);
+	for (size_t i = 0; i < lines.size(); ++i) {
+		if (errors[i].empty())
+			std::cout << results[i].count << "\t" << lines[i] << std::endl;
+		else
+			std::cout << COLOR_RED << errors[i] << COLOR_RESET << "\t" << lines[i] << std::endl;
+	}
+	std::cout << "Ran " << stats.queries << " queries, " << stats.distinct_queries << " distinct, sharing " << stats.shared_clauses
+			  << " clauses over " << stats.clause_uses << " uses, in " << stats.clause_seconds + stats.query_seconds << " s" << std::endl;
+}
+
+/**
+ * @param coordinator A coordinator connected to its shards
+ * @param query_string One line of input
+ * @brief Runs a count, group or match of the prompt on the shards
+ */
+void handle_coordinated_input(Coordinator& coordinator, const std::string& query_string) {
+	const Corpus& lexicon = coordinator.lexicon();
+	try {
+		const std::string count_prefix = "count ";
+		const std::string group_prefix = "group ";
+		if (query_string.compare(0, count_prefix.size(), count_prefix) == 0) {
+			std::cout << coordinator.count(parse_sequence(query_string.substr(count_prefix.size()), lexicon)) << " matches" << std::endl;
+			return;
+		}
+		if (query_string.compare(0, group_prefix.size(), group_prefix) == 0) {
+			std::istringstream in(query_string.substr(group_prefix.size()));
+			std::string attribute;
+			size_t clause = 0;
+			if (!(in >> attribute >> clause))
+				throw std::invalid_argument("Usage: group <attribute> <clause> <query>");
+			std::string rest;
+			std::getline(in, rest);
+
+			const std::vector<ValueCount> histogram = coordinator.group_by(parse_query(rest, lexicon), attribute, clause);
+			const Dictionary& dictionary = lexicon.dictionary(parse_attribute(attribute));
+			const size_t shown = std::min(histogram.size(), static_cast<size_t>(20));
+			for (size_t i = 0; i < shown; ++i)
+				std::cout << "  " << dictionary.index2string[histogram[i].value] << "\t" << histogram[i].count << std::endl;
+			if (histogram.size() > shown)
+				std::cout << "  ... " << histogram.size() - shown << " more values" << std::endl;
+			return;
+		}
+
+		size_t total = 0;
+		const std::vector<ShardMatch> matches = coordinator.match(parse_sequence(query_string, lexicon), 0, DISPLAYED_MATCHES, &total);
+		if (matches.empty()) {
+			std::cout << COLOR_RED << "No matches found." << COLOR_RESET << std::endl;
+			return;
+		}
+		std::cout << "Found " << total << " matches. Showing first " << matches.size() << std::endl;
+		const Dictionary& dictionary = lexicon.dictionary(Attribute::word);
+		for (size_t i = 0; i < matches.size(); ++i) {
+			const ShardMatch& found = matches[i];
+			std::cout << BOLD_UNDERLINE << "Match " << (i + 1) << COLOR_RESET << " in sentence " << found.match.sentence + 1 << ": ";
+			for (size_t j = 0; j < found.words.size(); ++j) {
+				const int position = found.sentence_start + static_cast<int>(j);
+				const std::string& word = dictionary.index2string[found.words[j]];
+				if (position >= found.match.pos && position < found.match.pos + found.match.len)
+					std::cout << COLOR_GREEN << word << COLOR_RESET << " ";
+				else
+					std::cout << word << " ";
+			}
+			std::cout << std::endl;
+		}
+	} catch (const std::logic_error& e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+	}
+}
+
+/**
+ * @param filename A CSV corpus or a compiled corpus image
+ * @param threads Threads used to parse and index a CSV corpus, 0 means one per core
+ * @param verify Range check every value of a corpus image, see load_corpus_image()
+ * @brief Loads a corpus, memory mapping it if the file is a corpus image
+ * @return Corpus object
+ */
+Corpus open_corpus(const std::string& filename, unsigned threads, bool verify)
+{
+	if (is_corpus_image(filename))
+		return load_corpus_image(filename, verify);
+
+	IngestStats stats{};
+	Corpus corpus = load_corpus(filename, &stats, threads);
+	std::cout << "Parsed " << stats.tokens << " tokens in " << stats.parse_seconds << " s ("
+			  << stats.tokens_per_second() << " tokens/s), indexed in " << stats.index_seconds << " s" << std::endl;
+	return corpus;
+}
+
+/**
+ * Usage: B [corpus file] [--append <file>]... [--compile <image file>] [--verify-image] [--build-shards <prefix>] [--coordinate <shards>] [--threads <n>] [--binary-index <first>:<second>]... [--compress-index] [--bitmap-density <fraction>] [--query-threads <n>] [--cache-mb <n>] [--scan <mode>] [--batch <query file>] [--serve <port>] [--server-workers <n>] [--queue-capacity <n>] [--queue-timeout <ms>] [--max-connections <n>] [--max-request-bytes <n>] [--profile]
+ *	- The corpus file is either a CSV corpus or an image, default bnc-05M.csv
+ *	- --append adds the sentences of a file in the same format as a new segment, see segment.h,
+ *	  also at the prompt with append <file>
+ *	- --compile writes the loaded corpus as an image and exits
+ *	- --verify-image range checks every value of a corpus image when loading it, which reads
+ *	  the whole file instead of mapping it lazily
+ *	- --build-shards writes the corpus file and every --append file as one shard image each,
+ *	  <prefix>0.img, <prefix>1.img, ..., and their dictionaries as <prefix>lexicon.img, see shard.h
+ *	- --coordinate runs the prompt on shard servers, given as <host>:<port>,<host>:<port>,...
+ *	  in the order of their shards, the corpus file is then their lexicon image
+ *	- --threads sets the number of threads used to build a CSV corpus, 0 means one per core
+ *	- --binary-index builds a binary index over two attributes of adjacent tokens, e.g. pos:lemma
+ *	- --compress-index replaces the four indexes with block compressed postings lists
+ *	- --bitmap-density sets the fraction of the corpus a value must cover to get a bitmap,
+ *	  default 1/32, 0 builds no bitmaps
+ *	- --query-threads sets the number of threads counting matches in parallel, 0 means one per core
+ *	- --cache-mb sets the memory budget of the result cache, default 64, 0 disables it
+ *	- --scan sets when queries scan the columns instead of using the indexes: auto (by
+ *	  estimated cost, the default), always or never, see scan.h
+ *	- --batch counts the matches of every query in a file, one per line, sharing their common clauses
+ *	- --serve answers requests on a TCP port instead of reading queries from the terminal, see server.h
+ *	- --server-workers, --queue-capacity, --queue-timeout, --max-connections and --max-request-bytes
+ *	  configure the server, by default one worker per core, 256 queued requests, 5000 ms in the queue
+ *	  at most, 1024 clients and 16 MiB per request line
+ *	- --profile prints where the time of every query at the prompt went, or adds it to every
+ *	  reply of the server, see profile.h
+ */
+int main(int argc, char* argv[])
+{
+	std::string corpus_filename = "bnc-05M.csv";
+	std::vector<std::string> append_filenames;
+	std::string image_filename;
+	bool verify_image = false;
+	std::string shard_prefix;
+	std::vector<std::string> shard_addresses;
+	unsigned threads = 1;
+	unsigned query_threads = 1;
+	size_t cache_mb = 64;
+	std::string batch_filename;
+	bool serve = false;
+	bool profile_queries = false;
+	ServerOptions server_options;
+	bool compress = false;
+	double bitmap_density = DEFAULT_BITMAP_DENSITY;
+	std::vector<std::pair<std::string, std::string>> binary_indexes;
 	Corpus corpus;
 
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (arg == "--append" && i + 1 < argc) {
+			append_filenames.push_back(argv[++i]);
+		} else if (arg == "--compile" && i + 1 < argc) {
+			image_filename = argv[++i];
+		} else if (arg == "--verify-image") {
+			verify_image = true;
+		} else if (arg == "--build-shards" && i + 1 < argc) {
+			shard_prefix = argv[++i];
+		} else if (arg == "--coordinate" && i + 1 < argc) {
+			std::istringstream addresses(argv[++i]);
+			std::string address;
+			while (std::getline(addresses, address, ','))
+				shard_addresses.push_back(address);
+		} else if (arg == "--threads" && i + 1 < argc) {
+			threads = std::stoul(argv[++i]);
+		} else if (arg == "--query-threads" && i + 1 < argc) {
+			query_threads = std::stoul(argv[++i]);
+		} else if (arg == "--cache-mb" && i + 1 < argc) {
+			cache_mb = std::stoul(argv[++i]);
+		} else if (arg == "--scan" && i + 1 < argc) {
+			try {
+				set_scan_mode(parse_scan_mode(argv[++i]));
+			} catch (const std::invalid_argument &e) {
+				std::cerr << e.what() << ", expected auto, always or never" << std::endl;
+				exit(1);
+			}
+		} else if (arg == "--batch" && i + 1 < argc) {
+			batch_filename = argv[++i];
+		} else if (arg == "--serve" && i + 1 < argc) {
+			serve = true;
+			server_options.port = std::stoi(argv[++i]);
+		} else if (arg == "--server-workers" && i + 1 < argc) {
+			server_options.workers = std::stoul(argv[++i]);
+		} else if (arg == "--queue-capacity" && i + 1 < argc) {
+			server_options.queue_capacity = std::stoul(argv[++i]);
+		} else if (arg == "--queue-timeout" && i + 1 < argc) {
+			server_options.queue_timeout_ms = std::stoi(argv[++i]);
+		} else if (arg == "--max-connections" && i + 1 < argc) {
+			server_options.max_connections = std::stoul(argv[++i]);
+		} else if (arg == "--max-request-bytes" && i + 1 < argc) {
+			server_options.max_request_bytes = std::stoul(argv[++i]);
+		} else if (arg == "--profile") {
+			profile_queries = true;
+		} else if (arg == "--binary-index" && i + 1 < argc) {
+			const std::string pair = argv[++i];
+			const size_t colon = pair.find(':');
+			if (colon == std::string::npos) {
+				std::cerr << "Binary index must be given as <first>:<second>, e.g. pos:lemma" << std::endl;
+				exit(1);
+			}
+			binary_indexes.emplace_back(pair.substr(0, colon), pair.substr(colon + 1));
+		} else if (arg == "--bitmap-density" && i + 1 < argc) {
+			bitmap_density = std::stod(argv[++i]);
+		} else if (arg == "--compress-index") {
+			compress = true;
+		} else if (!arg.empty() && arg[0] != '-') {
+			corpus_filename = arg;
+		} else {
+			std::cerr << "Usage: " << argv[0] << " [corpus file] [--append <file>]... [--compile <image file>] [--verify-image] [--build-shards <prefix>] [--coordinate <shards>] [--threads <n>] [--binary-index <first>:<second>]... [--compress-index] [--bitmap-density <fraction>] [--query-threads <n>] [--cache-mb <n>] [--scan <mode>] [--batch <query file>] [--serve <port>] [--server-workers <n>] [--queue-capacity <n>] [--queue-timeout <ms>] [--max-connections <n>] [--max-request-bytes <n>] [--profile]" << std::endl;
+			exit(1);
+		}
+	}
+
+	if (!shard_prefix.empty()) {
+		try {
+			std::vector<std::string> files{corpus_filename};
+			files.insert(files.end(), append_filenames.begin(), append_filenames.end());
+			build_shards(files, shard_prefix, threads);
+			std::cout << "Wrote " << files.size() << " shards and " << shard_prefix << "lexicon.img" << std::endl;
+		} catch (const std::invalid_argument& e) {
+			std::cerr << "Error building shards: " << e.what() << std::endl;
+			exit(1);
+		}
+		return 0;
+	}
+
+	if (!shard_addresses.empty()) {
+		try {
+			Coordinator coordinator(open_corpus(corpus_filename, threads, verify_image), shard_addresses);
+			std::cout << "Coordinating " << coordinator.shard_count() << " shards of " << coordinator.token_count() << " tokens" << std::endl;
+			for (std::string query_string = get_input(); !query_string.empty(); query_string = get_input())
+				handle_coordinated_input(coordinator, query_string);
+		} catch (const std::invalid_argument& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			exit(1);
+		}
+		std::cout << COLOR_GREEN << "Exiting program." << COLOR_RESET << std::endl;
+		return 0;
+	}
+
 	try {
-		corpus = load_corpus(corpus_filename);
+		corpus = open_corpus(corpus_filename, threads, verify_image);
 		std::cout << "Corpus loaded successfully from " << corpus_filename << std::endl;
 
+		if (!image_filename.empty()) {
+			save_corpus_image(corpus, image_filename);
+			std::cout << "Corpus image written to " << image_filename << std::endl;
+			return 0;
+		}
+
+		if (!binary_indexes.empty()) {
+			build_binary_indices(corpus, binary_indexes);
+			std::cout << "Built " << binary_indexes.size() << " binary indexes" << std::endl;
+		}
+
+		build_bitmap_indices(corpus, bitmap_density);
+
+		if (compress) {
+			const size_t plain_bytes = corpus.word_index.size() * 4 * sizeof(int)
+				+ (corpus.word_offsets.size() + corpus.c5_offsets.size() + corpus.lemma_offsets.size() + corpus.pos_offsets.size()) * sizeof(int);
+			compress_indices(corpus);
+			const size_t compressed_bytes = corpus.word_compressed.bytes() + corpus.c5_compressed.bytes()
+				+ corpus.lemma_compressed.bytes() + corpus.pos_compressed.bytes();
+			std::cout << "Compressed indexes from " << plain_bytes << " to " << compressed_bytes << " bytes" << std::endl;
+		}
 	} catch (const std::invalid_argument& e) {
 		std::cerr << "Error loading corpus: " << e.what() << std::endl;
 		exit(1);
 	}
 
+	SegmentedCorpus segments(std::move(corpus), {threads, bitmap_density, compress, binary_indexes});
+	try {
+		for (const std::string& filename : append_filenames) {
+			IngestStats stats{};
+			const size_t tokens = segments.append_file(filename, &stats);
+			std::cout << "Appended " << tokens << " tokens from " << filename << " in "
+					  << stats.parse_seconds + stats.index_seconds << " s" << std::endl;
+		}
+	} catch (const std::invalid_argument& e) {
+		std::cerr << "Error appending: " << e.what() << std::endl;
+		exit(1);
+	}
+	// The batch runner and the server read a single corpus
+	if (!append_filenames.empty() && (!batch_filename.empty() || serve))
+		segments.compact();
+	const std::shared_ptr<const Corpus> whole = segments.snapshot()->segments.front();
+
+	ThreadPool pool(query_threads);
+	std::optional<ResultCache> cache;
+	if (cache_mb > 0)
+		cache.emplace(cache_mb << 20);
+	ResultCache* cache_pointer = cache ? &*cache : nullptr;
+	if (!batch_filename.empty()) {
+		try {
+			run_batch_file(*whole, batch_filename, pool);
+		} catch (const std::invalid_argument& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			exit(1);
+		}
+		return 0;
+	}
+	if (profile_queries && !profiling_compiled())
+		std::cerr << "Profiles are empty, the program was built without QUERY_PROFILING" << std::endl;
+	if (serve) {
+		server_options.pool = &pool;
+		server_options.cache = cache_pointer;
+		server_options.profile = profile_queries;
+		try {
+			run_server(*whole, server_options);
+		} catch (const std::invalid_argument& e) {
+			std::cerr << "Error: " << e.what() << std::endl;
+			exit(1);
+		}
+	}
+
 	while (true)
 	{
 		std::string query_string = get_input();
@@ -136,7 +538,13 @@ int main()
 			break;
 		}
 
-		handle_input(corpus, query_string);
+		QueryProfile profile;
+		{
+			const ProfileScope scope(profile_queries ? &profile : nullptr);
+			handle_input(segments, query_string, pool, cache_pointer);
+		}
+		if (profile_queries)
+			std::cout << format_profile(profile);
 	}
 
 	return 0;
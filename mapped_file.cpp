@@ -0,0 +1,51 @@
+#include "mapped_file.h"
+
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::~MappedFile()
+{
+	if (size != 0)
+		munmap(const_cast<char*>(data), size);
+}
+
+/**
+ * @param filename Name of a file
+ * @param sequential Hint the kernel that the file will be read front to back
+ * @brief Maps a whole file read-only. Empty files give an empty mapping.
+ *
+ * @attention Throws an exception if the file could not be opened or mapped
+ * @return The mapping
+ */
+std::shared_ptr<const MappedFile> map_file(const std::string &filename, bool sequential)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::invalid_argument("Could not open file " + filename);
+
+	struct stat file_stat{};
+	if (fstat(fd, &file_stat) != 0)
+	{
+		close(fd);
+		throw std::invalid_argument("Could not open file " + filename);
+	}
+
+	const size_t length = file_stat.st_size;
+	if (length == 0)
+	{
+		close(fd);
+		return std::make_shared<const MappedFile>();
+	}
+
+	void* address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // The mapping stays valid after the descriptor is closed
+	if (address == MAP_FAILED)
+		throw std::invalid_argument("Could not map file " + filename);
+
+	if (sequential)
+		madvise(address, length, MADV_SEQUENTIAL);
+	return std::make_shared<const MappedFile>(static_cast<const char*>(address), length);
+}
@@ -0,0 +1,33 @@
+#include <memory>
+#include <string>
+#include <string_view>
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+/*********************************************************
+ * @brief
+ *			Read-only memory mapped files.
+ * @details
+ *			Used both for corpus images, which are viewed in place, and
+ *			for streaming CSV ingest. The mapping is released when the
+ *			last shared_ptr to it goes away.
+ */
+//*********************************************************
+
+struct MappedFile
+{
+	const char* data = nullptr;
+	size_t size = 0;
+
+	MappedFile() = default;
+	MappedFile(const char* data, size_t size) : data(data), size(size) {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile();
+
+	std::string_view view() const { return {data, size}; }
+};
+
+std::shared_ptr<const MappedFile> map_file(const std::string &filename, bool sequential = false);
+
+#endif //MAPPED_FILE_H
@@ -0,0 +1,272 @@
+#include "pattern.h"
+#include "bitmap.h"
+#include "compressed.h"
+#include "profile.h"
+
+#include <cctype>
+#include <optional>
+#include <queue>
+#include <regex>
+#include <stdexcept>
+
+//-----------------------------  DICTIONARIES  ----------------------------------------------------------
+
+static char fold(char ch)
+{
+	return static_cast<char>(std::tolower(static_cast<unsigned char>(ch)));
+}
+
+/**
+ * @return a < b compared case-insensitively, byte by byte after folding ASCII letters
+ */
+static bool folded_less(std::string_view a, std::string_view b)
+{
+	return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end(), [](char x, char y) {
+		return static_cast<unsigned char>(fold(x)) < static_cast<unsigned char>(fold(y));
+	});
+}
+
+/**
+ * @return True if str starts with prefix, case-insensitively if ignore_case
+ */
+static bool has_prefix(std::string_view str, std::string_view prefix, bool ignore_case)
+{
+	if (str.size() < prefix.size())
+		return false;
+	for (size_t i = 0; i < prefix.size(); ++i)
+	{
+		if (ignore_case ? fold(str[i]) != fold(prefix[i]) : str[i] != prefix[i])
+			return false;
+	}
+	return true;
+}
+
+/**
+ *
+ * @param dictionary A dictionary with its strings
+ * @brief Orders the values by their strings, and by their case-folded strings,
+ *		  replacing any earlier orders
+ */
+void sort_dictionary(Dictionary &dictionary)
+{
+	const std::vector<std::string>& strings = dictionary.index2string;
+	dictionary.sorted.resize(strings.size());
+	std::iota(dictionary.sorted.begin(), dictionary.sorted.end(), 0);
+	dictionary.folded = dictionary.sorted;
+
+	std::sort(dictionary.sorted.begin(), dictionary.sorted.end(), [&](uint32_t a, uint32_t b) {
+		return strings[a] < strings[b];
+	});
+	std::sort(dictionary.folded.begin(), dictionary.folded.end(), [&](uint32_t a, uint32_t b) {
+		return folded_less(strings[a], strings[b]);
+	});
+}
+
+/**
+ * @param corpus A corpus with its dictionaries
+ * @brief Sorts the dictionary of every attribute, see sort_dictionary()
+ */
+void sort_dictionaries(Corpus &corpus)
+{
+	for (Dictionary& dictionary : corpus.dictionaries)
+		sort_dictionary(dictionary);
+}
+
+//-----------------------------  PATTERNS  ----------------------------------------------------------
+
+/**
+ * @brief The literal characters a regex starts with, and whether they are
+ *		  the whole pattern (exact) or followed by only .* (prefix)
+ */
+struct RegexPrefix
+{
+	std::string prefix;
+	bool exact;
+	bool prefix_only;
+};
+
+/**
+ *
+ * @param pattern An ECMAScript regex
+ * @brief Takes characters up to the first special one. A quantifier after
+ *		  the prefix makes its last character optional, so it is dropped, and
+ *		  any alternation can bypass the prefix, so there is none.
+ * @return The prefix every match of the whole pattern starts with
+ */
+static RegexPrefix regex_prefix(std::string_view pattern)
+{
+	constexpr std::string_view SPECIAL = ".[]()*+?{}|^$\\";
+	if (pattern.find('|') != std::string_view::npos)
+		return {"", false, false};
+
+	const size_t end = std::min(pattern.find_first_of(SPECIAL), pattern.size());
+	RegexPrefix result{std::string(pattern.substr(0, end)), end == pattern.size(), pattern.substr(end) == ".*"};
+	if (end < pattern.size() && std::string_view("*?{").find(pattern[end]) != std::string_view::npos && !result.prefix.empty())
+	{
+		result.prefix.pop_back();
+		result.prefix_only = false;
+	}
+	return result;
+}
+
+/**
+ *
+ * @param dictionary A dictionary
+ * @param prefix A prefix
+ * @param ignore_case Compare case-insensitively, in the folded order
+ * @return The range of the order whose strings start with prefix. Without
+ *		   an order, after a corpus was built by hand, every value.
+ */
+static std::pair<const uint32_t*, const uint32_t*> prefix_range(const Dictionary &dictionary, std::string_view prefix, bool ignore_case)
+{
+	const std::vector<uint32_t>& order = ignore_case ? dictionary.folded : dictionary.sorted;
+	const std::vector<std::string>& strings = dictionary.index2string;
+	if (order.size() != strings.size())
+		return {nullptr, nullptr};
+
+	auto first = std::partition_point(order.begin(), order.end(), [&](uint32_t value) {
+		const std::string_view str(strings[value]);
+		const std::string_view head = str.substr(0, prefix.size());
+		return ignore_case ? folded_less(head, prefix) : head < prefix;
+	});
+	auto last = std::partition_point(first, order.end(), [&](uint32_t value) {
+		return has_prefix(strings[value], prefix, ignore_case);
+	});
+	return {order.data() + (first - order.begin()), order.data() + (last - order.begin())};
+}
+
+/**
+ *
+ * @param text The pattern as written
+ * @param values Values of one attribute, in any order and possibly repeated
+ * @param dictionary_size Size of the attribute's dictionary, every value is below it
+ * @return The set of the values, sorted, with its bits
+ */
+std::shared_ptr<const ValueSet> make_value_set(std::string text, std::vector<uint32_t> values, size_t dictionary_size)
+{
+	auto set = std::make_shared<ValueSet>();
+	set->text = std::move(text);
+	set->values = std::move(values);
+	std::sort(set->values.begin(), set->values.end());
+	set->values.erase(std::unique(set->values.begin(), set->values.end()), set->values.end());
+
+	set->bits.assign((dictionary_size + 63) / 64, 0);
+	for (uint32_t value : set->values)
+		set->bits[value / 64] |= uint64_t{1} << (value % 64);
+	return set;
+}
+
+/**
+ *
+ * @param dictionary The dictionary of the literal's attribute
+ * @param pattern A regex if is_regex, else a value
+ * @param is_regex Match the whole string against pattern as an ECMAScript regex
+ * @param ignore_case Ignore the case of ASCII letters
+ * @brief Expands the pattern into the values it matches, narrowed to the
+ *		  range of its prefix first, see pattern.h
+ * @attention Throws an exception if the regex is malformed
+ * @return The values, possibly none
+ */
+std::shared_ptr<const ValueSet> expand_pattern(const Dictionary &dictionary, std::string_view pattern, bool is_regex, bool ignore_case)
+{
+	const RegexPrefix prefix = is_regex ? regex_prefix(pattern) : RegexPrefix{std::string(pattern), true, false};
+	std::optional<std::regex> regex;
+	if (!prefix.exact && !prefix.prefix_only)
+	{
+		try
+		{
+			regex.emplace(pattern.begin(), pattern.end(), ignore_case ? std::regex::ECMAScript | std::regex::icase : std::regex::ECMAScript);
+		}
+		catch (const std::regex_error &e)
+		{
+			throw std::invalid_argument("Invalid pattern \"" + std::string(pattern) + "\": " + e.what());
+		}
+	}
+
+	auto keep = [&](uint32_t value) {
+		const std::string& str = dictionary.index2string[value];
+		if (prefix.exact)
+			return ignore_case ? str.size() == prefix.prefix.size() && has_prefix(str, prefix.prefix, true) : str == prefix.prefix;
+		return prefix.prefix_only || std::regex_match(str, *regex);
+	};
+
+	std::vector<uint32_t> values;
+	auto [first, last] = prefix_range(dictionary, prefix.prefix, ignore_case);
+	if (!first)
+	{
+		for (uint32_t value = 0; value < dictionary.size(); ++value)
+			if (keep(value)) values.push_back(value);
+	}
+	else
+	{
+		for (const uint32_t* value = first; value != last; ++value)
+			if (keep(*value)) values.push_back(*value);
+	}
+	const std::string text = (is_regex ? "~\"" : "=\"") + std::string(pattern) + "\"" + (ignore_case ? "%c" : "");
+	return make_value_set(text, std::move(values), dictionary.size());
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param attribute An attribute
+ * @param values Values of the attribute
+ * @param shift Shift of the literal's clause
+ * @brief Unites the postings of the values into match starts. The lists are
+ *		  disjoint, a token has one value, so the union has their total size.
+ *		  Past 1/32 of the corpus it is written into a bitmap, which is then
+ *		  also the smaller one, otherwise the lists are merged through a heap
+ *		  holding the next position of each.
+ * @return The match starts, an ExplicitSet or a BitmapSet, owning its elements
+ */
+MatchSet union_postings(const Corpus &corpus, Attribute attribute, const std::vector<uint32_t> &values, int shift)
+{
+	const PostingsDirectory directory = postings_directory(corpus, attribute);
+	std::vector<ExplicitSet> decoded;	// Compressed lists, decoded first
+	std::vector<std::span<const int>> lists;
+	size_t total = 0;
+	for (uint32_t value : values)
+	{
+		if (directory.is_compressed())
+		{
+			decoded.push_back(decompress(directory.compressed->lookup(value)));
+			lists.emplace_back(decoded.back().elems);
+		}
+		else
+			lists.push_back(directory.lookup(value).elems);
+		PROFILE_LOOKUP(lists.back().size());
+		total += lists.back().size();
+	}
+
+	const int corpus_size = static_cast<int>(corpus.token_count());
+	if (total >= corpus_size * DEFAULT_BITMAP_DENSITY)
+	{
+		std::vector<uint64_t> words((static_cast<size_t>(corpus_size) + 63) / 64, 0);
+		for (std::span<const int> list : lists)
+		{
+			for (int position : list)
+				words[position / 64] |= uint64_t{1} << (position % 64);
+		}
+		return MatchSet{BitmapSet{SharedArray<uint64_t>(std::move(words)), shift, corpus_size, total}, false};
+	}
+
+	std::vector<int> starts;
+	starts.reserve(total);
+	using Head = std::pair<int, size_t>;	// Next position of a list, and the list
+	std::priority_queue<Head, std::vector<Head>, std::greater<>> heads;
+	std::vector<size_t> next(lists.size(), 0);
+	for (size_t k = 0; k < lists.size(); ++k)
+	{
+		if (!lists[k].empty())
+			heads.push({lists[k][0], k});
+	}
+	while (!heads.empty())
+	{
+		const auto [position, k] = heads.top();
+		heads.pop();
+		starts.push_back(position - shift);
+		if (++next[k] < lists[k].size())
+			heads.push({lists[k][next[k]], k});
+	}
+	return MatchSet{ExplicitSet(std::move(starts)), false};
+}
@@ -0,0 +1,48 @@
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "corpus.h"
+
+#ifndef PATTERN_H
+#define PATTERN_H
+/*********************************************************
+ * @brief
+ *			Literals that match several values: regular expressions,
+ *			prefixes and case-insensitive values.
+ * @details
+ *			Every dictionary keeps its values in string order and in
+ *			case-folded order, see sort_dictionary(). A pattern is
+ *			expanded against the dictionary once, when the query is
+ *			parsed, into the set of values it matches:
+ *				- the longest literal prefix of the pattern is found
+ *				  by binary search, the values starting with it are
+ *				  one range of the order
+ *				- a pattern that is only a prefix, like house.*, is
+ *				  that range, other patterns are matched against the
+ *				  strings of the range with std::regex
+ *				- a case-insensitive pattern searches the folded order
+ *			So a pattern costs a dictionary lookup per candidate value,
+ *			never a pass over the tokens.
+ *
+ *			The postings of the values are then united into one set of
+ *			match starts, see union_postings(): merged through a heap
+ *			of the k lists, or, once they cover a large part of the
+ *			corpus, written into a bitmap. The union is an ordinary
+ *			operand for the planner, and the column tests check a
+ *			token's value against the set's bits.
+ */
+//*********************************************************
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+
+// Dictionaries
+void sort_dictionary(Dictionary &dictionary);
+void sort_dictionaries(Corpus &corpus);
+
+// Patterns
+std::shared_ptr<const ValueSet> make_value_set(std::string text, std::vector<uint32_t> values, size_t dictionary_size);
+std::shared_ptr<const ValueSet> expand_pattern(const Dictionary &dictionary, std::string_view pattern, bool is_regex, bool ignore_case);
+MatchSet union_postings(const Corpus &corpus, Attribute attribute, const std::vector<uint32_t> &values, int shift);
+
+#endif //PATTERN_H
@@ -0,0 +1,756 @@
+#include "planner.h"
+#include "pattern.h"
+#include "profile.h"
+#include "simd_sets.h"
+
+#include <cmath>
+#include <iomanip>
+#include <limits>
+
+//-----------------------------  COST MODEL  ----------------------------------------------------------
+
+// Relative cost of the work done by the kernels, per element or word
+constexpr double MERGE_COST = 0.25;		// Vectorized merge, several elements per compare
+constexpr double PROBE_COST = 1.0;		// A bitmap probe or one galloping step
+constexpr double DECODE_COST = 0.5;		// Unpacking one compressed position
+constexpr double WORD_COST = 1.0;		// One 64 bit word of a bitmap operation
+constexpr double VERIFY_COST = 1.0;		// Reading the token of one candidate, usually a cache miss
+constexpr double SCAN_COST = 0.4;		// Comparing 64 column values, per byte of their width
+
+enum class Representation
+{
+	POSTINGS,	// IndexSet, ExplicitSet or DenseSet
+	COMPRESSED,
+	BITMAP
+};
+
+struct Estimate
+{
+	Representation representation;
+	double size;
+	bool complement;
+};
+
+struct StepCost
+{
+	double cost;
+	Estimate result;
+	std::string operation;
+	std::string kernel;
+};
+
+static Representation representation_of(const MatchSet& set)
+{
+	if (std::holds_alternative<CompressedSet>(set.set))
+		return Representation::COMPRESSED;
+	if (std::holds_alternative<BitmapSet>(set.set))
+		return Representation::BITMAP;
+	return Representation::POSTINGS;
+}
+
+static const char* representation_name(const MatchSet& set)
+{
+	return representation_name(static_cast<int>(set.set.index()));
+}
+
+/**
+ * @return Cost of decoding the set if it is compressed, kernels other than the
+ *		   block skipping ones decode it first
+ */
+static double decode_cost(const Estimate& set)
+{
+	return set.representation == Representation::COMPRESSED ? set.size * DECODE_COST : 0;
+}
+
+/**
+ * @param small The smaller sorted set
+ * @param large The larger sorted set
+ * @return Cost and name of adaptive_intersect's choice for the two sizes
+ */
+static std::pair<double, const char*> sorted_cost(double small, double large)
+{
+	if (large >= small * GALLOP_RATIO)
+		return {small * std::log2(large / std::max(small, 1.0) + 1) * PROBE_COST, "gallop"};
+	return {(small + large) * MERGE_COST, "simd merge"};
+}
+
+/**
+ * @param compressed Size of a compressed set
+ * @param other Size of the set skipping through it
+ * @return Cost of the block skipping kernels, which decode at most one block per element of other
+ */
+static double block_skip_cost(double compressed, double other)
+{
+	const double decoded = std::min(compressed, other * POSTING_BLOCK_SIZE);
+	return decoded * DECODE_COST + (decoded + other) * MERGE_COST;
+}
+
+static StepCost intersect_cost(const Estimate& A, const Estimate& B, double n)
+{
+	const double size = std::min({A.size, B.size, A.size * B.size / n});
+	const bool a_bitmap = A.representation == Representation::BITMAP;
+	const bool b_bitmap = B.representation == Representation::BITMAP;
+
+	if (a_bitmap && b_bitmap)
+		return {n / 64 * WORD_COST, {Representation::BITMAP, size, false}, "and", "bitmap and"};
+	if (a_bitmap || b_bitmap)
+	{
+		const Estimate& sparse = a_bitmap ? B : A;
+		return {sparse.size * PROBE_COST + decode_cost(sparse), {Representation::POSTINGS, size, false}, "and", "bitmap probe"};
+	}
+	if (A.representation == Representation::COMPRESSED || B.representation == Representation::COMPRESSED)
+	{
+		const Estimate& compressed = A.representation == Representation::COMPRESSED ? A : B;
+		const Estimate& other = A.representation == Representation::COMPRESSED ? B : A;
+		return {block_skip_cost(compressed.size, other.size), {Representation::POSTINGS, size, false}, "and", "block skip"};
+	}
+	auto [cost, kernel] = sorted_cost(std::min(A.size, B.size), std::max(A.size, B.size));
+	return {cost, {Representation::POSTINGS, size, false}, "and", kernel};
+}
+
+// A diff B, B is the complemented side
+static StepCost difference_cost(const Estimate& A, const Estimate& B, double n)
+{
+	const double size = std::max(0.0, A.size * (1 - B.size / n));
+	const bool a_bitmap = A.representation == Representation::BITMAP;
+	const bool b_bitmap = B.representation == Representation::BITMAP;
+
+	if (a_bitmap && b_bitmap)
+		return {n / 64 * WORD_COST, {Representation::BITMAP, size, false}, "and not", "bitmap and not"};
+	if (a_bitmap)
+		return {n / 64 * WORD_COST + B.size * PROBE_COST + decode_cost(B), {Representation::BITMAP, size, false}, "and not", "bitmap clear"};
+	if (b_bitmap)
+		return {A.size * PROBE_COST + decode_cost(A), {Representation::POSTINGS, size, false}, "and not", "bitmap probe"};
+	if (B.representation == Representation::COMPRESSED)
+		return {decode_cost(A) + block_skip_cost(B.size, A.size), {Representation::POSTINGS, size, false}, "and not", "block skip"};
+
+	const char* kernel = "simd merge";
+	double cost = (A.size + B.size) * MERGE_COST;
+	if (B.size >= A.size * GALLOP_RATIO)
+	{
+		cost = A.size * std::log2(B.size / std::max(A.size, 1.0) + 1) * PROBE_COST;
+		kernel = "gallop";
+	}
+	else if (A.size >= B.size * GALLOP_RATIO)
+	{
+		cost = B.size * std::log2(A.size / std::max(B.size, 1.0) + 1) * PROBE_COST + A.size * MERGE_COST;
+		kernel = "gallop runs";
+	}
+	return {cost + decode_cost(A), {Representation::POSTINGS, size, false}, "and not", kernel};
+}
+
+// Both sides are complemented, the excluded positions are united
+static StepCost union_cost(const Estimate& A, const Estimate& B, double n)
+{
+	const double size = std::min(n, A.size + B.size - A.size * B.size / n);
+	if (A.representation == Representation::BITMAP || B.representation == Representation::BITMAP)
+	{
+		const double sparse = (A.representation == Representation::BITMAP ? 0 : A.size + decode_cost(A))
+			+ (B.representation == Representation::BITMAP ? 0 : B.size + decode_cost(B));
+		return {n / 64 * WORD_COST + sparse, {Representation::BITMAP, size, true}, "or", "bitmap or"};
+	}
+	return {A.size + B.size + decode_cost(A) + decode_cost(B), {Representation::POSTINGS, size, true}, "or", "merge union"};
+}
+
+/**
+ * @param acc Estimate of the result so far
+ * @param op Estimate of the next operand
+ * @param n Corpus size
+ * @return Cost of combining them, picked like intersection(MatchSet, MatchSet) would
+ */
+static StepCost step_cost(const Estimate& acc, const Estimate& op, double n)
+{
+	if (!acc.complement && !op.complement)
+		return intersect_cost(acc, op, n);
+	if (!acc.complement)
+		return difference_cost(acc, op, n);
+	if (!op.complement)
+		return difference_cost(op, acc, n);
+	return union_cost(acc, op, n);
+}
+
+/**
+ * @param acc Estimate of the result so far, not a complement
+ * @param op Estimate of the next operand, a literal
+ * @param n Corpus size
+ * @return Cost of verifying op's literal on every start of acc, see verify_set()
+ */
+static StepCost verify_cost(const Estimate& acc, const Estimate& op, double n)
+{
+	const double passing = op.complement ? 1 - op.size / n : op.size / n;
+	const double walk = acc.representation == Representation::BITMAP ? n / 64 * WORD_COST : decode_cost(acc);
+	return {acc.size * VERIFY_COST + walk, {Representation::POSTINGS, acc.size * passing, false}, op.complement ? "and not" : "and", "verify"};
+}
+
+static Estimate estimate(const PlanOperand& operand, bool use_bitmap)
+{
+	const MatchSet& set = use_bitmap ? *operand.bitmap : operand.set;
+	return {representation_of(set), static_cast<double>(find_set_size(set)), set.complement};
+}
+
+//-----------------------------  PLANNING  ----------------------------------------------------------
+
+/**
+ * @return The literal as written in a query, e.g. pos="ART", a disjunction in parentheses
+ */
+static std::string literal_text(const Corpus &corpus, const Literal &literal)
+{
+	if (literal.alternatives)
+	{
+		std::string text;
+		for (const Literal& alternative : *literal.alternatives)
+			text += (text.empty() ? "(" : " | ") + literal_text(corpus, alternative);
+		return text + ")";
+	}
+	if (literal.values)
+		return std::string(attribute_name(literal.attribute)) + (literal.is_equality ? "" : "!") + literal.values->text;
+	const Dictionary& dictionary = corpus.dictionary(literal.attribute);
+	const std::string value = literal.value < dictionary.size() ? dictionary.index2string[literal.value] : std::to_string(literal.value);
+	return std::string(attribute_name(literal.attribute)) + (literal.is_equality ? "=\"" : "!=\"") + value + "\"";
+}
+
+/**
+ * @return The literal as written in a query, with its shift, e.g. pos="ART" @0
+ */
+std::string literal_label(const Corpus &corpus, const Literal &literal, int shift)
+{
+	return literal_text(corpus, literal) + " @" + std::to_string(shift);
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param literal A literal
+ * @param shift Shift of the literal's clause
+ * @param labelled Label the operand for explain()
+ * @return The literal's postings, its bitmap if the value has one and its column test.
+ *		   A pattern's operand is the union of its values' postings, a disjunction's
+ *		   the union of its alternatives.
+ */
+PlanOperand literal_operand(const Corpus &corpus, const Literal &literal, int shift, bool labelled)
+{
+	PlanOperand operand;
+	if (labelled)
+		operand.label = literal_label(corpus, literal, shift);
+	operand.test = column_test(corpus, literal, shift);
+
+	const bool complement = !literal.is_equality;
+	if (literal.values)
+	{
+		operand.set = union_postings(corpus, literal.attribute, literal.values->values, shift);
+		operand.set.complement = complement;
+		return operand;
+	}
+	if (literal.alternatives)
+	{
+		std::vector<MatchSet> sets;
+		for (const Literal& alternative : *literal.alternatives)
+			sets.push_back(literal_operand(corpus, alternative, shift).set);
+		operand.set = unite_all(std::move(sets));
+		return operand;
+	}
+
+	const PostingsDirectory directory = postings_directory(corpus, literal.attribute);
+	if (directory.is_compressed())
+		operand.set = MatchSet{directory.compressed->lookup(literal.value, shift), complement};
+	else
+		operand.set = MatchSet{directory.lookup(literal.value, shift), complement};
+	PROFILE_LOOKUP(find_set_size(operand.set));
+
+	if (directory.bitmaps->contains(literal.value))
+		operand.bitmap = MatchSet{directory.bitmaps->lookup(literal.value, shift), complement};
+	return operand;
+}
+
+/**
+ *
+ * @param operands Sets to intersect, as match starts
+ * @param corpus_size Number of tokens, 0 if unknown, then the largest set is used
+ * @brief Tries every positive operand and representation as the start and
+ *		  completes each with the cheapest next step until all operands are used,
+ *		  positive ones before complemented ones. Keeps the cheapest plan.
+ * @return The plan
+ */
+QueryPlan plan_sets(std::vector<PlanOperand> operands, int corpus_size)
+{
+	PROFILE_STAGE(Stage::PLAN);
+	QueryPlan plan;
+	plan.corpus_size = corpus_size;
+
+	// An empty clause matches every token, it can only be the result on its own
+	std::vector<size_t> active;
+	for (size_t i = 0; i < operands.size(); ++i)
+	{
+		const MatchSet& set = operands[i].set;
+		if (std::holds_alternative<DenseSet>(set.set) && !set.complement)
+		{
+			DenseSet dense = std::get<DenseSet>(set.set);
+			if (plan.dense)
+				dense = {std::max(dense.first, plan.dense->first), std::min(dense.last, plan.dense->last)};
+			plan.dense = dense;
+		}
+		else
+			active.push_back(i);
+	}
+	plan.operands = std::move(operands);
+	if (active.empty())
+		return plan;
+
+	double n = std::max(corpus_size, 1);
+	for (size_t i : active)
+		n = std::max(n, static_cast<double>(find_set_size(plan.operands[i].set)));
+
+	auto is_positive = [&](size_t i) { return !plan.operands[i].set.complement; };
+	const bool any_positive = std::any_of(active.begin(), active.end(), is_positive);
+
+	auto complete = [&](size_t start, bool start_bitmap, std::vector<PlanStep>& steps) {
+		Estimate acc = estimate(plan.operands[start], start_bitmap);
+		steps = {{start, start_bitmap, "start", representation_name(start_bitmap ? *plan.operands[start].bitmap : plan.operands[start].set), acc.size, 0}};
+		double total = 0;
+
+		std::vector<size_t> remaining;
+		for (size_t i : active)
+			if (i != start) remaining.push_back(i);
+
+		while (!remaining.empty())
+		{
+			const bool positive_left = std::any_of(remaining.begin(), remaining.end(), is_positive);
+			size_t best = 0;
+			bool best_bitmap = false;
+			bool best_verify = false;
+			std::optional<StepCost> best_cost;
+			auto consider = [&](size_t k, bool use_bitmap, bool verify, StepCost cost) {
+				if (!best_cost || cost.cost < best_cost->cost)
+				{
+					best = k;
+					best_bitmap = use_bitmap;
+					best_verify = verify;
+					best_cost = std::move(cost);
+				}
+			};
+			for (size_t k = 0; k < remaining.size(); ++k)
+			{
+				const PlanOperand& operand = plan.operands[remaining[k]];
+				if (positive_left && operand.set.complement)
+					continue; // Complements are applied last
+				for (bool use_bitmap : {false, true})
+				{
+					if (use_bitmap && !operand.bitmap)
+						continue;
+					consider(k, use_bitmap, false, step_cost(acc, estimate(operand, use_bitmap), n));
+				}
+				if (operand.test && !acc.complement)
+					consider(k, false, true, verify_cost(acc, estimate(operand, false), n));
+			}
+			steps.push_back({remaining[best], best_bitmap, best_cost->operation, best_cost->kernel, best_cost->result.size, best_cost->cost, best_verify});
+			total += best_cost->cost;
+			acc = best_cost->result;
+			remaining.erase(remaining.begin() + best);
+		}
+		// Enumerating a bitmap result reads every word
+		if (acc.representation == Representation::BITMAP)
+			total += n / 64 * WORD_COST;
+		return total;
+	};
+
+	double best_total = std::numeric_limits<double>::infinity();
+	std::vector<PlanStep> steps;
+	for (size_t start : active)
+	{
+		if (any_positive && !is_positive(start))
+			continue;
+		for (bool use_bitmap : {false, true})
+		{
+			if (use_bitmap && !plan.operands[start].bitmap)
+				continue;
+			const double total = complete(start, use_bitmap, steps);
+			if (total < best_total)
+			{
+				best_total = total;
+				plan.steps = steps;
+			}
+		}
+	}
+	plan.cost = best_total;
+	return plan;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param query A query
+ * @param covered Output, covered[j][i] is set if literal i of clause j is answered
+ *				  by one of the returned operands
+ * @param labelled Label the operands for explain()
+ * @brief For each pair of neighbouring clauses, looks for equality literals whose
+ *		  attributes have a binary index and picks the smallest such pair. The pair
+ *		  lookup is the intersection of both literals, so they need no unary sets.
+ * @return The binary index operands
+ */
+static std::vector<PlanOperand> binary_index_operands(const Corpus &corpus, const Query &query, std::vector<std::vector<bool>> &covered, bool labelled)
+{
+	std::vector<PlanOperand> operands;
+	if (corpus.binary_indexes.empty())
+		return operands;
+
+	for (size_t j = 0; j + 1 < query.size(); ++j)
+	{
+		std::optional<IndexSet> best;
+		size_t best_first = 0, best_second = 0;
+		for (size_t a = 0; a < query[j].size(); ++a)
+		{
+			for (size_t b = 0; b < query[j + 1].size(); ++b)
+			{
+				const Literal& first = query[j][a];
+				const Literal& second = query[j + 1][b];
+				if (!first.is_equality || !second.is_equality || first.values || second.values || first.alternatives || second.alternatives)
+					continue;
+
+				const BinaryIndex* index = find_binary_index(corpus, first.attribute, second.attribute);
+				if (!index)
+					continue;
+
+				IndexSet set = index->lookup(first.value, second.value, static_cast<int>(j));
+				if (!best || set.elems.size() < best->elems.size())
+				{
+					best = set;
+					best_first = a;
+					best_second = b;
+				}
+			}
+		}
+		if (best)
+		{
+			std::string label;
+			if (labelled)
+			{
+				label = literal_label(corpus, query[j][best_first], static_cast<int>(j)) + " "
+					+ literal_label(corpus, query[j + 1][best_second], static_cast<int>(j + 1)) + " (binary index)";
+			}
+			operands.push_back({std::move(label), MatchSet{*best, false}, std::nullopt, {}, std::nullopt});
+			covered[j][best_first] = true;
+			covered[j + 1][best_second] = true;
+		}
+	}
+	return operands;
+}
+
+/**
+ * @return The literal by string index, e.g. pos=3, a disjunction in parentheses
+ */
+static std::string literal_key(const Literal &literal)
+{
+	if (literal.alternatives)
+	{
+		std::string key;
+		for (const Literal& alternative : *literal.alternatives)
+			key += (key.empty() ? "(" : "|") + literal_key(alternative);
+		return key + ")";
+	}
+	if (literal.values)
+		return std::string(attribute_name(literal.attribute)) + (literal.is_equality ? "" : "!") + literal.values->text;
+	return std::string(attribute_name(literal.attribute)) + (literal.is_equality ? "=" : "!=") + std::to_string(literal.value);
+}
+
+/**
+ *
+ * @param clause A clause
+ * @brief Literals are written by string index and sorted, duplicates dropped,
+ *		  so clauses with the same literals in any order share a key. The key
+ *		  does not depend on the clause's offset.
+ * @return The normalized clause
+ */
+std::string clause_key(const Clause &clause)
+{
+	std::vector<std::string> literals;
+	for (const Literal& literal : clause)
+		literals.push_back(literal_key(literal));
+	std::sort(literals.begin(), literals.end());
+	literals.erase(std::unique(literals.begin(), literals.end()), literals.end());
+
+	std::string key = "[";
+	for (size_t i = 0; i < literals.size(); ++i)
+		key += (i ? " " : "") + literals[i];
+	return key + "]";
+}
+
+/**
+ *
+ * @param query A query
+ * @return The clause_key() of every clause in order, identical for queries
+ *		   that only differ in the order of literals within clauses
+ */
+std::string query_key(const Query &query)
+{
+	std::string key;
+	for (const Clause& clause : query)
+		key += clause_key(clause);
+	return key;
+}
+
+/**
+ *
+ * @param set A MatchSet at shift 0
+ * @brief An ExplicitSet is moved into storage and viewed as an IndexSet, so
+ *		  the result can be shifted to any offset with shift_set()
+ * @return The set and the storage it views
+ */
+ClauseResult make_shiftable(MatchSet set)
+{
+	ClauseResult result{std::move(set), {}};
+	if (auto* elems = std::get_if<ExplicitSet>(&result.set.set))
+	{
+		result.storage.emplace_back(std::move(elems->elems));
+		result.set.set = IndexSet{result.storage.back().span(), 0};
+	}
+	return result;
+}
+
+/**
+ *
+ * @param plan A plan
+ * @brief Runs the plan and keeps its result shiftable. A result that is not
+ *		  computed can be an operand's set, so it holds on to the storage of
+ *		  every operand, which can then be released.
+ * @return The plan's result at the plan's shifts
+ */
+ClauseResult plan_result(const QueryPlan &plan)
+{
+	ClauseResult result = make_shiftable(execute_plan(plan));
+	if (result.storage.empty() && !plan.scan)
+	{
+		for (const PlanOperand& operand : plan.operands)
+			result.storage.insert(result.storage.end(), operand.storage.begin(), operand.storage.end());
+	}
+	return result;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param clause A clause
+ * @return The clause's matches at shift 0, see make_shiftable()
+ */
+ClauseResult clause_result(const Corpus &corpus, const Clause &clause)
+{
+	return make_shiftable(match_set(corpus, clause, 0));
+}
+
+/**
+ *
+ * @param result Match starts of a whole query
+ * @param corpus_size Number of tokens
+ * @return A plan of one step, the result itself
+ */
+QueryPlan result_plan(const ClauseResult &result, int corpus_size)
+{
+	std::vector<PlanOperand> operands;
+	operands.push_back({"cached result", result.set, std::nullopt, result.storage, std::nullopt});
+	return plan_sets(std::move(operands), corpus_size);
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param query A query
+ * @param clauses Optional, results of clauses computed beforehand, by clause_key()
+ * @param labelled Label the operands and scan tests, which only explain() reads,
+ *				   so running a query does not build their strings
+ * @brief Literals answered by a binary index are replaced by the pair lookup,
+ *		  every other literal of every clause is its own operand. A clause found
+ *		  in clauses is a single operand instead, its result shifted to the
+ *		  clause's offset. A column scan replaces the steps if it is estimated
+ *		  cheaper, or always or never, see set_scan_mode().
+ * @return The plan
+ */
+QueryPlan plan_query(const Corpus &corpus, const Query &query, const ClauseResults *clauses, bool labelled)
+{
+	PROFILE_STAGE(Stage::PLAN);
+	std::vector<std::vector<bool>> covered;
+	for (const auto &clause : query)
+		covered.emplace_back(clause.size(), false);
+
+	std::vector<PlanOperand> operands = binary_index_operands(corpus, query, covered, labelled);
+	const int corpus_size = static_cast<int>(corpus.token_count());
+	for (size_t j = 0; j < query.size(); ++j)
+	{
+		if (query[j].empty())
+		{
+			operands.push_back({labelled ? "[] @" + std::to_string(j) : std::string(), MatchSet{DenseSet{0, corpus_size - 1}, false}, std::nullopt, {}, std::nullopt});
+			continue;
+		}
+
+		const std::string key = clauses ? clause_key(query[j]) : std::string();
+		const auto found = clauses ? clauses->find(key) : ClauseResults::const_iterator();
+		if (clauses && found != clauses->end())
+		{
+			const ClauseResult& result = found->second;
+			std::string label = labelled ? key + " @" + std::to_string(j) + " (shared)" : std::string();
+			operands.push_back({std::move(label), shift_set(result.set, static_cast<int>(j)), std::nullopt, result.storage, std::nullopt});
+			continue;
+		}
+		for (size_t i = 0; i < query[j].size(); ++i)
+		{
+			if (!covered[j][i])
+				operands.push_back(literal_operand(corpus, query[j][i], static_cast<int>(j), labelled));
+		}
+	}
+	QueryPlan plan = plan_sets(std::move(operands), corpus_size);
+	plan.index_cost = plan.cost;
+
+	const ScanMode mode = scan_mode();
+	if (mode == ScanMode::NEVER || plan.steps.empty())
+		return plan;
+	ColumnScan scan = compile_scan(corpus, query, labelled);
+	const double cost = scan_cost(scan);
+	if (mode == ScanMode::ALWAYS || cost < plan.cost)
+	{
+		plan.scan = std::move(scan);
+		plan.cost = cost;
+	}
+	return plan;
+}
+
+/**
+ *
+ * @param scan A compiled scan
+ * @brief Every block runs the first test, and the next one only if some start
+ *		  is left, which by the selectivities so far, taken as independent, has
+ *		  probability 1 - (1 - s)^64. A test compares 64 values of its width.
+ *		  The result is a bitmap, written and enumerated a word at a time.
+ * @return Estimated cost of the scan, in the units of the index plans
+ */
+double scan_cost(const ColumnScan &scan)
+{
+	const double blocks = std::max(scan.corpus_size, 1) / 64.0;
+	double reached = 1;		// Fraction of the blocks running the next test
+	double passing = 1;		// Fraction of the starts passing every test so far
+	double cost = blocks * WORD_COST;
+	for (const ColumnScan::Test& test : scan.tests)
+	{
+		cost += blocks * reached * test.literal.width * SCAN_COST;
+		passing *= test.selectivity;
+		reached = 1 - std::pow(1 - passing, 64);
+	}
+	return cost;
+}
+
+//-----------------------------  EXECUTION  ----------------------------------------------------------
+
+/**
+ *
+ * @param plan A plan from plan_sets() or plan_query()
+ * @brief Runs the steps in order, each with the representation the plan chose
+ * @return The match starts, a complement if every operand was complemented
+ */
+MatchSet execute_plan(const QueryPlan &plan)
+{
+	return execute_plan(plan, 0, plan.corpus_size);
+}
+
+/**
+ *
+ * @param plan A plan from plan_sets() or plan_query()
+ * @param begin First match start of the window
+ * @param end Match start past the last one of the window
+ * @brief Runs the plan with every operand restricted to the match starts in
+ *		  [begin, end), see restrict_set(). The whole corpus runs the operands
+ *		  as they are. A scan only scans the blocks of the window, and a verify
+ *		  step only reads the starts left in it.
+ * @return The match starts, only those in the window are exact
+ */
+MatchSet execute_plan(const QueryPlan &plan, int begin, int end)
+{
+	PROFILE_STAGE(Stage::EXECUTE);
+	if (plan.scan)
+		return PROFILE_STEP(SetOperation::SCAN, nullptr, nullptr, scan_columns(*plan.scan, begin, end));
+
+	const bool whole = begin <= 0 && end >= plan.corpus_size;
+	if (plan.steps.empty())
+	{
+		if (!plan.dense)
+			return {};
+		return whole ? MatchSet{*plan.dense, false} : restrict_set(MatchSet{*plan.dense, false}, begin, end);
+	}
+
+	auto chosen = [&](const PlanStep& step) -> const MatchSet& {
+		const PlanOperand& operand = plan.operands[step.operand];
+		return step.use_bitmap ? *operand.bitmap : operand.set;
+	};
+
+	MatchSet result = whole ? chosen(plan.steps[0]) : restrict_set(chosen(plan.steps[0]), begin, end);
+	for (size_t i = 1; i < plan.steps.size(); ++i)
+	{
+		if (plan.steps[i].verify)
+			result = PROFILE_STEP(SetOperation::VERIFY, &result, nullptr, verify_set(result, *plan.operands[plan.steps[i].operand].test, plan.corpus_size));
+		else if (whole)
+			result = intersection(result, chosen(plan.steps[i]));
+		else
+			result = intersection(result, restrict_set(chosen(plan.steps[i]), begin, end));
+	}
+	return result;
+}
+
+/**
+ *
+ * @param plan A plan
+ * @return Estimated number of match starts of the plan's result
+ */
+double estimated_matches(const QueryPlan &plan)
+{
+	if (plan.steps.empty())
+		return plan.dense ? plan.dense->last - plan.dense->first + 1 : 0;
+
+	bool complement = true;
+	for (const PlanStep& step : plan.steps)
+		complement = complement && plan.operands[step.operand].set.complement;
+	const double size = plan.steps.back().estimated_size;
+	return complement ? plan.corpus_size - size : size;
+}
+
+/**
+ *
+ * @param plan A plan, from plan_query() with labelled set
+ * @return One line per step: operation, operand, kernel, estimated result size and cost
+ */
+std::string explain(const QueryPlan &plan)
+{
+	std::ostringstream out;
+	out << "Plan over " << plan.corpus_size << " tokens, estimated cost " << std::llround(plan.steps.empty() ? 0 : plan.cost) << "\n";
+	if (plan.steps.empty())
+	{
+		if (plan.dense)
+			out << "  dense [" << plan.dense->first << ", " << plan.dense->last << "], only empty clauses\n";
+		else
+			out << "  empty query\n";
+		return out.str();
+	}
+	if (plan.scan)
+	{
+		out << "  column scan, most selective literal first\n";
+		for (const ColumnScan::Test& test : plan.scan->tests)
+		{
+			out << "  " << std::left << std::setw(40) << test.label << std::setw(8) << (std::to_string(test.literal.width) + "B")
+				<< "~" << std::setw(10) << std::llround(test.selectivity * plan.corpus_size) << "tokens\n";
+		}
+		out << "  instead of the index plan, estimated cost " << std::llround(plan.index_cost) << "\n";
+		return out.str();
+	}
+
+	bool complement = true;
+	for (size_t i = 0; i < plan.steps.size(); ++i)
+	{
+		const PlanStep& step = plan.steps[i];
+		const PlanOperand& operand = plan.operands[step.operand];
+		complement = complement && operand.set.complement;
+		out << "  " << std::right << std::setw(2) << i + 1 << ". " << std::left
+			<< std::setw(8) << step.operation << std::setw(40) << operand.label
+			<< std::setw(16) << step.kernel << "~" << std::setw(10) << std::llround(step.estimated_size)
+			<< "cost " << std::llround(step.cost) << "\n";
+	}
+	if (plan.dense)
+		out << "  empty clauses match every token and are skipped\n";
+	if (complement)
+		out << "  result is a complement of the positions above, streamed at output\n";
+	return out.str();
+}
@@ -0,0 +1,99 @@
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "corpus.h"
+#include "scan.h"
+
+#ifndef PLANNER_H
+#define PLANNER_H
+/*********************************************************
+ * @brief
+ *			Cost based query planner.
+ * @details
+ *			A query is flattened into one operand per literal, over all
+ *			clauses, plus the binary index lookups. Every operand knows
+ *			its posting size, and frequent values also have a bitmap.
+ *			The planner estimates the cost of each kernel from those
+ *			sizes, assuming the literals are independent, and greedily
+ *			picks the cheapest next operand and representation:
+ *				- positive operands first, the first one from each
+ *				  possible start, keeping the cheapest plan
+ *				- complemented operands last, as differences, or as a
+ *				  union if nothing is positive (not A and not B is
+ *				  not (A or B))
+ *				- empty clauses only when nothing else constrains, since
+ *				  they match every token
+ *			A literal can also be applied by verifying the starts so far,
+ *			reading its token for each, which costs the same whatever the
+ *			literal's size: a rare clause followed by a common one reads
+ *			a few tokens instead of intersecting a long postings list.
+ *			Clause results computed beforehand, shared by a batch of
+ *			queries, replace the literals of their clause.
+ *			The plan is then compared with a scan of the columns, see
+ *			scan.h, which replaces the steps if it is cheaper.
+ *			explain() prints the chosen plan.
+ */
+//*********************************************************
+
+// ----------------- STRUCTS -----------------
+struct PlanOperand
+{
+	std::string label;	// Only for explain(), empty unless the plan was labelled
+	MatchSet set;
+	std::optional<MatchSet> bitmap;	// The same set as a BitmapSet, if the value has one
+	std::vector<SharedArray<int>> storage;	// Owns the elements set views, if it is a computed result
+	std::optional<ColumnTest> test;			// The literal on its column, if the operand is one literal
+};
+
+struct PlanStep
+{
+	size_t operand;
+	bool use_bitmap;
+	std::string operation;	// start, and, and not, or
+	std::string kernel;
+	double estimated_size;	// Of the result so far, excluded positions if it is a complement
+	double cost;
+	bool verify = false;	// Tests the operand's literal on every start so far instead of a set operation
+};
+
+/**
+ * @brief Matches of one clause at shift 0, see clause_result()
+ */
+struct ClauseResult
+{
+	MatchSet set;							// Never an ExplicitSet, so it can be shifted
+	std::vector<SharedArray<int>> storage;	// Owns the elements set may view, if any
+};
+
+using ClauseResults = std::unordered_map<std::string, ClauseResult>;
+
+struct QueryPlan
+{
+	std::vector<PlanOperand> operands;
+	std::vector<PlanStep> steps;
+	std::optional<DenseSet> dense;	// Empty clauses, the result if there are no steps
+	std::optional<ColumnScan> scan;	// Runs instead of the steps if set, they remain for the estimates
+	double index_cost = 0;			// Of the steps, cost is the scan's if it was chosen
+	int corpus_size = 0;
+	double cost = 0;
+};
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+std::string literal_label(const Corpus &corpus, const Literal &literal, int shift);
+PlanOperand literal_operand(const Corpus &corpus, const Literal &literal, int shift, bool labelled = false);
+QueryPlan plan_sets(std::vector<PlanOperand> operands, int corpus_size);
+std::string clause_key(const Clause &clause);
+std::string query_key(const Query &query);
+ClauseResult make_shiftable(MatchSet set);
+ClauseResult plan_result(const QueryPlan &plan);
+ClauseResult clause_result(const Corpus &corpus, const Clause &clause);
+QueryPlan result_plan(const ClauseResult &result, int corpus_size);
+QueryPlan plan_query(const Corpus &corpus, const Query &query, const ClauseResults *clauses = nullptr, bool labelled = false);
+double scan_cost(const ColumnScan &scan);
+MatchSet execute_plan(const QueryPlan &plan);
+MatchSet execute_plan(const QueryPlan &plan, int begin, int end);
+double estimated_matches(const QueryPlan &plan);
+std::string explain(const QueryPlan &plan);
+
+#endif //PLANNER_H
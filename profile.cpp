@@ -0,0 +1,440 @@
+#include "profile.h"
+
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+
+//-----------------------------  COUNTERS  ----------------------------------------------------------
+
+static thread_local QueryProfile* current_profile = nullptr;
+
+#ifdef QUERY_PROFILING
+static thread_local bool stage_running = false;
+
+/**
+ * @brief The counters of one thread. Only the thread writes them, so a hook
+ *		  adds with a plain load and store instead of a locked add on a line
+ *		  every thread writes; profile_counters() reads them relaxed.
+ */
+struct ThreadCounters
+{
+	std::array<std::atomic<uint64_t>, STAGE_COUNT> stage_calls{};
+	std::array<std::atomic<uint64_t>, STAGE_COUNT> stage_ns{};
+	std::array<std::atomic<uint64_t>, OPERATION_COUNT> steps{};
+	std::array<std::array<std::array<std::atomic<uint64_t>, REPRESENTATION_COUNT>, REPRESENTATION_COUNT>, SET_OPERATION_COUNT> overloads{};
+	std::array<std::atomic<uint64_t>, KERNEL_COUNT> kernels{};
+	std::atomic<uint64_t> lookups{0};
+	std::atomic<uint64_t> looked_up{0};
+	std::atomic<uint64_t> allocations{0};
+	std::atomic<uint64_t> bytes_allocated{0};
+	ThreadCounters* previous = nullptr;
+	ThreadCounters* next = nullptr;
+
+	ThreadCounters();
+	~ThreadCounters();
+	void add_to(ProfileCounters &counters) const;
+};
+
+// The counters of the running threads, and the totals of the finished ones
+static std::mutex counters_mutex;
+static ThreadCounters* live_counters = nullptr;
+static ProfileCounters retired_counters{};
+
+static thread_local ThreadCounters thread_counters;
+
+ThreadCounters::ThreadCounters()
+{
+	const std::lock_guard<std::mutex> lock(counters_mutex);
+	next = live_counters;
+	if (next)
+		next->previous = this;
+	live_counters = this;
+}
+
+ThreadCounters::~ThreadCounters()
+{
+	const std::lock_guard<std::mutex> lock(counters_mutex);
+	add_to(retired_counters);
+	if (previous)
+		previous->next = next;
+	else
+		live_counters = next;
+	if (next)
+		next->previous = previous;
+}
+
+/**
+ *
+ * @param counters Totals to add to
+ * @brief Adds the thread's counters to the totals
+ */
+void ThreadCounters::add_to(ProfileCounters &counters) const
+{
+	for (size_t s = 0; s < STAGE_COUNT; ++s)
+	{
+		counters.stage_calls[s] += stage_calls[s].load(std::memory_order_relaxed);
+		counters.stage_ns[s] += stage_ns[s].load(std::memory_order_relaxed);
+	}
+	for (size_t o = 0; o < OPERATION_COUNT; ++o)
+		counters.steps[o] += steps[o].load(std::memory_order_relaxed);
+	for (size_t o = 0; o < SET_OPERATION_COUNT; ++o)
+		for (size_t a = 0; a < REPRESENTATION_COUNT; ++a)
+			for (size_t b = 0; b < REPRESENTATION_COUNT; ++b)
+				counters.overloads[o][a][b] += overloads[o][a][b].load(std::memory_order_relaxed);
+	for (size_t k = 0; k < KERNEL_COUNT; ++k)
+		counters.kernels[k] += kernels[k].load(std::memory_order_relaxed);
+	counters.lookups += lookups.load(std::memory_order_relaxed);
+	counters.looked_up += looked_up.load(std::memory_order_relaxed);
+	counters.allocations += allocations.load(std::memory_order_relaxed);
+	counters.bytes_allocated += bytes_allocated.load(std::memory_order_relaxed);
+}
+
+/**
+ * @brief Adds to a counter of the calling thread, which is its only writer
+ */
+static void add(std::atomic<uint64_t> &counter, uint64_t n)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+#endif
+
+ProfileScope::ProfileScope(QueryProfile *profile) : previous(current_profile)
+{
+	current_profile = profile;
+}
+
+ProfileScope::~ProfileScope()
+{
+	current_profile = previous;
+}
+
+/**
+ * @return The profile the hooks of the thread record into, nullptr if none
+ */
+QueryProfile* active_profile()
+{
+	return current_profile;
+}
+
+/**
+ *
+ * @param other A profile of work done for the same query, on another thread
+ * @brief Adds the stage times and counts of other, and appends its steps
+ */
+void QueryProfile::merge(const QueryProfile &other)
+{
+	for (size_t s = 0; s < STAGE_COUNT; ++s)
+		stage_ms[s] += other.stage_ms[s];
+	steps.insert(steps.end(), other.steps.begin(), other.steps.end());
+	lookups += other.lookups;
+	looked_up += other.looked_up;
+	allocations += other.allocations;
+	bytes_allocated += other.bytes_allocated;
+}
+
+/**
+ * @return The counters so far, all zero if QUERY_PROFILING is not defined
+ */
+ProfileCounters profile_counters()
+{
+	ProfileCounters counters{};
+#ifdef QUERY_PROFILING
+	const std::lock_guard<std::mutex> lock(counters_mutex);
+	counters = retired_counters;
+	for (const ThreadCounters* thread = live_counters; thread; thread = thread->next)
+		thread->add_to(counters);
+#endif
+	return counters;
+}
+
+//-----------------------------  HOOKS  ----------------------------------------------------------
+
+#ifdef QUERY_PROFILING
+void profile_kernel(Kernel kernel)
+{
+	add(thread_counters.kernels[static_cast<size_t>(kernel)], 1);
+	if (current_profile)
+		current_profile->kernels |= uint32_t{1} << static_cast<unsigned>(kernel);
+}
+
+void profile_lookup(size_t positions)
+{
+	add(thread_counters.lookups, 1);
+	add(thread_counters.looked_up, positions);
+	if (current_profile)
+	{
+		current_profile->lookups++;
+		current_profile->looked_up += positions;
+	}
+}
+
+void profile_allocation(size_t bytes)
+{
+	add(thread_counters.allocations, 1);
+	add(thread_counters.bytes_allocated, bytes);
+	if (current_profile)
+	{
+		current_profile->allocations++;
+		current_profile->bytes_allocated += bytes;
+	}
+}
+
+void count_step(SetOperation operation, const MatchSet *A, const MatchSet *B)
+{
+	const size_t o = static_cast<size_t>(operation);
+	add(thread_counters.steps[o], 1);
+	if (o < SET_OPERATION_COUNT && A && B)
+		add(thread_counters.overloads[o][A->set.index()][B->set.index()], 1);
+}
+
+void record_step(QueryProfile &profile, SetOperation operation, const MatchSet *A, const MatchSet *B, const MatchSet &result, std::chrono::steady_clock::duration elapsed)
+{
+	ProfileStep step{};
+	step.operation = operation;
+	step.left_representation = A ? static_cast<int>(A->set.index()) : -1;
+	step.right_representation = B ? static_cast<int>(B->set.index()) : -1;
+	step.left_size = A ? static_cast<size_t>(std::max(find_set_size(*A), 0)) : 0;
+	step.right_size = B ? static_cast<size_t>(std::max(find_set_size(*B), 0)) : 0;
+	step.result_size = static_cast<size_t>(std::max(find_set_size(result), 0));
+	step.kernels = profile.kernels;
+	step.ms = std::chrono::duration<double, std::milli>(elapsed).count();
+	profile.steps.push_back(step);
+}
+
+StageTimer::StageTimer(Stage stage) : stage(stage), outermost(!stage_running)
+{
+	if (!outermost)
+		return;
+	stage_running = true;
+	started = std::chrono::steady_clock::now();
+}
+
+StageTimer::~StageTimer()
+{
+	if (!outermost)
+		return;
+	stage_running = false;
+	const std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - started;
+	const size_t s = static_cast<size_t>(stage);
+	add(thread_counters.stage_calls[s], 1);
+	add(thread_counters.stage_ns[s], std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+	if (current_profile)
+		current_profile->stage_ms[s] += std::chrono::duration<double, std::milli>(elapsed).count();
+}
+#endif
+
+//-----------------------------  NAMES  ----------------------------------------------------------
+
+const char* stage_name(Stage stage)
+{
+	switch (stage)
+	{
+		case Stage::PARSE: return "parse";
+		case Stage::PLAN: return "plan";
+		case Stage::EXECUTE: return "execute";
+		case Stage::RESOLVE: return "resolve";
+	}
+	return "unknown";
+}
+
+const char* operation_name(SetOperation operation)
+{
+	switch (operation)
+	{
+		case SetOperation::AND: return "and";
+		case SetOperation::AND_NOT: return "and not";
+		case SetOperation::OR: return "or";
+		case SetOperation::VERIFY: return "verify";
+		case SetOperation::SCAN: return "scan";
+	}
+	return "unknown";
+}
+
+const char* kernel_name(Kernel kernel)
+{
+	switch (kernel)
+	{
+		case Kernel::MERGE: return "merge";
+		case Kernel::GALLOP: return "gallop";
+		case Kernel::GALLOP_RUNS: return "gallop runs";
+		case Kernel::UNION_MERGE: return "union merge";
+		case Kernel::DENSE_RANGE: return "dense range";
+		case Kernel::BITMAP_WORDS: return "bitmap words";
+		case Kernel::BITMAP_PROBE: return "bitmap probe";
+		case Kernel::BITMAP_UPDATE: return "bitmap update";
+		case Kernel::BLOCK_SKIP: return "block skip";
+		case Kernel::DECODE: return "decode";
+	}
+	return "unknown";
+}
+
+/**
+ * @param representation Index of an alternative of MatchSet::set, -1 for none
+ * @return Its name
+ */
+const char* representation_name(int representation)
+{
+	switch (representation)
+	{
+		case 0: return "dense";
+		case 1: return "postings";
+		case 2: return "explicit";
+		case 3: return "compressed";
+		case 4: return "bitmap";
+	}
+	return "-";
+}
+
+//-----------------------------  REPORTS  ----------------------------------------------------------
+
+/**
+ * @return The names of the kernels set in the mask, joined by +
+ */
+static std::string kernel_list(uint32_t kernels)
+{
+	std::string names;
+	for (size_t k = 0; k < KERNEL_COUNT; ++k)
+	{
+		if (kernels >> k & 1)
+			names += (names.empty() ? "" : "+") + std::string(kernel_name(static_cast<Kernel>(k)));
+	}
+	return names.empty() ? "-" : names;
+}
+
+/**
+ * @return The step's operands, e.g. postings & bitmap
+ */
+static std::string operands(const ProfileStep &step)
+{
+	if (step.left_representation < 0)
+		return "columns";
+	if (step.right_representation < 0)
+		return representation_name(step.left_representation);
+	return std::string(representation_name(step.left_representation)) + " & " + representation_name(step.right_representation);
+}
+
+/**
+ *
+ * @param profile A profile
+ * @return The stage times, the lookups and allocations, and one line per step:
+ *		   operation, operands, their sizes and the result's, kernels and time
+ */
+std::string format_profile(const QueryProfile &profile)
+{
+	std::ostringstream out;
+	if (!profiling_compiled())
+		return "Profiling is not compiled in, see QUERY_PROFILING\n";
+
+	out << "Profile:";
+	for (size_t s = 0; s < STAGE_COUNT; ++s)
+		out << (s ? ", " : " ") << stage_name(static_cast<Stage>(s)) << " " << profile.stage_ms[s] << " ms";
+	out << "\n  " << profile.lookups << " lookups of " << profile.looked_up << " positions, "
+		<< profile.allocations << " scratch allocations of " << profile.bytes_allocated << " bytes\n";
+	for (size_t i = 0; i < profile.steps.size(); ++i)
+	{
+		const ProfileStep& step = profile.steps[i];
+		std::string sizes = step.left_representation >= 0 ? std::to_string(step.left_size) : "";
+		if (step.right_representation >= 0)
+			sizes += " x " + std::to_string(step.right_size);
+		out << "  " << std::right << std::setw(3) << i + 1 << ". " << std::left << std::setw(8) << operation_name(step.operation)
+			<< std::setw(26) << operands(step) << std::setw(22) << sizes << "-> " << std::setw(10) << step.result_size
+			<< std::setw(24) << kernel_list(step.kernels) << step.ms << " ms\n";
+	}
+	return out.str();
+}
+
+/**
+ * @param profile A profile
+ * @return The profile as a JSON object
+ */
+std::string profile_json(const QueryProfile &profile)
+{
+	std::ostringstream out;
+	out << "{\"stages_ms\":{";
+	for (size_t s = 0; s < STAGE_COUNT; ++s)
+		out << (s ? "," : "") << "\"" << stage_name(static_cast<Stage>(s)) << "\":" << profile.stage_ms[s];
+	out << "},\"lookups\":" << profile.lookups << ",\"looked_up\":" << profile.looked_up
+		<< ",\"allocations\":" << profile.allocations << ",\"bytes_allocated\":" << profile.bytes_allocated << ",\"steps\":[";
+	for (size_t i = 0; i < profile.steps.size(); ++i)
+	{
+		const ProfileStep& step = profile.steps[i];
+		out << (i ? "," : "") << "{\"operation\":\"" << operation_name(step.operation) << "\",\"left\":\"" << representation_name(step.left_representation)
+			<< "\",\"right\":\"" << representation_name(step.right_representation) << "\",\"left_size\":" << step.left_size
+			<< ",\"right_size\":" << step.right_size << ",\"result_size\":" << step.result_size
+			<< ",\"kernels\":\"" << kernel_list(step.kernels) << "\",\"ms\":" << step.ms << "}";
+	}
+	out << "]}";
+	return out.str();
+}
+
+/**
+ *
+ * @param counters Counters from profile_counters()
+ * @brief One counter per line in the Prometheus text format, with the stage,
+ *		  operation, overload or kernel as a label. Overloads that never ran
+ *		  are left out.
+ * @return The counters as text
+ */
+std::string format_counters(const ProfileCounters &counters)
+{
+	std::ostringstream out;
+	for (size_t s = 0; s < STAGE_COUNT; ++s)
+	{
+		const char* name = stage_name(static_cast<Stage>(s));
+		out << "corpus_stage_calls_total{stage=\"" << name << "\"} " << counters.stage_calls[s] << "\n"
+			<< "corpus_stage_seconds_total{stage=\"" << name << "\"} " << static_cast<double>(counters.stage_ns[s]) / 1e9 << "\n";
+	}
+	for (size_t o = 0; o < OPERATION_COUNT; ++o)
+		out << "corpus_steps_total{operation=\"" << operation_name(static_cast<SetOperation>(o)) << "\"} " << counters.steps[o] << "\n";
+	for (size_t o = 0; o < SET_OPERATION_COUNT; ++o)
+		for (size_t a = 0; a < REPRESENTATION_COUNT; ++a)
+			for (size_t b = 0; b < REPRESENTATION_COUNT; ++b)
+			{
+				if (counters.overloads[o][a][b] == 0)
+					continue;
+				out << "corpus_overload_calls_total{operation=\"" << operation_name(static_cast<SetOperation>(o)) << "\",left=\""
+					<< representation_name(static_cast<int>(a)) << "\",right=\"" << representation_name(static_cast<int>(b)) << "\"} "
+					<< counters.overloads[o][a][b] << "\n";
+			}
+	for (size_t k = 0; k < KERNEL_COUNT; ++k)
+		out << "corpus_kernel_calls_total{kernel=\"" << kernel_name(static_cast<Kernel>(k)) << "\"} " << counters.kernels[k] << "\n";
+	out << "corpus_lookups_total " << counters.lookups << "\n"
+		<< "corpus_looked_up_positions_total " << counters.looked_up << "\n"
+		<< "corpus_scratch_allocations_total " << counters.allocations << "\n"
+		<< "corpus_scratch_allocated_bytes_total " << counters.bytes_allocated << "\n";
+	return out.str();
+}
+
+/**
+ * @param counters Counters from profile_counters()
+ * @return The counters as a JSON object, overloads keyed by operation:left:right
+ */
+std::string counters_json(const ProfileCounters &counters)
+{
+	std::ostringstream out;
+	out << "{\"stages\":{";
+	for (size_t s = 0; s < STAGE_COUNT; ++s)
+		out << (s ? "," : "") << "\"" << stage_name(static_cast<Stage>(s)) << "\":{\"calls\":" << counters.stage_calls[s]
+			<< ",\"ms\":" << static_cast<double>(counters.stage_ns[s]) / 1e6 << "}";
+	out << "},\"steps\":{";
+	for (size_t o = 0; o < OPERATION_COUNT; ++o)
+		out << (o ? "," : "") << "\"" << operation_name(static_cast<SetOperation>(o)) << "\":" << counters.steps[o];
+	out << "},\"overloads\":{";
+	bool first = true;
+	for (size_t o = 0; o < SET_OPERATION_COUNT; ++o)
+		for (size_t a = 0; a < REPRESENTATION_COUNT; ++a)
+			for (size_t b = 0; b < REPRESENTATION_COUNT; ++b)
+			{
+				if (counters.overloads[o][a][b] == 0)
+					continue;
+				out << (first ? "" : ",") << "\"" << operation_name(static_cast<SetOperation>(o)) << ":" << representation_name(static_cast<int>(a))
+					<< ":" << representation_name(static_cast<int>(b)) << "\":" << counters.overloads[o][a][b];
+				first = false;
+			}
+	out << "},\"kernels\":{";
+	for (size_t k = 0; k < KERNEL_COUNT; ++k)
+		out << (k ? "," : "") << "\"" << kernel_name(static_cast<Kernel>(k)) << "\":" << counters.kernels[k];
+	out << "},\"lookups\":" << counters.lookups << ",\"looked_up\":" << counters.looked_up
+		<< ",\"allocations\":" << counters.allocations << ",\"bytes_allocated\":" << counters.bytes_allocated << "}";
+	return out.str();
+}
@@ -0,0 +1,235 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <variant>
+#include <vector>
+#include "corpus.h"
+
+#ifndef PROFILE_H
+#define PROFILE_H
+/*********************************************************
+ * @brief
+ *			Where the time of a query goes: per query profiles and
+ *			counters over all queries.
+ * @details
+ *			The hot paths are instrumented with the PROFILE_ macros
+ *			below, which compile to nothing unless QUERY_PROFILING is
+ *			defined, see the CMake option of the same name, off by default.
+ *			Compiled in, every hook updates the counters of its thread,
+ *			which profile_counters() adds up, and fills in the
+ *			QueryProfile of the calling thread if a ProfileScope set one:
+ *				- stages, timed where they are entered first, so a plan
+ *				  that computes clause results counts as planning
+ *					parse	parse_query() and parse_sequence()
+ *					plan	plan_query() and plan_sets(), with the lookups
+ *					execute	execute_plan(), and the starts of repetitions
+ *					resolve	dropping the matches that cross a sentence and
+ *							handing them over, see for_each_match()
+ *				- one step per MatchSet operation: the overload run, its
+ *				  operand and result sizes, the kernels it chose and its
+ *				  time. Sizes are the excluded positions of complements.
+ *				- postings lookups, and the scratch buffers that had to
+ *				  be allocated, see scratch.h
+ *			Without a profile a hook costs a thread local read and an
+ *			increment of a counter no other thread writes, steps are only
+ *			timed for a profile.
+ *			Work a query runs on a thread pool is recorded in a profile
+ *			per task and merged into the caller's, so its stage times
+ *			add up the threads.
+ */
+//*********************************************************
+
+// ----------------- ENUMS -----------------
+enum class Stage
+{
+	PARSE,
+	PLAN,
+	EXECUTE,
+	RESOLVE
+};
+constexpr size_t STAGE_COUNT = 4;
+
+enum class SetOperation
+{
+	AND,
+	AND_NOT,
+	OR,
+	VERIFY,	// Testing the starts so far on a column, see verify_set()
+	SCAN	// A column scan instead of the plan, see scan.h
+};
+constexpr size_t OPERATION_COUNT = 5;
+constexpr size_t SET_OPERATION_COUNT = 3;	// The operations with two sets
+constexpr size_t REPRESENTATION_COUNT = std::variant_size_v<decltype(MatchSet::set)>;
+
+// The kernels a set operation can choose, a step records every one it ran
+enum class Kernel
+{
+	MERGE,			// Vectorized merge of sorted sets, see simd_sets.h
+	GALLOP,			// The smaller sorted set searched in the larger
+	GALLOP_RUNS,	// Copying the runs between the elements of a much smaller set
+	UNION_MERGE,
+	DENSE_RANGE,	// A sorted set cut to or against a range
+	BITMAP_WORDS,	// Two bitmaps combined a word at a time
+	BITMAP_PROBE,	// A sorted set tested against a bitmap
+	BITMAP_UPDATE,	// The bits of a sorted set set or cleared in a copy of a bitmap
+	BLOCK_SKIP,		// Compressed blocks skipped by their bounds
+	DECODE			// A compressed set decoded in full
+};
+constexpr size_t KERNEL_COUNT = 10;
+
+// ----------------- STRUCTS -----------------
+struct ProfileStep
+{
+	SetOperation operation;
+	int left_representation;	// Index into MatchSet::set, -1 if there is no operand
+	int right_representation;
+	size_t left_size;
+	size_t right_size;
+	size_t result_size;
+	uint32_t kernels;	// Bit k set if Kernel k ran
+	double ms;
+};
+
+struct QueryProfile
+{
+	std::array<double, STAGE_COUNT> stage_ms{};
+	std::vector<ProfileStep> steps;
+	size_t lookups = 0;
+	size_t looked_up = 0;		// Positions in the postings looked up
+	size_t allocations = 0;		// Scratch buffers allocated or grown
+	size_t bytes_allocated = 0;
+	uint32_t kernels = 0;		// Kernels of the step running, see ProfileStep
+
+	void merge(const QueryProfile &other);
+};
+
+/**
+ * @brief Totals over all queries since the program started
+ */
+struct ProfileCounters
+{
+	std::array<uint64_t, STAGE_COUNT> stage_calls{};
+	std::array<uint64_t, STAGE_COUNT> stage_ns{};
+	std::array<uint64_t, OPERATION_COUNT> steps{};
+	std::array<std::array<std::array<uint64_t, REPRESENTATION_COUNT>, REPRESENTATION_COUNT>, SET_OPERATION_COUNT> overloads{};
+	std::array<uint64_t, KERNEL_COUNT> kernels{};
+	uint64_t lookups;
+	uint64_t looked_up;
+	uint64_t allocations;
+	uint64_t bytes_allocated;
+};
+
+/**
+ * @brief Records the hooks of the current thread into a profile while it
+ *		  lives, nullptr records nothing. Scopes nest, the outer profile is
+ *		  restored at the end of the inner one.
+ */
+class ProfileScope
+{
+public:
+	explicit ProfileScope(QueryProfile *profile);
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+	~ProfileScope();
+
+private:
+	QueryProfile* previous;
+};
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+constexpr bool profiling_compiled()
+{
+#ifdef QUERY_PROFILING
+	return true;
+#else
+	return false;
+#endif
+}
+
+QueryProfile* active_profile();
+ProfileCounters profile_counters();
+
+const char* stage_name(Stage stage);
+const char* operation_name(SetOperation operation);
+const char* kernel_name(Kernel kernel);
+const char* representation_name(int representation);
+
+// Reports
+std::string format_profile(const QueryProfile &profile);
+std::string profile_json(const QueryProfile &profile);
+std::string format_counters(const ProfileCounters &counters);
+std::string counters_json(const ProfileCounters &counters);
+
+// ----------------- HOOKS -----------------
+#ifdef QUERY_PROFILING
+
+void profile_kernel(Kernel kernel);
+void profile_lookup(size_t positions);
+void profile_allocation(size_t bytes);
+void count_step(SetOperation operation, const MatchSet *A, const MatchSet *B);
+void record_step(QueryProfile &profile, SetOperation operation, const MatchSet *A, const MatchSet *B, const MatchSet &result, std::chrono::steady_clock::duration elapsed);
+
+/**
+ * @brief Times the outermost stage entered on the thread, inner ones are
+ *		  part of it
+ */
+class StageTimer
+{
+public:
+	explicit StageTimer(Stage stage);
+	StageTimer(const StageTimer&) = delete;
+	StageTimer& operator=(const StageTimer&) = delete;
+	~StageTimer();
+
+private:
+	Stage stage;
+	bool outermost;
+	std::chrono::steady_clock::time_point started;
+};
+
+/**
+ *
+ * @param operation The operation run
+ * @param A First operand, or nullptr
+ * @param B Second operand, or nullptr
+ * @param f Runs the operation
+ * @brief Counts the operation, and records it as a step of the thread's
+ *		  profile if there is one, with the kernels run by f
+ * @return The result of f
+ */
+template<typename F>
+MatchSet profiled_step(SetOperation operation, const MatchSet *A, const MatchSet *B, F &&f)
+{
+	count_step(operation, A, B);
+	QueryProfile* profile = active_profile();
+	if (!profile)
+		return f();
+
+	const uint32_t outer = profile->kernels;
+	profile->kernels = 0;
+	const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+	MatchSet result = f();
+	record_step(*profile, operation, A, B, result, std::chrono::steady_clock::now() - started);
+	profile->kernels |= outer;
+	return result;
+}
+
+#define PROFILE_STAGE(stage) const StageTimer profile_stage_timer(stage)
+#define PROFILE_STEP(operation, A, B, ...) profiled_step(operation, A, B, [&]() -> MatchSet { return __VA_ARGS__; })
+#define PROFILE_KERNEL(kernel) profile_kernel(kernel)
+#define PROFILE_LOOKUP(positions) profile_lookup(positions)
+#define PROFILE_ALLOCATION(bytes) profile_allocation(bytes)
+
+#else
+
+#define PROFILE_STAGE(stage) ((void)0)
+#define PROFILE_STEP(operation, A, B, ...) (__VA_ARGS__)
+#define PROFILE_KERNEL(kernel) ((void)0)
+#define PROFILE_LOOKUP(positions) ((void)0)
+#define PROFILE_ALLOCATION(bytes) ((void)0)
+
+#endif //QUERY_PROFILING
+
+#endif //PROFILE_H
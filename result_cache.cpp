@@ -0,0 +1,136 @@
+#include "result_cache.h"
+
+/**
+ * @param budget_bytes Most bytes of results kept
+ */
+ResultCache::ResultCache(size_t budget_bytes) : budget(budget_bytes) {}
+
+/**
+ *
+ * @param key A clause_key() or query_key()
+ * @brief Counts a hit or a miss, a hit becomes the most recently used entry
+ * @return The result, if it is cached
+ */
+std::optional<ClauseResult> ResultCache::find(const std::string &key)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto found = lookup.find(key);
+	if (found == lookup.end())
+	{
+		misses++;
+		return std::nullopt;
+	}
+
+	hits++;
+	entries.splice(entries.begin(), entries, found->second);
+	return found->second->result;
+}
+
+/**
+ *
+ * @param key A clause_key() or query_key()
+ * @param result The result, at shift 0
+ * @brief Adds or replaces an entry, evicting the least recently used ones to
+ *		  stay within the budget. A result larger than the budget is not kept.
+ */
+void ResultCache::insert(const std::string &key, const ClauseResult &result)
+{
+	const size_t bytes = result_bytes(result) + key.size();
+	std::lock_guard<std::mutex> lock(mutex);
+	if (auto found = lookup.find(key); found != lookup.end())
+	{
+		used -= found->second->bytes;
+		entries.erase(found->second);
+		lookup.erase(found);
+	}
+	if (bytes > budget)
+		return;
+
+	evict_to(budget - bytes);
+	entries.push_front({key, result, bytes});
+	lookup[key] = entries.begin();
+	used += bytes;
+}
+
+void ResultCache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.clear();
+	lookup.clear();
+	used = 0;
+}
+
+CacheStats ResultCache::stats() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return {hits, misses, evictions, entries.size(), used, budget};
+}
+
+/**
+ * @param budget_bytes Bytes to get down to, the mutex must be held
+ */
+void ResultCache::evict_to(size_t budget_bytes)
+{
+	while (used > budget_bytes && !entries.empty())
+	{
+		used -= entries.back().bytes;
+		lookup.erase(entries.back().key);
+		entries.pop_back();
+		evictions++;
+	}
+}
+
+/**
+ *
+ * @param result A result
+ * @brief Counts the elements a result owns or pins, views of the corpus
+ *		  indexes cost nothing. Storage shared with other entries is counted
+ *		  by each of them.
+ * @return Approximate bytes of the result
+ */
+size_t result_bytes(const ClauseResult &result)
+{
+	constexpr size_t ENTRY_OVERHEAD = 128;
+	size_t bytes = ENTRY_OVERHEAD;
+	for (const SharedArray<int>& storage : result.storage)
+		bytes += storage.size() * sizeof(int);
+	if (const auto* bitmap = std::get_if<BitmapSet>(&result.set.set))
+		bytes += bitmap->words.size() * sizeof(uint64_t);
+	return bytes;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param query A query
+ * @param cache The cache to use and fill
+ * @brief Plans a query with the cache. A cached query result is the plan on its
+ *		  own. Otherwise every clause of several literals is taken from the
+ *		  cache, or matched and cached, and planned as one operand.
+ * @return The plan
+ */
+QueryPlan plan_cached(const Corpus &corpus, const Query &query, ResultCache &cache)
+{
+	const int corpus_size = static_cast<int>(corpus.token_count());
+	if (std::optional<ClauseResult> result = cache.find(query_key(query)))
+		return result_plan(*result, corpus_size);
+
+	ClauseResults clauses;
+	for (const Clause& clause : query)
+	{
+		if (clause.size() < 2)
+			continue;
+
+		const std::string key = clause_key(clause);
+		if (clauses.count(key))
+			continue;
+		std::optional<ClauseResult> result = cache.find(key);
+		if (!result)
+		{
+			result = clause_result(corpus, clause);
+			cache.insert(key, *result);
+		}
+		clauses.emplace(key, std::move(*result));
+	}
+	return plan_query(corpus, query, &clauses);
+}
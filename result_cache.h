@@ -0,0 +1,75 @@
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include "corpus.h"
+#include "planner.h"
+
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+/*********************************************************
+ * @brief
+ *			LRU cache of clause and query results.
+ * @details
+ *			Users repeat and refine queries, so the same clauses come
+ *			back at different offsets. Results are kept at shift 0 under
+ *			clause_key(), which ignores the order of literals and the
+ *			clause's offset, and shifted on reuse with shift_set(). Only
+ *			clauses of several literals are cached, a single literal is
+ *			already a view of its postings. Whole query results are kept
+ *			under query_key() once a query has run without a limit.
+ *
+ *			Entries are charged the bytes they own, and the least recently
+ *			used ones are evicted to stay within the budget. A result out
+ *			of the cache stays valid after eviction, it shares its storage.
+ *			The cache is locked, so one cache can serve several threads.
+ */
+//*********************************************************
+
+// ----------------- STRUCTS -----------------
+struct CacheStats
+{
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t entries;
+	size_t bytes;
+	size_t budget;
+};
+
+class ResultCache
+{
+public:
+	explicit ResultCache(size_t budget_bytes);
+
+	std::optional<ClauseResult> find(const std::string &key);
+	void insert(const std::string &key, const ClauseResult &result);
+	void clear();
+	CacheStats stats() const;
+
+private:
+	struct Entry
+	{
+		std::string key;
+		ClauseResult result;
+		size_t bytes;
+	};
+
+	void evict_to(size_t budget_bytes);
+
+	size_t budget;
+	size_t used = 0;
+	size_t hits = 0;
+	size_t misses = 0;
+	size_t evictions = 0;
+	std::list<Entry> entries;	// Most recently used first
+	std::unordered_map<std::string, std::list<Entry>::iterator> lookup;
+	mutable std::mutex mutex;
+};
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+size_t result_bytes(const ClauseResult &result);
+QueryPlan plan_cached(const Corpus &corpus, const Query &query, ResultCache &cache);
+
+#endif //RESULT_CACHE_H
@@ -0,0 +1,408 @@
+#include "scan.h"
+#include "compressed.h"
+#include "planner.h"
+#include "scratch.h"
+#include "simd_sets.h"
+
+#include <atomic>
+#include <bit>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+//-----------------------------  BLOCK COMPARES  ----------------------------------------------------------
+
+constexpr size_t BLOCK_SIZE = 64;	// Match starts per word of the result
+
+/**
+ * @brief Compares 64 values one at a time, for CPUs without AVX2
+ */
+template<typename T>
+static uint64_t block_scalar(const ColumnTest& literal, size_t first)
+{
+	const T* values = static_cast<const T*>(literal.column) + first;
+	uint64_t mask = 0;
+	for (size_t i = 0; i < BLOCK_SIZE; ++i)
+		mask |= static_cast<uint64_t>(values[i] == literal.value) << i;
+	return mask;
+}
+
+/**
+ * @brief Looks 64 values up in a pattern's values, a load of its bits each
+ */
+template<typename T>
+static uint64_t block_contains(const ColumnTest& literal, size_t first)
+{
+	const T* values = static_cast<const T*>(literal.column) + first;
+	uint64_t mask = 0;
+	for (size_t i = 0; i < BLOCK_SIZE; ++i)
+		mask |= static_cast<uint64_t>(literal.values->contains(values[i])) << i;
+	return mask;
+}
+
+/**
+ * @brief Tests 64 tokens against a disjunction, each alternative one value at a time
+ */
+static uint64_t block_any(const ColumnTest& literal, size_t first)
+{
+	uint64_t mask = 0;
+	for (size_t i = 0; i < BLOCK_SIZE; ++i)
+		mask |= static_cast<uint64_t>(literal.matches_at(first + i)) << i;
+	return mask;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("avx2")))
+static inline __m256i load(const void* values)
+{
+	return _mm256_loadu_si256(static_cast<const __m256i*>(values));
+}
+
+__attribute__((target("avx2")))
+static uint64_t block_u8_avx2(const ColumnTest& literal, size_t first)
+{
+	const uint8_t* values = static_cast<const uint8_t*>(literal.column) + first;
+	const __m256i v = _mm256_set1_epi8(static_cast<char>(literal.value));
+	const uint32_t low = _mm256_movemask_epi8(_mm256_cmpeq_epi8(load(values), v));
+	const uint32_t high = _mm256_movemask_epi8(_mm256_cmpeq_epi8(load(values + 32), v));
+	return low | static_cast<uint64_t>(high) << 32;
+}
+
+__attribute__((target("avx2")))
+static uint64_t block_u16_avx2(const ColumnTest& literal, size_t first)
+{
+	const uint16_t* values = static_cast<const uint16_t*>(literal.column) + first;
+	const __m256i v = _mm256_set1_epi16(static_cast<short>(literal.value));
+	uint64_t mask = 0;
+	for (size_t k = 0; k < 2; ++k)
+	{
+		const __m256i a = _mm256_cmpeq_epi16(load(values + 32 * k), v);
+		const __m256i b = _mm256_cmpeq_epi16(load(values + 32 * k + 16), v);
+		// packs interleaves the 128 bit lanes of a and b, the permute puts them back in order
+		const __m256i bytes = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+		mask |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(bytes))) << (32 * k);
+	}
+	return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t block_u32_avx2(const ColumnTest& literal, size_t first)
+{
+	const uint32_t* values = static_cast<const uint32_t*>(literal.column) + first;
+	const __m256i v = _mm256_set1_epi32(static_cast<int>(literal.value));
+	uint64_t mask = 0;
+	for (size_t k = 0; k < 8; ++k)
+	{
+		const __m256i eq = _mm256_cmpeq_epi32(load(values + 8 * k), v);
+		mask |= static_cast<uint64_t>(_mm256_movemask_ps(_mm256_castsi256_ps(eq))) << (8 * k);
+	}
+	return mask;
+}
+#endif
+
+/**
+ * @return The block compare for values of the column's width, vectorized if
+ *		   the kernels currently use AVX2 or wider, or the lookup for a pattern
+ *		   or a disjunction
+ */
+static ColumnScan::Block block_compare(const Column &column, const ColumnTest &test)
+{
+	if (test.alternatives)
+		return block_any;
+	if (test.values)
+	{
+		return column.visit([](auto values) -> ColumnScan::Block {
+			return block_contains<typename decltype(values)::value_type>;
+		});
+	}
+#ifdef SCAN_X86
+	if (simd_level() != SimdLevel::SCALAR)
+	{
+		switch (column.width())
+		{
+			case 1: return block_u8_avx2;
+			case 2: return block_u16_avx2;
+			default: return block_u32_avx2;
+		}
+	}
+#endif
+	return column.visit([](auto values) -> ColumnScan::Block {
+		return block_scalar<typename decltype(values)::value_type>;
+	});
+}
+
+//-----------------------------  SCAN  ----------------------------------------------------------
+
+/**
+ *
+ * @param corpus A corpus
+ * @param literal A literal
+ * @param offset Clause of the literal
+ * @brief A value the corpus's dictionary does not have, one a later segment
+ *		  or shard added, can not occur in the column and may not fit its
+ *		  width. It is tested as a pattern without values, never equal.
+ * @return The literal bound to its column
+ */
+ColumnTest column_test(const Corpus &corpus, const Literal &literal, int offset)
+{
+	if (literal.alternatives)
+	{
+		auto alternatives = std::make_shared<std::vector<ColumnTest>>();
+		for (const Literal& alternative : *literal.alternatives)
+			alternatives->push_back(column_test(corpus, alternative, offset));
+		return {nullptr, 0, 0, true, offset, nullptr, std::move(alternatives)};
+	}
+	static const std::shared_ptr<const ValueSet> no_values = std::make_shared<const ValueSet>();
+	const Column& column = corpus.column(literal.attribute);
+	const bool known = literal.values || literal.value < corpus.dictionary(literal.attribute).size();
+	return {column.data(), static_cast<uint8_t>(column.width()), literal.value, literal.is_equality, offset, known ? literal.values : no_values, nullptr};
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param literal A literal
+ * @return Fraction of the tokens that pass the literal, from its postings size,
+ *		   the sum over the values of a pattern or the alternatives of a disjunction
+ */
+double literal_selectivity(const Corpus &corpus, const Literal &literal)
+{
+	if (literal.alternatives)
+	{
+		double passing = 0;
+		for (const Literal& alternative : *literal.alternatives)
+			passing += literal_selectivity(corpus, alternative);
+		return std::min(passing, 1.0);
+	}
+	const PostingsDirectory directory = postings_directory(corpus, literal.attribute);
+	auto postings_size = [&](uint32_t value) {
+		return directory.is_compressed() ? directory.compressed->lookup(value).size() : directory.lookup(value).elems.size();
+	};
+	size_t postings = 0;
+	if (literal.values)
+	{
+		for (uint32_t value : literal.values->values)
+			postings += postings_size(value);
+	}
+	else
+		postings = postings_size(literal.value);
+	const double equal = static_cast<double>(postings) / std::max<size_t>(corpus.token_count(), 1);
+	return literal.is_equality ? equal : 1 - equal;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param query A query
+ * @param labelled Label the tests for explain()
+ * @brief Binds every literal to its column and a block compare of the column's
+ *		  width, and estimates its selectivity. Empty clauses have no test, they
+ *		  only lengthen the match.
+ * @return The scan, its tests ordered by selectivity
+ */
+ColumnScan compile_scan(const Corpus &corpus, const Query &query, bool labelled)
+{
+	ColumnScan scan;
+	scan.len = static_cast<int>(query.size());
+	scan.corpus_size = static_cast<int>(corpus.token_count());
+	for (size_t j = 0; j < query.size(); ++j)
+	{
+		const int offset = static_cast<int>(j);
+		for (const Literal& literal : query[j])
+		{
+			ColumnTest test = column_test(corpus, literal, offset);
+			const ColumnScan::Block block = block_compare(corpus.column(literal.attribute), test);
+			scan.tests.push_back({block, std::move(test), literal_selectivity(corpus, literal),
+				labelled ? literal_label(corpus, literal, offset) : std::string()});
+		}
+	}
+	std::stable_sort(scan.tests.begin(), scan.tests.end(), [](const ColumnScan::Test& a, const ColumnScan::Test& b) {
+		return a.selectivity < b.selectivity;
+	});
+
+	double passing = 1;
+	for (const ColumnScan::Test& test : scan.tests)
+		passing *= test.selectivity;
+	scan.complement = passing > 0.5;
+	return scan;
+}
+
+/**
+ *
+ * @param scan A compiled scan
+ * @param begin First match start wanted
+ * @param end Match start past the last one wanted
+ * @brief Tests the blocks of 64 match starts holding [begin, end), every test
+ *		  of a block until its mask is empty. A block whose values would run
+ *		  past the corpus is tested one value at a time. Starts with fewer than
+ *		  len tokens left are cleared, so every bit is a start the query matches
+ *		  if it stays in one sentence. A complemented scan sets the bits of the
+ *		  other starts instead.
+ * @return The match starts as a BitmapSet, or the starts that fail if the scan
+ *		   is complemented. Bit 0 is the first start of the first block.
+ */
+MatchSet scan_columns(const ColumnScan &scan, int begin, int end)
+{
+	const int64_t last_start = static_cast<int64_t>(scan.corpus_size) - scan.len; // Last start with len tokens left
+	const int64_t stop = std::min<int64_t>(end, last_start + 1);
+	const size_t first_word = static_cast<size_t>(std::max(begin, 0)) / BLOCK_SIZE;
+	const size_t end_word = stop > 0 ? (static_cast<size_t>(stop) + BLOCK_SIZE - 1) / BLOCK_SIZE : 0;
+	const size_t word_count = std::max(end_word, first_word) - first_word;
+
+	std::shared_ptr<std::vector<uint64_t>> buffer = scratch_words(word_count);
+	std::vector<uint64_t>& words = *buffer;
+	size_t count = 0;
+	for (size_t w = 0; w < word_count; ++w)
+	{
+		const size_t start = (first_word + w) * BLOCK_SIZE;
+		const int64_t left = stop - static_cast<int64_t>(start); // Starts of the block that can match
+		const uint64_t valid = left >= static_cast<int64_t>(BLOCK_SIZE) ? ~uint64_t{0} : (uint64_t{1} << left) - 1;
+		uint64_t mask = valid;
+		for (const ColumnScan::Test& test : scan.tests)
+		{
+			// Tested before the compare rather than after, a sparse result would mispredict the last one
+			if (mask == 0)
+				break;
+			const ColumnTest& literal = test.literal;
+			const size_t first = start + literal.offset;
+			uint64_t equal = 0;
+			if (first + BLOCK_SIZE <= static_cast<size_t>(scan.corpus_size))
+				equal = test.block(literal, first);
+			else
+			{
+				for (size_t i = 0; first + i < static_cast<size_t>(scan.corpus_size); ++i)
+					equal |= static_cast<uint64_t>(literal.matches_at(first + i)) << i;
+			}
+			mask &= literal.is_equality ? equal : ~equal;
+		}
+		words[w] = scan.complement ? valid & ~mask : mask;
+		count += std::popcount(words[w]);
+	}
+	const BitmapSet set{share_words(std::move(buffer)), -static_cast<int>(first_word * BLOCK_SIZE), scan.corpus_size, count};
+	return MatchSet{set, scan.complement};
+}
+
+//-----------------------------  VERIFY  ----------------------------------------------------------
+
+/**
+ *
+ * @param set A set of match starts, not a complement
+ * @param f Called with every start in increasing order
+ */
+template<typename F>
+static void for_each_start(const MatchSet &set, F &&f)
+{
+	std::visit([&](const auto &s) {
+		using T = std::decay_t<decltype(s)>;
+		if constexpr (std::is_same_v<T, DenseSet>)
+		{
+			for (int i = s.first; i <= s.last; ++i)
+				f(i);
+		}
+		else if constexpr (std::is_same_v<T, IndexSet>)
+		{
+			for (int elem : s.elems)
+				f(elem - s.shift);
+		}
+		else if constexpr (std::is_same_v<T, CompressedSet>)
+		{
+			int values[POSTING_BLOCK_SIZE];
+			for (size_t b = 0; b < s.blocks.size(); ++b)
+			{
+				const size_t k = decode_block(s, b, values);
+				for (size_t i = 0; i < k; ++i)
+					f(values[i] - s.shift);
+			}
+		}
+		else if constexpr (std::is_same_v<T, BitmapSet>)
+		{
+			for (size_t w = 0; w < s.words.size(); ++w)
+			{
+				for (uint64_t bits = s.words[w]; bits; bits &= bits - 1)
+					f(static_cast<int>(w * 64) + std::countr_zero(bits) - s.shift);
+			}
+		}
+		else
+		{
+			for (int elem : s.elems)
+				f(elem);
+		}
+	}, set.set);
+}
+
+/**
+ *
+ * @param set Candidate match starts, not a complement
+ * @param test A literal bound to its column
+ * @param corpus_size Number of tokens
+ * @brief Reads the token of every candidate and keeps the ones that pass, the
+ *		  same starts as intersecting with the literal's set, or subtracting it
+ *		  if the literal is an inequality. Costs one load per candidate however
+ *		  large the literal's set is.
+ * @attention Throws an exception if the set is a complement
+ * @return The candidates that pass
+ */
+MatchSet verify_set(const MatchSet &set, const ColumnTest &test, int corpus_size)
+{
+	if (set.complement)
+		throw std::logic_error("Only a set of starts can be verified, not a complement");
+
+	// Every candidate is written and kept by advancing past it, a branch on the test would mispredict
+	ExplicitSet result = scratch_set(static_cast<size_t>(std::max(find_set_size(set), 0)));
+	result.elems.resize(result.elems.capacity());
+	int* out = result.elems.data();
+	size_t kept = 0;
+	for_each_start(set, [&](int start) {
+		out[kept] = start;
+		kept += test.passes(start, corpus_size);
+	});
+	result.elems.resize(kept);
+	return MatchSet{std::move(result), false};
+}
+
+//-----------------------------  MODE  ----------------------------------------------------------
+
+static std::atomic<ScanMode> current_mode = ScanMode::AUTO;
+
+/**
+ * @return When the planner scans, see plan_query()
+ */
+ScanMode scan_mode()
+{
+	return current_mode.load(std::memory_order_relaxed);
+}
+
+/**
+ * @param mode AUTO to pick scan or index by cost, or to force either to compare them
+ */
+void set_scan_mode(ScanMode mode)
+{
+	current_mode.store(mode, std::memory_order_relaxed);
+}
+
+/**
+ *
+ * @param name auto, never or always
+ * @attention Throws an exception if the name is none of them
+ * @return The mode
+ */
+ScanMode parse_scan_mode(std::string_view name)
+{
+	if (name == "auto") return ScanMode::AUTO;
+	if (name == "never") return ScanMode::NEVER;
+	if (name == "always") return ScanMode::ALWAYS;
+	throw std::invalid_argument("Unknown scan mode: " + std::string(name));
+}
+
+const char* scan_mode_name(ScanMode mode)
+{
+	switch (mode)
+	{
+		case ScanMode::NEVER: return "never";
+		case ScanMode::ALWAYS: return "always";
+		default: return "auto";
+	}
+}
@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "corpus.h"
+
+#ifndef SCAN_H
+#define SCAN_H
+/*********************************************************
+ * @brief
+ *			Column scan engine, the alternative to the index plans.
+ * @details
+ *			A query whose literals are dense, or only complemented,
+ *			makes the index plans merge or materialize sets of millions
+ *			of positions. The scan instead reads the attribute columns
+ *			directly: for a block of 64 match starts it compares the
+ *			64 values of each literal's column, offset by the literal's
+ *			clause, against the literal's value in a few vector compares
+ *			and ANDs the resulting masks. The block's final mask is one
+ *			word of a BitmapSet of match starts, so the rest of the
+ *			matching runs on the result like on any other set.
+ *
+ *			Literals are tested most selective first, and a block stops
+ *			as soon as its mask is empty, so a scan costs little more
+ *			than the most selective literal's column. A query expected
+ *			to match most starts, like one of only complemented literals,
+ *			gets the failing starts instead, as a complemented set, so
+ *			counting it walks the few excluded ones. The planner picks
+ *			it over the index plan when its estimated cost is lower, see
+ *			plan_query(), or always or never with set_scan_mode().
+ *
+ *			The same column tests verify candidates: verify_set() keeps
+ *			the starts of a small set whose token passes a literal, one
+ *			load per start, instead of intersecting the set with the
+ *			literal's postings. The planner uses it for a literal far
+ *			larger than the starts left, see plan_sets().
+ */
+//*********************************************************
+
+// ----------------- ENUMS -----------------
+enum class ScanMode
+{
+	AUTO,	// Scan when it is estimated cheaper than the index plan
+	NEVER,
+	ALWAYS	// Scan every query with a literal
+};
+
+// ----------------- STRUCTS -----------------
+/**
+ * @brief A literal bound to its attribute's column, see column_test()
+ */
+struct ColumnTest
+{
+	const void* column;
+	uint8_t width;		// Bytes per value of the column
+	uint32_t value;
+	bool is_equality;
+	int offset;			// Clause of the literal, the token tested is start + offset
+	std::shared_ptr<const ValueSet> values;	// A pattern's values, tested instead of value
+	std::shared_ptr<const std::vector<ColumnTest>> alternatives;	// A disjunction's literals, at the same offset
+
+	bool matches_value(uint32_t v) const { return values ? values->contains(v) : v == value; }
+
+	uint32_t value_at(size_t position) const
+	{
+		switch (width)
+		{
+			case 1: return static_cast<const uint8_t*>(column)[position];
+			case 2: return static_cast<const uint16_t*>(column)[position];
+			default: return static_cast<const uint32_t*>(column)[position];
+		}
+	}
+
+	// The token at a position in the corpus matches, before the operator is applied
+	bool matches_at(size_t position) const
+	{
+		if (!alternatives)
+			return matches_value(value_at(position));
+		for (const ColumnTest& alternative : *alternatives)
+		{
+			if (alternative.matches_at(position) == alternative.is_equality)
+				return true;
+		}
+		return false;
+	}
+
+	// A token outside the corpus has no value, it only passes an inequality
+	bool passes(int64_t start, int corpus_size) const
+	{
+		const int64_t position = start + offset;
+		if (position < 0 || position >= corpus_size)
+		{
+			if (!alternatives)
+				return !is_equality;
+			return std::any_of(alternatives->begin(), alternatives->end(), [](const ColumnTest& alternative) {
+				return !alternative.is_equality;
+			});
+		}
+		return matches_at(static_cast<size_t>(position)) == is_equality;
+	}
+};
+
+/**
+ * @brief A query compiled for scanning, see compile_scan()
+ */
+struct ColumnScan
+{
+	// Equality mask of the 64 values from first, bit i is literal.matches_at(first + i)
+	using Block = uint64_t (*)(const ColumnTest& literal, size_t first);
+
+	struct Test
+	{
+		Block block;
+		ColumnTest literal;
+		double selectivity;		// Estimated fraction of the tokens that pass
+		std::string label;		// Only for explain(), empty unless labelled
+	};
+
+	std::vector<Test> tests;	// Most selective first
+	int len = 0;				// Number of clauses, a match start needs len tokens left
+	int corpus_size = 0;
+	bool complement = false;	// The result holds the starts that fail, expected to be fewer
+};
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+ColumnTest column_test(const Corpus &corpus, const Literal &literal, int offset);
+double literal_selectivity(const Corpus &corpus, const Literal &literal);
+ColumnScan compile_scan(const Corpus &corpus, const Query &query, bool labelled = false);
+MatchSet scan_columns(const ColumnScan &scan, int begin, int end);
+MatchSet verify_set(const MatchSet &set, const ColumnTest &test, int corpus_size);
+
+ScanMode scan_mode();
+void set_scan_mode(ScanMode mode);
+ScanMode parse_scan_mode(std::string_view name);
+const char* scan_mode_name(ScanMode mode);
+
+#endif //SCAN_H
@@ -0,0 +1,210 @@
+#include "scratch.h"
+#include "profile.h"
+
+//-----------------------------  POOL  ----------------------------------------------------------
+
+static std::atomic<size_t> acquired_count{0};
+static std::atomic<size_t> allocation_count{0};
+
+// Set once the pool of the thread is destroyed, sets freed after that release their memory
+static thread_local bool pool_destroyed = false;
+
+/**
+ * @brief The buffers of one thread. The vectors are reserved up front, so
+ *		  returning a buffer never allocates.
+ */
+struct ScratchPool
+{
+	std::vector<std::vector<int>> elems;
+	std::vector<std::shared_ptr<std::vector<uint64_t>>> words;
+
+	ScratchPool()
+	{
+		elems.reserve(SCRATCH_BUFFERS);
+		words.reserve(SCRATCH_BUFFERS);
+	}
+
+	~ScratchPool() { pool_destroyed = true; }
+};
+
+static ScratchPool* thread_pool()
+{
+	if (pool_destroyed)
+		return nullptr;
+	static thread_local ScratchPool pool;
+	return &pool;
+}
+
+/**
+ *
+ * @param capacity Most elements the buffer will hold
+ * @brief Takes the smallest buffer of the thread that holds capacity elements,
+ *		  or grows the largest one if none does
+ * @return An empty buffer with at least the capacity
+ */
+std::vector<int> scratch_elems(size_t capacity)
+{
+	acquired_count.fetch_add(1, std::memory_order_relaxed);
+	std::vector<int> elems;
+	ScratchPool* pool = thread_pool();
+	if (pool && !pool->elems.empty())
+	{
+		size_t best = 0;
+		for (size_t i = 1; i < pool->elems.size(); ++i)
+		{
+			const size_t have = pool->elems[i].capacity();
+			const size_t best_have = pool->elems[best].capacity();
+			if (have >= capacity ? best_have < capacity || have < best_have : have > best_have)
+				best = i;
+		}
+		elems = std::move(pool->elems[best]);
+		pool->elems[best] = std::move(pool->elems.back());
+		pool->elems.pop_back();
+	}
+
+	if (elems.capacity() < capacity)
+	{
+		allocation_count.fetch_add(1, std::memory_order_relaxed);
+		PROFILE_ALLOCATION((capacity - elems.capacity()) * sizeof(int));
+		elems.reserve(capacity);
+	}
+	return elems;
+}
+
+/**
+ * @param capacity Most elements the set will hold
+ * @return An empty set on a scratch buffer, see scratch_elems()
+ */
+ExplicitSet scratch_set(size_t capacity)
+{
+	return ExplicitSet(scratch_elems(capacity));
+}
+
+/**
+ *
+ * @param elems A buffer that is no longer used
+ * @brief Keeps the buffer for the thread's next set. A full pool drops its
+ *		  smallest buffer for a larger one, buffers over MAX_SCRATCH_BYTES are
+ *		  freed.
+ */
+void recycle_elems(std::vector<int> &&elems) noexcept
+{
+	const size_t capacity = elems.capacity();
+	if (capacity == 0 || capacity * sizeof(int) > MAX_SCRATCH_BYTES)
+		return;
+	ScratchPool* pool = thread_pool();
+	if (!pool)
+		return;
+
+	elems.clear();
+	if (pool->elems.size() < SCRATCH_BUFFERS)
+	{
+		pool->elems.push_back(std::move(elems));
+		return;
+	}
+	auto smallest = std::min_element(pool->elems.begin(), pool->elems.end(), [](const auto& a, const auto& b) {
+		return a.capacity() < b.capacity();
+	});
+	if (smallest->capacity() < capacity)
+		*smallest = std::move(elems);
+}
+
+/**
+ *
+ * @param count Number of words
+ * @brief Takes a buffer of the thread that no set views anymore, the best
+ *		  fitting one. If every buffer is in use, for instance kept by a
+ *		  cached result, a new one replaces the pool's reference to one of them.
+ * @return A buffer of count words, their values are unspecified
+ */
+std::shared_ptr<std::vector<uint64_t>> scratch_words(size_t count)
+{
+	acquired_count.fetch_add(1, std::memory_order_relaxed);
+	ScratchPool* pool = thread_pool();
+	if (!pool || count * sizeof(uint64_t) > MAX_SCRATCH_BYTES)
+	{
+		allocation_count.fetch_add(1, std::memory_order_relaxed);
+		PROFILE_ALLOCATION(count * sizeof(uint64_t));
+		return std::make_shared<std::vector<uint64_t>>(count);
+	}
+
+	std::shared_ptr<std::vector<uint64_t>>* best = nullptr;
+	for (auto& words : pool->words)
+	{
+		if (words.use_count() != 1)
+			continue;
+		const size_t have = words->capacity();
+		const size_t best_have = best ? (*best)->capacity() : 0;
+		if (!best || (have >= count ? best_have < count || have < best_have : have > best_have))
+			best = &words;
+	}
+
+	if (!best)
+	{
+		allocation_count.fetch_add(1, std::memory_order_relaxed);
+		PROFILE_ALLOCATION(count * sizeof(uint64_t));
+		auto words = std::make_shared<std::vector<uint64_t>>(count);
+		if (pool->words.size() < SCRATCH_BUFFERS)
+			pool->words.push_back(words);
+		else
+			pool->words[acquired_count.load(std::memory_order_relaxed) % SCRATCH_BUFFERS] = words;
+		return words;
+	}
+
+	// The last set viewing the buffer may have been freed on another thread
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if ((*best)->capacity() < count)
+	{
+		allocation_count.fetch_add(1, std::memory_order_relaxed);
+		PROFILE_ALLOCATION((count - (*best)->capacity()) * sizeof(uint64_t));
+	}
+	(*best)->resize(count);
+	return *best;
+}
+
+/**
+ * @param words A buffer from scratch_words()
+ * @return The words as a SharedArray, keeping the buffer in use while it lives
+ */
+SharedArray<uint64_t> share_words(std::shared_ptr<std::vector<uint64_t>> words)
+{
+	const std::span<const uint64_t> view(*words);
+	return SharedArray<uint64_t>(view, std::move(words));
+}
+
+/**
+ * @return Buffers handed out and allocated so far, over all threads
+ */
+ScratchStats scratch_stats()
+{
+	return {acquired_count.load(std::memory_order_relaxed), allocation_count.load(std::memory_order_relaxed)};
+}
+
+//-----------------------------  EXPLICIT SETS  ----------------------------------------------------------
+
+ExplicitSet::ExplicitSet(const ExplicitSet &other) : elems(scratch_elems(other.elems.size()))
+{
+	elems.assign(other.elems.begin(), other.elems.end());
+}
+
+ExplicitSet& ExplicitSet::operator=(const ExplicitSet &other)
+{
+	if (this != &other)
+		elems.assign(other.elems.begin(), other.elems.end());
+	return *this;
+}
+
+ExplicitSet& ExplicitSet::operator=(ExplicitSet &&other) noexcept
+{
+	if (this != &other)
+	{
+		recycle_elems(std::move(elems));
+		elems = std::move(other.elems);
+	}
+	return *this;
+}
+
+ExplicitSet::~ExplicitSet()
+{
+	recycle_elems(std::move(elems));
+}
@@ -0,0 +1,49 @@
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "corpus.h"
+
+#ifndef SCRATCH_H
+#define SCRATCH_H
+/*********************************************************
+ * @brief
+ *			Reusable buffers for the intermediate sets of a query.
+ * @details
+ *			Every step of a plan produces a new set, and most of them are
+ *			dropped by the next step. Instead of allocating each one, the
+ *			kernels take a buffer sized from their input bounds out of a
+ *			small pool owned by the calling thread, and an ExplicitSet
+ *			hands its buffer back to that pool when it is destroyed or
+ *			overwritten. Once the pool has buffers large enough for a
+ *			query, running it again does not touch the heap.
+ *
+ *			Bitmap results share their words through SharedArray, so
+ *			their buffers are reference counted instead: a buffer is
+ *			reused once no set views it anymore.
+ *
+ *			scratch_stats() counts the buffers handed out and the ones
+ *			that had to be allocated or grown, over all threads.
+ */
+//*********************************************************
+
+// ----------------- CONSTANTS -----------------
+constexpr size_t SCRATCH_BUFFERS = 16;				// Buffers of each kind kept per thread
+constexpr size_t MAX_SCRATCH_BYTES = size_t{64} << 20;	// Larger buffers are freed, not kept
+
+// ----------------- STRUCTS -----------------
+struct ScratchStats
+{
+	size_t acquired;	// Buffers handed out
+	size_t allocations;	// Of those, the ones the pool had to allocate or grow
+};
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+std::vector<int> scratch_elems(size_t capacity);
+ExplicitSet scratch_set(size_t capacity);
+void recycle_elems(std::vector<int> &&elems) noexcept;
+std::shared_ptr<std::vector<uint64_t>> scratch_words(size_t count);
+SharedArray<uint64_t> share_words(std::shared_ptr<std::vector<uint64_t>> words);
+ScratchStats scratch_stats();
+
+#endif //SCRATCH_H
@@ -0,0 +1,511 @@
+#include "segment.h"
+#include "compressed.h"
+#include "pattern.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+//-----------------------------  SNAPSHOTS  ----------------------------------------------------------
+
+/**
+ *
+ * @param segments Segments in position order, at least one
+ * @brief Lays the segments end to end
+ * @attention Throws an exception if there are no segments, or more positions
+ *			  than an int holds
+ * @return The snapshot, with the first position and sentence of every segment
+ */
+std::shared_ptr<const SegmentSnapshot> make_snapshot(std::vector<std::shared_ptr<const Corpus>> segments)
+{
+	if (segments.empty())
+		throw std::invalid_argument("Error: a snapshot needs at least one segment");
+
+	auto snapshot = std::make_shared<SegmentSnapshot>();
+	size_t tokens = 0;
+	size_t sentences = 0;
+	for (const std::shared_ptr<const Corpus>& segment : segments)
+	{
+		if (tokens + segment->token_count() > static_cast<size_t>(std::numeric_limits<int>::max()))
+			throw std::invalid_argument("Error: the segments hold more tokens than a position can address");
+		snapshot->token_bases.push_back(static_cast<int>(tokens));
+		snapshot->sentence_bases.push_back(static_cast<int>(sentences));
+		tokens += segment->token_count();
+		sentences += segment->sentences.size();
+	}
+	snapshot->token_bases.push_back(static_cast<int>(tokens));
+	snapshot->sentence_bases.push_back(static_cast<int>(sentences));
+	snapshot->segments = std::move(segments);
+	return snapshot;
+}
+
+/**
+ * @param sentence A global sentence
+ * @return The segment holding the sentence
+ */
+size_t SegmentSnapshot::segment_of(int sentence) const
+{
+	const auto first = sentence_bases.begin();
+	return std::upper_bound(first, first + static_cast<std::ptrdiff_t>(segments.size()), sentence) - first - 1;
+}
+
+//-----------------------------  BUILDING SEGMENTS  ----------------------------------------------------------
+
+/**
+ *
+ * @param segment A segment with its columns and indexes
+ * @param options Which optional indexes to build
+ * @brief Builds the binary and bitmap indexes of a new segment and compresses
+ *		  its indexes, in the order main does for the loaded corpus
+ */
+void finish_segment(Corpus &segment, const SegmentOptions &options)
+{
+	if (!options.binary_indexes.empty())
+		build_binary_indices(segment, options.binary_indexes);
+	build_bitmap_indices(segment, options.bitmap_density);
+	if (options.compress)
+		compress_indices(segment);
+}
+
+/**
+ *
+ * @param segments Adjacent segments in position order, the last one with the
+ *				   newest dictionaries
+ * @param options How to index the result
+ * @brief Rebuilds the segments as one: the columns and sentences are laid end
+ *		  to end and indexed again, the dictionaries are those of the last
+ *		  segment, which hold the values of all of them
+ * @attention Throws an exception if there are no segments
+ * @return The merged segment
+ */
+Corpus merge_segments(std::span<const std::shared_ptr<const Corpus>> segments, const SegmentOptions &options)
+{
+	if (segments.empty())
+		throw std::invalid_argument("Error: no segments to merge");
+
+	size_t total = 0;
+	for (const std::shared_ptr<const Corpus>& segment : segments)
+		total += segment->token_count();
+
+	Corpus merged;
+	merged.dictionaries = segments.back()->dictionaries;
+	std::vector<Token> tokens(total);
+	std::vector<int> sentences;
+	size_t base = 0;
+	for (const std::shared_ptr<const Corpus>& segment : segments)
+	{
+		for (size_t a = 0; a < ATTRIBUTE_COUNT; ++a)
+		{
+			uint32_t Token::* member = attribute_member(static_cast<Attribute>(a));
+			segment->columns[a].visit([&](auto values) {
+				for (size_t p = 0; p < values.size(); ++p)
+					tokens[base + p].*member = values[p];
+			});
+		}
+		for (int sentence : segment->sentences)
+			sentences.push_back(static_cast<int>(base) + sentence);
+		base += segment->token_count();
+	}
+
+	build_columns(merged, tokens);
+	tokens = {};
+	merged.sentences = std::move(sentences);
+	build_sentence_ids(merged);
+	build_indices(merged, options.threads == 0 ? std::max(1u, std::thread::hardware_concurrency()) : options.threads);
+	finish_segment(merged, options);
+	return merged;
+}
+
+//-----------------------------  SEGMENTED CORPUS  ----------------------------------------------------------
+
+/**
+ *
+ * @param base The loaded corpus, with its indexes, the first segment
+ * @param options How appended and merged segments are indexed
+ * @brief Starts with one segment, and the merger thread if merging in the background
+ */
+SegmentedCorpus::SegmentedCorpus(Corpus base, SegmentOptions options) : options(std::move(options))
+{
+	std::vector<std::shared_ptr<const Corpus>> segments;
+	segments.push_back(std::make_shared<const Corpus>(std::move(base)));
+	current = make_snapshot(std::move(segments));
+	if (this->options.background_merge)
+		merger = std::thread(&SegmentedCorpus::merge_loop, this);
+}
+
+/**
+ * @brief Stops the merger, after the merge it is running, if any
+ */
+SegmentedCorpus::~SegmentedCorpus()
+{
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	if (merger.joinable())
+		merger.join();
+}
+
+/**
+ * @return The current segments. It stays valid, and unchanged, for as long
+ *		   as it is held.
+ */
+std::shared_ptr<const SegmentSnapshot> SegmentedCorpus::snapshot() const
+{
+	std::lock_guard<std::mutex> lock(snapshot_mutex);
+	return current;
+}
+
+/**
+ *
+ * @param filename A file in the format of load_corpus()
+ * @param stats Optional output, sizes and timings of the load
+ * @brief Loads the file into a new segment after the others, see load_segment(),
+ *		  and publishes it. Readers see the new sentences from their next
+ *		  snapshot on. Wakes the merger.
+ * @attention Throws an exception if the file could not be loaded, or the corpus
+ *			  would hold more tokens than a position can address
+ * @return Number of tokens appended, a file without tokens adds no segment
+ */
+size_t SegmentedCorpus::append_file(const std::string &filename, IngestStats *stats)
+{
+	std::lock_guard<std::mutex> append_lock(append_mutex);
+	const std::shared_ptr<const SegmentSnapshot> base = snapshot();
+	Corpus segment = load_segment(filename, base->lexicon(), stats, options.threads);
+	const size_t tokens = segment.token_count();
+	if (tokens == 0)
+		return 0;
+	if (base->token_count() + tokens > static_cast<size_t>(std::numeric_limits<int>::max()))
+		throw std::invalid_argument("Error: appending " + filename + " would exceed the positions of the corpus");
+
+	finish_segment(segment, options);
+	{
+		std::lock_guard<std::mutex> lock(snapshot_mutex);
+		std::vector<std::shared_ptr<const Corpus>> segments = current->segments;
+		segments.push_back(std::make_shared<const Corpus>(std::move(segment)));
+		current = make_snapshot(std::move(segments));
+	}
+	++appends;
+
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		++requested;
+	}
+	wake.notify_one();
+	return tokens;
+}
+
+/**
+ *
+ * @param snapshot A snapshot
+ * @brief The merge policy: the first segment that is no larger than the one
+ *		  after it is merged with it, see segment.h
+ * @return The segments [first, last) to merge, an empty range if none
+ */
+static std::pair<size_t, size_t> merge_candidate(const SegmentSnapshot &snapshot)
+{
+	for (size_t s = 0; s + 1 < snapshot.segments.size(); ++s)
+	{
+		if (snapshot.segments[s]->token_count() <= snapshot.segments[s + 1]->token_count())
+			return {s, s + 2};
+	}
+	return {0, 0};
+}
+
+/**
+ *
+ * @param first First segment to merge
+ * @param last One past the last segment to merge
+ * @param from The snapshot the segments are taken from
+ * @brief Merges the segments without a lock, then replaces them in the current
+ *		  snapshot. Only merges remove segments and they run one at a time,
+ *		  while appends only add segments at the end, so the merged segments
+ *		  are still at the same place. Needs merge_mutex.
+ */
+void SegmentedCorpus::merge_range(size_t first, size_t last, const SegmentSnapshot &from)
+{
+	const std::span<const std::shared_ptr<const Corpus>> run(from.segments.data() + first, last - first);
+	auto merged = std::make_shared<const Corpus>(merge_segments(run, options));
+
+	{
+		std::lock_guard<std::mutex> lock(snapshot_mutex);
+		std::vector<std::shared_ptr<const Corpus>> segments = current->segments;
+		segments.erase(segments.begin() + first, segments.begin() + last);
+		segments.insert(segments.begin() + first, merged);
+		current = make_snapshot(std::move(segments));
+	}
+	++merges;
+	merged_tokens += merged->token_count();
+}
+
+/**
+ * @brief Runs one merge chosen by merge_candidate()
+ * @return False if there was nothing to merge
+ */
+bool SegmentedCorpus::merge_once()
+{
+	std::lock_guard<std::mutex> lock(merge_mutex);
+	const std::shared_ptr<const SegmentSnapshot> from = snapshot();
+	const auto [first, last] = merge_candidate(*from);
+	if (first == last)
+		return false;
+	merge_range(first, last, *from);
+	return true;
+}
+
+/**
+ * @brief The merger thread: after every append, merges until the policy finds
+ *		  nothing to merge. An error is kept for wait_for_merges().
+ */
+void SegmentedCorpus::merge_loop()
+{
+	std::unique_lock<std::mutex> lock(wake_mutex);
+	while (true)
+	{
+		wake.wait(lock, [&] { return stopping || finished < requested; });
+		if (stopping)
+			return;
+
+		const size_t target = requested;
+		lock.unlock();
+		std::exception_ptr error;
+		try
+		{
+			bool more = true;
+			while (more)
+			{
+				{
+					std::lock_guard<std::mutex> stop_lock(wake_mutex);
+					if (stopping)
+						break;
+				}
+				more = merge_once();
+			}
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+		lock.lock();
+		if (error)
+			merge_error = error;
+		finished = target;
+		idle.notify_all();
+	}
+}
+
+/**
+ * @brief Waits until the merger has caught up with every append so far, or,
+ *		  without a merger thread, runs the merges itself
+ * @attention Rethrows an error of the merger
+ */
+void SegmentedCorpus::wait_for_merges()
+{
+	if (!options.background_merge)
+	{
+		while (merge_once())
+		{
+		}
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(wake_mutex);
+	idle.wait(lock, [&] { return finished == requested; });
+	if (merge_error)
+		std::rethrow_exception(std::exchange(merge_error, nullptr));
+}
+
+/**
+ * @brief Merges every segment into one, waiting for a running merge first
+ */
+void SegmentedCorpus::compact()
+{
+	std::lock_guard<std::mutex> lock(merge_mutex);
+	const std::shared_ptr<const SegmentSnapshot> from = snapshot();
+	if (from->segments.size() > 1)
+		merge_range(0, from->segments.size(), *from);
+}
+
+/**
+ * @return The number and size of the segments, and the work done so far
+ */
+SegmentStats SegmentedCorpus::stats() const
+{
+	const std::shared_ptr<const SegmentSnapshot> now = snapshot();
+	return {now->segments.size(), now->token_count(), appends.load(), merges.load(), merged_tokens.load()};
+}
+
+//-----------------------------  MATCHING  ----------------------------------------------------------
+
+/**
+ *
+ * @param literal A literal parsed against the lexicon
+ * @param segment The segment it runs on
+ * @param lexicon The segment with the newest dictionaries
+ * @brief A value the segment's dictionary does not have yet can not occur in
+ *		  it, it becomes a pattern without values, written as the string of
+ *		  the lexicon
+ * @return The literal for the segment
+ */
+static Literal segment_literal(const Literal &literal, const Corpus &segment, const Corpus &lexicon)
+{
+	if (literal.alternatives)
+	{
+		std::vector<Literal> alternatives;
+		for (const Literal& alternative : *literal.alternatives)
+			alternatives.push_back(segment_literal(alternative, segment, lexicon));
+		return Literal{literal.attribute, 0, true, nullptr, std::make_shared<const std::vector<Literal>>(std::move(alternatives))};
+	}
+
+	const size_t size = segment.dictionary(literal.attribute).size();
+	const Dictionary& dictionary = lexicon.dictionary(literal.attribute);
+	if (literal.values || literal.value < size || literal.value >= dictionary.size())
+		return literal;
+	Literal absent = literal;
+	absent.values = make_value_set("=\"" + dictionary.index2string[literal.value] + "\"", {}, size);
+	return absent;
+}
+
+/**
+ *
+ * @param snapshot A snapshot
+ * @param s A segment of it
+ * @param query A query parsed against snapshot.lexicon()
+ * @brief Rewrites the values segment s does not have, see segment_literal(),
+ *		  so its plan is labelled with the strings of the query
+ * @return The query for the segment
+ */
+Query segment_query(const SegmentSnapshot &snapshot, size_t s, const Query &query)
+{
+	Query local;
+	for (const Clause& clause : query)
+	{
+		Clause& rewritten = local.emplace_back();
+		for (const Literal& literal : clause)
+			rewritten.push_back(segment_literal(literal, *snapshot.segments[s], snapshot.lexicon()));
+	}
+	return local;
+}
+
+
+/**
+ *
+ * @param snapshot A snapshot
+ * @param sequence A sequence parsed against snapshot.lexicon()
+ * @param f Called with each match in order, with global positions, returns false to stop
+ * @param options Matches to skip and produce, or to only count
+ * @brief Runs the sequence on every segment in order, see stream_matches().
+ *		  Segments hold whole sentences, so no match crosses one, and
+ *		  segments entirely before the offset are only counted. The cache is
+ *		  only used while there is one segment, its keys do not tell segments
+ *		  apart.
+ * @return Number of matches produced, or counted
+ */
+size_t stream_matches(const SegmentSnapshot &snapshot, const Sequence &sequence, const std::function<bool(const Match &)> &f, const ResultOptions &options)
+{
+	if (snapshot.segments.size() == 1)
+		return stream_matches(*snapshot.segments.front(), sequence, f, options);
+
+	size_t offset = options.offset;
+	size_t produced = 0;
+	bool stopped = false;
+	for (size_t s = 0; s < snapshot.segments.size() && !stopped && produced < options.limit; ++s)
+	{
+		const Corpus& segment = *snapshot.segments[s];
+		if (offset > 0)
+		{
+			const size_t found = count(segment, sequence, options.pool);
+			if (found <= offset)
+			{
+				offset -= found;
+				continue;
+			}
+		}
+
+		ResultOptions local = options;
+		local.offset = offset;
+		local.limit = options.limit == NO_LIMIT ? NO_LIMIT : options.limit - produced;
+		local.cache = nullptr;
+		const int token_base = snapshot.token_bases[s];
+		const int sentence_base = snapshot.sentence_bases[s];
+		produced += stream_matches(segment, sequence, [&](const Match &match) {
+			stopped = !f({match.sentence + sentence_base, match.pos + token_base, match.len});
+			return !stopped;
+		}, local);
+		offset = 0;
+	}
+	return produced;
+}
+
+/**
+ * @param snapshot A snapshot
+ * @param sequence A sequence parsed against snapshot.lexicon()
+ * @param options Matches to skip and produce
+ * @return The matches, with global positions, see stream_matches()
+ */
+std::vector<Match> match2(const SegmentSnapshot &snapshot, const Sequence &sequence, const ResultOptions &options)
+{
+	if (snapshot.segments.size() == 1)
+		return match2(*snapshot.segments.front(), sequence, options);
+
+	std::vector<Match> matches;
+	stream_matches(snapshot, sequence, [&](const Match &match) {
+		matches.push_back(match);
+		return true;
+	}, options);
+	return matches;
+}
+
+/**
+ * @param snapshot A snapshot
+ * @param sequence A sequence parsed against snapshot.lexicon()
+ * @param pool Optional, counts each segment in parallel
+ * @param cache Optional, only used while there is one segment
+ * @return Number of matches, the sum over the segments
+ */
+size_t count(const SegmentSnapshot &snapshot, const Sequence &sequence, ThreadPool *pool, ResultCache *cache)
+{
+	if (snapshot.segments.size() == 1)
+		return count(*snapshot.segments.front(), sequence, pool, cache);
+
+	size_t total = 0;
+	for (const std::shared_ptr<const Corpus>& segment : snapshot.segments)
+		total += count(*segment, sequence, pool);
+	return total;
+}
+
+/**
+ *
+ * @param snapshot A snapshot
+ * @param query A query parsed against snapshot.lexicon()
+ * @param attribute Attribute to count, word, c5, lemma or pos
+ * @param clause Clause of the query whose token is counted
+ * @brief Adds up the histograms of the segments, see group_by()
+ * @attention Throws an exception if the attribute is unknown or the clause is
+ *			  past the end of the query
+ * @return The values that occur, most frequent first
+ */
+std::vector<ValueCount> group_by(const SegmentSnapshot &snapshot, const Query &query, const std::string &attribute, size_t clause)
+{
+	if (snapshot.segments.size() == 1)
+		return group_by(*snapshot.segments.front(), query, attribute, clause);
+
+	std::vector<size_t> counts(snapshot.lexicon().dictionary(parse_attribute(attribute)).size(), 0);
+	for (const std::shared_ptr<const Corpus>& segment : snapshot.segments)
+	{
+		for (const ValueCount& bar : group_by(*segment, query, attribute, clause))
+			counts[bar.value] += bar.count;
+	}
+
+	std::vector<ValueCount> histogram;
+	for (size_t value = 0; value < counts.size(); ++value)
+	{
+		if (counts[value] > 0)
+			histogram.push_back({static_cast<uint32_t>(value), counts[value]});
+	}
+	std::sort(histogram.begin(), histogram.end(), [](const ValueCount& a, const ValueCount& b) {
+		return a.count != b.count ? a.count > b.count : a.value < b.value;
+	});
+	return histogram;
+}
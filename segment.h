@@ -0,0 +1,149 @@
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "corpus.h"
+#include "bitmap.h"
+
+#ifndef SEGMENT_H
+#define SEGMENT_H
+/*********************************************************
+ * @brief
+ *			A corpus that grows by appending files, as a list of
+ *			immutable segments merged in the background.
+ * @details
+ *			Every segment is an ordinary Corpus with its own columns
+ *			and indexes. Appending a file loads it into a new segment,
+ *			see load_segment(), which indexes only the new tokens. The
+ *			dictionaries are append-only: the new segment starts from
+ *			a copy of those of the last segment, so a string keeps its
+ *			index in every segment and a query parsed against the last
+ *			segment, the lexicon, holds for all of them. Older segments
+ *			simply never contain the newer values, and their lookups of
+ *			them are empty.
+ *
+ *			Readers take a SegmentSnapshot, the segments and where each
+ *			one starts, and query it with the overloads below, which run
+ *			the query on every segment in order and offset the matches,
+ *			so they come out in position order. A snapshot is never
+ *			changed: appends and merges publish a new one, swapping a
+ *			pointer under a lock held for just that, and a reader keeps
+ *			its segments alive for as long as it holds the snapshot.
+ *
+ *			A merger thread keeps the number of segments logarithmic.
+ *			Whenever a segment is no larger than the one after it, the
+ *			two are rebuilt as one, so appends of equal size merge like
+ *			a binary counter and a token is rewritten O(log n) times.
+ *			A merge builds its segment without any lock, and replaces
+ *			the merged segments in whatever snapshot is current once it
+ *			is done, so appends never wait for a merge either.
+ */
+//*********************************************************
+
+class ThreadPool;
+class ResultCache;
+
+// ----------------- STRUCTS -----------------
+
+/**
+ * @brief How new and merged segments are indexed, like main does for the
+ *		  loaded corpus
+ */
+struct SegmentOptions
+{
+	unsigned threads = 1;	// Threads parsing and indexing a segment, 0 means one per core
+	double bitmap_density = DEFAULT_BITMAP_DENSITY;
+	bool compress = false;
+	std::vector<std::pair<std::string, std::string>> binary_indexes;
+	bool background_merge = true;	// Merge on a thread of its own, else only in wait_for_merges()
+};
+
+/**
+ * @brief The segments of a corpus at one point in time. Global positions and
+ *		  sentences are those of the segments laid end to end.
+ */
+struct SegmentSnapshot
+{
+	std::vector<std::shared_ptr<const Corpus>> segments;	// In position order, never empty
+	std::vector<int> token_bases;		// First position of each segment, and the token count last
+	std::vector<int> sentence_bases;	// First sentence of each segment, and the sentence count last
+
+	// The segment with the newest dictionaries, to parse queries against
+	const Corpus& lexicon() const { return *segments.back(); }
+	size_t token_count() const { return token_bases.back(); }
+	size_t sentence_count() const { return sentence_bases.back(); }
+	size_t segment_of(int sentence) const;
+};
+
+struct SegmentStats
+{
+	size_t segments;
+	size_t tokens;
+	size_t appends;
+	size_t merges;
+	size_t merged_tokens;	// Tokens rewritten by merges
+};
+
+class SegmentedCorpus
+{
+public:
+	explicit SegmentedCorpus(Corpus base, SegmentOptions options = {});
+	SegmentedCorpus(const SegmentedCorpus&) = delete;
+	SegmentedCorpus& operator=(const SegmentedCorpus&) = delete;
+	~SegmentedCorpus();
+
+	std::shared_ptr<const SegmentSnapshot> snapshot() const;
+	size_t append_file(const std::string &filename, IngestStats *stats = nullptr);
+	void wait_for_merges();
+	void compact();
+	SegmentStats stats() const;
+
+private:
+	void publish(std::shared_ptr<const SegmentSnapshot> next);
+	bool merge_once();
+	void merge_range(size_t first, size_t last, const SegmentSnapshot &from);
+	void merge_loop();
+
+	const SegmentOptions options;
+	std::shared_ptr<const SegmentSnapshot> current;
+	mutable std::mutex snapshot_mutex;	// Held only to copy or swap current
+	std::mutex append_mutex;			// One append at a time
+	std::mutex merge_mutex;				// One merge at a time
+
+	// Merger thread, woken by appends
+	std::thread merger;
+	std::mutex wake_mutex;
+	std::condition_variable wake;
+	std::condition_variable idle;
+	size_t requested = 0;	// Appends the merger was told about
+	size_t finished = 0;	// Appends the merger has caught up with
+	bool stopping = false;
+	std::exception_ptr merge_error;
+
+	std::atomic<size_t> appends{0};
+	std::atomic<size_t> merges{0};
+	std::atomic<size_t> merged_tokens{0};
+};
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+
+// Segments
+std::shared_ptr<const SegmentSnapshot> make_snapshot(std::vector<std::shared_ptr<const Corpus>> segments);
+Corpus merge_segments(std::span<const std::shared_ptr<const Corpus>> segments, const SegmentOptions &options = {});
+void finish_segment(Corpus &segment, const SegmentOptions &options);
+
+// Matching over every segment
+size_t stream_matches(const SegmentSnapshot &snapshot, const Sequence &sequence, const std::function<bool(const Match &)> &f, const ResultOptions &options = {});
+std::vector<Match> match2(const SegmentSnapshot &snapshot, const Sequence &sequence, const ResultOptions &options = {});
+size_t count(const SegmentSnapshot &snapshot, const Sequence &sequence, ThreadPool *pool = nullptr, ResultCache *cache = nullptr);
+Query segment_query(const SegmentSnapshot &snapshot, size_t s, const Query &query);
+std::vector<ValueCount> group_by(const SegmentSnapshot &snapshot, const Query &query, const std::string &attribute, size_t clause);
+
+#endif //SEGMENT_H
@@ -0,0 +1,464 @@
+#include "server.h"
+#include "planner.h"
+#include "profile.h"
+#include "result_cache.h"
+#include "scratch.h"
+#include "shard.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using Clock = std::chrono::steady_clock;
+
+//-----------------------------  REQUESTS  ----------------------------------------------------------
+
+/**
+ * @return str as the contents of a JSON string
+ */
+std::string json_escape(const std::string &str)
+{
+	std::string escaped;
+	escaped.reserve(str.size());
+	for (char c : str)
+	{
+		switch (c)
+		{
+			case '"': escaped += "\\\""; break;
+			case '\\': escaped += "\\\\"; break;
+			case '\n': escaped += "\\n"; break;
+			case '\t': escaped += "\\t"; break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+				{
+					char code[8];
+					std::snprintf(code, sizeof(code), "\\u%04x", static_cast<unsigned char>(c));
+					escaped += code;
+				}
+				else
+					escaped += c;
+		}
+	}
+	return escaped;
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param request One request line, see server.h
+ * @param pool Optional, counts matches in parallel
+ * @param cache Optional, shared by all requests
+ * @brief Runs one request
+ * @attention Throws an exception if the request or its query is malformed, or
+ *			  the query has a value that is not in the corpus
+ * @return The reply's JSON fields, without the enclosing braces
+ */
+static std::string reply_fields(const Corpus &corpus, const std::string &request, ThreadPool *pool, ResultCache *cache)
+{
+	std::istringstream in(request);
+	std::string command;
+	in >> command;
+
+	std::ostringstream out;
+	if (command == "match")
+	{
+		size_t offset = 0;
+		size_t limit = 0;
+		if (!(in >> offset >> limit))
+			throw std::invalid_argument("Usage: match <offset> <limit> <query>");
+		std::string rest;
+		std::getline(in, rest);
+
+		// One run produces the window and counts the total
+		std::vector<Match> matches;
+		size_t seen = 0;
+		const size_t total = stream_matches(corpus, parse_sequence(rest, corpus), [&](const Match &match) {
+			if (seen++ >= offset && matches.size() < limit)
+				matches.push_back(match);
+			return true;
+		}, {0, NO_LIMIT, false, pool, cache});
+		out << "\"status\":\"ok\",\"total\":" << total << ",\"matches\":[";
+		for (size_t i = 0; i < matches.size(); ++i)
+			out << (i ? "," : "") << "{\"sentence\":" << matches[i].sentence << ",\"pos\":" << matches[i].pos << ",\"len\":" << matches[i].len << "}";
+		out << "]";
+	}
+	else if (command == "count")
+	{
+		std::string rest;
+		std::getline(in, rest);
+		out << "\"status\":\"ok\",\"count\":" << count(corpus, parse_sequence(rest, corpus), pool, cache);
+	}
+	else if (command == "group")
+	{
+		std::string attribute;
+		size_t clause = 0;
+		if (!(in >> attribute >> clause))
+			throw std::invalid_argument("Usage: group <attribute> <clause> <query>");
+		std::string rest;
+		std::getline(in, rest);
+
+		const std::vector<ValueCount> histogram = group_by(corpus, parse_query(rest, corpus), attribute, clause);
+		const Dictionary& dictionary = corpus.dictionary(parse_attribute(attribute));
+		out << "\"status\":\"ok\",\"values\":[";
+		for (size_t i = 0; i < histogram.size(); ++i)
+			out << (i ? "," : "") << "{\"value\":\"" << json_escape(dictionary.index2string[histogram[i].value]) << "\",\"count\":" << histogram[i].count << "}";
+		out << "]";
+	}
+	else if (command == "explain")
+	{
+		std::string rest;
+		std::getline(in, rest);
+		out << "\"status\":\"ok\",\"plan\":\"" << json_escape(explain(plan_query(corpus, parse_query(rest, corpus), nullptr, true))) << "\"";
+	}
+	else if (command == "shard")
+	{
+		std::string rest;
+		std::getline(in, rest);
+		out << shard_reply_fields(corpus, rest, pool, cache);
+	}
+	else
+		throw std::invalid_argument("Unknown request: " + command);
+	return out.str();
+}
+
+/**
+ *
+ * @param corpus A corpus
+ * @param request One request line, see server.h
+ * @param pool Optional, counts matches in parallel
+ * @param cache Optional, shared by all requests
+ * @brief Runs one request, turning errors into an error reply. Safe to call
+ *		  from several threads at once.
+ * @return The reply as a JSON object
+ */
+std::string serve_request(const Corpus &corpus, const std::string &request, ThreadPool *pool, ResultCache *cache)
+{
+	try
+	{
+		return "{" + reply_fields(corpus, request, pool, cache) + "}";
+	}
+	catch (const std::exception &e)
+	{
+		return "{\"status\":\"error\",\"message\":\"" + json_escape(e.what()) + "\"}";
+	}
+}
+
+//-----------------------------  METRICS  ----------------------------------------------------------
+
+/**
+ * @brief Totals over all requests. Latencies, queue wait plus run time, are
+ *		  kept in power of two buckets of microseconds, percentiles are the
+ *		  upper bound of their bucket.
+ */
+struct ServerMetrics
+{
+	static constexpr size_t BUCKETS = 40;
+
+	std::atomic<uint64_t> served{0};
+	std::atomic<uint64_t> failed{0};
+	std::atomic<uint64_t> rejected{0};
+	std::atomic<uint64_t> timed_out{0};
+	std::atomic<uint64_t> refused{0};		// Connections past the limit
+	std::atomic<size_t> connections{0};		// Open now
+	std::atomic<uint64_t> max_us{0};
+	std::array<std::atomic<uint64_t>, BUCKETS> latency_buckets{};
+
+	void record(uint64_t us)
+	{
+		latency_buckets[std::min<size_t>(std::bit_width(us), BUCKETS - 1)]++;
+		uint64_t seen = max_us;
+		while (us > seen && !max_us.compare_exchange_weak(seen, us)) {}
+	}
+
+	double percentile_ms(double fraction) const
+	{
+		uint64_t total = 0;
+		for (const auto& bucket : latency_buckets)
+			total += bucket;
+		if (total == 0)
+			return 0;
+
+		uint64_t seen = 0;
+		for (size_t b = 0; b < BUCKETS; ++b)
+		{
+			seen += latency_buckets[b];
+			if (seen >= fraction * total)
+				return static_cast<double>(std::min(uint64_t{1} << b, max_us.load())) / 1000;
+		}
+		return static_cast<double>(max_us) / 1000;
+	}
+
+	std::string fields() const
+	{
+		std::ostringstream out;
+		out << "\"status\":\"ok\",\"served\":" << served << ",\"failed\":" << failed << ",\"rejected\":" << rejected
+			<< ",\"timed_out\":" << timed_out << ",\"refused\":" << refused << ",\"connections\":" << connections << ",\"p50_ms\":" << percentile_ms(0.5) << ",\"p99_ms\":" << percentile_ms(0.99)
+			<< ",\"max_ms\":" << static_cast<double>(max_us) / 1000;
+		return out.str();
+	}
+};
+
+//-----------------------------  CONNECTIONS  ----------------------------------------------------------
+
+/**
+ * @brief A client socket, closed when the last request holding it is done
+ */
+struct Connection
+{
+	int fd;
+	std::mutex write_mutex;
+
+	explicit Connection(int fd) : fd(fd) {}
+	Connection(const Connection&) = delete;
+	Connection& operator=(const Connection&) = delete;
+	~Connection() { close(fd); }
+
+	// Writes one reply line, a client that went away is ignored
+	void send_line(const std::string &line)
+	{
+		const std::string data = line + "\n";
+		std::lock_guard<std::mutex> lock(write_mutex);
+		for (size_t sent = 0; sent < data.size();)
+		{
+			const ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+			if (n <= 0)
+				return;
+			sent += n;
+		}
+	}
+};
+
+struct Request
+{
+	std::shared_ptr<Connection> connection;
+	size_t id;
+	std::string line;
+	Clock::time_point received;
+};
+
+/**
+ * @brief Requests waiting for a worker, at most capacity of them
+ */
+struct RequestQueue
+{
+	size_t capacity;
+	std::deque<Request> requests;
+	std::mutex mutex;
+	std::condition_variable ready;
+
+	explicit RequestQueue(size_t capacity) : capacity(capacity) {}
+
+	bool try_push(Request &&request)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (requests.size() >= capacity)
+				return false;
+			requests.push_back(std::move(request));
+		}
+		ready.notify_one();
+		return true;
+	}
+
+	Request pop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		ready.wait(lock, [&] { return !requests.empty(); });
+		Request request = std::move(requests.front());
+		requests.pop_front();
+		return request;
+	}
+};
+
+static double milliseconds(Clock::duration duration)
+{
+	return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+/**
+ * @brief Reads request lines from one client until it disconnects, or sends
+ *		  more than max_request_bytes without a newline, which is answered
+ *		  with an error before the connection is closed. Gives its place in
+ *		  metrics.connections back.
+ */
+static void read_requests(std::shared_ptr<Connection> connection, size_t max_request_bytes, RequestQueue &queue, ServerMetrics &metrics)
+{
+	struct Release
+	{
+		ServerMetrics& metrics;
+		~Release() { metrics.connections--; }
+	} release{metrics};
+
+	std::string buffer;
+	char chunk[4096];
+	size_t next_id = 0;
+	while (true)
+	{
+		const ssize_t n = recv(connection->fd, chunk, sizeof(chunk), 0);
+		if (n <= 0)
+			return;
+		buffer.append(chunk, n);
+
+		size_t newline;
+		while ((newline = buffer.find('\n')) != std::string::npos)
+		{
+			std::string line = buffer.substr(0, newline);
+			buffer.erase(0, newline + 1);
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (line.empty())
+				continue;
+
+			const size_t id = next_id++;
+			if (!queue.try_push({connection, id, std::move(line), Clock::now()}))
+			{
+				metrics.rejected++;
+				connection->send_line("{\"id\":" + std::to_string(id) + ",\"status\":\"busy\"}");
+			}
+		}
+		if (buffer.size() > max_request_bytes)
+		{
+			metrics.failed++;
+			connection->send_line("{\"id\":" + std::to_string(next_id) + ",\"status\":\"error\",\"message\":\"Request longer than "
+								  + std::to_string(max_request_bytes) + " bytes\"}");
+			return;
+		}
+	}
+}
+
+/**
+ * @brief Serves queued requests until the process ends
+ */
+static void serve_requests(const Corpus &corpus, const ServerOptions &options, RequestQueue &queue, ServerMetrics &metrics)
+{
+	while (true)
+	{
+		Request request = queue.pop();
+		const Clock::time_point started = Clock::now();
+		const double queue_ms = milliseconds(started - request.received);
+		const std::string id = "{\"id\":" + std::to_string(request.id) + ",";
+		if (queue_ms > options.queue_timeout_ms)
+		{
+			metrics.timed_out++;
+			std::ostringstream reply;
+			reply << id << "\"status\":\"timeout\",\"queue_ms\":" << queue_ms << "}";
+			request.connection->send_line(reply.str());
+			continue;
+		}
+
+		std::string fields;
+		if (request.line == "stats")
+		{
+			fields = metrics.fields();
+			if (options.cache)
+			{
+				const CacheStats cache = options.cache->stats();
+				fields += ",\"cache_hits\":" + std::to_string(cache.hits) + ",\"cache_misses\":" + std::to_string(cache.misses)
+					+ ",\"cache_bytes\":" + std::to_string(cache.bytes);
+			}
+			const ScratchStats scratch = scratch_stats();
+			fields += ",\"scratch_buffers\":" + std::to_string(scratch.acquired) + ",\"scratch_allocations\":" + std::to_string(scratch.allocations);
+			if (profiling_compiled())
+				fields += ",\"counters\":" + counters_json(profile_counters());
+		}
+		else
+		{
+			try
+			{
+				QueryProfile profile;
+				const ProfileScope scope(options.profile ? &profile : nullptr);
+				fields = reply_fields(corpus, request.line, options.pool, options.cache);
+				if (options.profile)
+					fields += ",\"profile\":" + profile_json(profile);
+				metrics.served++;
+			}
+			catch (const std::exception &e)
+			{
+				fields = "\"status\":\"error\",\"message\":\"" + json_escape(e.what()) + "\"";
+				metrics.failed++;
+			}
+		}
+		const Clock::time_point finished = Clock::now();
+		metrics.record(std::chrono::duration_cast<std::chrono::microseconds>(finished - request.received).count());
+
+		std::ostringstream timing;
+		timing << ",\"queue_ms\":" << queue_ms << ",\"run_ms\":" << milliseconds(finished - started) << "}";
+		request.connection->send_line(id + fields + timing.str());
+	}
+}
+
+/**
+ *
+ * @param corpus A corpus, shared read only by every worker
+ * @param options Port, workers, queue capacity, queue timeout and connection and request limits
+ * @brief Listens on the port and serves requests until the process ends. A
+ *		  connection past the limit is answered busy and closed. Failing
+ *		  accepts, e.g. out of descriptors, are retried after a pause that
+ *		  doubles up to a second.
+ * @attention Throws an exception if the port can not be listened on
+ */
+void run_server(const Corpus &corpus, const ServerOptions &options)
+{
+	const int listener = socket(AF_INET, SOCK_STREAM, 0);
+	if (listener < 0)
+		throw std::invalid_argument("Could not create a socket");
+	const int reuse = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+	sockaddr_in address{};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(static_cast<uint16_t>(options.port));
+	if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0)
+	{
+		close(listener);
+		throw std::invalid_argument("Could not listen on port " + std::to_string(options.port));
+	}
+
+	RequestQueue queue(std::max<size_t>(options.queue_capacity, 1));
+	ServerMetrics metrics;
+	const unsigned worker_count = options.workers == 0 ? std::max(1u, std::thread::hardware_concurrency()) : options.workers;
+	std::vector<std::thread> workers;
+	for (unsigned w = 0; w < worker_count; ++w)
+		workers.emplace_back(serve_requests, std::cref(corpus), std::cref(options), std::ref(queue), std::ref(metrics));
+	std::cout << "Serving on port " << options.port << " with " << worker_count << " workers" << std::endl;
+
+	std::chrono::milliseconds pause(0);
+	while (true)
+	{
+		const int client = accept(listener, nullptr, nullptr);
+		if (client < 0)
+		{
+			if (errno != EINTR && errno != ECONNABORTED)
+			{
+				pause = std::clamp(pause * 2, std::chrono::milliseconds(10), std::chrono::milliseconds(1000));
+				std::this_thread::sleep_for(pause);
+			}
+			continue;
+		}
+		pause = std::chrono::milliseconds(0);
+
+		auto connection = std::make_shared<Connection>(client);
+		if (metrics.connections++ >= std::max<size_t>(options.max_connections, 1))
+		{
+			metrics.connections--;
+			metrics.refused++;
+			connection->send_line("{\"status\":\"busy\"}");
+			continue;
+		}
+		std::thread(read_requests, std::move(connection), std::max<size_t>(options.max_request_bytes, 1), std::ref(queue), std::ref(metrics)).detach();
+	}
+}
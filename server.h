@@ -0,0 +1,59 @@
+#include <string>
+#include "corpus.h"
+
+#ifndef SERVER_H
+#define SERVER_H
+/*********************************************************
+ * @brief
+ *			Concurrent query server over one shared corpus.
+ * @details
+ *			Clients connect over TCP and send one request per line, each
+ *			answered with one line of JSON carrying the request's number
+ *			on the connection, counted from 0. Requests may be pipelined;
+ *			replies come back as they finish, not always in order.
+ *				match <offset> <limit> <query>
+ *				count <query>
+ *				group <attribute> <clause> <query>
+ *				explain <query>
+ *				stats
+ *				shard ..., the requests of a coordinator, see shard.h
+ *
+ *			A thread per connection, up to a limit past which a client
+ *			is answered busy and closed, reads the requests into one
+ *			bounded queue, which a fixed pool of workers serves. A line
+ *			longer than the request limit is answered with an error and
+ *			closes its connection. The corpus is never written after
+ *			loading, so every worker reads it without locks. A request that finds the queue full is answered busy at
+ *			once, and one that waited in it past the queue timeout is
+ *			answered timeout without running; a request that started
+ *			runs to the end. Every reply carries its queue and run time,
+ *			and stats returns the totals and latency percentiles, and the
+ *			cache counters if the server has a cache, and the counters of
+ *			profile.h. With profile set, every reply also carries the
+ *			profile of its request.
+ */
+//*********************************************************
+
+class ThreadPool;
+class ResultCache;
+
+// ----------------- STRUCTS -----------------
+struct ServerOptions
+{
+	int port = 7878;
+	unsigned workers = 0;			// 0 means one per core
+	size_t queue_capacity = 256;	// Queued requests, more are answered busy
+	int queue_timeout_ms = 5000;	// Longest wait in the queue, a running request is not timed
+	size_t max_connections = 1024;	// Open connections, more are answered busy and closed
+	size_t max_request_bytes = 16 << 20;	// Longest request line, a longer one closes its connection
+	ThreadPool* pool = nullptr;		// Optional, counts matches in parallel
+	ResultCache* cache = nullptr;	// Optional, shared by all requests
+	bool profile = false;			// Adds the profile of each request to its reply, see profile.h
+};
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+std::string json_escape(const std::string &str);
+std::string serve_request(const Corpus &corpus, const std::string &request, ThreadPool *pool = nullptr, ResultCache *cache = nullptr);
+void run_server(const Corpus &corpus, const ServerOptions &options);
+
+#endif //SERVER_H
@@ -0,0 +1,691 @@
+#include "shard.h"
+#include "image.h"
+#include "pattern.h"
+
+#include <algorithm>
+#include <cctype>
+#include <exception>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//-----------------------------  BUILDING  ----------------------------------------------------------
+
+/**
+ *
+ * @param filenames Corpus files, one per shard, in sentence order
+ * @param prefix Path prefix of the images
+ * @param threads Threads parsing and indexing a file, 0 means one per core
+ * @brief Loads the files one after the other and writes shard i to <prefix>i.img,
+ *		  each interning into the dictionaries of the one before, see shard.h.
+ *		  The last dictionaries are written to <prefix>lexicon.img, an image
+ *		  without tokens.
+ * @attention Throws an exception if there are no files, or a file can not be
+ *			  loaded or an image written
+ */
+void build_shards(const std::vector<std::string> &filenames, const std::string &prefix, unsigned threads)
+{
+	if (filenames.empty())
+		throw std::invalid_argument("Error: no files to shard");
+
+	Corpus lexicon;	// Only the dictionaries are kept between shards
+	for (size_t i = 0; i < filenames.size(); ++i)
+	{
+		Corpus shard = i == 0 ? load_corpus(filenames[i], nullptr, threads) : load_segment(filenames[i], lexicon, nullptr, threads);
+		save_corpus_image(shard, prefix + std::to_string(i) + ".img");
+		lexicon = Corpus{};
+		lexicon.dictionaries = std::move(shard.dictionaries);
+	}
+
+	// An image needs the offsets tables, of an empty corpus here
+	build_columns(lexicon, {});
+	build_sentence_ids(lexicon);
+	build_indices(lexicon);
+	save_corpus_image(lexicon, prefix + "lexicon.img");
+}
+
+//-----------------------------  ENCODED QUERIES  ----------------------------------------------------------
+
+/**
+ * @brief Appends literal as attr=value or attr!=value, a pattern as
+ *		  attr={v,v,...} and a disjunction as (literal|literal|...)
+ */
+static void encode_literal(const Literal &literal, std::string &out)
+{
+	if (literal.alternatives)
+	{
+		out += '(';
+		for (size_t i = 0; i < literal.alternatives->size(); ++i)
+		{
+			if (i > 0)
+				out += '|';
+			encode_literal((*literal.alternatives)[i], out);
+		}
+		out += ')';
+		return;
+	}
+
+	out += attribute_name(literal.attribute);
+	out += literal.is_equality ? "=" : "!=";
+	if (!literal.values)
+	{
+		out += std::to_string(literal.value);
+		return;
+	}
+	out += '{';
+	for (size_t i = 0; i < literal.values->values.size(); ++i)
+		out += (i > 0 ? "," : "") + std::to_string(literal.values->values[i]);
+	out += '}';
+}
+
+/**
+ *
+ * @param sequence A parsed sequence
+ * @brief Writes the sequence with its values as string indexes, one
+ *		  [literal literal ...]{min,max} per clause, separated by spaces
+ * @return The encoded sequence, on one line
+ */
+std::string encode_sequence(const Sequence &sequence)
+{
+	std::string out;
+	for (const RepeatedClause &element : sequence)
+	{
+		if (!out.empty())
+			out += ' ';
+		out += '[';
+		for (size_t i = 0; i < element.clause.size(); ++i)
+		{
+			if (i > 0)
+				out += ' ';
+			encode_literal(element.clause[i], out);
+		}
+		out += "]{" + std::to_string(element.min) + "," + std::to_string(element.max) + "}";
+	}
+	return out;
+}
+
+/**
+ * @brief Reads an encoded sequence character by character
+ */
+struct EncodedReader
+{
+	const std::string &text;
+	size_t p = 0;
+
+	bool accept(char ch)
+	{
+		if (p < text.size() && text[p] == ch)
+		{
+			++p;
+			return true;
+		}
+		return false;
+	}
+
+	void expect(char ch)
+	{
+		if (!accept(ch))
+			throw std::invalid_argument("Malformed encoded query, expected '" + std::string(1, ch) + "' at " + std::to_string(p) + ": " + text);
+	}
+
+	std::string_view word()
+	{
+		const size_t start = p;
+		while (p < text.size() && std::isalnum(static_cast<unsigned char>(text[p])))
+			++p;
+		return std::string_view(text).substr(start, p - start);
+	}
+
+	uint32_t number()
+	{
+		const std::string_view digits = word();
+		if (digits.empty() || digits.size() > 10 || !std::all_of(digits.begin(), digits.end(), [](char ch) { return std::isdigit(static_cast<unsigned char>(ch)); }))
+			throw std::invalid_argument("Malformed encoded query, expected a number at " + std::to_string(p) + ": " + text);
+		const uint64_t value = std::stoull(std::string(digits));
+		if (value > std::numeric_limits<uint32_t>::max())
+			throw std::invalid_argument("Malformed encoded query, value out of range: " + text);
+		return static_cast<uint32_t>(value);
+	}
+};
+
+/**
+ *
+ * @param in The reader, at the start of a literal
+ * @param shard The corpus of the shard
+ * @brief Reads one literal. Values of a pattern that the shard's dictionary
+ *		  does not have yet can not occur in it and are dropped.
+ * @return The literal
+ */
+static Literal decode_literal(EncodedReader &in, const Corpus &shard)
+{
+	if (in.accept('('))
+	{
+		std::vector<Literal> alternatives;
+		do
+			alternatives.push_back(decode_literal(in, shard));
+		while (in.accept('|'));
+		in.expect(')');
+		const Attribute attribute = alternatives.front().attribute;
+		return Literal{attribute, 0, true, nullptr, std::make_shared<const std::vector<Literal>>(std::move(alternatives))};
+	}
+
+	Literal literal{parse_attribute(in.word()), 0, true, nullptr, nullptr};
+	literal.is_equality = !in.accept('!');
+	in.expect('=');
+	if (!in.accept('{'))
+	{
+		literal.value = in.number();
+		return literal;
+	}
+
+	const size_t size = shard.dictionary(literal.attribute).size();
+	const size_t start = in.p - 1;
+	std::vector<uint32_t> values;
+	if (!in.accept('}'))
+	{
+		do
+		{
+			const uint32_t value = in.number();
+			if (value < size)
+				values.push_back(value);
+		}
+		while (in.accept(','));
+		in.expect('}');
+	}
+	literal.values = make_value_set("=" + in.text.substr(start, in.p - start), std::move(values), size);
+	return literal;
+}
+
+/**
+ *
+ * @param text A sequence from encode_sequence()
+ * @param shard The corpus of the shard, whose dictionaries are a prefix of
+ *				those the sequence was parsed against
+ * @attention Throws an exception if the text is malformed or a repetition is
+ *			  out of range
+ * @return The sequence
+ */
+Sequence decode_sequence(const std::string &text, const Corpus &shard)
+{
+	EncodedReader in{text};
+	Sequence sequence;
+	do
+	{
+		in.expect('[');
+		Clause clause;
+		if (!in.accept(']'))
+		{
+			do
+				clause.push_back(decode_literal(in, shard));
+			while (in.accept(' '));
+			in.expect(']');
+		}
+		in.expect('{');
+		const uint32_t min = in.number();
+		in.expect(',');
+		const uint32_t max = in.number();
+		in.expect('}');
+		if (min > max || max == 0 || max > MAX_REPETITION)
+			throw std::invalid_argument("Malformed encoded query, invalid repetition: " + text);
+		sequence.push_back({std::move(clause), static_cast<int>(min), static_cast<int>(max)});
+	}
+	while (in.accept(' '));
+
+	if (in.p != text.size())
+		throw std::invalid_argument("Malformed encoded query, trailing characters: " + text);
+	return sequence;
+}
+
+//-----------------------------  SHARD REQUESTS  ----------------------------------------------------------
+
+/**
+ *
+ * @param corpus The corpus of the shard
+ * @param request The request after "shard", see shard.h
+ * @param pool Optional, counts matches in parallel
+ * @param cache Optional, shared by all requests
+ * @brief Runs one request of the coordinator. Matches come with the first
+ *		  position and the word values of their sentence.
+ * @attention Throws an exception if the request or its query is malformed
+ * @return The reply's JSON fields, without the enclosing braces
+ */
+std::string shard_reply_fields(const Corpus &corpus, const std::string &request, ThreadPool *pool, ResultCache *cache)
+{
+	std::istringstream in(request);
+	std::string command;
+	in >> command;
+	auto encoded = [&] {
+		std::string rest;
+		std::getline(in, rest);
+		rest.erase(0, rest.find_first_not_of(' '));
+		return decode_sequence(rest, corpus);
+	};
+
+	std::ostringstream out;
+	if (command == "info")
+	{
+		out << "\"status\":\"ok\",\"tokens\":" << corpus.token_count() << ",\"sentences\":" << corpus.sentences.size() << ",\"dictionary\":[";
+		for (size_t a = 0; a < ATTRIBUTE_COUNT; ++a)
+			out << (a ? "," : "") << corpus.dictionaries[a].size();
+		out << "]";
+	}
+	else if (command == "count")
+	{
+		out << "\"status\":\"ok\",\"count\":" << count(corpus, encoded(), pool, cache);
+	}
+	else if (command == "match")
+	{
+		size_t offset = 0;
+		size_t limit = 0;
+		if (!(in >> offset >> limit))
+			throw std::invalid_argument("Usage: shard match <offset> <limit> <encoded query>");
+
+		const std::vector<Match> matches = match2(corpus, encoded(), {offset, limit, false, nullptr, cache});
+		const Column& words = corpus.column(Attribute::word);
+		const int token_count = static_cast<int>(corpus.token_count());
+		out << "\"status\":\"ok\",\"matches\":[";
+		for (size_t i = 0; i < matches.size(); ++i)
+		{
+			const Match& match = matches[i];
+			const int first = corpus.sentences[match.sentence];
+			const int last = static_cast<size_t>(match.sentence) + 1 < corpus.sentences.size() ? corpus.sentences[match.sentence + 1] : token_count;
+			out << (i ? "," : "") << "{\"sentence\":" << match.sentence << ",\"pos\":" << match.pos << ",\"len\":" << match.len
+				<< ",\"first\":" << first << ",\"words\":[";
+			for (int p = first; p < last; ++p)
+				out << (p > first ? "," : "") << words[p];
+			out << "]}";
+		}
+		out << "]";
+	}
+	else if (command == "group")
+	{
+		std::string attribute;
+		size_t clause = 0;
+		if (!(in >> attribute >> clause))
+			throw std::invalid_argument("Usage: shard group <attribute> <clause> <encoded query>");
+		const Sequence sequence = encoded();
+		if (!is_fixed_length(sequence))
+			throw std::invalid_argument("Error: Repeated clauses can only be matched and counted");
+
+		const std::vector<ValueCount> histogram = group_by(corpus, fixed_query(sequence), attribute, clause);
+		out << "\"status\":\"ok\",\"values\":[";
+		for (size_t i = 0; i < histogram.size(); ++i)
+			out << (i ? "," : "") << "{\"value\":" << histogram[i].value << ",\"count\":" << histogram[i].count << "}";
+		out << "]";
+	}
+	else
+		throw std::invalid_argument("Unknown shard request: " + command);
+	return out.str();
+}
+
+//-----------------------------  REPLIES  ----------------------------------------------------------
+
+/**
+ * @param reply A reply line of a shard
+ * @param p Position to search from, moved past the number
+ * @param key A key of the reply
+ * @attention Throws an exception if the key is missing or not a number
+ * @return The integer after the next "key":
+ */
+static long long read_integer(const std::string &reply, size_t &p, const std::string &key)
+{
+	const std::string needle = "\"" + key + "\":";
+	const size_t found = reply.find(needle, p);
+	if (found == std::string::npos)
+		throw std::invalid_argument("Shard reply without " + key + ": " + reply);
+	p = found + needle.size();
+	size_t used = 0;
+	const long long value = std::stoll(reply.substr(p, 24), &used);
+	p += used;
+	return value;
+}
+
+/**
+ * @param reply A reply line of a shard
+ * @param p Position to search from, moved past the ] of the array
+ * @param key A key of the reply whose value is an array of integers
+ * @attention Throws an exception if the key is missing
+ * @return The integers of the array
+ */
+static std::vector<uint32_t> read_integers(const std::string &reply, size_t &p, const std::string &key)
+{
+	const std::string needle = "\"" + key + "\":[";
+	const size_t found = reply.find(needle, p);
+	if (found == std::string::npos)
+		throw std::invalid_argument("Shard reply without " + key + ": " + reply);
+	p = found + needle.size();
+
+	std::vector<uint32_t> values;
+	while (p < reply.size() && reply[p] != ']')
+	{
+		if (reply[p] == ',')
+		{
+			++p;
+			continue;
+		}
+		size_t used = 0;
+		values.push_back(static_cast<uint32_t>(std::stoul(reply.substr(p, 12), &used)));
+		p += used;
+	}
+	++p;
+	return values;
+}
+
+/**
+ * @param reply A reply line of a shard
+ * @param p Position to search from
+ * @param key A key of the reply whose value is an array of objects
+ * @brief Calls f with the position of each object of the array, f reads its
+ *		  fields and leaves p inside the object
+ */
+template<typename F>
+static void read_objects(const std::string &reply, const std::string &key, F &&f)
+{
+	const std::string needle = "\"" + key + "\":[";
+	size_t p = reply.find(needle);
+	if (p == std::string::npos)
+		throw std::invalid_argument("Shard reply without " + key + ": " + reply);
+	p += needle.size();
+	while (p < reply.size() && reply[p] == '{')
+	{
+		f(p);
+		p = reply.find('}', p);
+		if (p == std::string::npos)
+			throw std::invalid_argument("Truncated shard reply: " + reply);
+		if (++p < reply.size() && reply[p] == ',')
+			++p;
+	}
+}
+
+//-----------------------------  COORDINATOR  ----------------------------------------------------------
+
+/**
+ * @param address <host>:<port>
+ * @attention Throws an exception if the address is malformed or nothing
+ *			  accepts the connection
+ * @return A connected socket
+ */
+static int connect_to(const std::string &address)
+{
+	const size_t colon = address.rfind(':');
+	if (colon == std::string::npos || colon == 0 || colon + 1 == address.size())
+		throw std::invalid_argument("Shard address must be <host>:<port>, got " + address);
+	const std::string host = address.substr(0, colon);
+	const std::string port = address.substr(colon + 1);
+
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* found = nullptr;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0)
+		throw std::invalid_argument("Could not resolve shard " + address);
+
+	int fd = -1;
+	for (addrinfo* candidate = found; candidate && fd < 0; candidate = candidate->ai_next)
+	{
+		fd = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+		if (fd >= 0 && connect(fd, candidate->ai_addr, candidate->ai_addrlen) != 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(found);
+	if (fd < 0)
+		throw std::invalid_argument("Could not connect to shard " + address);
+	return fd;
+}
+
+/**
+ *
+ * @param lexicon The dictionaries of the last shard, see build_shards()
+ * @param addresses The shards' servers as <host>:<port>, in sentence order
+ * @brief Connects to every shard and asks for its size, which places its
+ *		  sentences and tokens after those of the shards before it
+ * @attention Throws an exception if a shard can not be reached, or knows
+ *			  strings the lexicon does not
+ */
+Coordinator::Coordinator(Corpus lexicon, const std::vector<std::string> &addresses) : dictionaries(std::move(lexicon))
+{
+	if (addresses.empty())
+		throw std::invalid_argument("Error: no shards to coordinate");
+	for (const std::string& address : addresses)
+	{
+		auto shard = std::make_unique<Shard>();
+		shard->address = address;
+		shard->fd = connect_to(address);
+		shards.push_back(std::move(shard));
+	}
+
+	const std::vector<std::string> replies = scatter(std::vector<std::string>(shards.size(), "shard info"));
+	size_t sentences = 0;
+	for (size_t s = 0; s < shards.size(); ++s)
+	{
+		size_t p = 0;
+		const long long tokens = read_integer(replies[s], p, "tokens");
+		const long long shard_sentences = read_integer(replies[s], p, "sentences");
+		const std::vector<uint32_t> sizes = read_integers(replies[s], p, "dictionary");
+		for (size_t a = 0; a < ATTRIBUTE_COUNT && a < sizes.size(); ++a)
+		{
+			if (sizes[a] > dictionaries.dictionaries[a].size())
+				throw std::invalid_argument("Error: shard " + shards[s]->address + " has " + attribute_name(static_cast<Attribute>(a))
+					+ " values the lexicon does not, it must be the lexicon of the last shard");
+		}
+		if (token_total + tokens > static_cast<size_t>(std::numeric_limits<int>::max()))
+			throw std::invalid_argument("Error: the shards hold more tokens than a position can address");
+
+		shards[s]->token_base = static_cast<int>(token_total);
+		shards[s]->sentence_base = static_cast<int>(sentences);
+		token_total += tokens;
+		sentences += shard_sentences;
+	}
+}
+
+/**
+ * @brief Closes the connections
+ */
+Coordinator::~Coordinator()
+{
+	for (const std::unique_ptr<Shard>& shard : shards)
+	{
+		if (shard->fd >= 0)
+			close(shard->fd);
+	}
+}
+
+/**
+ *
+ * @param shard A shard
+ * @param line One request
+ * @brief Sends the request and waits for its reply, one request at a time
+ *		  per shard
+ * @attention Throws an exception if the connection is lost or the reply is
+ *			  not ok
+ * @return The reply
+ */
+std::string Coordinator::request(Shard &shard, const std::string &line)
+{
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	const std::string data = line + "\n";
+	for (size_t sent = 0; sent < data.size();)
+	{
+		const ssize_t n = send(shard.fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			throw std::invalid_argument("Lost the connection to shard " + shard.address);
+		sent += n;
+	}
+
+	size_t newline;
+	char chunk[65536];
+	while ((newline = shard.buffer.find('\n')) == std::string::npos)
+	{
+		const ssize_t n = recv(shard.fd, chunk, sizeof(chunk), 0);
+		if (n <= 0)
+			throw std::invalid_argument("Lost the connection to shard " + shard.address);
+		shard.buffer.append(chunk, n);
+	}
+	std::string reply = shard.buffer.substr(0, newline);
+	shard.buffer.erase(0, newline + 1);
+
+	if (reply.find("\"status\":\"ok\"") == std::string::npos)
+		throw std::invalid_argument("Shard " + shard.address + " failed: " + reply);
+	return reply;
+}
+
+/**
+ *
+ * @param lines One request per shard, an empty one is not sent
+ * @brief Sends the requests to their shards at once, a thread per shard
+ * @attention Rethrows the first error in shard order
+ * @return The replies, empty for requests not sent
+ */
+std::vector<std::string> Coordinator::scatter(const std::vector<std::string> &lines)
+{
+	std::vector<std::string> replies(shards.size());
+	std::vector<std::exception_ptr> errors(shards.size());
+	std::vector<std::thread> workers;
+	for (size_t s = 0; s < shards.size(); ++s)
+	{
+		if (lines[s].empty())
+			continue;
+		workers.emplace_back([&, s] {
+			try
+			{
+				replies[s] = request(*shards[s], lines[s]);
+			}
+			catch (...)
+			{
+				errors[s] = std::current_exception();
+			}
+		});
+	}
+	for (std::thread& worker : workers)
+		worker.join();
+	for (const std::exception_ptr& error : errors)
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+	return replies;
+}
+
+/**
+ * @param sequence A sequence parsed against lexicon()
+ * @return Number of matches, the sum over the shards
+ */
+size_t Coordinator::count(const Sequence &sequence)
+{
+	const std::vector<std::string> replies = scatter(std::vector<std::string>(shards.size(), "shard count " + encode_sequence(sequence)));
+	size_t total = 0;
+	for (const std::string& reply : replies)
+	{
+		size_t p = 0;
+		total += read_integer(reply, p, "count");
+	}
+	return total;
+}
+
+/**
+ *
+ * @param sequence A sequence parsed against lexicon()
+ * @param offset Matches skipped before the first one returned
+ * @param limit Most matches returned
+ * @param total Optional output, number of matches on all shards
+ * @brief Counts on every shard, then fetches the range of matches from the
+ *		  shards that hold it, see shard.h
+ * @return The matches in global order, with global positions
+ */
+std::vector<ShardMatch> Coordinator::match(const Sequence &sequence, size_t offset, size_t limit, size_t *total)
+{
+	const std::string encoded = encode_sequence(sequence);
+	const std::vector<std::string> counts = scatter(std::vector<std::string>(shards.size(), "shard count " + encoded));
+
+	std::vector<std::string> lines(shards.size());
+	size_t found = 0;
+	for (size_t s = 0; s < shards.size(); ++s)
+	{
+		size_t p = 0;
+		const size_t shard_count = read_integer(counts[s], p, "count");
+		found += shard_count;
+		if (offset >= shard_count)
+		{
+			offset -= shard_count;
+			continue;
+		}
+		const size_t wanted = std::min(limit, shard_count - offset);
+		if (wanted > 0)
+			lines[s] = "shard match " + std::to_string(offset) + " " + std::to_string(wanted) + " " + encoded;
+		offset = 0;
+		limit -= wanted;
+	}
+	if (total)
+		*total = found;
+
+	const std::vector<std::string> replies = scatter(lines);
+	std::vector<ShardMatch> matches;
+	for (size_t s = 0; s < shards.size(); ++s)
+	{
+		if (lines[s].empty())
+			continue;
+		const Shard& shard = *shards[s];
+		read_objects(replies[s], "matches", [&](size_t &p) {
+			ShardMatch match;
+			match.match.sentence = static_cast<int>(read_integer(replies[s], p, "sentence")) + shard.sentence_base;
+			match.match.pos = static_cast<int>(read_integer(replies[s], p, "pos")) + shard.token_base;
+			match.match.len = static_cast<int>(read_integer(replies[s], p, "len"));
+			match.sentence_start = static_cast<int>(read_integer(replies[s], p, "first")) + shard.token_base;
+			match.words = read_integers(replies[s], p, "words");
+			matches.push_back(std::move(match));
+		});
+	}
+	return matches;
+}
+
+/**
+ *
+ * @param query A query parsed against lexicon()
+ * @param attribute Attribute to count, word, c5, lemma or pos
+ * @param clause Clause of the query whose token is counted
+ * @brief Adds up the histograms of the shards, see group_by()
+ * @attention Throws an exception if the attribute is unknown or the clause is
+ *			  past the end of the query
+ * @return The values that occur, most frequent first
+ */
+std::vector<ValueCount> Coordinator::group_by(const Query &query, const std::string &attribute, size_t clause)
+{
+	if (clause >= query.size())
+		throw std::invalid_argument("Clause " + std::to_string(clause) + " is not in the query");
+	const Attribute counted = parse_attribute(attribute);
+
+	Sequence sequence;
+	for (const Clause& element : query)
+		sequence.push_back({element, 1, 1});
+	const std::string line = "shard group " + std::string(attribute_name(counted)) + " " + std::to_string(clause) + " " + encode_sequence(sequence);
+	const std::vector<std::string> replies = scatter(std::vector<std::string>(shards.size(), line));
+
+	std::vector<size_t> counts(dictionaries.dictionary(counted).size(), 0);
+	for (const std::string& reply : replies)
+	{
+		read_objects(reply, "values", [&](size_t &p) {
+			const long long value = read_integer(reply, p, "value");
+			const long long found = read_integer(reply, p, "count");
+			if (value >= 0 && static_cast<size_t>(value) < counts.size())
+				counts[value] += found;
+		});
+	}
+
+	std::vector<ValueCount> histogram;
+	for (size_t value = 0; value < counts.size(); ++value)
+	{
+		if (counts[value] > 0)
+			histogram.push_back({static_cast<uint32_t>(value), counts[value]});
+	}
+	std::sort(histogram.begin(), histogram.end(), [](const ValueCount& a, const ValueCount& b) {
+		return a.count != b.count ? a.count > b.count : a.value < b.value;
+	});
+	return histogram;
+}
@@ -0,0 +1,102 @@
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "corpus.h"
+
+#ifndef SHARD_H
+#define SHARD_H
+/*********************************************************
+ * @brief
+ *			A corpus split by sentence ranges over several servers, and
+ *			the coordinator that queries them as one.
+ * @details
+ *			build_shards() turns a list of corpus files, in order, into
+ *			one image per shard plus a lexicon image that holds only the
+ *			dictionaries. Every shard interns into the dictionaries of
+ *			the shard before it, see load_segment(), so a string has the
+ *			same index on every shard and the lexicon, the dictionaries
+ *			of the last shard, knows all of them. Only one shard is in
+ *			memory at a time.
+ *
+ *			Each shard is an ordinary server, see server.h, and the
+ *			coordinator loads the lexicon and parses a query once
+ *			against it. The parsed query is sent to the shards with its
+ *			values as string indexes, see encode_sequence(), so a shard
+ *			never parses strings or expands patterns, and requests go
+ *			to all shards at once:
+ *				- count adds up the counts of the shards
+ *				- match first counts on every shard, then asks only the
+ *				  shards that hold the wanted range of matches for
+ *				  their part of it, and offsets their sentences and
+ *				  positions by those of the shards before them
+ *				- group adds up the histograms of the shards
+ *			The shards answer the requests below, with the token ids of
+ *			a match's sentence so the coordinator can show it:
+ *				shard info
+ *				shard count <encoded query>
+ *				shard match <offset> <limit> <encoded query>
+ *				shard group <attribute> <clause> <encoded query>
+ */
+//*********************************************************
+
+// ----------------- STRUCTS -----------------
+
+/**
+ * @brief A match with global positions, and the words of its sentence
+ */
+struct ShardMatch
+{
+	Match match;
+	int sentence_start;				// Global position of the sentence's first token
+	std::vector<uint32_t> words;	// Word values of the sentence, in the lexicon
+};
+
+class Coordinator
+{
+public:
+	Coordinator(Corpus lexicon, const std::vector<std::string> &addresses);
+	Coordinator(const Coordinator&) = delete;
+	Coordinator& operator=(const Coordinator&) = delete;
+	~Coordinator();
+
+	const Corpus& lexicon() const { return dictionaries; }
+	size_t shard_count() const { return shards.size(); }
+	size_t token_count() const { return token_total; }
+
+	size_t count(const Sequence &sequence);
+	std::vector<ShardMatch> match(const Sequence &sequence, size_t offset, size_t limit, size_t *total = nullptr);
+	std::vector<ValueCount> group_by(const Query &query, const std::string &attribute, size_t clause);
+
+private:
+	struct Shard
+	{
+		std::string address;
+		int fd = -1;
+		std::string buffer;	// Received bytes after the last reply
+		std::mutex mutex;	// One request at a time on the connection
+		int token_base = 0;
+		int sentence_base = 0;
+	};
+
+	std::string request(Shard &shard, const std::string &line);
+	std::vector<std::string> scatter(const std::vector<std::string> &lines);
+
+	Corpus dictionaries;
+	std::vector<std::unique_ptr<Shard>> shards;	// In sentence order
+	size_t token_total = 0;
+};
+
+// ----------------- FUNCTION DECLARATIONS -----------------
+
+// Building
+void build_shards(const std::vector<std::string> &filenames, const std::string &prefix, unsigned threads = 1);
+
+// Queries on the wire
+std::string encode_sequence(const Sequence &sequence);
+Sequence decode_sequence(const std::string &text, const Corpus &shard);
+
+// Shard side of the protocol
+std::string shard_reply_fields(const Corpus &corpus, const std::string &request, ThreadPool *pool = nullptr, ResultCache *cache = nullptr);
+
+#endif //SHARD_H
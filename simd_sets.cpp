@@ -0,0 +1,386 @@
+#include "simd_sets.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_SETS_X86 1
+#endif
+
+//-----------------------------  SCALAR  ----------------------------------------------------------
+
+/**
+ * @brief Merge intersection of A[i..] and B[j..], appending to out[count..]
+ * @return The new number of elements in out
+ */
+static size_t intersect_tail(const int* A, size_t a_size, int A_shift, const int* B, size_t b_size, int B_shift,
+	size_t i, size_t j, int* out, size_t count)
+{
+	while (i < a_size && j < b_size)
+	{
+		const int x = A[i] - A_shift;
+		const int y = B[j] - B_shift;
+		if (x < y) {
+			++i;
+		} else if (y < x) {
+			++j;
+		} else {
+			out[count++] = x; // Found an intersection
+			++i;
+			++j;
+		}
+	}
+	return count;
+}
+
+/**
+ * @brief Merge difference of A[i..] and B[j..], appending to out[count..].
+ *		  Bit k of found marks A[i+k] as already seen in B by a vector kernel.
+ * @return The new number of elements in out
+ */
+static size_t diff_tail(const int* A, size_t a_size, int A_shift, const int* B, size_t b_size, int B_shift,
+	size_t i, size_t j, uint32_t found, int* out, size_t count)
+{
+	for (size_t k = 0; i < a_size; ++i, ++k)
+	{
+		const int x = A[i] - A_shift;
+		while (j < b_size && B[j] - B_shift < x)
+			++j;
+
+		const bool in_b = (j < b_size && B[j] - B_shift == x) || (k < 32 && (found >> k) & 1);
+		if (!in_b)
+			out[count++] = x; // A[i] is not in B
+	}
+	return count;
+}
+
+/**
+ * @brief Keeps the starts whose match, last_offset tokens long after the start,
+ *		  ends inside the corpus and in the same sentence. Appends to out[kept..]
+ * @return The new number of elements in out
+ */
+static size_t same_sentence_tail(const int* starts, size_t count, int last_offset,
+	const int* sentence_ids, int id_count, size_t i, int* out, size_t kept)
+{
+	for (; i < count; ++i)
+	{
+		const int start = starts[i];
+		const int last = start + last_offset;
+		if (last < id_count && sentence_ids[start] == sentence_ids[last])
+			out[kept++] = start;
+	}
+	return kept;
+}
+
+#ifdef SIMD_SETS_X86
+//-----------------------------  AVX2  ----------------------------------------------------------
+
+/**
+ * @brief For each 8 bit lane mask, the permutation that moves the selected lanes
+ *		  to the front of a vector.
+ */
+static const std::array<std::array<int, 8>, 256> COMPRESS_LUT = [] {
+	std::array<std::array<int, 8>, 256> lut{};
+	for (int mask = 0; mask < 256; ++mask)
+	{
+		int n = 0;
+		for (int lane = 0; lane < 8; ++lane)
+		{
+			if (mask & (1 << lane))
+				lut[mask][n++] = lane;
+		}
+	}
+	return lut;
+}();
+
+/**
+ * @brief Compares every lane of va with every lane of vb
+ * @return Bit k is set if lane k of va occurs in vb
+ */
+__attribute__((target("avx2")))
+static inline uint32_t block_matches_avx2(__m256i va, __m256i vb)
+{
+	__m256i eq = _mm256_cmpeq_epi32(va, vb);
+	for (int r = 1; r < 8; ++r)
+	{
+		const __m256i rotation = _mm256_setr_epi32(r, (r + 1) % 8, (r + 2) % 8, (r + 3) % 8,
+			(r + 4) % 8, (r + 5) % 8, (r + 6) % 8, (r + 7) % 8);
+		eq = _mm256_or_si256(eq, _mm256_cmpeq_epi32(va, _mm256_permutevar8x32_epi32(vb, rotation)));
+	}
+	return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(eq)));
+}
+
+/**
+ * @brief Stores the lanes of v selected by mask at out, packed to the front
+ * @return Number of lanes stored
+ */
+__attribute__((target("avx2,popcnt")))
+static inline size_t compress_store_avx2(int* out, __m256i v, uint32_t mask)
+{
+	const __m256i permutation = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(COMPRESS_LUT[mask].data()));
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permutevar8x32_epi32(v, permutation));
+	return __builtin_popcount(mask);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t intersect_avx2(const int* A, size_t a_size, int A_shift, const int* B, size_t b_size, int B_shift, int* out)
+{
+	size_t i = 0, j = 0, count = 0;
+	const __m256i a_shift = _mm256_set1_epi32(A_shift);
+	const __m256i b_shift = _mm256_set1_epi32(B_shift);
+
+	while (i + 8 <= a_size && j + 8 <= b_size)
+	{
+		const __m256i va = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(A + i)), a_shift);
+		const __m256i vb = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(B + j)), b_shift);
+		count += compress_store_avx2(out + count, va, block_matches_avx2(va, vb));
+
+		// Advance the block(s) whose largest element is smallest
+		const int a_max = A[i + 7] - A_shift;
+		const int b_max = B[j + 7] - B_shift;
+		if (a_max <= b_max) i += 8;
+		if (b_max <= a_max) j += 8;
+	}
+	return intersect_tail(A, a_size, A_shift, B, b_size, B_shift, i, j, out, count);
+}
+
+/**
+ * @brief Gathers the sentence of the first and last token of 8 matches at a time
+ */
+__attribute__((target("avx2,popcnt")))
+static size_t same_sentence_avx2(const int* starts, size_t count, int last_offset, const int* sentence_ids, int id_count, int* out)
+{
+	size_t i = 0, kept = 0;
+	const __m256i offset = _mm256_set1_epi32(last_offset);
+	const __m256i limit = _mm256_set1_epi32(id_count);
+
+	for (; i + 8 <= count; i += 8)
+	{
+		const __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(starts + i));
+		const __m256i last = _mm256_add_epi32(first, offset);
+		const __m256i inside = _mm256_cmpgt_epi32(limit, last);
+		// Lanes past the corpus are not gathered
+		const __m256i first_ids = _mm256_i32gather_epi32(sentence_ids, first, 4);
+		const __m256i last_ids = _mm256_mask_i32gather_epi32(_mm256_set1_epi32(-1), sentence_ids, last, inside, 4);
+		const __m256i keep = _mm256_and_si256(inside, _mm256_cmpeq_epi32(first_ids, last_ids));
+		kept += compress_store_avx2(out + kept, first, static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(keep))));
+	}
+	return same_sentence_tail(starts, count, last_offset, sentence_ids, id_count, i, out, kept);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t difference_avx2(const int* A, size_t a_size, int A_shift, const int* B, size_t b_size, int B_shift, int* out)
+{
+	size_t i = 0, j = 0, count = 0;
+	uint32_t found = 0; // Lanes of the current A block seen in B so far
+	const __m256i a_shift = _mm256_set1_epi32(A_shift);
+	const __m256i b_shift = _mm256_set1_epi32(B_shift);
+
+	while (i + 8 <= a_size && j + 8 <= b_size)
+	{
+		const __m256i va = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(A + i)), a_shift);
+		const __m256i vb = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(B + j)), b_shift);
+		found |= block_matches_avx2(va, vb);
+
+		// An A block is final once no later B block can contain its elements
+		const int a_max = A[i + 7] - A_shift;
+		const int b_max = B[j + 7] - B_shift;
+		if (a_max <= b_max)
+		{
+			count += compress_store_avx2(out + count, va, ~found & 0xFF);
+			found = 0;
+			i += 8;
+		}
+		if (b_max <= a_max) j += 8;
+	}
+	return diff_tail(A, a_size, A_shift, B, b_size, B_shift, i, j, found, out, count);
+}
+
+//-----------------------------  AVX-512  ----------------------------------------------------------
+
+/**
+ * @brief Compares every lane of va with every lane of vb
+ * @return Bit k is set if lane k of va occurs in vb
+ */
+__attribute__((target("avx512f")))
+static inline uint32_t block_matches_avx512(__m512i va, __m512i vb)
+{
+	// alignr needs the rotation as an immediate. The zero masked form with every
+	// lane kept is the same instruction, without the undefined source GCC warns about.
+#define MATCH_ROTATION(r) | _mm512_cmpeq_epi32_mask(va, _mm512_maskz_alignr_epi32(0xFFFF, vb, vb, r))
+	return _mm512_cmpeq_epi32_mask(va, vb)
+		MATCH_ROTATION(1) MATCH_ROTATION(2) MATCH_ROTATION(3) MATCH_ROTATION(4)
+		MATCH_ROTATION(5) MATCH_ROTATION(6) MATCH_ROTATION(7) MATCH_ROTATION(8)
+		MATCH_ROTATION(9) MATCH_ROTATION(10) MATCH_ROTATION(11) MATCH_ROTATION(12)
+		MATCH_ROTATION(13) MATCH_ROTATION(14) MATCH_ROTATION(15);
+#undef MATCH_ROTATION
+}
+
+__attribute__((target("avx512f,popcnt")))
+static inline size_t compress_store_avx512(int* out, __m512i v, uint32_t mask)
+{
+	_mm512_storeu_si512(out, _mm512_maskz_compress_epi32(static_cast<__mmask16>(mask), v));
+	return __builtin_popcount(mask);
+}
+
+__attribute__((target("avx512f,popcnt")))
+static size_t intersect_avx512(const int* A, size_t a_size, int A_shift, const int* B, size_t b_size, int B_shift, int* out)
+{
+	size_t i = 0, j = 0, count = 0;
+	const __m512i a_shift = _mm512_set1_epi32(A_shift);
+	const __m512i b_shift = _mm512_set1_epi32(B_shift);
+
+	while (i + 16 <= a_size && j + 16 <= b_size)
+	{
+		const __m512i va = _mm512_sub_epi32(_mm512_loadu_si512(A + i), a_shift);
+		const __m512i vb = _mm512_sub_epi32(_mm512_loadu_si512(B + j), b_shift);
+		count += compress_store_avx512(out + count, va, block_matches_avx512(va, vb));
+
+		const int a_max = A[i + 15] - A_shift;
+		const int b_max = B[j + 15] - B_shift;
+		if (a_max <= b_max) i += 16;
+		if (b_max <= a_max) j += 16;
+	}
+	return intersect_tail(A, a_size, A_shift, B, b_size, B_shift, i, j, out, count);
+}
+
+__attribute__((target("avx512f,popcnt")))
+static size_t difference_avx512(const int* A, size_t a_size, int A_shift, const int* B, size_t b_size, int B_shift, int* out)
+{
+	size_t i = 0, j = 0, count = 0;
+	uint32_t found = 0;
+	const __m512i a_shift = _mm512_set1_epi32(A_shift);
+	const __m512i b_shift = _mm512_set1_epi32(B_shift);
+
+	while (i + 16 <= a_size && j + 16 <= b_size)
+	{
+		const __m512i va = _mm512_sub_epi32(_mm512_loadu_si512(A + i), a_shift);
+		const __m512i vb = _mm512_sub_epi32(_mm512_loadu_si512(B + j), b_shift);
+		found |= block_matches_avx512(va, vb);
+
+		const int a_max = A[i + 15] - A_shift;
+		const int b_max = B[j + 15] - B_shift;
+		if (a_max <= b_max)
+		{
+			count += compress_store_avx512(out + count, va, ~found & 0xFFFF);
+			found = 0;
+			i += 16;
+		}
+		if (b_max <= a_max) j += 16;
+	}
+	return diff_tail(A, a_size, A_shift, B, b_size, B_shift, i, j, found, out, count);
+}
+#endif
+
+//-----------------------------  DISPATCH  ----------------------------------------------------------
+
+/**
+ * @return The widest instruction set supported by this CPU
+ */
+SimdLevel detected_simd_level()
+{
+#ifdef SIMD_SETS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SimdLevel::AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return SimdLevel::AVX2;
+#endif
+	return SimdLevel::SCALAR;
+}
+
+/**
+ * @brief The 8 lane AVX2 kernels have measured faster than the 16 lane AVX-512
+ *		  ones (fewer compares per block, no frequency penalty), so AVX2 is the
+ *		  default whenever present. AVX-512 can still be chosen with set_simd_level.
+ */
+static SimdLevel default_simd_level()
+{
+	return std::min(detected_simd_level(), SimdLevel::AVX2);
+}
+
+static std::atomic<SimdLevel> current_level = default_simd_level();
+
+/**
+ * @return The instruction set the kernels currently use
+ */
+SimdLevel simd_level()
+{
+	return current_level.load(std::memory_order_relaxed);
+}
+
+/**
+ * @param level Wanted instruction set, e.g. SCALAR to compare against the vector kernels
+ * @brief Selects the kernels to use, limited to what the CPU supports
+ */
+void set_simd_level(SimdLevel level)
+{
+	current_level.store(std::min(level, detected_simd_level()), std::memory_order_relaxed);
+}
+
+const char* simd_level_name(SimdLevel level)
+{
+	switch (level)
+	{
+		case SimdLevel::AVX512: return "avx512";
+		case SimdLevel::AVX2: return "avx2";
+		default: return "scalar";
+	}
+}
+
+/**
+ * Computes the intersection of two sorted sets.
+ * @param out Room for min(a_size, b_size) + SIMD_OUTPUT_PADDING elements
+ * @return Number of elements written to out
+ */
+size_t simd_intersect(const int* A, size_t a_size, int A_shift, const int* B, size_t b_size, int B_shift, int* out)
+{
+#ifdef SIMD_SETS_X86
+	switch (simd_level())
+	{
+		case SimdLevel::AVX512: return intersect_avx512(A, a_size, A_shift, B, b_size, B_shift, out);
+		case SimdLevel::AVX2: return intersect_avx2(A, a_size, A_shift, B, b_size, B_shift, out);
+		default: break;
+	}
+#endif
+	return intersect_tail(A, a_size, A_shift, B, b_size, B_shift, 0, 0, out, 0);
+}
+
+/**
+ * Computes the difference A \ B of two sorted sets.
+ * @param out Room for a_size + SIMD_OUTPUT_PADDING elements
+ * @return Number of elements written to out
+ */
+size_t simd_difference(const int* A, size_t a_size, int A_shift, const int* B, size_t b_size, int B_shift, int* out)
+{
+#ifdef SIMD_SETS_X86
+	switch (simd_level())
+	{
+		case SimdLevel::AVX512: return difference_avx512(A, a_size, A_shift, B, b_size, B_shift, out);
+		case SimdLevel::AVX2: return difference_avx2(A, a_size, A_shift, B, b_size, B_shift, out);
+		default: break;
+	}
+#endif
+	return diff_tail(A, a_size, A_shift, B, b_size, B_shift, 0, 0, 0, out, 0);
+}
+
+/**
+ * Filters match starts to the matches that stay inside one sentence.
+ * @param starts Match starts, each in [0, id_count)
+ * @param last_offset Offset of the last token of a match, query length - 1
+ * @param sentence_ids Sentence of each token
+ * @param out Room for count + SIMD_OUTPUT_PADDING elements, may be starts itself
+ * @return Number of starts written to out
+ */
+size_t simd_same_sentence(const int* starts, size_t count, int last_offset, const int* sentence_ids, int id_count, int* out)
+{
+#ifdef SIMD_SETS_X86
+	// There is no AVX-512 version, the gathers dominate at either width
+	if (simd_level() != SimdLevel::SCALAR)
+		return same_sentence_avx2(starts, count, last_offset, sentence_ids, id_count, out);
+#endif
+	return same_sentence_tail(starts, count, last_offset, sentence_ids, id_count, 0, out, 0);
+}
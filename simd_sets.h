@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <cstddef>
+
+#ifndef SIMD_SETS_H
+#define SIMD_SETS_H
+/*********************************************************
+ * @brief
+ *			Vectorized kernels for sorted sets of token positions.
+ * @details
+ *			Block-compare intersection and difference of two sorted,
+ *			duplicate free int arrays, each with its own shift. Every
+ *			element of a block of A is compared against every rotation
+ *			of a block of B, and the matching (or non matching) lanes
+ *			are compressed into the output. The instruction set is
+ *			picked at runtime: AVX2 when the CPU has it, otherwise a
+ *			scalar merge. AVX-512 kernels exist but are only used when
+ *			selected with set_simd_level().
+ *
+ *			Output elements are A[i] - A_shift, like the merge kernels in
+ *			corpus.cpp. The output buffer must have room for the largest
+ *			possible result plus SIMD_OUTPUT_PADDING elements, since whole
+ *			vectors are stored.
+ *
+ *			simd_same_sentence() filters the match starts of a query to
+ *			the matches that do not cross a sentence boundary, by gathering
+ *			the sentence ids of their first and last token.
+ *
+ *			Also holds gallop(), the exponential search shared by the
+ *			galloping and block skipping kernels.
+ */
+//*********************************************************
+
+constexpr size_t SIMD_OUTPUT_PADDING = 16;
+
+// Size ratio above which galloping beats a linear merge
+constexpr size_t GALLOP_RATIO = 10;
+
+enum class SimdLevel
+{
+	SCALAR,
+	AVX2,
+	AVX512
+};
+
+SimdLevel detected_simd_level();
+SimdLevel simd_level();
+void set_simd_level(SimdLevel level);
+const char* simd_level_name(SimdLevel level);
+
+size_t simd_intersect(const int* A, size_t a_size, int A_shift, const int* B, size_t b_size, int B_shift, int* out);
+size_t simd_difference(const int* A, size_t a_size, int A_shift, const int* B, size_t b_size, int B_shift, int* out);
+size_t simd_same_sentence(const int* starts, size_t count, int last_offset, const int* sentence_ids, int id_count, int* out);
+
+/**
+ * Finds the first element of B that is not less than target.
+ * @param B A sorted set
+ * @param lo Position to start from, every element before it is less than target
+ * @param target The value to find
+ * @brief  Doubles the step from lo until it passes target, then binary searches
+ *		  the last step. Costs O(log d) where d is the distance moved.
+ * @return Position of the first element >= target, or B.size()
+ */
+template<typename T>
+size_t gallop(const T& B, size_t lo, int target)
+{
+	size_t step = 1;
+	size_t hi = lo;
+	while (hi < B.size() && B[hi] < target)
+	{
+		lo = hi + 1;
+		hi += step;
+		step *= 2;
+	}
+	hi = std::min(hi, B.size());
+	return std::lower_bound(B.begin() + lo, B.begin() + hi, target) - B.begin();
+}
+
+#endif //SIMD_SETS_H
@@ -0,0 +1,170 @@
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+#include "../bitmap.h"
+#include "../compressed.h"
+#include "../corpus.h"
+#include "../planner.h"
+
+/*********************************************************
+ * @brief
+ *			The steady state of running a planned query makes no heap
+ *			allocations.
+ * @details
+ *			Every allocation of the program goes through the counting
+ *			operator new below. A plan is executed and streamed once to
+ *			warm the scratch buffers of the thread, see scratch.h, then
+ *			again with the counter watched, which must not move. That
+ *			holds for plain, bitmap and compressed indexes alike.
+ *			Planning itself still allocates its operand list, and only
+ *			builds the labels of explain() when asked to.
+ */
+//*********************************************************
+
+static std::atomic<size_t> allocations{0};
+
+void* operator new(std::size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	const size_t align = static_cast<size_t>(alignment);
+	if (void* p = std::aligned_alloc(align, (size + align - 1) / align * align))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what)
+{
+	if (!condition)
+	{
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+/**
+ *
+ * @param filename File to write
+ * @brief Writes a corpus in the format of load_corpus(), an empty row after each sentence
+ */
+static void write_corpus(const std::string &filename)
+{
+	static const char* const tags[] = {"SUBST", "VERB", "ADJ", "ART", "SUBST", "PREP"};
+	std::ofstream out(filename);
+	out << "word\tc5\tlemma\tpos\n";
+	int token = 0;
+	for (int s = 0; s < 4000; ++s)
+	{
+		out << "# sentence " << s + 1 << ", Texts/A/A0/A01.xml\n";
+		for (int t = 0; t < 4 + s % 11; ++t, ++token)
+		{
+			const std::string word = "w" + std::to_string(token * 31 % 900);
+			out << word << "\tNN1\t" << word << "\t" << tags[token % 6] << "\n";
+		}
+		out << "\n";
+	}
+}
+
+/**
+ * @return Heap allocations made by f
+ */
+template<typename F>
+static size_t allocations_of(F &&f)
+{
+	const size_t before = allocations.load(std::memory_order_relaxed);
+	f();
+	return allocations.load(std::memory_order_relaxed) - before;
+}
+
+int main()
+{
+	const std::filesystem::path directory = std::filesystem::temp_directory_path() / "alloc_test";
+	std::filesystem::create_directories(directory);
+	const std::string file = (directory / "corpus.csv").string();
+	write_corpus(file);
+
+	const std::vector<std::string> queries = {
+		"[word=\"w7\"]",
+		"[pos=\"SUBST\"] [pos=\"VERB\"]",
+		"[pos=\"ART\"] [] [pos!=\"SUBST\"]",
+		"[word!=\"w1\" pos=\"ADJ\"]",
+		"[word=\"w0\"] [word=\"w31\"]",
+	};
+	for (const std::string indexes : {"plain", "bitmaps", "compressed"})
+	{
+		Corpus corpus = load_corpus(file);
+		if (indexes != "plain")
+			build_bitmap_indices(corpus, 0.01);
+		if (indexes == "compressed")
+			compress_indices(corpus);
+
+		for (const std::string& text : queries)
+		{
+			const Query query = parse_query(text, corpus);
+			QueryPlan plan;
+			check(allocations_of([&] { plan = plan_query(corpus, query); }) > 0, indexes + " " + text + ": planning not counted");
+			for (const PlanOperand& operand : plan.operands)
+				check(operand.label.empty(), indexes + " " + text + ": operand labelled without explain");
+
+			size_t matches = 0;
+			const std::function<bool(const Match &)> f = [&matches](const Match &) {
+				++matches;
+				return true;
+			};
+			ResultOptions counted;
+			counted.count_only = true;
+			ResultOptions page;
+			page.offset = 5;
+			page.limit = 20;
+			const int len = static_cast<int>(query.size());
+			auto run = [&] {
+				execute_plan(plan);
+				stream_plan(corpus, plan, len, f, counted);
+				stream_plan(corpus, plan, len, f);
+				stream_plan(corpus, plan, len, f, page);
+			};
+			run();
+			const size_t allocated = allocations_of(run);
+			check(allocated == 0, indexes + " " + text + ": " + std::to_string(allocated) + " allocations in the steady state");
+			check(matches > 0, indexes + " " + text + ": no matches");
+		}
+	}
+
+	std::filesystem::remove_all(directory);
+	if (failures == 0)
+		std::cout << "alloc_test passed" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <span>
+#include <string>
+#include <vector>
+#include "../corpus.h"
+#include "../image.h"
+
+/*********************************************************
+ * @brief
+ *			Corpus images round trip: a CSV compiled to an image and
+ *			loaded again is the same corpus and answers every query
+ *			the same.
+ * @details
+ *			One file ends with an empty row, the other stops right
+ *			after its last token, which gives the corpus an extra
+ *			sentence start at the token count, see build_corpus(). A
+ *			corrupt index entry is refused by a verified load.
+ */
+//*********************************************************
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what)
+{
+	if (!condition)
+	{
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+/**
+ *
+ * @param filename File to write
+ * @param trailing_newline Whether the last row ends with a newline
+ * @brief Writes a small corpus in the format of load_corpus()
+ */
+static void write_corpus(const std::string &filename, bool trailing_newline)
+{
+	static const char* const tags[] = {"SUBST", "VERB", "ADJ", "ART"};
+	std::string text = "word\tc5\tlemma\tpos\n";
+	int token = 0;
+	for (int s = 0; s < 300; ++s)
+	{
+		text += "# sentence " + std::to_string(s + 1) + ", Texts/A/A0/A01.xml\n";
+		for (int t = 0; t < 2 + s % 9; ++t, ++token)
+		{
+			const std::string word = "w" + std::to_string(token * 13 % 350);
+			text += word + "\tNN1\t" + word + "\t" + tags[token % 4] + "\n";
+		}
+		text += "\n";
+	}
+	if (!trailing_newline)
+		text.erase(text.find_last_not_of('\n') + 1);
+	std::ofstream(filename, std::ios::binary) << text;
+}
+
+template<typename T>
+static bool same(std::span<const T> a, std::span<const T> b)
+{
+	return std::equal(a.begin(), a.end(), b.begin(), b.end());
+}
+
+/**
+ * @brief Checks that the loaded image holds the same corpus as the one it was
+ *		  compiled from, and matches the same
+ */
+static void check_same(const Corpus &expected, const Corpus &loaded, const std::string &name)
+{
+	check(loaded.token_count() == expected.token_count(), name + ": token count");
+	for (size_t a = 0; a < ATTRIBUTE_COUNT; ++a)
+	{
+		check(loaded.dictionaries[a].index2string == expected.dictionaries[a].index2string, name + ": dictionary " + std::to_string(a));
+		check(loaded.columns[a].width() == expected.columns[a].width(), name + ": column width " + std::to_string(a));
+		for (size_t i = 0; i < expected.token_count(); ++i)
+		{
+			if (loaded.columns[a][i] != expected.columns[a][i])
+			{
+				check(false, name + ": column " + std::to_string(a) + " at " + std::to_string(i));
+				break;
+			}
+		}
+	}
+	check(same(loaded.sentences.span(), expected.sentences.span()), name + ": sentences");
+	check(same(loaded.sentence_ids.span(), expected.sentence_ids.span()), name + ": sentence ids");
+	check(same(loaded.word_index.span(), expected.word_index.span()), name + ": word index");
+	check(same(loaded.pos_offsets.span(), expected.pos_offsets.span()), name + ": pos offsets");
+
+	for (const char* query : {"[word=\"w7\"]", "[pos=\"SUBST\"] [pos=\"VERB\"]", "[word!=\"w1\" pos=\"ART\"] []", "[pos=\"ADJ\"]{2,3}"})
+	{
+		const std::vector<Match> a = match2(expected, parse_sequence(query, expected));
+		const std::vector<Match> b = match2(loaded, parse_sequence(query, loaded));
+		check(a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const Match& x, const Match& y) {
+			return x.sentence == y.sentence && x.pos == y.pos && x.len == y.len;
+		}), name + ": matches of " + query);
+	}
+}
+
+int main()
+{
+	const std::filesystem::path directory = std::filesystem::temp_directory_path() / "image_test";
+	std::filesystem::create_directories(directory);
+	for (const bool trailing_newline : {true, false})
+	{
+		const std::string name = trailing_newline ? "newline" : "nonl";
+		const std::string csv = (directory / (name + ".csv")).string();
+		const std::string image = (directory / (name + ".img")).string();
+		write_corpus(csv, trailing_newline);
+
+		const Corpus corpus = load_corpus(csv);
+		check(trailing_newline || static_cast<size_t>(corpus.sentences.span().back()) == corpus.token_count(), name + ": sentence start at the end");
+		save_corpus_image(corpus, image);
+		check(is_corpus_image(image), name + ": is an image");
+		for (const bool verify : {false, true})
+		{
+			try
+			{
+				check_same(corpus, load_corpus_image(image, verify), name + (verify ? " verified" : ""));
+			}
+			catch (const std::exception& e)
+			{
+				check(false, name + ": " + e.what());
+			}
+		}
+	}
+
+	// An index entry past the corpus is only found by a verified load
+	const std::string image = (directory / "newline.img").string();
+	std::string bytes;
+	{
+		std::ifstream in(image, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(in), {});
+	}
+	ImageHeader header;
+	std::memcpy(&header, bytes.data(), sizeof(header));
+	const int outside = 1 << 30;
+	std::memcpy(bytes.data() + header.sections[SECTION_WORD_INDEX].offset, &outside, sizeof(outside));
+	const std::string corrupt = (directory / "corrupt.img").string();
+	std::ofstream(corrupt, std::ios::binary) << bytes;
+	bool refused = false;
+	try
+	{
+		load_corpus_image(corrupt, true);
+	}
+	catch (const std::invalid_argument&)
+	{
+		refused = true;
+	}
+	check(refused, "corrupt index entry refused by a verified load");
+
+	std::filesystem::remove_all(directory);
+	if (failures == 0)
+		std::cout << "image_test passed" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../corpus.h"
+#include "../planner.h"
+#include "../scan.h"
+#include "../segment.h"
+
+/*********************************************************
+ * @brief
+ *			Queries over segments whose dictionaries outgrow the
+ *			column width of the older ones.
+ * @details
+ *			The base has fewer than 256 words, so its word column is
+ *			one byte wide, and the appended file adds as many again,
+ *			so the newest words have indexes an older column can not
+ *			hold. Every query must count the same under every scan
+ *			mode as over the segments merged into one, and the plans
+ *			of every segment name the newest words by their strings.
+ */
+//*********************************************************
+
+static int failures = 0;
+
+static void check(bool condition, const std::string &what)
+{
+	if (!condition)
+	{
+		std::cerr << "FAILED: " << what << std::endl;
+		++failures;
+	}
+}
+
+/**
+ *
+ * @param filename File to write
+ * @param prefix Prefix of the words, a word is the prefix and a number
+ * @param words Number of distinct words
+ * @param sentences Number of sentences
+ * @brief Writes a corpus in the format of load_corpus(), its words cycling
+ *		  through the values so every one occurs, an empty row after each sentence
+ */
+static void write_corpus(const std::string &filename, const std::string &prefix, int words, int sentences)
+{
+	static const char* const tags[] = {"SUBST", "VERB", "ADJ", "ART"};
+	std::ofstream out(filename);
+	out << "word\tc5\tlemma\tpos\n";
+	int token = 0;
+	for (int s = 0; s < sentences; ++s)
+	{
+		out << "# sentence " << s + 1 << ", Texts/A/A0/A01.xml\n";
+		for (int t = 0; t < 3 + s % 7; ++t, ++token)
+		{
+			const std::string word = prefix + std::to_string(token * 7 % words);
+			out << word << "\tNN1\t" << word << "\t" << tags[token % 4] << "\n";
+		}
+		out << "\n";
+	}
+}
+
+int main()
+{
+	const std::filesystem::path directory = std::filesystem::temp_directory_path() / "segment_test";
+	std::filesystem::create_directories(directory);
+	const std::string base_file = (directory / "base.csv").string();
+	const std::string newer_file = (directory / "newer.csv").string();
+	write_corpus(base_file, "n", 200, 2000);
+	write_corpus(newer_file, "m", 400, 2000);
+
+	SegmentOptions options;
+	options.background_merge = false;
+	options.bitmap_density = 0.01;
+	Corpus base = load_corpus(base_file);
+	finish_segment(base, options);
+	SegmentedCorpus segments(std::move(base), options);
+	segments.append_file(newer_file);
+	const std::shared_ptr<const SegmentSnapshot> snapshot = segments.snapshot();
+	check(snapshot->segments.size() == 2, "two segments");
+	check(snapshot->segments.front()->column(Attribute::word).width() == 1, "one byte column in the base");
+	check(snapshot->lexicon().dictionary(Attribute::word).size() > 256, "the lexicon outgrows one byte");
+
+	const Corpus merged = merge_segments(snapshot->segments, options);
+	const std::vector<std::string> queries = {
+		"[word=\"m60\"]",
+		"[word!=\"m60\"]",
+		"[word!=\"m60\" pos=\"SUBST\"]",
+		"[word=\"m300\"] [pos=\"VERB\"]",
+		"[pos=\"ART\"] [word!=\"m399\"]",
+		"[word=\"n60\"]",
+	};
+	for (const ScanMode mode : {ScanMode::NEVER, ScanMode::AUTO, ScanMode::ALWAYS})
+	{
+		set_scan_mode(mode);
+		for (const std::string& query : queries)
+		{
+			const size_t expected = count(merged, parse_sequence(query, merged));
+			const size_t found = count(*snapshot, parse_sequence(query, snapshot->lexicon()));
+			check(found == expected, std::string(scan_mode_name(mode)) + " " + query + ": " + std::to_string(found) + " matches, expected " + std::to_string(expected));
+			check(match2(*snapshot, parse_sequence(query, snapshot->lexicon())).size() == expected, std::string(scan_mode_name(mode)) + " " + query + " streamed");
+		}
+
+		const Query query = parse_query("[word!=\"m60\" pos=\"SUBST\"]", snapshot->lexicon());
+		size_t found = 0;
+		for (size_t s = 0; s < snapshot->segments.size(); ++s)
+		{
+			const Query local = segment_query(*snapshot, s, query);
+			const std::string plan = explain(plan_query(*snapshot->segments[s], local, nullptr, true));
+			check(plan.find("word!=\"m60\"") != std::string::npos, std::string(scan_mode_name(mode)) + " plan of segment " + std::to_string(s) + " labels m60:\n" + plan);
+			found += count(*snapshot->segments[s], local);
+		}
+		check(found == count(merged, parse_query("[word!=\"m60\" pos=\"SUBST\"]", merged)), std::string(scan_mode_name(mode)) + " segment queries");
+	}
+	set_scan_mode(ScanMode::AUTO);
+
+	std::filesystem::remove_all(directory);
+	if (failures == 0)
+		std::cout << "segment_test passed" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
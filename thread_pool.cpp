@@ -0,0 +1,144 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <optional>
+
+/**
+ *
+ * @param threads Threads working on a job, including the caller of run(). 0
+ *				  means one per core, 1 runs every task on the caller.
+ */
+ThreadPool::ThreadPool(unsigned threads) : queues(std::max(1u, threads == 0 ? std::thread::hardware_concurrency() : threads))
+{
+	for (size_t home = 1; home < queues.size(); ++home)
+		workers.emplace_back([this, home] { work(home); });
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+/**
+ *
+ * @param home Queue of the calling thread, tried first
+ * @brief Runs one task, from the back of the home queue or else stolen from the
+ *		  front of another queue
+ * @return False if every queue was empty
+ */
+bool ThreadPool::try_run_one(size_t home)
+{
+	std::optional<Task> task;
+	for (size_t i = 0; i < queues.size() && !task; ++i)
+	{
+		Queue& queue = queues[(home + i) % queues.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty())
+			continue;
+		if (i == 0)
+		{
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+		}
+		else
+		{
+			task = queue.tasks.front();
+			queue.tasks.pop_front();
+		}
+	}
+	if (!task)
+		return false;
+	pending--;
+
+	Job& job = *task->job;
+	try
+	{
+		(*job.task)(task->index);
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> lock(job.error_mutex);
+		if (!job.error)
+			job.error = std::current_exception();
+	}
+
+	if (--job.remaining == 0)
+	{
+		// The caller of run() may be waiting for the last task
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		wake.notify_all();
+	}
+	return true;
+}
+
+/**
+ * @param home Queue of the worker
+ * @brief Runs tasks until the pool is destroyed, sleeping while there are none
+ */
+void ThreadPool::work(size_t home)
+{
+	while (true)
+	{
+		if (try_run_one(home))
+			continue;
+
+		std::unique_lock<std::mutex> lock(wake_mutex);
+		wake.wait(lock, [&] { return stopping || pending > 0; });
+		if (stopping)
+			return;
+	}
+}
+
+/**
+ *
+ * @param count Number of tasks
+ * @param task Called once with each index in [0, count), concurrently
+ * @brief Runs the tasks on the pool and the calling thread and waits for them
+ * @attention Rethrows the first exception thrown by a task, after all tasks ran
+ */
+void ThreadPool::run(size_t count, const std::function<void(size_t)> &task)
+{
+	if (count == 0)
+		return;
+	if (workers.empty() || count == 1)
+	{
+		for (size_t i = 0; i < count; ++i)
+			task(i);
+		return;
+	}
+
+	Job job;
+	job.task = &task;
+	job.remaining = count;
+	{
+		std::lock_guard<std::mutex> lock(wake_mutex);
+		pending += count;
+	}
+	// Queue 0 is shared by callers, the tasks are dealt over the workers' queues
+	for (size_t i = 0; i < count; ++i)
+	{
+		Queue& queue = queues[1 + i % workers.size()];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		queue.tasks.push_back({&job, i});
+	}
+	wake.notify_all();
+
+	while (job.remaining > 0)
+	{
+		if (try_run_one(0))
+			continue;
+
+		// Every task of the job is taken, wait for the ones still running
+		std::unique_lock<std::mutex> lock(wake_mutex);
+		wake.wait(lock, [&] { return job.remaining == 0 || pending > 0; });
+	}
+
+	if (job.error)
+		std::rethrow_exception(job.error);
+}
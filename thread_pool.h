@@ -0,0 +1,72 @@
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+/*********************************************************
+ * @brief
+ *			Work stealing thread pool shared by all queries.
+ * @details
+ *			run() splits a job into tasks and spreads them over the
+ *			workers' queues, round robin. A worker takes its tasks from
+ *			the back of its own queue and steals from the front of the
+ *			others' once it runs out, so shards of uneven cost even out.
+ *			The thread calling run() works on the tasks too while it
+ *			waits, which keeps a pool of n threads at n busy threads
+ *			however many queries share it, and lets a task call run()
+ *			itself without deadlocking.
+ */
+//*********************************************************
+
+class ThreadPool
+{
+public:
+	explicit ThreadPool(unsigned threads = 0);
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	~ThreadPool();
+
+	// Threads working on a job, the workers and the caller
+	unsigned size() const { return static_cast<unsigned>(workers.size()) + 1; }
+
+	void run(size_t count, const std::function<void(size_t)> &task);
+
+private:
+	struct Job
+	{
+		const std::function<void(size_t)>* task;
+		std::atomic<size_t> remaining;
+		std::exception_ptr error;
+		std::mutex error_mutex;
+	};
+
+	struct Task
+	{
+		Job* job;
+		size_t index;
+	};
+
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+
+	bool try_run_one(size_t home);
+	void work(size_t home);
+
+	std::vector<std::thread> workers;
+	std::vector<Queue> queues;	// One per worker, and one for callers
+	std::atomic<size_t> pending{0};
+	std::mutex wake_mutex;
+	std::condition_variable wake;
+	bool stopping = false;
+};
+
+#endif //THREAD_POOL_H